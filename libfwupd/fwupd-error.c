@@ -74,6 +74,9 @@ fwupd_error_quark (void)
 		g_dbus_error_register_error (quark,
 					     FWUPD_ERROR_SIGNATURE_INVALID,
 					     "org.freedesktop.fwupd.SignatureInvalid");
+		g_dbus_error_register_error (quark,
+					     FWUPD_ERROR_NOT_READY,
+					     "org.freedesktop.fwupd.NotReady");
 	}
 	return quark;
 }
@@ -40,6 +40,7 @@
  * @FWUPD_ERROR_NOTHING_TO_DO:			Nothing to do
  * @FWUPD_ERROR_NOT_SUPPORTED:			Action was not possible
  * @FWUPD_ERROR_SIGNATURE_INVALID:		Signature was invalid
+ * @FWUPD_ERROR_NOT_READY:			Device has not been found yet
  *
  * The error code.
  **/
@@ -56,6 +57,7 @@ typedef enum {
 	FWUPD_ERROR_NOTHING_TO_DO,		/* Since: 0.1.1 */
 	FWUPD_ERROR_NOT_SUPPORTED,		/* Since: 0.1.1 */
 	FWUPD_ERROR_SIGNATURE_INVALID,		/* Since: 0.1.2 */
+	FWUPD_ERROR_NOT_READY,			/* Since: 0.1.7 */
 	/*< private >*/
 	FWUPD_ERROR_LAST
 } FwupdError;
@@ -0,0 +1,429 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <appstream-glib.h>
+#include <fcntl.h>
+#include <fwupd.h>
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fu-cab.h"
+#include "fu-cleanup.h"
+#include "fu-device.h"
+#include "fu-main-store.h"
+#include "fu-pending.h"
+#include "fu-rom.h"
+
+/**
+ * fu_benchmark_report:
+ *
+ * Prints one result per line as JSON so that it can be compared against
+ * the results from a previous build.
+ **/
+static void
+fu_benchmark_report (const gchar *name, guint iterations, gint64 elapsed)
+{
+	g_print ("{\"name\":\"%s\",\"iterations\":%u,"
+		 "\"total_us\":%" G_GINT64_FORMAT ",\"per_op_us\":%.2f}\n",
+		 name, iterations, elapsed,
+		 iterations > 0 ? (gdouble) elapsed / iterations : 0.f);
+}
+
+/**
+ * fu_benchmark_rom:
+ **/
+static void
+fu_benchmark_rom (const gchar *path)
+{
+	const gchar *fn;
+	gint64 elapsed = 0;
+	guint n = 0;
+	_cleanup_dir_close_ GDir *dir = NULL;
+
+	dir = g_dir_open (path, 0, NULL);
+	if (dir == NULL) {
+		g_printerr ("No ROMs in %s, skipping\n", path);
+		return;
+	}
+	while ((fn = g_dir_read_name (dir)) != NULL) {
+		gint64 start;
+		_cleanup_error_free_ GError *error = NULL;
+		_cleanup_free_ gchar *filename = NULL;
+		_cleanup_object_unref_ FuRom *rom = NULL;
+		_cleanup_object_unref_ GFile *file = NULL;
+
+		filename = g_build_filename (path, fn, NULL);
+		file = g_file_new_for_path (filename);
+		rom = fu_rom_new ();
+		start = g_get_monotonic_time ();
+		if (!fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_BLANK_PPID,
+				       NULL, &error)) {
+			g_printerr ("Failed to load %s: %s\n", filename, error->message);
+			continue;
+		}
+		elapsed += g_get_monotonic_time () - start;
+		n++;
+	}
+	fu_benchmark_report ("rom-load", n, elapsed);
+}
+
+/**
+ * fu_benchmark_cab:
+ **/
+static void
+fu_benchmark_cab (const gchar *filename, guint iterations)
+{
+	gint64 elapsed_load = 0;
+	gint64 elapsed_extract = 0;
+	gint64 elapsed_verify = 0;
+	guint i;
+	_cleanup_free_ gchar *basename = NULL;
+	_cleanup_free_ gchar *name = NULL;
+
+	for (i = 0; i < iterations; i++) {
+		gint fd;
+		gint64 start;
+		_cleanup_error_free_ GError *error = NULL;
+		_cleanup_object_unref_ FuCab *cab = NULL;
+
+		fd = open (filename, O_RDONLY);
+		if (fd < 0) {
+			g_printerr ("Failed to open %s\n", filename);
+			return;
+		}
+		cab = fu_cab_new ();
+		start = g_get_monotonic_time ();
+		if (!fu_cab_load_fd (cab, fd, NULL, &error)) {
+			g_printerr ("Failed to load %s: %s\n", filename, error->message);
+			return;
+		}
+		elapsed_load += g_get_monotonic_time () - start;
+		start = g_get_monotonic_time ();
+		if (!fu_cab_extract (cab, FU_CAB_EXTRACT_FLAG_FIRMWARE |
+					  FU_CAB_EXTRACT_FLAG_SIGNATURE, &error)) {
+			g_printerr ("Failed to extract %s: %s\n", filename, error->message);
+			return;
+		}
+		elapsed_extract += g_get_monotonic_time () - start;
+
+		/* an untrusted cab is still a valid measurement */
+		start = g_get_monotonic_time ();
+		if (!fu_cab_verify (cab, &error)) {
+			g_debug ("Failed to verify %s: %s", filename, error->message);
+			g_clear_error (&error);
+		}
+		elapsed_verify += g_get_monotonic_time () - start;
+		if (!fu_cab_delete_temp_files (cab, &error)) {
+			g_printerr ("Failed to clean up %s: %s\n", filename, error->message);
+			return;
+		}
+	}
+
+	/* name the results after the file */
+	basename = g_path_get_basename (filename);
+	name = g_strdup_printf ("cab-load:%s", basename);
+	fu_benchmark_report (name, iterations, elapsed_load);
+	g_free (name);
+	name = g_strdup_printf ("cab-extract:%s", basename);
+	fu_benchmark_report (name, iterations, elapsed_extract);
+	g_free (name);
+	name = g_strdup_printf ("cab-verify:%s", basename);
+	fu_benchmark_report (name, iterations, elapsed_verify);
+}
+
+/**
+ * fu_benchmark_pending_run:
+ **/
+static void
+fu_benchmark_pending_run (FuPending *pending, GPtrArray *devices)
+{
+	gint64 start;
+	guint i;
+	guint n_devices = devices->len;
+	_cleanup_error_free_ GError *error = NULL;
+
+	/* insert all in one transaction */
+	start = g_get_monotonic_time ();
+	if (!fu_pending_add_devices (pending, devices, &error)) {
+		g_printerr ("Failed to add devices: %s\n", error->message);
+		return;
+	}
+	fu_benchmark_report ("pending-insert", n_devices, g_get_monotonic_time () - start);
+
+	/* query each device */
+	start = g_get_monotonic_time ();
+	for (i = 0; i < devices->len; i++) {
+		FuDevice *device = g_ptr_array_index (devices, i);
+		_cleanup_object_unref_ FuDevice *device_tmp = NULL;
+		device_tmp = fu_pending_get_device (pending, fu_device_get_id (device), &error);
+		if (device_tmp == NULL) {
+			g_printerr ("Failed to get device: %s\n", error->message);
+			return;
+		}
+	}
+	fu_benchmark_report ("pending-query", n_devices, g_get_monotonic_time () - start);
+
+	/* update the state of all devices */
+	start = g_get_monotonic_time ();
+	if (!fu_pending_set_states (pending, devices, FU_PENDING_STATE_SUCCESS, &error)) {
+		g_printerr ("Failed to set states: %s\n", error->message);
+		return;
+	}
+	fu_benchmark_report ("pending-set-states", n_devices, g_get_monotonic_time () - start);
+
+	/* remove each device */
+	start = g_get_monotonic_time ();
+	for (i = 0; i < devices->len; i++) {
+		FuDevice *device = g_ptr_array_index (devices, i);
+		if (!fu_pending_remove_device (pending, device, &error)) {
+			g_printerr ("Failed to remove device: %s\n", error->message);
+			return;
+		}
+	}
+	fu_benchmark_report ("pending-remove", n_devices, g_get_monotonic_time () - start);
+}
+
+/**
+ * fu_benchmark_pending:
+ *
+ * Uses a temporary database so that a failed run does not leave devices
+ * scheduled in the system one.
+ **/
+static void
+fu_benchmark_pending (guint n_devices)
+{
+	guint i;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_free_ gchar *dirname = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	FuPending *pending;
+
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = 0; i < n_devices; i++) {
+		FuDevice *device;
+		_cleanup_free_ gchar *id = NULL;
+		id = g_strdup_printf ("fu-benchmark-%05u", i);
+		device = fu_device_new ();
+		fu_device_set_id (device, id);
+		fu_device_set_display_name (device, "Benchmark");
+		fu_device_set_metadata (device, FU_DEVICE_KEY_PROVIDER, "Fake");
+		fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, "1.2.3");
+		fu_device_set_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION, "1.2.4");
+		fu_device_set_metadata (device, FU_DEVICE_KEY_FILENAME_CAB, "/tmp/fu-benchmark.cab");
+		g_ptr_array_add (devices, device);
+	}
+
+	/* never touch the system database */
+	dirname = g_dir_make_tmp ("fu-benchmark-XXXXXX", &error);
+	if (dirname == NULL) {
+		g_printerr ("Failed to create directory: %s\n", error->message);
+		return;
+	}
+	filename = g_build_filename (dirname, "pending.db", NULL);
+	pending = fu_pending_new ();
+	fu_pending_set_filename (pending, filename);
+	fu_benchmark_pending_run (pending, devices);
+	g_object_unref (pending);
+
+	/* remove the database and any WAL files */
+	for (i = 0; i < 3; i++) {
+		const gchar *suffixes[] = { "", "-wal", "-shm" };
+		_cleanup_free_ gchar *tmp = NULL;
+		tmp = g_strdup_printf ("%s%s", filename, suffixes[i]);
+		g_unlink (tmp);
+	}
+	g_rmdir (dirname);
+}
+
+/**
+ * fu_benchmark_create_app:
+ **/
+static AsApp *
+fu_benchmark_create_app (guint idx, const gchar *version)
+{
+	AsApp *app;
+	_cleanup_free_ gchar *guid = NULL;
+	_cleanup_free_ gchar *id = NULL;
+	_cleanup_object_unref_ AsProvide *prov = NULL;
+	_cleanup_object_unref_ AsRelease *rel = NULL;
+
+	id = g_strdup_printf ("com.example.Benchmark%05u.firmware", idx);
+	guid = g_strdup_printf ("00000000-0000-0000-0000-%012u", idx);
+	app = as_app_new ();
+	as_app_set_id (app, id);
+	as_app_set_id_kind (app, AS_ID_KIND_FIRMWARE);
+	prov = as_provide_new ();
+	as_provide_set_kind (prov, AS_PROVIDE_KIND_FIRMWARE_FLASHED);
+	as_provide_set_value (prov, guid);
+	as_app_add_provide (app, prov);
+	rel = as_release_new ();
+	as_release_set_version (rel, version);
+	as_app_add_release (app, rel);
+	return app;
+}
+
+/**
+ * fu_benchmark_get_updates:
+ *
+ * Measures the GUID index and the version comparison used by the daemon
+ * for GetUpdates.
+ **/
+static void
+fu_benchmark_get_updates (guint n_devices)
+{
+	gint64 start;
+	guint i;
+	_cleanup_hashtable_unref_ GHashTable *releases_by_guid = NULL;
+	_cleanup_object_unref_ AsStore *store = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *updates = NULL;
+
+	store = as_store_new ();
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = 0; i < n_devices; i++) {
+		FuDevice *device;
+		_cleanup_free_ gchar *guid = NULL;
+		_cleanup_free_ gchar *id = NULL;
+		_cleanup_object_unref_ AsApp *app = NULL;
+
+		app = fu_benchmark_create_app (i, "1.2.4");
+		as_store_add_app (store, app);
+
+		id = g_strdup_printf ("fu-benchmark-%05u", i);
+		guid = g_strdup_printf ("00000000-0000-0000-0000-%012u", i);
+		device = fu_device_new ();
+		fu_device_set_id (device, id);
+		fu_device_set_guid (device, guid);
+		fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION,
+					i % 2 == 0 ? "1.2.3" : "1.2.4");
+		g_ptr_array_add (devices, device);
+	}
+
+	/* build the release index */
+	start = g_get_monotonic_time ();
+	releases_by_guid = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						  (GDestroyNotify) fu_main_release_free);
+	fu_main_release_index_rebuild (releases_by_guid, store);
+	fu_benchmark_report ("release-index", n_devices, g_get_monotonic_time () - start);
+
+	/* find the updates, which copies the AppStream data the first time */
+	start = g_get_monotonic_time ();
+	updates = fu_main_get_updates (releases_by_guid, devices, NULL);
+	fu_benchmark_report ("get-updates", n_devices, g_get_monotonic_time () - start);
+	g_debug ("%u of %u devices had updates", updates->len, n_devices);
+}
+
+/**
+ * fu_benchmark_metadata_merge:
+ *
+ * Merges a store where every tenth component has a new release, in the
+ * same way as the daemon does for UpdateMetadata.
+ **/
+static void
+fu_benchmark_metadata_merge (guint n_apps)
+{
+	gint64 start;
+	guint i;
+	guint cnt;
+	_cleanup_object_unref_ AsStore *store = NULL;
+	_cleanup_object_unref_ AsStore *store_new = NULL;
+
+	store = as_store_new ();
+	store_new = as_store_new ();
+	for (i = 0; i < n_apps; i++) {
+		_cleanup_object_unref_ AsApp *app = NULL;
+		_cleanup_object_unref_ AsApp *app_new = NULL;
+		app = fu_benchmark_create_app (i, "1.2.3");
+		as_store_add_app (store, app);
+		app_new = fu_benchmark_create_app (i, i % 10 == 0 ? "1.2.4" : "1.2.3");
+		as_store_add_app (store_new, app_new);
+	}
+
+	start = g_get_monotonic_time ();
+	cnt = fu_main_store_merge (store, store_new);
+	fu_benchmark_report ("metadata-merge", n_apps, g_get_monotonic_time () - start);
+	g_debug ("%u of %u components changed", cnt, n_apps);
+}
+
+/**
+ * main:
+ **/
+int
+main (int argc, char **argv)
+{
+	gint iterations = 10;
+	gint n_devices = 5000;
+	guint i;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_free_ gchar *path_roms = NULL;
+	_cleanup_strv_free_ gchar **cabs = NULL;
+	const GOptionEntry options[] = {
+		{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+		  "Number of times to load each cabinet", NULL },
+		{ "devices", 'd', 0, G_OPTION_ARG_INT, &n_devices,
+		  "Number of synthetic devices and components", NULL },
+		{ "roms", 'r', 0, G_OPTION_ARG_FILENAME, &path_roms,
+		  "Directory of ROMs to parse", NULL },
+		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &cabs,
+		  NULL, "[FILE.cab...]" },
+		{ NULL}
+	};
+	GOptionContext *context;
+
+	context = g_option_context_new (NULL);
+	g_option_context_set_summary (context, "Benchmark the fwupd parsers and update pipeline");
+	g_option_context_add_main_entries (context, options, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("Failed to parse arguments: %s\n", error->message);
+		g_option_context_free (context);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+	if (iterations <= 0 || n_devices <= 0) {
+		g_printerr ("Iterations and devices must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* parsers */
+	if (path_roms == NULL)
+		path_roms = g_build_filename (TESTDATADIR, "roms", NULL);
+	fu_benchmark_rom (path_roms);
+	if (cabs == NULL) {
+		filename = g_build_filename (TESTDATADIR, "colorhug",
+					     "colorhug-als-3.0.2.cab", NULL);
+		fu_benchmark_cab (filename, (guint) iterations);
+	} else {
+		for (i = 0; cabs[i] != NULL; i++)
+			fu_benchmark_cab (cabs[i], (guint) iterations);
+	}
+
+	/* daemon */
+	fu_benchmark_pending ((guint) n_devices);
+	fu_benchmark_get_updates ((guint) n_devices);
+	fu_benchmark_metadata_merge ((guint) n_devices);
+	return EXIT_SUCCESS;
+}
@@ -23,18 +23,32 @@
 
 #include <fwupd.h>
 #include <appstream-glib.h>
+#include <archive_entry.h>
+#include <archive.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <glib-object.h>
 #include <gio/gio.h>
 #include <libgcab.h>
 #include <glib/gstdio.h>
 #include <gio/gunixinputstream.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "fu-cleanup.h"
 #include "fu-cab.h"
 #include "fu-keyring.h"
+#include "fu-memfd.h"
+#include "fu-provider.h"
 
 static void fu_cab_finalize			 (GObject *object);
 
+/* the payloads, signatures and metadata together */
+#define FU_CAB_ARCHIVE_MAX	(2 * FU_PROVIDER_FIRMWARE_MAX)	/* bytes */
+
 #define FU_CAB_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), FU_TYPE_CAB, FuCabPrivate))
 
 /**
@@ -46,6 +60,7 @@ struct _FuCabPrivate
 {
 	GCabCabinet			*gcab;
 	GInputStream			*cab_stream;
+	GBytes				*cab_data;	/* when mapped */
 	GKeyFile			*inf_kf;
 	FwupdTrustFlags			 trust_flags;
 	gchar				*firmware_basename;
@@ -64,6 +79,12 @@ struct _FuCabPrivate
 	gchar				*vendor;
 	gchar				*version;
 	guint64				 size;
+	gboolean			 in_memory;
+	GHashTable			*payloads;	/* basename:GBytes */
+	GHashTable			*checksums;	/* basename:SHA1 */
+	gchar				*checksum_expected;
+	GThread				*verify_thread;
+	FuKeyring			*keyring;
 	GPtrArray			*basenames_to_delete;
 	GPtrArray			*filelist;	/* with full path */
 };
@@ -75,6 +96,160 @@ typedef struct {
 	FuCabExtractFlags	 flags;
 } FuCabExtractHelper;
 
+typedef struct {
+	GInputStream		*stream;
+	GError			*error;
+	guint8			 buf[0x8000];
+} FuCabArchiveHelper;
+
+typedef struct {
+	gpointer		 data;
+	gsize			 len;
+} FuCabMapping;
+
+typedef struct {
+	gchar			*basename;
+	FuKeyring		*keyring;
+	GBytes			*payload;
+	GBytes			*payload_signature;
+	gboolean		 trusted;
+	GError			*error;
+} FuCabVerifyHelper;
+
+/**
+ * fu_cab_verify_helper_free:
+ **/
+static void
+fu_cab_verify_helper_free (FuCabVerifyHelper *helper)
+{
+	g_free (helper->basename);
+	if (helper->keyring != NULL)
+		g_object_unref (helper->keyring);
+	g_bytes_unref (helper->payload);
+	g_bytes_unref (helper->payload_signature);
+	if (helper->error != NULL)
+		g_error_free (helper->error);
+	g_free (helper);
+}
+
+/**
+ * fu_cab_get_keyring:
+ *
+ * Returns the keyring set with fu_cab_set_keyring(), or a new keyring
+ * loaded with the system trusted keys.
+ **/
+static FuKeyring *
+fu_cab_get_keyring (FuKeyring *keyring, GError **error)
+{
+	_cleanup_free_ gchar *pki_dir = NULL;
+	_cleanup_object_unref_ FuKeyring *kr = NULL;
+
+	if (keyring != NULL)
+		return g_object_ref (keyring);
+	pki_dir = g_build_filename (SYSCONFDIR, "pki", "fwupd", NULL);
+	kr = fu_keyring_new ();
+	if (!fu_keyring_add_public_keys (kr, pki_dir, error))
+		return NULL;
+	return g_object_ref (kr);
+}
+
+/**
+ * fu_cab_verify_payload:
+ *
+ * Returns %FALSE only if the keyring could not be loaded.
+ **/
+static gboolean
+fu_cab_verify_payload (FuKeyring *keyring,
+		       GBytes *payload, GBytes *payload_signature,
+		       gboolean *trusted, GError **error)
+{
+	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_object_unref_ FuKeyring *kr = NULL;
+
+	/* verify against the system trusted keys */
+	kr = fu_cab_get_keyring (keyring, error);
+	if (kr == NULL)
+		return FALSE;
+	*trusted = fu_keyring_verify_data (kr, payload, payload_signature,
+					   &error_local);
+	if (!*trusted) {
+		g_warning ("untrusted as failed to verify: %s",
+			   error_local->message);
+	}
+	return TRUE;
+}
+
+/**
+ * fu_cab_verify_thread_cb:
+ **/
+static gpointer
+fu_cab_verify_thread_cb (gpointer data)
+{
+	FuCabVerifyHelper *helper = (FuCabVerifyHelper *) data;
+	if (!fu_cab_verify_payload (helper->keyring,
+				    helper->payload,
+				    helper->payload_signature,
+				    &helper->trusted,
+				    &helper->error))
+		helper->trusted = FALSE;
+	return helper;
+}
+
+/**
+ * fu_cab_verify_start:
+ *
+ * Starts checking the signature of @basename in a thread as soon as both
+ * the payload and signature have been decompressed, so that verification
+ * overlaps decompressing and parsing the rest of the archive.
+ **/
+static void
+fu_cab_verify_start (FuCab *cab, const gchar *basename)
+{
+	FuCabPrivate *priv = cab->priv;
+	FuCabVerifyHelper *helper;
+	GBytes *payload;
+	GBytes *payload_signature;
+	_cleanup_free_ gchar *basename_sig = NULL;
+
+	if (priv->verify_thread != NULL)
+		return;
+	basename_sig = g_strdup_printf ("%s.asc", basename);
+	payload = g_hash_table_lookup (priv->payloads, basename);
+	payload_signature = g_hash_table_lookup (priv->payloads, basename_sig);
+	if (payload == NULL || payload_signature == NULL)
+		return;
+
+	g_debug ("verifying %s in the background", basename);
+	helper = g_new0 (FuCabVerifyHelper, 1);
+	helper->basename = g_strdup (basename);
+	if (priv->keyring != NULL)
+		helper->keyring = g_object_ref (priv->keyring);
+	helper->payload = g_bytes_ref (payload);
+	helper->payload_signature = g_bytes_ref (payload_signature);
+	priv->verify_thread = g_thread_new ("fu-cab-verify",
+					    fu_cab_verify_thread_cb,
+					    helper);
+}
+
+/**
+ * fu_cab_verify_finish:
+ *
+ * Waits for any background verification and returns the result, or %NULL
+ * if none was started.
+ **/
+static FuCabVerifyHelper *
+fu_cab_verify_finish (FuCab *cab)
+{
+	FuCabPrivate *priv = cab->priv;
+	FuCabVerifyHelper *helper;
+
+	if (priv->verify_thread == NULL)
+		return NULL;
+	helper = g_thread_join (priv->verify_thread);
+	priv->verify_thread = NULL;
+	return helper;
+}
+
 /**
  * fu_cab_add_file:
  **/
@@ -160,58 +335,230 @@ fu_cab_extract_cb (GCabFile *file, gpointer user_data)
 }
 
 /**
- * fu_cab_parse:
+ * fu_cab_archive_read_cb:
+ **/
+static ssize_t
+fu_cab_archive_read_cb (struct archive *arch, void *user_data, const void **buffer)
+{
+	FuCabArchiveHelper *helper = (FuCabArchiveHelper *) user_data;
+	gssize sz;
+
+	sz = g_input_stream_read (helper->stream, helper->buf, sizeof (helper->buf),
+				  NULL, &helper->error);
+	if (sz < 0) {
+		archive_set_error (arch, EIO, "%s", helper->error->message);
+		return -1;
+	}
+	*buffer = helper->buf;
+	return sz;
+}
+
+/**
+ * fu_cab_parse_memory:
+ *
+ * Decompresses every file in the archive into a #GBytes without touching
+ * the filesystem.
  **/
 static gboolean
-fu_cab_parse (FuCab *cab, GError **error)
+fu_cab_parse_memory (FuCab *cab, GError **error)
 {
-	AsRelease *rel;
 	FuCabPrivate *priv = cab->priv;
-	GString *update_description;
-	const gchar *tmp;
-	guint i;
-	const gchar *fn;
-	_cleanup_error_free_ GError *error_local = NULL;
-	_cleanup_free_ gchar *inf_filename = NULL;
-	_cleanup_object_unref_ AsApp *app = NULL;
-	_cleanup_object_unref_ GFile *path = NULL;
-
-	g_return_val_if_fail (FU_IS_CAB (cab), FALSE);
+	gboolean ret = TRUE;
+	int r;
+	struct archive *arch = NULL;
+	struct archive_entry *entry;
+	FuCabArchiveHelper *helper;
+	gsize total = 0;
+
+	/* rewind in case we were loaded already */
+	if (!g_seekable_seek (G_SEEKABLE (priv->cab_stream), 0,
+			      G_SEEK_SET, NULL, error))
+		return FALSE;
 
-	/* open the file */
-	priv->gcab = gcab_cabinet_new ();
-	if (!gcab_cabinet_load (priv->gcab, priv->cab_stream, NULL, &error_local)) {
+	helper = g_new0 (FuCabArchiveHelper, 1);
+	helper->stream = priv->cab_stream;
+	arch = archive_read_new ();
+	archive_read_support_format_cab (arch);
+	if (priv->cab_data != NULL) {
+		gsize len;
+		gconstpointer data = g_bytes_get_data (priv->cab_data, &len);
+		r = archive_read_open_memory (arch, (void *) data, len);
+	} else {
+		r = archive_read_open (arch, helper, NULL,
+				       fu_cab_archive_read_cb, NULL);
+	}
+	if (r != ARCHIVE_OK) {
+		ret = FALSE;
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_READ,
 			     "cannot load .cab file: %s",
-			     error_local->message);
-		return FALSE;
+			     archive_error_string (arch));
+		goto out;
 	}
+	for (;;) {
+		GByteArray *buf;
+		const gchar *basename;
+		gssize sz;
+		guint8 tmp[0x8000];
+		_cleanup_checksum_free_ GChecksum *csum = NULL;
+
+		r = archive_read_next_header (arch, &entry);
+		if (r == ARCHIVE_EOF)
+			break;
+		if (r != ARCHIVE_OK) {
+			ret = FALSE;
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_READ,
+				     "cannot read .cab file: %s",
+				     archive_error_string (arch));
+			goto out;
+		}
 
-	/* decompress to /tmp */
-	priv->tmp_path = g_dir_make_tmp ("fwupd-XXXXXX", &error_local);
-	if (priv->tmp_path == NULL) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "failed to create temp dir: %s",
-			     error_local->message);
-		return FALSE;
+		/* the header can be trusted to reject an entry early, but the
+		 * decompressed size is checked as well in case it lies */
+		basename = archive_entry_pathname (entry);
+		if (archive_entry_size_is_set (entry) &&
+		    archive_entry_size (entry) > FU_PROVIDER_FIRMWARE_MAX) {
+			ret = FALSE;
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "%s is too large: %" G_GINT64_FORMAT " bytes",
+				     basename, (gint64) archive_entry_size (entry));
+			goto out;
+		}
+
+		/* decompress to RAM, hashing each chunk while it is hot */
+		buf = g_byte_array_new ();
+		csum = g_checksum_new (G_CHECKSUM_SHA1);
+		while ((sz = archive_read_data (arch, tmp, sizeof (tmp))) > 0) {
+			total += sz;
+			if (buf->len + sz > FU_PROVIDER_FIRMWARE_MAX ||
+			    total > FU_CAB_ARCHIVE_MAX) {
+				ret = FALSE;
+				g_set_error (error,
+					     FWUPD_ERROR,
+					     FWUPD_ERROR_INVALID_FILE,
+					     "%s is too large to extract",
+					     basename);
+				g_byte_array_unref (buf);
+				goto out;
+			}
+			g_byte_array_append (buf, tmp, sz);
+			g_checksum_update (csum, tmp, sz);
+		}
+		if (sz < 0) {
+			ret = FALSE;
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_READ,
+				     "failed to extract .cab file: %s",
+				     archive_error_string (arch));
+			g_byte_array_unref (buf);
+			goto out;
+		}
+		g_debug ("decompressed %s [%u bytes]", basename, buf->len);
+		g_ptr_array_add (priv->filelist, g_strdup (basename));
+		g_hash_table_insert (priv->payloads,
+				     g_strdup (basename),
+				     g_byte_array_free_to_bytes (buf));
+		g_hash_table_insert (priv->checksums,
+				     g_strdup (basename),
+				     g_strdup (g_checksum_get_string (csum)));
+
+		/* we have a payload and detached signature pair */
+		if (g_str_has_suffix (basename, ".asc")) {
+			_cleanup_free_ gchar *basename_fw = NULL;
+			basename_fw = g_strndup (basename, strlen (basename) - 4);
+			fu_cab_verify_start (cab, basename_fw);
+		} else {
+			fu_cab_verify_start (cab, basename);
+		}
 	}
+out:
+	archive_read_close (arch);
+	archive_read_free (arch);
+	if (helper->error != NULL)
+		g_error_free (helper->error);
+	g_free (helper);
+	return ret;
+}
 
-	/* get the file list */
-	path = g_file_new_for_path (priv->tmp_path);
-	if (!gcab_cabinet_extract_simple (priv->gcab, path,
-					  fu_cab_read_file_list_cb,
-					  cab, NULL, &error_local)) {
+/**
+ * fu_cab_get_metadata_filename:
+ *
+ * AppStream can only parse metadata from a file, so when everything is in
+ * RAM the small metadata file is written out just long enough to be read.
+ **/
+static gchar *
+fu_cab_get_metadata_filename (FuCab *cab, const gchar *basename,
+			      const gchar *suffix, GError **error)
+{
+	FuCabPrivate *priv = cab->priv;
+	GBytes *data;
+	gchar *filename = NULL;
+	gint fd;
+	_cleanup_free_ gchar *tmpl = NULL;
+
+	/* already on disk */
+	if (!priv->in_memory)
+		return g_build_filename (priv->tmp_path, basename, NULL);
+
+	data = g_hash_table_lookup (priv->payloads, basename);
+	if (data == NULL) {
 		g_set_error (error,
 			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "failed to extract .cab file: %s",
-			     error_local->message);
-		return FALSE;
+			     FWUPD_ERROR_INVALID_FILE,
+			     "%s not found in .cab file", basename);
+		return NULL;
 	}
+	tmpl = g_strdup_printf ("fwupd-XXXXXX%s", suffix);
+	fd = g_file_open_tmp (tmpl, &filename, error);
+	if (fd < 0)
+		return NULL;
+	close (fd);
+	if (!g_file_set_contents (filename,
+				  g_bytes_get_data (data, NULL),
+				  (gssize) g_bytes_get_size (data),
+				  error)) {
+		g_unlink (filename);
+		g_free (filename);
+		return NULL;
+	}
+	return filename;
+}
+
+/**
+ * fu_cab_parse_app_file:
+ **/
+static gboolean
+fu_cab_parse_app_file (FuCab *cab, AsApp *app, const gchar *filename, GError **error)
+{
+	gboolean ret;
+	ret = as_app_parse_file (app, filename, AS_APP_PARSE_FLAG_NONE, error);
+	if (cab->priv->in_memory)
+		g_unlink (filename);
+	return ret;
+}
+
+/**
+ * fu_cab_parse_metadata:
+ **/
+static gboolean
+fu_cab_parse_metadata (FuCab *cab, GError **error)
+{
+	AsChecksum *csum;
+	AsRelease *rel;
+	FuCabPrivate *priv = cab->priv;
+	GString *update_description;
+	const gchar *tmp;
+	guint i;
+	const gchar *fn;
+	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_free_ gchar *inf_filename = NULL;
+	_cleanup_object_unref_ AsApp *app = NULL;
 
 	/* find the .inf file in the file list */
 	for (i = 0; i < priv->filelist->len; i++) {
@@ -236,15 +583,18 @@ fu_cab_parse (FuCab *cab, GError **error)
 	}
 
 	/* extract these */
-	if (!fu_cab_extract (cab, FU_CAB_EXTRACT_FLAG_INF |
+	if (!priv->in_memory &&
+	    !fu_cab_extract (cab, FU_CAB_EXTRACT_FLAG_INF |
 				  FU_CAB_EXTRACT_FLAG_METAINFO, error))
 		return FALSE;
 
 	/* parse it */
 	app = as_app_new ();
-	inf_filename = g_build_filename (priv->tmp_path, priv->inf_basename, NULL);
-	if (!as_app_parse_file (app, inf_filename,
-				AS_APP_PARSE_FLAG_NONE, &error_local)) {
+	inf_filename = fu_cab_get_metadata_filename (cab, priv->inf_basename,
+						     ".inf", error);
+	if (inf_filename == NULL)
+		return FALSE;
+	if (!fu_cab_parse_app_file (cab, app, inf_filename, &error_local)) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_INVALID_FILE,
@@ -258,10 +608,14 @@ fu_cab_parse (FuCab *cab, GError **error)
 		_cleanup_free_ gchar *metainfo_filename = NULL;
 		_cleanup_object_unref_ AsApp *app2 = NULL;
 		app2 = as_app_new ();
-		metainfo_filename = g_build_filename (priv->tmp_path,
-						      priv->metainfo_basename, NULL);
-		if (!as_app_parse_file (app2, metainfo_filename,
-					AS_APP_PARSE_FLAG_NONE, &error_local)) {
+		metainfo_filename = fu_cab_get_metadata_filename (cab,
+								  priv->metainfo_basename,
+								  ".metainfo.xml",
+								  error);
+		if (metainfo_filename == NULL)
+			return FALSE;
+		if (!fu_cab_parse_app_file (cab, app2, metainfo_filename,
+					    &error_local)) {
 			g_set_error (error,
 				     FWUPD_ERROR,
 				     FWUPD_ERROR_INVALID_FILE,
@@ -286,6 +640,9 @@ fu_cab_parse (FuCab *cab, GError **error)
 	priv->license = g_strdup (as_app_get_project_license (app));
 	rel = as_app_get_release_default (app);
 	priv->version = g_strdup (as_release_get_version (rel));
+	csum = as_release_get_checksum_by_target (rel, AS_CHECKSUM_TARGET_CONTENT);
+	if (csum != NULL && as_checksum_get_kind (csum) == G_CHECKSUM_SHA1)
+		priv->checksum_expected = g_strdup (as_checksum_get_value (csum));
 	tmp = as_release_get_description (rel, NULL);
 	if (tmp != NULL)
 		g_string_append (update_description, tmp);
@@ -299,13 +656,127 @@ fu_cab_parse (FuCab *cab, GError **error)
 	/* find out what firmware file we have to open */
 	tmp = as_app_get_metadata_item (app, "FirmwareBasename");
 	priv->firmware_basename = g_strdup (tmp);
-	priv->firmware_filename = g_build_filename (priv->tmp_path, tmp, NULL);
+	if (priv->tmp_path != NULL)
+		priv->firmware_filename = g_build_filename (priv->tmp_path, tmp, NULL);
 	priv->signature_basename = g_strdup_printf ("%s.asc", tmp);
 
 	/* success */
 	return TRUE;
 }
 
+/**
+ * fu_cab_parse:
+ **/
+static gboolean
+fu_cab_parse (FuCab *cab, GError **error)
+{
+	FuCabPrivate *priv = cab->priv;
+	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_object_unref_ GFile *path = NULL;
+
+	g_return_val_if_fail (FU_IS_CAB (cab), FALSE);
+
+	/* everything is decompressed into RAM in one pass */
+	if (priv->in_memory) {
+		if (!fu_cab_parse_memory (cab, error))
+			return FALSE;
+		return fu_cab_parse_metadata (cab, error);
+	}
+
+	/* open the file */
+	priv->gcab = gcab_cabinet_new ();
+	if (!gcab_cabinet_load (priv->gcab, priv->cab_stream, NULL, &error_local)) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_READ,
+			     "cannot load .cab file: %s",
+			     error_local->message);
+		return FALSE;
+	}
+
+	/* decompress to /tmp */
+	priv->tmp_path = g_dir_make_tmp ("fwupd-XXXXXX", &error_local);
+	if (priv->tmp_path == NULL) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "failed to create temp dir: %s",
+			     error_local->message);
+		return FALSE;
+	}
+
+	/* get the file list */
+	path = g_file_new_for_path (priv->tmp_path);
+	if (!gcab_cabinet_extract_simple (priv->gcab, path,
+					  fu_cab_read_file_list_cb,
+					  cab, NULL, &error_local)) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "failed to extract .cab file: %s",
+			     error_local->message);
+		return FALSE;
+	}
+	return fu_cab_parse_metadata (cab, error);
+}
+
+/**
+ * fu_cab_mapping_free:
+ **/
+static void
+fu_cab_mapping_free (FuCabMapping *mapping)
+{
+	munmap (mapping->data, mapping->len);
+	g_free (mapping);
+}
+
+/**
+ * fu_cab_load_fd_mmap:
+ *
+ * Maps a memfd so the archive is parsed straight from the page cache.
+ * The fd comes from the client, so this is only safe if the client can
+ * neither truncate it, which would raise SIGBUS in the daemon, nor change
+ * the contents after the signature has been checked. Anything else is
+ * copied into memory owned by the daemon. The fd is closed on success.
+ **/
+static gboolean
+fu_cab_load_fd_mmap (FuCab *cab, gint fd)
+{
+	FuCabMapping *mapping;
+	FuCabPrivate *priv = cab->priv;
+	gint seals;
+	gpointer data;
+	struct stat stat_buf;
+
+	seals = fcntl (fd, F_GET_SEALS);
+	if (seals < 0)
+		return FALSE;
+	if ((seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		g_debug ("not mapping fd without F_SEAL_SHRINK|F_SEAL_WRITE");
+		return FALSE;
+	}
+	if (fstat (fd, &stat_buf) != 0)
+		return FALSE;
+	if (!S_ISREG (stat_buf.st_mode) || stat_buf.st_size == 0)
+		return FALSE;
+	data = mmap (NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		g_debug ("failed to mmap: %s", g_strerror (errno));
+		return FALSE;
+	}
+	close (fd);
+
+	mapping = g_new0 (FuCabMapping, 1);
+	mapping->data = data;
+	mapping->len = stat_buf.st_size;
+	priv->cab_data = g_bytes_new_with_free_func (data, mapping->len,
+						     (GDestroyNotify) fu_cab_mapping_free,
+						     mapping);
+	priv->cab_stream = g_memory_input_stream_new_from_bytes (priv->cab_data);
+	priv->size = mapping->len;
+	return TRUE;
+}
+
 /**
  * fu_cab_load_fd:
  **/
@@ -323,7 +794,12 @@ fu_cab_load_fd (FuCab *cab, gint fd, GCancellable *cancellable, GError **error)
 	 * be the largest thing by far, and typically be uncompressable */
 	priv->size = 0;
 
-	/* GCab needs a GSeekable input stream, so buffer to RAM then load */
+	/* no copy required for a sealed memfd */
+	if (fu_cab_load_fd_mmap (cab, fd))
+		return fu_cab_parse (cab, error);
+
+	/* GCab needs a GSeekable input stream, so buffer to RAM then load;
+	 * this is also a private copy the client cannot change under us */
 	stream = g_unix_input_stream_new (fd, TRUE);
 	priv->cab_stream = g_memory_input_stream_new ();
 	while (1) {
@@ -331,8 +807,6 @@ fu_cab_load_fd (FuCab *cab, gint fd, GCancellable *cancellable, GError **error)
 		data = g_input_stream_read_bytes (stream, 8192,
 						  cancellable,
 						  &error_local);
-		if (g_bytes_get_size (data) == 0)
-			break;
 		if (data == NULL) {
 			g_set_error_literal (error,
 					     FWUPD_ERROR,
@@ -340,6 +814,8 @@ fu_cab_load_fd (FuCab *cab, gint fd, GCancellable *cancellable, GError **error)
 					     error_local->message);
 			return FALSE;
 		}
+		if (g_bytes_get_size (data) == 0)
+			break;
 		priv->size += g_bytes_get_size (data);
 		g_memory_input_stream_add_bytes (G_MEMORY_INPUT_STREAM (priv->cab_stream), data);
 	}
@@ -363,6 +839,15 @@ fu_cab_save_file (FuCab *cab, GFile *file, GCancellable *cancellable, GError **e
 
 	g_return_val_if_fail (FU_IS_CAB (cab), FALSE);
 
+	/* GCab can only add files that exist on disk */
+	if (priv->in_memory) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_NOT_SUPPORTED,
+				     "cannot save a .cab file loaded into memory");
+		return FALSE;
+	}
+
 	/* ensure all files are decompressed */
 	if (!fu_cab_extract (cab, FU_CAB_EXTRACT_FLAG_ALL, error))
 		return FALSE;
@@ -459,6 +944,10 @@ fu_cab_extract (FuCab *cab, FuCabExtractFlags flags, GError **error)
 
 	g_return_val_if_fail (FU_IS_CAB (cab), FALSE);
 
+	/* everything was decompressed when loading */
+	if (priv->in_memory)
+		return TRUE;
+
 	/* extract anything we need */
 	helper.cab = cab;
 	helper.flags = flags;
@@ -477,6 +966,48 @@ fu_cab_extract (FuCab *cab, FuCabExtractFlags flags, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_cab_verify_checksum:
+ *
+ * Checks the payload against the content checksum in the metadata, using
+ * the hash computed while decompressing, or hashing the extracted file when
+ * the archive was not loaded into memory.
+ **/
+static gboolean
+fu_cab_verify_checksum (FuCab *cab, GError **error)
+{
+	FuCabPrivate *priv = cab->priv;
+	const gchar *checksum;
+	_cleanup_free_ gchar *checksum_file = NULL;
+
+	if (priv->checksum_expected == NULL)
+		return TRUE;
+	checksum = g_hash_table_lookup (priv->checksums, priv->firmware_basename);
+	if (checksum == NULL && priv->firmware_filename != NULL) {
+		gsize len = 0;
+		_cleanup_free_ gchar *data = NULL;
+		if (!g_file_get_contents (priv->firmware_filename,
+					  &data, &len, error))
+			return FALSE;
+		checksum_file = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+							     (const guchar *) data,
+							     len);
+		checksum = checksum_file;
+	}
+	if (g_strcmp0 (checksum, priv->checksum_expected) != 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INVALID_FILE,
+			     "%s checksum invalid, expected %s got %s",
+			     priv->firmware_basename,
+			     priv->checksum_expected,
+			     checksum);
+		return FALSE;
+	}
+	g_debug ("%s checksum %s matches", priv->firmware_basename, checksum);
+	return TRUE;
+}
+
 /**
  * fu_cab_verify:
  **/
@@ -502,6 +1033,10 @@ fu_cab_verify (FuCab *cab, GError **error)
 		return FALSE;
 	}
 
+	/* this does not need any keys */
+	if (!fu_cab_verify_checksum (cab, error))
+		return FALSE;
+
 	/* check we were installed correctly */
 	pki_dir = g_build_filename (SYSCONFDIR, "pki", "fwupd", NULL);
 	if (!g_file_test (pki_dir, G_FILE_TEST_EXISTS)) {
@@ -512,6 +1047,57 @@ fu_cab_verify (FuCab *cab, GError **error)
 		return FALSE;
 	}
 
+	/* verify the payload without writing it to disk */
+	if (priv->in_memory) {
+		FuCabVerifyHelper *helper;
+		GBytes *payload;
+		GBytes *payload_signature;
+		gboolean trusted = FALSE;
+		payload = g_hash_table_lookup (priv->payloads, priv->firmware_basename);
+		payload_signature = g_hash_table_lookup (priv->payloads,
+							 priv->signature_basename);
+		if (payload == NULL) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "%s not found in .cab file",
+				     priv->firmware_basename);
+			return FALSE;
+		}
+		if (payload_signature == NULL) {
+			g_debug ("firmware archive contained no GPG signature");
+			return TRUE;
+		}
+
+		/* use the result from the background thread if it was for
+		 * the right file, otherwise verify it now */
+		helper = fu_cab_verify_finish (cab);
+		if (helper != NULL &&
+		    g_strcmp0 (helper->basename, priv->firmware_basename) != 0) {
+			fu_cab_verify_helper_free (helper);
+			helper = NULL;
+		}
+		if (helper != NULL) {
+			if (helper->error != NULL) {
+				g_propagate_error (error, helper->error);
+				helper->error = NULL;
+				fu_cab_verify_helper_free (helper);
+				return FALSE;
+			}
+			trusted = helper->trusted;
+			fu_cab_verify_helper_free (helper);
+		} else if (!fu_cab_verify_payload (priv->keyring,
+						   payload, payload_signature,
+						   &trusted, error)) {
+			return FALSE;
+		}
+		if (trusted) {
+			g_debug ("marking payload as trusted");
+			priv->trust_flags |= FWUPD_TRUST_FLAG_PAYLOAD;
+		}
+		return TRUE;
+	}
+
 	/* load signature */
 	fn = g_build_filename (priv->tmp_path, priv->signature_basename, NULL);
 	if (!g_file_test (fn, G_FILE_TEST_EXISTS)) {
@@ -522,8 +1108,8 @@ fu_cab_verify (FuCab *cab, GError **error)
 		return FALSE;
 
 	/* verify against the system trusted keys */
-	kr = fu_keyring_new ();
-	if (!fu_keyring_add_public_keys (kr, pki_dir, error))
+	kr = fu_cab_get_keyring (priv->keyring, error);
+	if (kr == NULL)
 		return FALSE;
 	if (!fu_keyring_verify_file (kr, priv->firmware_filename,
 				     signature, &error_local)) {
@@ -562,6 +1148,132 @@ fu_cab_delete_temp_files (FuCab *cab, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_cab_set_in_memory:
+ *
+ * Sets whether the archive is decompressed into RAM rather than into a
+ * temporary directory. This has to be set before the archive is loaded.
+ **/
+void
+fu_cab_set_in_memory (FuCab *cab, gboolean in_memory)
+{
+	g_return_if_fail (FU_IS_CAB (cab));
+	cab->priv->in_memory = in_memory;
+}
+
+/**
+ * fu_cab_set_keyring:
+ *
+ * Sets a keyring that already has the trusted keys imported, rather than
+ * loading the system keys each time the archive is verified.
+ **/
+void
+fu_cab_set_keyring (FuCab *cab, FuKeyring *keyring)
+{
+	g_return_if_fail (FU_IS_CAB (cab));
+	if (cab->priv->keyring != NULL)
+		g_object_unref (cab->priv->keyring);
+	cab->priv->keyring = keyring != NULL ? g_object_ref (keyring) : NULL;
+}
+
+/**
+ * fu_cab_get_firmware_data:
+ *
+ * Returns the decompressed firmware, or %NULL if not loaded into memory.
+ **/
+GBytes *
+fu_cab_get_firmware_data (FuCab *cab)
+{
+	FuCabPrivate *priv = cab->priv;
+	g_return_val_if_fail (FU_IS_CAB (cab), NULL);
+	if (priv->firmware_basename == NULL)
+		return NULL;
+	return g_hash_table_lookup (priv->payloads, priv->firmware_basename);
+}
+
+/**
+ * fu_cab_get_firmware_fd:
+ *
+ * Returns a file descriptor for the extracted firmware, which the caller
+ * has to close. When loaded into memory an anonymous memfd is used so that
+ * nothing is written to the filesystem.
+ **/
+gint
+fu_cab_get_firmware_fd (FuCab *cab, GError **error)
+{
+	FuCabPrivate *priv = cab->priv;
+	GBytes *data;
+	const guint8 *buf;
+	gint fd = -1;
+	gsize len;
+	gsize offset = 0;
+
+	g_return_val_if_fail (FU_IS_CAB (cab), -1);
+
+	/* just open the extracted file */
+	if (!priv->in_memory) {
+		fd = g_open (priv->firmware_filename, O_CLOEXEC, 0);
+		if (fd < 0) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_READ,
+				     "failed to open %s",
+				     priv->firmware_filename);
+		}
+		return fd;
+	}
+
+	data = fu_cab_get_firmware_data (cab);
+	if (data == NULL) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INVALID_FILE,
+			     "%s not found in .cab file",
+			     priv->firmware_basename);
+		return -1;
+	}
+#ifdef __NR_memfd_create
+	fd = syscall (__NR_memfd_create, "fwupd-firmware", 0x0001 /* MFD_CLOEXEC */);
+#endif
+	if (fd < 0) {
+		_cleanup_free_ gchar *fn = NULL;
+
+		/* fall back to an unlinked temporary file */
+		fd = g_file_open_tmp ("fwupd-XXXXXX", &fn, error);
+		if (fd < 0)
+			return -1;
+		g_unlink (fn);
+	}
+
+	/* copy the payload in */
+	buf = g_bytes_get_data (data, &len);
+	while (offset < len) {
+		gssize wrote = write (fd, buf + offset, len - offset);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_WRITE,
+				     "failed to write firmware: %s",
+				     g_strerror (errno));
+			close (fd);
+			return -1;
+		}
+		offset += wrote;
+	}
+	if (lseek (fd, 0, SEEK_SET) < 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_READ,
+			     "failed to rewind firmware: %s",
+			     g_strerror (errno));
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
 /**
  * fu_cab_get_stream:
  **/
@@ -702,6 +1414,10 @@ fu_cab_init (FuCab *cab)
 	cab->priv = FU_CAB_GET_PRIVATE (cab);
 	cab->priv->basenames_to_delete = g_ptr_array_new_with_free_func (g_free);
 	cab->priv->filelist = g_ptr_array_new_with_free_func (g_free);
+	cab->priv->payloads = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, (GDestroyNotify) g_bytes_unref);
+	cab->priv->checksums = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free, g_free);
 }
 
 /**
@@ -712,8 +1428,15 @@ fu_cab_finalize (GObject *object)
 {
 	FuCab *cab = FU_CAB (object);
 	FuCabPrivate *priv = cab->priv;
+	FuCabVerifyHelper *helper;
+
+	/* never verified */
+	helper = fu_cab_verify_finish (cab);
+	if (helper != NULL)
+		fu_cab_verify_helper_free (helper);
 
 	g_free (priv->firmware_basename);
+	g_free (priv->checksum_expected);
 	g_free (priv->firmware_filename);
 	g_free (priv->signature_basename);
 	g_free (priv->cat_basename);
@@ -730,12 +1453,18 @@ fu_cab_finalize (GObject *object)
 	g_free (priv->license);
 	if (priv->cab_stream != NULL)
 		g_object_unref (priv->cab_stream);
+	if (priv->cab_data != NULL)
+		g_bytes_unref (priv->cab_data);
 	if (priv->gcab != NULL)
 		g_object_unref (priv->gcab);
 	if (priv->inf_kf != NULL)
 		g_key_file_unref (priv->inf_kf);
+	if (priv->keyring != NULL)
+		g_object_unref (priv->keyring);
 	g_ptr_array_unref (priv->basenames_to_delete);
 	g_ptr_array_unref (priv->filelist);
+	g_hash_table_unref (priv->payloads);
+	g_hash_table_unref (priv->checksums);
 
 	G_OBJECT_CLASS (fu_cab_parent_class)->finalize (object);
 }
@@ -25,6 +25,8 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include "fu-keyring.h"
+
 G_BEGIN_DECLS
 
 #define FU_TYPE_CAB		(fu_cab_get_type ())
@@ -83,6 +85,13 @@ gboolean	 fu_cab_extract				(FuCab		*cab,
 							 GError		**error);
 gboolean	 fu_cab_delete_temp_files		(FuCab		*cab,
 							 GError		**error);
+void		 fu_cab_set_in_memory			(FuCab		*cab,
+							 gboolean	 in_memory);
+void		 fu_cab_set_keyring			(FuCab		*cab,
+							 FuKeyring	*keyring);
+GBytes		*fu_cab_get_firmware_data		(FuCab		*cab);
+gint		 fu_cab_get_firmware_fd			(FuCab		*cab,
+							 GError		**error);
 GInputStream	*fu_cab_get_stream			(FuCab		*cab);
 const gchar	*fu_cab_get_guid			(FuCab		*cab);
 const gchar	*fu_cab_get_version			(FuCab		*cab);
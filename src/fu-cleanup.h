@@ -49,11 +49,13 @@ G_BEGIN_DECLS
 
 GS_DEFINE_CLEANUP_FUNCTION0(GArray*, gs_local_array_unref, g_array_unref)
 GS_DEFINE_CLEANUP_FUNCTION0(GBytes*, gs_local_bytes_unref, g_bytes_unref)
+GS_DEFINE_CLEANUP_FUNCTION0(GByteArray*, gs_local_bytearray_unref, g_byte_array_unref)
 GS_DEFINE_CLEANUP_FUNCTION0(GChecksum*, gs_local_checksum_free, g_checksum_free)
 GS_DEFINE_CLEANUP_FUNCTION0(GDir*, gs_local_dir_close, g_dir_close)
 GS_DEFINE_CLEANUP_FUNCTION0(GError*, gs_local_free_error, g_error_free)
 GS_DEFINE_CLEANUP_FUNCTION0(GHashTable*, gs_local_hashtable_unref, g_hash_table_unref)
 GS_DEFINE_CLEANUP_FUNCTION0(GKeyFile*, gs_local_keyfile_unref, g_key_file_unref)
+GS_DEFINE_CLEANUP_FUNCTION0(GMappedFile*, gs_local_mapped_file_unref, g_mapped_file_unref)
 GS_DEFINE_CLEANUP_FUNCTION0(GMarkupParseContext*, gs_local_markup_parse_context_unref, g_markup_parse_context_unref)
 GS_DEFINE_CLEANUP_FUNCTION0(GObject*, gs_local_obj_unref, g_object_unref)
 GS_DEFINE_CLEANUP_FUNCTION0(GPtrArray*, gs_local_ptrarray_unref, g_ptr_array_unref)
@@ -79,8 +81,10 @@ GS_DEFINE_CLEANUP_FUNCTION(void*, gs_local_free, g_free)
 #define _cleanup_variant_iter_free_ __attribute__ ((cleanup(gs_local_variant_iter_free)))
 #define _cleanup_array_unref_ __attribute__ ((cleanup(gs_local_array_unref)))
 #define _cleanup_bytes_unref_ __attribute__ ((cleanup(gs_local_bytes_unref)))
+#define _cleanup_bytearray_unref_ __attribute__ ((cleanup(gs_local_bytearray_unref)))
 #define _cleanup_hashtable_unref_ __attribute__ ((cleanup(gs_local_hashtable_unref)))
 #define _cleanup_keyfile_unref_ __attribute__ ((cleanup(gs_local_keyfile_unref)))
+#define _cleanup_mapped_file_unref_ __attribute__ ((cleanup(gs_local_mapped_file_unref)))
 #define _cleanup_markup_parse_context_unref_ __attribute__ ((cleanup(gs_local_markup_parse_context_unref)))
 #define _cleanup_object_unref_ __attribute__ ((cleanup(gs_local_obj_unref)))
 #define _cleanup_ptrarray_unref_ __attribute__ ((cleanup(gs_local_ptrarray_unref)))
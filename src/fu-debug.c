@@ -26,8 +26,22 @@
 
 #include <fu-debug.h>
 
+#define FU_DEBUG_LOG_SIZE	1024	/* entries */
+
+typedef struct {
+	gint64			 time;		/* us, wall clock */
+	GLogLevelFlags		 log_level;
+	gchar			*message;
+} FuDebugEntry;
+
 static gboolean _verbose = FALSE;
 static gboolean _console = FALSE;
+static gboolean _log_buffer = FALSE;
+static FuDebugEntry *_log = NULL;	/* ring of FU_DEBUG_LOG_SIZE */
+static guint _log_head = 0;		/* next entry to write */
+static guint _log_len = 0;
+static guint _log_undumped = 0;	/* newest entries not yet printed */
+static GMutex _log_mutex;
 
 /**
  * fu_debug_is_verbose:
@@ -45,6 +59,134 @@ fu_debug_is_verbose (void)
 	return FALSE;
 }
 
+/**
+ * fu_debug_is_enabled:
+ *
+ * Callers can use this to avoid building strings that are only ever
+ * passed to g_debug(), for instance hex dumps.
+ **/
+gboolean
+fu_debug_is_enabled (void)
+{
+	if (_log != NULL)
+		return TRUE;
+	if (g_getenv ("G_MESSAGES_DEBUG") != NULL)
+		return TRUE;
+	return fu_debug_is_verbose ();
+}
+
+/**
+ * fu_debug_log_level_to_string:
+ **/
+static const gchar *
+fu_debug_log_level_to_string (GLogLevelFlags log_level)
+{
+	if (log_level & G_LOG_LEVEL_ERROR)
+		return "ERROR";
+	if (log_level & G_LOG_LEVEL_CRITICAL)
+		return "CRITICAL";
+	if (log_level & G_LOG_LEVEL_WARNING)
+		return "WARNING";
+	if (log_level & G_LOG_LEVEL_INFO)
+		return "INFO";
+	return "DEBUG";
+}
+
+/**
+ * fu_debug_get_log_unlocked:
+ *
+ * Formats the newest @len entries, oldest first.
+ **/
+static gchar *
+fu_debug_get_log_unlocked (guint len)
+{
+	FuDebugEntry *entry;
+	GString *str;
+	guint i;
+
+	str = g_string_new ("");
+	for (i = 0; i < len; i++) {
+		gchar str_time[255];
+		time_t the_time;
+
+		/* oldest first */
+		entry = &_log[(_log_head + FU_DEBUG_LOG_SIZE - len + i) % FU_DEBUG_LOG_SIZE];
+		the_time = entry->time / G_USEC_PER_SEC;
+		strftime (str_time, 254, "%H:%M:%S", localtime (&the_time));
+		g_string_append_printf (str, "%s.%03u\t%s\t%s\n",
+					str_time,
+					(guint) ((entry->time % G_USEC_PER_SEC) / 1000),
+					fu_debug_log_level_to_string (entry->log_level),
+					entry->message);
+	}
+	return g_string_free (str, FALSE);
+}
+
+/**
+ * fu_debug_get_log:
+ *
+ * Formats all the messages in the buffer, including any that have already
+ * been printed because of a warning.
+ *
+ * Returns: a string, or %NULL if the log buffer is not enabled
+ **/
+gchar *
+fu_debug_get_log (void)
+{
+	gchar *tmp;
+
+	if (_log == NULL)
+		return NULL;
+	g_mutex_lock (&_log_mutex);
+	tmp = fu_debug_get_log_unlocked (_log_len);
+	g_mutex_unlock (&_log_mutex);
+	return tmp;
+}
+
+/**
+ * fu_debug_log_cb:
+ *
+ * Records the messages in the ring buffer without any formatting, and
+ * only prints them all out if something goes wrong.
+ **/
+static void
+fu_debug_log_cb (const gchar *log_domain,
+		 GLogLevelFlags log_level,
+		 const gchar *message,
+		 gpointer user_data)
+{
+	FuDebugEntry *entry;
+	gchar *tmp = NULL;
+
+	g_mutex_lock (&_log_mutex);
+	entry = &_log[_log_head];
+	g_free (entry->message);
+	entry->time = g_get_real_time ();
+	entry->log_level = log_level;
+	entry->message = g_strdup (message);
+	_log_head = (_log_head + 1) % FU_DEBUG_LOG_SIZE;
+	if (_log_len < FU_DEBUG_LOG_SIZE)
+		_log_len++;
+	if (_log_undumped < FU_DEBUG_LOG_SIZE)
+		_log_undumped++;
+
+	/* show what led up to the problem, without repeating anything that
+	 * was shown for an earlier one; the entries are kept for GetDebugLog */
+	if (log_level & (G_LOG_LEVEL_WARNING |
+			 G_LOG_LEVEL_CRITICAL |
+			 G_LOG_LEVEL_ERROR)) {
+		tmp = fu_debug_get_log_unlocked (_log_undumped);
+		_log_undumped = 0;
+	}
+	g_mutex_unlock (&_log_mutex);
+	if (tmp != NULL) {
+		g_print ("%s", tmp);
+		g_free (tmp);
+		return;
+	}
+	if (log_level & G_LOG_LEVEL_INFO)
+		g_print ("%s\n", message);
+}
 
 /**
  * fu_debug_ignore_cb:
@@ -135,6 +277,9 @@ fu_debug_pre_parse_hook (GOptionContext *context,
 		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &_verbose,
 		  /* TRANSLATORS: turn on all debugging */
 		  N_("Show debugging information for all files"), NULL },
+		{ "log-buffer", '\0', 0, G_OPTION_ARG_NONE, &_log_buffer,
+		  /* TRANSLATORS: keep recent debugging in memory */
+		  N_("Record debugging information in memory"), NULL },
 		{ NULL}
 	};
 
@@ -149,6 +294,17 @@ fu_debug_pre_parse_hook (GOptionContext *context,
 void
 fu_debug_destroy (void)
 {
+	guint i;
+
+	if (_log == NULL)
+		return;
+	for (i = 0; i < FU_DEBUG_LOG_SIZE; i++)
+		g_free (_log[i].message);
+	g_free (_log);
+	_log = NULL;
+	_log_len = 0;
+	_log_undumped = 0;
+	_log_head = 0;
 }
 
 /**
@@ -166,6 +322,17 @@ fu_debug_setup (gboolean enabled)
 				   G_LOG_LEVEL_DEBUG |
 				   G_LOG_LEVEL_WARNING,
 				   fu_debug_handler_cb, NULL);
+	} else if (_log_buffer) {
+		/* keep the most recent debugging */
+		if (_log == NULL)
+			_log = g_new0 (FuDebugEntry, FU_DEBUG_LOG_SIZE);
+		g_log_set_handler (G_LOG_DOMAIN,
+				   G_LOG_LEVEL_ERROR |
+				   G_LOG_LEVEL_CRITICAL |
+				   G_LOG_LEVEL_DEBUG |
+				   G_LOG_LEVEL_INFO |
+				   G_LOG_LEVEL_WARNING,
+				   fu_debug_log_cb, NULL);
 	} else {
 		/* hide all debugging */
 		g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
@@ -25,6 +25,8 @@
 #include <glib.h>
 
 gboolean	 fu_debug_is_verbose		(void);
+gboolean	 fu_debug_is_enabled		(void);
+gchar		*fu_debug_get_log		(void);
 GOptionGroup	*fu_debug_get_option_group	(void);
 void		 fu_debug_setup			(gboolean	 enabled);
 void		 fu_debug_destroy		(void);
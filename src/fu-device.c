@@ -40,7 +40,9 @@ struct _FuDevicePrivate
 {
 	gchar				*id;
 	guint64				 flags;
-	GHashTable			*metadata;
+	GHashTable			*metadata;	/* GQuark:value */
+	GVariant			*metadata_variant; /* a{sv}, or NULL */
+	GMutex				 mutex;		/* for the above and flags */
 };
 
 enum {
@@ -55,6 +57,20 @@ enum {
 
 G_DEFINE_TYPE (FuDevice, fu_device, G_TYPE_OBJECT)
 
+/**
+ * fu_device_invalidate:
+ *
+ * The mutex must be held.
+ **/
+static void
+fu_device_invalidate (FuDevice *device)
+{
+	if (device->priv->metadata_variant == NULL)
+		return;
+	g_variant_unref (device->priv->metadata_variant);
+	device->priv->metadata_variant = NULL;
+}
+
 /**
  * fu_device_get_id:
  **/
@@ -83,8 +99,12 @@ fu_device_set_id (FuDevice *device, const gchar *id)
 guint64
 fu_device_get_flags (FuDevice *device)
 {
+	guint64 flags;
 	g_return_val_if_fail (FU_IS_DEVICE (device), 0);
-	return device->priv->flags;
+	g_mutex_lock (&device->priv->mutex);
+	flags = device->priv->flags;
+	g_mutex_unlock (&device->priv->mutex);
+	return flags;
 }
 
 /**
@@ -94,7 +114,12 @@ void
 fu_device_set_flags (FuDevice *device, guint64 flags)
 {
 	g_return_if_fail (FU_IS_DEVICE (device));
-	device->priv->flags = flags;
+	g_mutex_lock (&device->priv->mutex);
+	if (device->priv->flags != flags) {
+		device->priv->flags = flags;
+		fu_device_invalidate (device);
+	}
+	g_mutex_unlock (&device->priv->mutex);
 }
 
 /**
@@ -104,7 +129,12 @@ void
 fu_device_add_flag (FuDevice *device, FwupdDeviceFlags flag)
 {
 	g_return_if_fail (FU_IS_DEVICE (device));
-	device->priv->flags |= flag;
+	g_mutex_lock (&device->priv->mutex);
+	if ((device->priv->flags & flag) != flag) {
+		device->priv->flags |= flag;
+		fu_device_invalidate (device);
+	}
+	g_mutex_unlock (&device->priv->mutex);
 }
 
 /**
@@ -149,45 +179,123 @@ fu_device_set_display_name (FuDevice *device, const gchar *display_name)
 
 /**
  * fu_device_get_metadata:
+ *
+ * The value is only valid until the key is next set. Devices added to the
+ * daemon are only changed from the main thread, as providers go through
+ * fu_provider_set_device_metadata(), so any other thread that may race with
+ * a setter should use fu_device_dup_metadata() instead.
  **/
 const gchar *
 fu_device_get_metadata (FuDevice *device, const gchar *key)
 {
+	GQuark quark;
+	const gchar *value;
+
 	g_return_val_if_fail (FU_IS_DEVICE (device), NULL);
 	g_return_val_if_fail (key != NULL, NULL);
-	return g_hash_table_lookup (device->priv->metadata, key);
+
+	/* a key nobody has ever set can't be on this device */
+	quark = g_quark_try_string (key);
+	if (quark == 0)
+		return NULL;
+	g_mutex_lock (&device->priv->mutex);
+	value = g_hash_table_lookup (device->priv->metadata, GUINT_TO_POINTER (quark));
+	g_mutex_unlock (&device->priv->mutex);
+	return value;
 }
 
 /**
- * fu_device_get_id:
+ * fu_device_dup_metadata:
+ *
+ * Returns: (transfer full): a copy of the value, or %NULL if not set
+ **/
+gchar *
+fu_device_dup_metadata (FuDevice *device, const gchar *key)
+{
+	GQuark quark;
+	gchar *value;
+
+	g_return_val_if_fail (FU_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (key != NULL, NULL);
+
+	quark = g_quark_try_string (key);
+	if (quark == 0)
+		return NULL;
+	g_mutex_lock (&device->priv->mutex);
+	value = g_strdup (g_hash_table_lookup (device->priv->metadata,
+					       GUINT_TO_POINTER (quark)));
+	g_mutex_unlock (&device->priv->mutex);
+	return value;
+}
+
+/**
+ * fu_device_set_metadata:
+ *
+ * The key is interned, so devices share a single copy of each key name.
  **/
 void
 fu_device_set_metadata (FuDevice *device, const gchar *key, const gchar *value)
 {
+	GQuark quark;
+	const gchar *value_old;
+
 	g_return_if_fail (FU_IS_DEVICE (device));
 	g_return_if_fail (key != NULL);
 	g_return_if_fail (value != NULL);
-	g_hash_table_insert (device->priv->metadata, g_strdup (key), g_strdup (value));
+
+	quark = g_quark_from_string (key);
+	g_mutex_lock (&device->priv->mutex);
+	value_old = g_hash_table_lookup (device->priv->metadata, GUINT_TO_POINTER (quark));
+	if (g_strcmp0 (value_old, value) != 0) {
+		g_hash_table_insert (device->priv->metadata,
+				     GUINT_TO_POINTER (quark),
+				     g_strdup (value));
+		fu_device_invalidate (device);
+	}
+	g_mutex_unlock (&device->priv->mutex);
 }
 
 /**
- * fu_device_to_variant:
+ * fu_device_sort_keys_cb:
  **/
-GVariant *
-fu_device_to_variant (FuDevice *device)
+static gint
+fu_device_sort_keys_cb (gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0 (g_quark_to_string (GPOINTER_TO_UINT (a)),
+			  g_quark_to_string (GPOINTER_TO_UINT (b)));
+}
+
+/**
+ * fu_device_get_metadata_variant:
+ *
+ * Returns the sorted metadata as a{sv}, which is only rebuilt after the
+ * metadata or flags have been changed. A reference is returned as another
+ * thread may invalidate the cache as soon as the mutex is released.
+ *
+ * Returns: (transfer full): a #GVariant
+ **/
+static GVariant *
+fu_device_get_metadata_variant (FuDevice *device)
 {
+	FuDevicePrivate *priv = device->priv;
 	GList *l;
+	GVariant *variant;
 	GVariantBuilder builder;
 	const gchar *key;
 	const gchar *value;
 	_cleanup_list_free_ GList *keys = NULL;
 
+	g_mutex_lock (&priv->mutex);
+	if (priv->metadata_variant != NULL)
+		goto out;
+
 	/* create an array with all the metadata in */
 	g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
-	keys = g_hash_table_get_keys (device->priv->metadata);
+	keys = g_hash_table_get_keys (priv->metadata);
+	keys = g_list_sort (keys, fu_device_sort_keys_cb);
 	for (l = keys; l != NULL; l = l->next) {
-		key = l->data;
-		value = g_hash_table_lookup (device->priv->metadata, key);
+		key = g_quark_to_string (GPOINTER_TO_UINT (l->data));
+		value = g_hash_table_lookup (priv->metadata, l->data);
 		if (g_strcmp0 (value, "TRUE") == 0) {
 			g_variant_builder_add (&builder, "{sv}",
 					       key, g_variant_new_boolean (TRUE));
@@ -198,8 +306,24 @@ fu_device_to_variant (FuDevice *device)
 	}
 	g_variant_builder_add (&builder, "{sv}",
 			       FU_DEVICE_KEY_FLAGS,
-			       g_variant_new_uint64 (device->priv->flags));
-	return g_variant_new ("{sa{sv}}", device->priv->id, &builder);
+			       g_variant_new_uint64 (priv->flags));
+	priv->metadata_variant = g_variant_ref_sink (g_variant_builder_end (&builder));
+out:
+	variant = g_variant_ref (priv->metadata_variant);
+	g_mutex_unlock (&priv->mutex);
+	return variant;
+}
+
+/**
+ * fu_device_to_variant:
+ **/
+GVariant *
+fu_device_to_variant (FuDevice *device)
+{
+	_cleanup_variant_unref_ GVariant *metadata = NULL;
+	g_return_val_if_fail (FU_IS_DEVICE (device), NULL);
+	metadata = fu_device_get_metadata_variant (device);
+	return g_variant_new ("{s@a{sv}}", device->priv->id, metadata);
 }
 
 /**
@@ -208,31 +332,10 @@ fu_device_to_variant (FuDevice *device)
 GVariant *
 fu_device_get_metadata_as_variant (FuDevice *device)
 {
-	GList *l;
-	GVariantBuilder builder;
-	const gchar *key;
-	const gchar *value;
-	_cleanup_list_free_ GList *keys = NULL;
-
-	/* create an array with all the metadata in */
-	g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
-	keys = g_hash_table_get_keys (device->priv->metadata);
-	keys = g_list_sort (keys, (GCompareFunc) g_strcmp0);
-	for (l = keys; l != NULL; l = l->next) {
-		key = l->data;
-		value = g_hash_table_lookup (device->priv->metadata, key);
-		if (g_strcmp0 (value, "TRUE") == 0) {
-			g_variant_builder_add (&builder, "{sv}",
-					       key, g_variant_new_boolean (TRUE));
-		} else {
-			g_variant_builder_add (&builder, "{sv}",
-					       key, g_variant_new_string (value));
-		}
-	}
-	g_variant_builder_add (&builder, "{sv}",
-			       FU_DEVICE_KEY_FLAGS,
-			       g_variant_new_uint64 (device->priv->flags));
-	return g_variant_new ("(a{sv})", &builder);
+	_cleanup_variant_unref_ GVariant *metadata = NULL;
+	g_return_val_if_fail (FU_IS_DEVICE (device), NULL);
+	metadata = fu_device_get_metadata_variant (device);
+	return g_variant_new ("(@a{sv})", metadata);
 }
 
 /**
@@ -338,8 +441,9 @@ static void
 fu_device_init (FuDevice *device)
 {
 	device->priv = FU_DEVICE_GET_PRIVATE (device);
-	device->priv->metadata = g_hash_table_new_full (g_str_hash, g_str_equal,
-							g_free, g_free);
+	device->priv->metadata = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							NULL, g_free);
+	g_mutex_init (&device->priv->mutex);
 }
 
 /**
@@ -353,6 +457,9 @@ fu_device_finalize (GObject *object)
 
 	g_free (priv->id);
 	g_hash_table_unref (priv->metadata);
+	if (priv->metadata_variant != NULL)
+		g_variant_unref (priv->metadata_variant);
+	g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (fu_device_parent_class)->finalize (object);
 }
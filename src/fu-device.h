@@ -57,6 +57,7 @@ G_BEGIN_DECLS
 #define FU_DEVICE_KEY_UPDATE_HASH	"UpdateHash"	/* s */
 #define FU_DEVICE_KEY_UPDATE_URI	"UpdateUri"	/* s */
 #define FU_DEVICE_KEY_UPDATE_DESCRIPTION "UpdateDescription" /* s */
+#define FU_DEVICE_KEY_RECONNECT_TIME	"ReconnectTime"	/* s, in ms */
 
 typedef struct _FuDevicePrivate	FuDevicePrivate;
 typedef struct _FuDevice	FuDevice;
@@ -94,6 +95,8 @@ void		 fu_device_set_display_name		(FuDevice	*device,
 							 const gchar	*display_name);
 const gchar	*fu_device_get_metadata			(FuDevice	*device,
 							 const gchar	*key);
+gchar		*fu_device_dup_metadata			(FuDevice	*device,
+							 const gchar	*key);
 GVariant	*fu_device_get_metadata_as_variant	(FuDevice	*device);
 void		 fu_device_set_metadata			(FuDevice	*device,
 							 const gchar	*key,
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <fwupd.h>
 #include <gpgme.h>
 
@@ -39,6 +40,8 @@ static void fu_keyring_finalize			 (GObject *object);
 struct _FuKeyringPrivate
 {
 	gpgme_ctx_t		 ctx;
+	GHashTable		*verified;	/* key=sha1:sha1 */
+	GMutex			 mutex;
 };
 
 G_DEFINE_TYPE (FuKeyring, fu_keyring, G_TYPE_OBJECT)
@@ -215,8 +218,10 @@ fu_keyring_add_public_key (FuKeyring *keyring, const gchar *filename, GError **e
 			     filename, gpgme_strerror (rc));
 		goto out;
 	}
+	g_mutex_lock (&keyring->priv->mutex);
 	rc = gpgme_op_import (keyring->priv->ctx, data);
 	if (rc != GPG_ERR_NO_ERROR) {
+		g_mutex_unlock (&keyring->priv->mutex);
 		ret = FALSE;
 		g_set_error (error,
 			     FWUPD_ERROR,
@@ -232,6 +237,11 @@ fu_keyring_add_public_key (FuKeyring *keyring, const gchar *filename, GError **e
 		g_debug ("importing key %s [%i] %s",
 			 s->fpr, s->status, gpgme_strerror (s->result));
 	}
+
+	/* the new key may revoke a signature we already trusted */
+	if (keyring->priv->verified != NULL)
+		g_hash_table_remove_all (keyring->priv->verified);
+	g_mutex_unlock (&keyring->priv->mutex);
 out:
 	gpgme_data_release (data);
 	return ret;
@@ -323,13 +333,13 @@ fu_keyring_check_signature (gpgme_signature_t signature, GError **error)
 }
 
 /**
- * fu_keyring_verify_file:
+ * fu_keyring_verify_file_unlocked:
  **/
-gboolean
-fu_keyring_verify_file (FuKeyring *keyring,
-			const gchar *filename,
-			const gchar *signature,
-			GError **error)
+static gboolean
+fu_keyring_verify_file_unlocked (FuKeyring *keyring,
+				 const gchar *filename,
+				 const gchar *signature,
+				 GError **error)
 {
 	gboolean has_header;
 	gboolean ret = TRUE;
@@ -421,6 +431,27 @@ out:
 	return ret;
 }
 
+/**
+ * fu_keyring_verify_file:
+ **/
+gboolean
+fu_keyring_verify_file (FuKeyring *keyring,
+			const gchar *filename,
+			const gchar *signature,
+			GError **error)
+{
+	gboolean ret;
+
+	g_return_val_if_fail (FU_IS_KEYRING (keyring), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+	g_return_val_if_fail (signature != NULL, FALSE);
+
+	g_mutex_lock (&keyring->priv->mutex);
+	ret = fu_keyring_verify_file_unlocked (keyring, filename, signature, error);
+	g_mutex_unlock (&keyring->priv->mutex);
+	return ret;
+}
+
 /**
  * fu_keyring_sign_data:
  **/
@@ -491,13 +522,13 @@ out:
 }
 
 /**
- * fu_keyring_verify_data:
+ * fu_keyring_verify_data_unlocked:
  **/
-gboolean
-fu_keyring_verify_data (FuKeyring *keyring,
-			GBytes *payload,
-			GBytes *payload_signature,
-			GError **error)
+static gboolean
+fu_keyring_verify_data_unlocked (FuKeyring *keyring,
+				 GBytes *payload,
+				 GBytes *payload_signature,
+				 GError **error)
 {
 	gboolean ret = TRUE;
 	gpgme_data_t data = NULL;
@@ -578,6 +609,224 @@ out:
 	return ret;
 }
 
+/**
+ * fu_keyring_get_cache_key:
+ **/
+static gchar *
+fu_keyring_get_cache_key (GBytes *payload, GBytes *payload_signature)
+{
+	_cleanup_free_ gchar *csum_data = NULL;
+	_cleanup_free_ gchar *csum_sig = NULL;
+
+	csum_data = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+						 g_bytes_get_data (payload, NULL),
+						 g_bytes_get_size (payload));
+	csum_sig = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+						g_bytes_get_data (payload_signature, NULL),
+						g_bytes_get_size (payload_signature));
+	return g_strdup_printf ("%s:%s", csum_data, csum_sig);
+}
+
+/**
+ * fu_keyring_verify_data:
+ *
+ * If the cache is enabled then a payload and signature pair that has
+ * already been verified successfully is not passed to GPG again.
+ **/
+gboolean
+fu_keyring_verify_data (FuKeyring *keyring,
+			GBytes *payload,
+			GBytes *payload_signature,
+			GError **error)
+{
+	FuKeyringPrivate *priv = keyring->priv;
+	gboolean ret;
+	_cleanup_free_ gchar *key = NULL;
+
+	g_return_val_if_fail (FU_IS_KEYRING (keyring), FALSE);
+	g_return_val_if_fail (payload != NULL, FALSE);
+	g_return_val_if_fail (payload_signature != NULL, FALSE);
+
+	g_mutex_lock (&priv->mutex);
+	if (priv->verified != NULL) {
+		key = fu_keyring_get_cache_key (payload, payload_signature);
+		if (g_hash_table_lookup (priv->verified, key) != NULL) {
+			g_debug ("signature %s already verified", key);
+			g_mutex_unlock (&priv->mutex);
+			return TRUE;
+		}
+	}
+	ret = fu_keyring_verify_data_unlocked (keyring, payload,
+					       payload_signature, error);
+	if (ret && key != NULL) {
+		g_hash_table_insert (priv->verified,
+				     g_strdup (key),
+				     GINT_TO_POINTER (TRUE));
+	}
+	g_mutex_unlock (&priv->mutex);
+	return ret;
+}
+
+/**
+ * fu_keyring_stream_read_cb:
+ **/
+static ssize_t
+fu_keyring_stream_read_cb (void *handle, void *buffer, size_t size)
+{
+	GInputStream *stream = G_INPUT_STREAM (handle);
+	gssize len;
+	_cleanup_error_free_ GError *error = NULL;
+
+	len = g_input_stream_read (stream, buffer, size, NULL, &error);
+	if (len < 0) {
+		g_warning ("failed to read stream: %s", error->message);
+		gpgme_err_set_errno (EIO);
+		return -1;
+	}
+	return len;
+}
+
+/**
+ * fu_keyring_verify_stream_unlocked:
+ **/
+static gboolean
+fu_keyring_verify_stream_unlocked (FuKeyring *keyring,
+				   GInputStream *payload,
+				   GBytes *payload_signature,
+				   GError **error)
+{
+	gboolean ret = TRUE;
+	gpgme_data_t data = NULL;
+	gpgme_data_t sig = NULL;
+	gpgme_error_t rc;
+	gpgme_signature_t s;
+	gpgme_verify_result_t result;
+	struct gpgme_data_cbs cbs = {
+		fu_keyring_stream_read_cb,
+		NULL,	/* write */
+		NULL,	/* seek */
+		NULL	/* release */
+	};
+
+	g_return_val_if_fail (FU_IS_KEYRING (keyring), FALSE);
+	g_return_val_if_fail (G_IS_INPUT_STREAM (payload), FALSE);
+	g_return_val_if_fail (payload_signature != NULL, FALSE);
+
+	/* setup context */
+	if (!fu_keyring_setup (keyring, error))
+		return FALSE;
+
+	/* load stream data */
+	rc = gpgme_data_new_from_cbs (&data, &cbs, payload);
+	if (rc != GPG_ERR_NO_ERROR) {
+		ret = FALSE;
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INTERNAL,
+			     "failed to load stream: %s",
+			     gpgme_strerror (rc));
+		goto out;
+	}
+	rc = gpgme_data_new_from_mem (&sig,
+				      g_bytes_get_data (payload_signature, NULL),
+				      g_bytes_get_size (payload_signature), 0);
+	if (rc != GPG_ERR_NO_ERROR) {
+		ret = FALSE;
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INTERNAL,
+			     "failed to load signature: %s",
+			      gpgme_strerror (rc));
+		goto out;
+	}
+
+	/* verify */
+	rc = gpgme_op_verify (keyring->priv->ctx, sig, data, NULL);
+	if (rc != GPG_ERR_NO_ERROR) {
+		ret = FALSE;
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INTERNAL,
+			     "failed to verify stream: %s",
+			     gpgme_strerror (rc));
+		goto out;
+	}
+
+	/* verify the result */
+	result = gpgme_op_verify_result (keyring->priv->ctx);
+	if (result == NULL) {
+		ret = FALSE;
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INTERNAL,
+				     "no result record from libgpgme");
+		goto out;
+	}
+
+	/* look at each signature */
+	for (s = result->signatures; s != NULL ; s = s->next ) {
+		ret = fu_keyring_check_signature (s, error);
+		if (!ret)
+			goto out;
+	}
+out:
+	if (data != NULL)
+		gpgme_data_release (data);
+	if (sig != NULL)
+		gpgme_data_release (sig);
+	return ret;
+}
+
+/**
+ * fu_keyring_verify_stream:
+ *
+ * Verifies the detached signature against data read incrementally from
+ * @payload, so the payload never has to be held in memory.
+ **/
+gboolean
+fu_keyring_verify_stream (FuKeyring *keyring,
+			  GInputStream *payload,
+			  GBytes *payload_signature,
+			  GError **error)
+{
+	gboolean ret;
+
+	g_return_val_if_fail (FU_IS_KEYRING (keyring), FALSE);
+	g_return_val_if_fail (G_IS_INPUT_STREAM (payload), FALSE);
+	g_return_val_if_fail (payload_signature != NULL, FALSE);
+
+	g_mutex_lock (&keyring->priv->mutex);
+	ret = fu_keyring_verify_stream_unlocked (keyring, payload,
+						 payload_signature, error);
+	g_mutex_unlock (&keyring->priv->mutex);
+	return ret;
+}
+
+/**
+ * fu_keyring_set_use_cache:
+ *
+ * Remembers successful calls to fu_keyring_verify_data() so that the same
+ * payload and signature can be checked again for free, e.g. when the same
+ * cabinet file is installed on many identical devices.
+ **/
+void
+fu_keyring_set_use_cache (FuKeyring *keyring, gboolean use_cache)
+{
+	FuKeyringPrivate *priv = keyring->priv;
+
+	g_return_if_fail (FU_IS_KEYRING (keyring));
+
+	g_mutex_lock (&priv->mutex);
+	if (use_cache && priv->verified == NULL) {
+		priv->verified = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, NULL);
+	} else if (!use_cache && priv->verified != NULL) {
+		g_hash_table_unref (priv->verified);
+		priv->verified = NULL;
+	}
+	g_mutex_unlock (&priv->mutex);
+}
+
 /**
  * fu_keyring_class_init:
  **/
@@ -596,6 +845,7 @@ static void
 fu_keyring_init (FuKeyring *keyring)
 {
 	keyring->priv = FU_KEYRING_GET_PRIVATE (keyring);
+	g_mutex_init (&keyring->priv->mutex);
 }
 
 /**
@@ -609,6 +859,9 @@ fu_keyring_finalize (GObject *object)
 
 	if (priv->ctx != NULL)
 		gpgme_release (priv->ctx);
+	if (priv->verified != NULL)
+		g_hash_table_unref (priv->verified);
+	g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (fu_keyring_parent_class)->finalize (object);
 }
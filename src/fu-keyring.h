@@ -70,6 +70,12 @@ gboolean	 fu_keyring_verify_data			(FuKeyring	*keyring,
 							 GBytes		*payload,
 							 GBytes		*payload_signature,
 							 GError		**error);
+gboolean	 fu_keyring_verify_stream		(FuKeyring	*keyring,
+							 GInputStream	*payload,
+							 GBytes		*payload_signature,
+							 GError		**error);
+void		 fu_keyring_set_use_cache		(FuKeyring	*keyring,
+							 gboolean	 use_cache);
 GBytes		*fu_keyring_sign_data			(FuKeyring	*keyring,
 							 GBytes		*payload,
 							 GError		**error);
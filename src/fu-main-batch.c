@@ -0,0 +1,412 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include "fu-cleanup.h"
+#include "fu-main-batch.h"
+
+typedef struct {
+	GPtrArray		*jobs;		/* of FuMainBatchJob */
+	GPtrArray		*serial;	/* of FuMainBatchJob */
+	GPtrArray		*stages;	/* of FuMainBatchStage */
+	GInputStream		*stream_cab;
+	FuProviderFlags		 flags;
+	GCancellable		*cancellable;
+	guint			 n_done;
+	FuMainBatchJobFunc	 job_func;
+	FuMainBatchDoneFunc	 done_func;
+	gpointer		 user_data;
+} FuMainBatchRun;
+
+typedef struct {
+	FuMainBatchRun		*run;
+	FuMainBatchJob		*job;
+} FuMainBatchJobHelper;
+
+typedef struct {
+	FuProvider		*provider;
+	GPtrArray		*jobs;		/* of FuMainBatchJob */
+	GPtrArray		*capsules;	/* of FuProviderCapsule, one per job */
+} FuMainBatchStage;
+
+/**
+ * fu_main_batch_job_new:
+ **/
+FuMainBatchJob *
+fu_main_batch_job_new (FuDevice *device, FuProvider *provider)
+{
+	FuMainBatchJob *job;
+	job = g_new0 (FuMainBatchJob, 1);
+	job->device = g_object_ref (device);
+	job->provider = g_object_ref (provider);
+	job->firmware_fd = -1;
+	return job;
+}
+
+/**
+ * fu_main_batch_job_free:
+ **/
+void
+fu_main_batch_job_free (FuMainBatchJob *job)
+{
+	if (job->firmware_fd >= 0)
+		close (job->firmware_fd);
+	g_object_unref (job->device);
+	g_object_unref (job->provider);
+	g_free (job->error_msg);
+	g_free (job);
+}
+
+/**
+ * fu_main_batch_stage_free:
+ **/
+static void
+fu_main_batch_stage_free (FuMainBatchStage *stage)
+{
+	g_object_unref (stage->provider);
+	g_ptr_array_unref (stage->jobs);
+	g_ptr_array_unref (stage->capsules);
+	g_free (stage);
+}
+
+/**
+ * fu_main_batch_run_free:
+ **/
+static void
+fu_main_batch_run_free (FuMainBatchRun *run)
+{
+	g_ptr_array_unref (run->jobs);
+	g_ptr_array_unref (run->serial);
+	g_ptr_array_unref (run->stages);
+	if (run->stream_cab != NULL)
+		g_object_unref (run->stream_cab);
+	if (run->cancellable != NULL)
+		g_object_unref (run->cancellable);
+	g_free (run);
+}
+
+/**
+ * fu_main_batch_job_done:
+ **/
+static void
+fu_main_batch_job_done (FuMainBatchRun *run, FuMainBatchJob *job, const gchar *state)
+{
+	run->n_done++;
+	run->job_func (job, state, run->n_done, run->user_data);
+}
+
+/**
+ * fu_main_batch_finish:
+ *
+ * Tells the caller once every job is done.
+ **/
+static void
+fu_main_batch_finish (FuMainBatchRun *run)
+{
+	if (run->n_done < run->jobs->len)
+		return;
+	run->done_func (run->user_data);
+	fu_main_batch_run_free (run);
+}
+
+static void fu_main_batch_serial_next (FuMainBatchRun *run);
+
+/**
+ * fu_main_batch_job_cb:
+ **/
+static void
+fu_main_batch_job_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuMainBatchJobHelper *helper = (FuMainBatchJobHelper *) user_data;
+	FuMainBatchRun *run = helper->run;
+	FuMainBatchJob *job = helper->job;
+	gboolean is_serial;
+	_cleanup_error_free_ GError *error = NULL;
+
+	if (!fu_provider_update_finish (FU_PROVIDER (source), res, &error)) {
+		g_warning ("failed to install %s: %s",
+			   fu_device_get_id (job->device), error->message);
+		job->error_msg = g_strdup (error->message);
+	}
+	g_free (helper);
+	fu_main_batch_job_done (run, job, job->error_msg != NULL ? "failed" : "success");
+
+	/* start the next device that has to wait its turn */
+	is_serial = run->serial->len > 0 &&
+		    g_ptr_array_index (run->serial, 0) == job;
+	if (is_serial) {
+		g_ptr_array_remove_index (run->serial, 0);
+		fu_main_batch_serial_next (run);
+	}
+	fu_main_batch_finish (run);
+}
+
+/**
+ * fu_main_batch_job_start:
+ **/
+static void
+fu_main_batch_job_start (FuMainBatchRun *run, FuMainBatchJob *job)
+{
+	FuMainBatchJobHelper *helper;
+
+	g_debug ("installing %s", fu_device_get_id (job->device));
+	job->start = g_get_monotonic_time ();
+	run->job_func (job, "installing", run->n_done, run->user_data);
+	helper = g_new0 (FuMainBatchJobHelper, 1);
+	helper->run = run;
+	helper->job = job;
+	fu_provider_update_async (job->provider,
+				  job->device,
+				  run->stream_cab,
+				  job->firmware_fd,
+				  run->flags,
+				  run->cancellable,
+				  fu_main_batch_job_cb,
+				  helper);
+}
+
+/**
+ * fu_main_batch_serial_next:
+ **/
+static void
+fu_main_batch_serial_next (FuMainBatchRun *run)
+{
+	if (run->serial->len == 0)
+		return;
+	fu_main_batch_job_start (run, g_ptr_array_index (run->serial, 0));
+}
+
+/**
+ * fu_main_batch_stage_add:
+ *
+ * Adds an offline job to the stage for its provider, so that all the
+ * capsules handled by one provider are scheduled together.
+ **/
+static void
+fu_main_batch_stage_add (FuMainBatchRun *run, FuMainBatchJob *job)
+{
+	FuMainBatchStage *stage = NULL;
+	FuProviderCapsule *capsule;
+	guint i;
+
+	for (i = 0; i < run->stages->len; i++) {
+		FuMainBatchStage *stage_tmp = g_ptr_array_index (run->stages, i);
+		if (stage_tmp->provider == job->provider) {
+			stage = stage_tmp;
+			break;
+		}
+	}
+	if (stage == NULL) {
+		stage = g_new0 (FuMainBatchStage, 1);
+		stage->provider = g_object_ref (job->provider);
+		stage->jobs = g_ptr_array_new ();
+		stage->capsules = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_provider_capsule_free);
+		g_ptr_array_add (run->stages, stage);
+	}
+	capsule = g_new0 (FuProviderCapsule, 1);
+	capsule->device = job->device;
+	capsule->fd = job->firmware_fd;
+	g_ptr_array_add (stage->capsules, capsule);
+	g_ptr_array_add (stage->jobs, job);
+}
+
+static void fu_main_batch_stage_next (FuMainBatchRun *run);
+
+/**
+ * fu_main_batch_stage_cb:
+ **/
+static void
+fu_main_batch_stage_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuMainBatchRun *run = (FuMainBatchRun *) user_data;
+	FuMainBatchJob *job;
+	FuMainBatchStage *stage = g_ptr_array_index (run->stages, 0);
+	FuProviderCapsule *capsule;
+	const gchar *state;
+	gboolean ret;
+	guint i;
+	_cleanup_error_free_ GError *error = NULL;
+
+	ret = fu_provider_stage_offline_finish (FU_PROVIDER (source), res, &error);
+	if (!ret) {
+		g_warning ("failed to stage %u devices: %s",
+			   stage->jobs->len, error->message);
+	}
+
+	/* each capsule has its own result if some of them were staged */
+	for (i = 0; i < stage->jobs->len; i++) {
+		job = g_ptr_array_index (stage->jobs, i);
+		capsule = g_ptr_array_index (stage->capsules, i);
+		if (!ret)
+			job->error_msg = g_strdup (error->message);
+		else if (capsule->error != NULL)
+			job->error_msg = g_strdup (capsule->error->message);
+		if (job->error_msg != NULL)
+			state = "failed";
+		else if (capsule->merged)
+			state = "merged";
+		else
+			state = "success";
+		fu_main_batch_job_done (run, job, state);
+	}
+
+	/* the cab stream cannot be shared, so do one provider at a time */
+	g_ptr_array_remove_index (run->stages, 0);
+	fu_main_batch_stage_next (run);
+	fu_main_batch_finish (run);
+}
+
+/**
+ * fu_main_batch_stage_next:
+ **/
+static void
+fu_main_batch_stage_next (FuMainBatchRun *run)
+{
+	FuMainBatchJob *job;
+	FuMainBatchStage *stage;
+	gint64 start = g_get_monotonic_time ();
+	guint i;
+
+	if (run->stages->len == 0)
+		return;
+	stage = g_ptr_array_index (run->stages, 0);
+	g_debug ("staging %u devices for %s", stage->jobs->len,
+		 fu_provider_get_name (stage->provider));
+	for (i = 0; i < stage->jobs->len; i++) {
+		job = g_ptr_array_index (stage->jobs, i);
+		job->start = start;
+		run->job_func (job, "installing", run->n_done, run->user_data);
+	}
+	fu_provider_stage_offline_async (stage->provider,
+					 stage->capsules,
+					 run->stream_cab,
+					 run->flags,
+					 run->cancellable,
+					 fu_main_batch_stage_cb,
+					 run);
+}
+
+/**
+ * fu_main_batch_run:
+ * @jobs: (element-type FuMainBatchJob): the jobs, where any with an error
+ * set are not attempted
+ * @stream_cab: the cabinet, used for offline updates
+ * @flags: the update flags
+ * @cancellable: a #GCancellable, or %NULL
+ * @job_func: called when each job starts and finishes
+ * @done_func: called when all the jobs have finished
+ * @user_data: data for @job_func and @done_func
+ *
+ * Installs the firmware on every device. Devices handled by providers that
+ * allow it are updated concurrently, and the rest are done one at a time.
+ * Offline updates are staged in one operation for each provider.
+ *
+ * If nothing needs doing then @done_func is called before this returns.
+ **/
+void
+fu_main_batch_run (GPtrArray *jobs,
+		   GInputStream *stream_cab,
+		   FuProviderFlags flags,
+		   GCancellable *cancellable,
+		   FuMainBatchJobFunc job_func,
+		   FuMainBatchDoneFunc done_func,
+		   gpointer user_data)
+{
+	FuMainBatchJob *job;
+	FuMainBatchRun *run;
+	guint i;
+	_cleanup_ptrarray_unref_ GPtrArray *parallel = NULL;
+
+	run = g_new0 (FuMainBatchRun, 1);
+	run->jobs = g_ptr_array_ref (jobs);
+	run->serial = g_ptr_array_new ();
+	run->stages = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_main_batch_stage_free);
+	if (stream_cab != NULL)
+		run->stream_cab = g_object_ref (stream_cab);
+	run->flags = flags;
+	if (cancellable != NULL)
+		run->cancellable = g_object_ref (cancellable);
+	run->job_func = job_func;
+	run->done_func = done_func;
+	run->user_data = user_data;
+
+	parallel = g_ptr_array_new ();
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index (jobs, i);
+		if (job->error_msg != NULL) {
+			run->n_done++;
+			continue;
+		}
+
+		/* the cab stream cannot be shared when scheduling */
+		if (flags & FU_PROVIDER_UPDATE_FLAG_OFFLINE) {
+			fu_main_batch_stage_add (run, job);
+			continue;
+		}
+		if (!fu_provider_get_allow_parallel (job->provider)) {
+			g_ptr_array_add (run->serial, job);
+			continue;
+		}
+		g_ptr_array_add (parallel, job);
+	}
+
+	/* nothing left to do */
+	if (run->n_done == jobs->len) {
+		fu_main_batch_finish (run);
+		return;
+	}
+	for (i = 0; i < parallel->len; i++)
+		fu_main_batch_job_start (run, g_ptr_array_index (parallel, i));
+	fu_main_batch_serial_next (run);
+	fu_main_batch_stage_next (run);
+}
+
+/**
+ * fu_main_batch_get_results:
+ * @jobs: (element-type FuMainBatchJob): the finished jobs
+ *
+ * Returns: the results as id:error, where an empty error means success,
+ * and a device that was requested more than once is only listed once
+ **/
+GVariant *
+fu_main_batch_get_results (GPtrArray *jobs)
+{
+	FuMainBatchJob *job;
+	GVariantBuilder builder;
+	guint i;
+	_cleanup_hashtable_unref_ GHashTable *ids = NULL;
+
+	ids = g_hash_table_new (g_str_hash, g_str_equal);
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index (jobs, i);
+		if (g_hash_table_contains (ids, fu_device_get_id (job->device)))
+			continue;
+		g_hash_table_add (ids, (gpointer) fu_device_get_id (job->device));
+		g_variant_builder_add (&builder, "{ss}",
+				       fu_device_get_id (job->device),
+				       job->error_msg != NULL ? job->error_msg : "");
+	}
+	return g_variant_builder_end (&builder);
+}
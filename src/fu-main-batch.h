@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __FU_MAIN_BATCH_H
+#define __FU_MAIN_BATCH_H
+
+#include <gio/gio.h>
+
+#include "fu-device.h"
+#include "fu-provider.h"
+
+G_BEGIN_DECLS
+
+typedef struct {
+	FuDevice		*device;
+	FuProvider		*provider;
+	gint			 firmware_fd;
+	gint			 vercmp;
+	gint64			 start;		/* us */
+	gchar			*error_msg;	/* or NULL for success */
+} FuMainBatchJob;
+
+/* @state is "installing", "success", "failed" or "merged" */
+typedef void	 (*FuMainBatchJobFunc)		(FuMainBatchJob	*job,
+						 const gchar	*state,
+						 guint		 n_done,
+						 gpointer	 user_data);
+typedef void	 (*FuMainBatchDoneFunc)		(gpointer	 user_data);
+
+FuMainBatchJob	*fu_main_batch_job_new		(FuDevice	*device,
+						 FuProvider	*provider);
+void		 fu_main_batch_job_free		(FuMainBatchJob	*job);
+void		 fu_main_batch_run		(GPtrArray	*jobs,
+						 GInputStream	*stream_cab,
+						 FuProviderFlags flags,
+						 GCancellable	*cancellable,
+						 FuMainBatchJobFunc job_func,
+						 FuMainBatchDoneFunc done_func,
+						 gpointer	 user_data);
+GVariant	*fu_main_batch_get_results	(GPtrArray	*jobs);
+
+G_END_DECLS
+
+#endif /* __FU_MAIN_BATCH_H */
@@ -0,0 +1,225 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+
+#include "fu-cleanup.h"
+#include "fu-main-snapshot.h"
+#include "fu-provider.h"
+
+#define FU_MAIN_SNAPSHOT_VERSION	1
+
+/**
+ * fu_main_snapshot_get_boot_id:
+ *
+ * The snapshot is only trusted until the next reboot, as firmware can be
+ * updated offline and the same sysfs inodes get reused.
+ **/
+static gchar *
+fu_main_snapshot_get_boot_id (void)
+{
+	gchar *data = NULL;
+	if (!g_file_get_contents ("/proc/sys/kernel/random/boot_id",
+				  &data, NULL, NULL))
+		return g_strdup ("");
+	return g_strstrip (data);
+}
+
+/**
+ * fu_main_snapshot_get_provider:
+ **/
+static FuProvider *
+fu_main_snapshot_get_provider (GPtrArray *providers, const gchar *name)
+{
+	FuProvider *provider;
+	guint i;
+
+	if (name == NULL)
+		return NULL;
+	for (i = 0; i < providers->len; i++) {
+		provider = g_ptr_array_index (providers, i);
+		if (g_strcmp0 (fu_provider_get_name (provider), name) == 0)
+			return provider;
+	}
+	return NULL;
+}
+
+/**
+ * fu_main_snapshot_save:
+ * @filename: the snapshot to write
+ * @providers: (element-type FuProvider): all the providers
+ * @devices: (element-type FuDevice): all the devices
+ *
+ * Saves the devices from each provider that can cheaply tell us if they
+ * are still valid, so that the next activation can return them straight
+ * away rather than waiting for the coldplug.
+ **/
+gboolean
+fu_main_snapshot_save (const gchar *filename,
+		       GPtrArray *providers,
+		       GPtrArray *devices,
+		       GError **error)
+{
+	FuDevice *device;
+	FuProvider *provider;
+	GVariantBuilder builder_devices;
+	GVariantBuilder builder_keys;
+	guint cnt = 0;
+	guint i;
+	_cleanup_free_ gchar *boot_id = NULL;
+	_cleanup_free_ gchar *dirname = NULL;
+	_cleanup_hashtable_unref_ GHashTable *keys = NULL;
+	_cleanup_variant_unref_ GVariant *val = NULL;
+
+	keys = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	g_variant_builder_init (&builder_keys, G_VARIANT_TYPE ("a{ss}"));
+	for (i = 0; i < providers->len; i++) {
+		gchar *key;
+		provider = g_ptr_array_index (providers, i);
+		key = fu_provider_get_snapshot_key (provider);
+		if (key == NULL)
+			continue;
+		g_variant_builder_add (&builder_keys, "{ss}",
+				       fu_provider_get_name (provider), key);
+		g_hash_table_insert (keys, provider, key);
+	}
+	g_variant_builder_init (&builder_devices, G_VARIANT_TYPE ("a{sa{sv}}"));
+	for (i = 0; i < devices->len; i++) {
+		device = g_ptr_array_index (devices, i);
+		provider = fu_main_snapshot_get_provider (providers,
+							  fu_device_get_metadata (device,
+										  FU_DEVICE_KEY_PROVIDER));
+		if (provider == NULL || g_hash_table_lookup (keys, provider) == NULL)
+			continue;
+		g_variant_builder_add_value (&builder_devices,
+					     fu_device_to_variant (device));
+		cnt++;
+	}
+	boot_id = fu_main_snapshot_get_boot_id ();
+	val = g_variant_ref_sink (g_variant_new ("(usa{ss}a{sa{sv}})",
+						 FU_MAIN_SNAPSHOT_VERSION,
+						 boot_id,
+						 &builder_keys,
+						 &builder_devices));
+
+	dirname = g_path_get_dirname (filename);
+	if (g_mkdir_with_parents (dirname, 0755) != 0) {
+		g_set_error (error,
+			     G_FILE_ERROR,
+			     g_file_error_from_errno (errno),
+			     "Failed to create %s",
+			     dirname);
+		return FALSE;
+	}
+	if (!g_file_set_contents (filename,
+				  g_variant_get_data (val),
+				  g_variant_get_size (val),
+				  error))
+		return FALSE;
+	g_debug ("saved snapshot of %u devices", cnt);
+	return TRUE;
+}
+
+/**
+ * fu_main_snapshot_load:
+ * @filename: the snapshot to read
+ * @providers: (element-type FuProvider): all the providers
+ *
+ * Loads the devices from the last snapshot for each provider where the
+ * hardware looks the same as when it was saved. A snapshot from an earlier
+ * boot or in an older format returns no devices.
+ *
+ * Returns: (element-type FuDevice): the devices, or %NULL if the snapshot
+ * could not be read
+ **/
+GPtrArray *
+fu_main_snapshot_load (const gchar *filename,
+		       GPtrArray *providers,
+		       GError **error)
+{
+	FuProvider *provider;
+	GPtrArray *devices;
+	GVariantIter *iter_dev;
+	GVariantIter *iter_keys;
+	const gchar *boot_id = NULL;
+	const gchar *id;
+	const gchar *key;
+	const gchar *name;
+	gchar *data = NULL;
+	gsize len;
+	guint32 version = 0;
+	_cleanup_free_ gchar *boot_id_now = NULL;
+	_cleanup_hashtable_unref_ GHashTable *valid = NULL;
+	_cleanup_variant_unref_ GVariant *val = NULL;
+
+	if (!g_file_get_contents (filename, &data, &len, error))
+		return NULL;
+	val = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("(usa{ss}a{sa{sv}})"),
+							   data, len, FALSE,
+							   g_free, data));
+	g_variant_get (val, "(u&sa{ss}a{sa{sv}})",
+		       &version, &boot_id, &iter_keys, &iter_dev);
+
+	/* invalidated by a reboot or a change of format */
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	boot_id_now = fu_main_snapshot_get_boot_id ();
+	if (version != FU_MAIN_SNAPSHOT_VERSION ||
+	    g_strcmp0 (boot_id, boot_id_now) != 0) {
+		g_debug ("ignoring stale device snapshot");
+		g_variant_iter_free (iter_keys);
+		g_variant_iter_free (iter_dev);
+		return devices;
+	}
+
+	/* only trust the providers where the hardware looks the same */
+	valid = g_hash_table_new (g_direct_hash, g_direct_equal);
+	while (g_variant_iter_next (iter_keys, "{&s&s}", &name, &key)) {
+		_cleanup_free_ gchar *key_now = NULL;
+		provider = fu_main_snapshot_get_provider (providers, name);
+		if (provider == NULL)
+			continue;
+		key_now = fu_provider_get_snapshot_key (provider);
+		if (g_strcmp0 (key, key_now) != 0) {
+			g_debug ("devices for %s have changed", name);
+			continue;
+		}
+		g_hash_table_add (valid, provider);
+	}
+	g_variant_iter_free (iter_keys);
+
+	/* add the devices */
+	while (g_variant_iter_next (iter_dev, "{&sa{sv}}", &id, &iter_keys)) {
+		_cleanup_object_unref_ FuDevice *device = fu_device_new ();
+		fu_device_set_id (device, id);
+		fu_device_set_metadata_from_iter (device, iter_keys);
+		g_variant_iter_free (iter_keys);
+		provider = fu_main_snapshot_get_provider (providers,
+							  fu_device_get_metadata (device,
+										  FU_DEVICE_KEY_PROVIDER));
+		if (provider == NULL || !g_hash_table_contains (valid, provider))
+			continue;
+		g_ptr_array_add (devices, g_object_ref (device));
+	}
+	g_variant_iter_free (iter_dev);
+	return devices;
+}
@@ -0,0 +1,416 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <fwupd.h>
+#include <appstream-glib.h>
+
+#include "fu-cleanup.h"
+#include "fu-device.h"
+#include "fu-main-store.h"
+
+/**
+ * fu_main_release_free:
+ **/
+void
+fu_main_release_free (FuMainRelease *release)
+{
+	g_free (release->version);
+	g_free (release->checksum);
+	g_free (release->uri);
+	g_object_unref (release->app);
+	g_free (release);
+}
+
+/**
+ * fu_main_release_is_newer:
+ *
+ * Returns %TRUE if @rel of @app should replace @release in the index. When
+ * two components have the same version the one with the lowest ID is used,
+ * so the result does not depend on the order of the store.
+ **/
+static gboolean
+fu_main_release_is_newer (AsRelease *rel, AsApp *app, FuMainRelease *release)
+{
+	gint vercmp;
+
+	vercmp = as_utils_vercmp (as_release_get_version (rel), release->version);
+	if (vercmp != 0)
+		return vercmp > 0;
+	return g_strcmp0 (as_app_get_id (app), as_app_get_id (release->app)) < 0;
+}
+
+/**
+ * fu_main_release_index_rebuild:
+ *
+ * Builds a table of the newest release for each flashed firmware GUID so
+ * that GetUpdates does not have to search the store for every device. If
+ * several components provide the same GUID then the newest release wins.
+ **/
+void
+fu_main_release_index_rebuild (GHashTable *releases_by_guid, AsStore *store)
+{
+	AsApp *app;
+	AsChecksum *csum;
+	AsProvide *prov;
+	AsRelease *rel;
+	FuMainRelease *release;
+	GPtrArray *apps;
+	GPtrArray *provides;
+	guint i;
+	guint j;
+
+	g_hash_table_remove_all (releases_by_guid);
+	apps = as_store_get_apps (store);
+	for (i = 0; i < apps->len; i++) {
+		app = g_ptr_array_index (apps, i);
+		rel = as_app_get_release_default (app);
+		if (rel == NULL)
+			continue;
+		csum = as_release_get_checksum_by_target (rel, AS_CHECKSUM_TARGET_CONTAINER);
+		provides = as_app_get_provides (app);
+		for (j = 0; j < provides->len; j++) {
+			prov = g_ptr_array_index (provides, j);
+			if (as_provide_get_kind (prov) != AS_PROVIDE_KIND_FIRMWARE_FLASHED)
+				continue;
+			if (as_provide_get_value (prov) == NULL)
+				continue;
+			release = g_hash_table_lookup (releases_by_guid,
+						       as_provide_get_value (prov));
+			if (release != NULL &&
+			    !fu_main_release_is_newer (rel, app, release)) {
+				g_debug ("ignoring %s for %s as %s is newer",
+					 as_app_get_id (app),
+					 as_provide_get_value (prov),
+					 as_app_get_id (release->app));
+				continue;
+			}
+			release = g_new0 (FuMainRelease, 1);
+			release->version = g_strdup (as_release_get_version (rel));
+			release->uri = g_strdup (as_release_get_location_default (rel));
+			if (csum != NULL)
+				release->checksum = g_strdup (as_checksum_get_value (csum));
+			release->app = g_object_ref (app);
+			g_hash_table_insert (releases_by_guid,
+					     g_strdup (as_provide_get_value (prov)),
+					     release);
+		}
+	}
+	g_debug ("indexed %u firmware releases",
+		 g_hash_table_size (releases_by_guid));
+}
+
+/**
+ * fu_main_app_checksum_is_same:
+ **/
+static gboolean
+fu_main_app_checksum_is_same (AsChecksum *csum1, AsChecksum *csum2)
+{
+	if (as_checksum_get_target (csum1) != as_checksum_get_target (csum2))
+		return FALSE;
+	if (as_checksum_get_kind (csum1) != as_checksum_get_kind (csum2))
+		return FALSE;
+	if (g_strcmp0 (as_checksum_get_filename (csum1),
+		       as_checksum_get_filename (csum2)) != 0)
+		return FALSE;
+	return g_strcmp0 (as_checksum_get_value (csum1),
+			  as_checksum_get_value (csum2)) == 0;
+}
+
+/**
+ * fu_main_app_release_is_same:
+ **/
+static gboolean
+fu_main_app_release_is_same (AsRelease *rel1, AsRelease *rel2)
+{
+	GPtrArray *csums1;
+	GPtrArray *csums2;
+	guint i;
+
+	if (as_utils_vercmp (as_release_get_version (rel1),
+			     as_release_get_version (rel2)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_release_get_location_default (rel1),
+		       as_release_get_location_default (rel2)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_release_get_description (rel1, NULL),
+		       as_release_get_description (rel2, NULL)) != 0)
+		return FALSE;
+	csums1 = as_release_get_checksums (rel1);
+	csums2 = as_release_get_checksums (rel2);
+	if (csums1->len != csums2->len)
+		return FALSE;
+	for (i = 0; i < csums1->len; i++) {
+		if (!fu_main_app_checksum_is_same (g_ptr_array_index (csums1, i),
+						   g_ptr_array_index (csums2, i)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_main_app_provide_is_same:
+ **/
+static gboolean
+fu_main_app_provide_is_same (AsProvide *prov1, AsProvide *prov2)
+{
+	if (as_provide_get_kind (prov1) != as_provide_get_kind (prov2))
+		return FALSE;
+	return g_strcmp0 (as_provide_get_value (prov1),
+			  as_provide_get_value (prov2)) == 0;
+}
+
+/**
+ * fu_main_app_is_same:
+ *
+ * Returns %TRUE if the component has no changes that affect fwupd.
+ **/
+gboolean
+fu_main_app_is_same (AsApp *app1, AsApp *app2)
+{
+	GPtrArray *releases1;
+	GPtrArray *releases2;
+	GPtrArray *provides1;
+	GPtrArray *provides2;
+	guint i;
+
+	if (g_strcmp0 (as_app_get_name (app1, NULL),
+		       as_app_get_name (app2, NULL)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_app_get_comment (app1, NULL),
+		       as_app_get_comment (app2, NULL)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_app_get_description (app1, NULL),
+		       as_app_get_description (app2, NULL)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_app_get_developer_name (app1, NULL),
+		       as_app_get_developer_name (app2, NULL)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_app_get_url_item (app1, AS_URL_KIND_HOMEPAGE),
+		       as_app_get_url_item (app2, AS_URL_KIND_HOMEPAGE)) != 0)
+		return FALSE;
+	if (g_strcmp0 (as_app_get_project_license (app1),
+		       as_app_get_project_license (app2)) != 0)
+		return FALSE;
+
+	/* the GUIDs the firmware applies to */
+	provides1 = as_app_get_provides (app1);
+	provides2 = as_app_get_provides (app2);
+	if (provides1->len != provides2->len)
+		return FALSE;
+	for (i = 0; i < provides1->len; i++) {
+		if (!fu_main_app_provide_is_same (g_ptr_array_index (provides1, i),
+						  g_ptr_array_index (provides2, i)))
+			return FALSE;
+	}
+
+	releases1 = as_app_get_releases (app1);
+	releases2 = as_app_get_releases (app2);
+	if (releases1->len != releases2->len)
+		return FALSE;
+	for (i = 0; i < releases1->len; i++) {
+		if (!fu_main_app_release_is_same (g_ptr_array_index (releases1, i),
+						  g_ptr_array_index (releases2, i)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_main_store_merge:
+ *
+ * Applies only the components that have changed to @store.
+ *
+ * Returns: the number of components added or replaced
+ **/
+guint
+fu_main_store_merge (AsStore *store, AsStore *store_new)
+{
+	AsApp *app;
+	AsApp *app_old;
+	GPtrArray *apps;
+	guint i;
+	guint cnt = 0;
+
+	apps = as_store_get_apps (store_new);
+	for (i = 0; i < apps->len; i++) {
+		app = g_ptr_array_index (apps, i);
+		app_old = as_store_get_app_by_id (store, as_app_get_id (app));
+		if (app_old != NULL) {
+			if (fu_main_app_is_same (app_old, app))
+				continue;
+			as_store_remove_app (store, app_old);
+		}
+		as_store_add_app (store, app);
+		cnt++;
+	}
+	return cnt;
+}
+
+/**
+ * fu_main_store_remove:
+ *
+ * Returns: the number of components removed
+ **/
+guint
+fu_main_store_remove (AsStore *store, GPtrArray *ids_removed)
+{
+	AsApp *app;
+	const gchar *id;
+	guint i;
+	guint cnt = 0;
+
+	for (i = 0; i < ids_removed->len; i++) {
+		id = g_ptr_array_index (ids_removed, i);
+		app = as_store_get_app_by_id (store, id);
+		if (app == NULL)
+			continue;
+		as_store_remove_app (store, app);
+		cnt++;
+	}
+	return cnt;
+}
+
+/**
+ * fu_main_device_set_metadata_changed:
+ *
+ * Returns: %TRUE if @value was different to what the device had
+ **/
+static gboolean
+fu_main_device_set_metadata_changed (FuDevice *device,
+				     const gchar *key,
+				     const gchar *value)
+{
+	if (value == NULL)
+		return FALSE;
+	if (g_strcmp0 (fu_device_get_metadata (device, key), value) == 0)
+		return FALSE;
+	fu_device_set_metadata (device, key, value);
+	return TRUE;
+}
+
+/**
+ * fu_main_device_set_update_metadata:
+ *
+ * Copies the AppStream data onto the device, only setting the keys that
+ * have changed.
+ *
+ * Returns: %TRUE if any of the metadata changed
+ **/
+gboolean
+fu_main_device_set_update_metadata (FuDevice *device, FuMainRelease *release)
+{
+	AsApp *app = release->app;
+	AsRelease *rel;
+	gboolean changed = FALSE;
+
+	/* add application metadata */
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_VENDOR,
+			as_app_get_developer_name (app, NULL));
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_NAME,
+			as_app_get_name (app, NULL));
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_SUMMARY,
+			as_app_get_comment (app, NULL));
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_DESCRIPTION,
+			as_app_get_description (app, NULL));
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_URL_HOMEPAGE,
+			as_app_get_url_item (app, AS_URL_KIND_HOMEPAGE));
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_LICENSE,
+			as_app_get_project_license (app));
+
+	/* add release information */
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_UPDATE_VERSION,
+			release->version);
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_UPDATE_HASH,
+			release->checksum);
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_UPDATE_URI,
+			release->uri);
+	rel = as_app_get_release_default (app);
+	changed |= fu_main_device_set_metadata_changed (device,
+			FU_DEVICE_KEY_UPDATE_DESCRIPTION,
+			as_release_get_description (rel, NULL));
+	return changed;
+}
+
+/**
+ * fu_main_get_updates:
+ *
+ * Finds the devices that have a newer release in the index, copying the
+ * AppStream data onto each of them. Devices where any of the copied
+ * metadata changed are added to @changed.
+ *
+ * Returns: (transfer container): the devices with updates
+ **/
+GPtrArray *
+fu_main_get_updates (GHashTable *releases_by_guid,
+		     GPtrArray *devices,
+		     GPtrArray *changed)
+{
+	FuDevice *device;
+	FuMainRelease *release;
+	GPtrArray *updates;
+	guint i;
+
+	/* find any updates using the release index */
+	updates = g_ptr_array_new ();
+	for (i = 0; i < devices->len; i++) {
+		const gchar *version;
+
+		device = g_ptr_array_index (devices, i);
+
+		/* get device version */
+		version = fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION);
+		if (version == NULL)
+			continue;
+
+		/* match the GUID in the XML */
+		if (fu_device_get_guid (device) == NULL)
+			continue;
+		release = g_hash_table_lookup (releases_by_guid,
+					       fu_device_get_guid (device));
+		if (release == NULL)
+			continue;
+
+		/* check if actually newer than what we have installed */
+		if (as_utils_vercmp (release->version, version) <= 0) {
+			g_debug ("%s has no firmware updates",
+				 fu_device_get_id (device));
+			continue;
+		}
+
+		/* only report the devices where the AppStream data changed */
+		if (fu_main_device_set_update_metadata (device, release) &&
+		    changed != NULL)
+			g_ptr_array_add (changed, device);
+		g_ptr_array_add (updates, device);
+	}
+	return updates;
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __FU_MAIN_STORE_H
+#define __FU_MAIN_STORE_H
+
+#include <appstream-glib.h>
+
+#include "fu-device.h"
+
+G_BEGIN_DECLS
+
+typedef struct {
+	gchar			*version;
+	gchar			*checksum;
+	gchar			*uri;
+	AsApp			*app;
+} FuMainRelease;
+
+void		 fu_main_release_free		(FuMainRelease	*release);
+void		 fu_main_release_index_rebuild	(GHashTable	*releases_by_guid,
+						 AsStore	*store);
+gboolean	 fu_main_app_is_same		(AsApp		*app1,
+						 AsApp		*app2);
+guint		 fu_main_store_merge		(AsStore	*store,
+						 AsStore	*store_new);
+guint		 fu_main_store_remove		(AsStore	*store,
+						 GPtrArray	*ids_removed);
+gboolean	 fu_main_device_set_update_metadata (FuDevice	*device,
+						 FuMainRelease	*release);
+GPtrArray	*fu_main_get_updates		(GHashTable	*releases_by_guid,
+						 GPtrArray	*devices,
+						 GPtrArray	*changed);
+
+G_END_DECLS
+
+#endif /* __FU_MAIN_STORE_H */
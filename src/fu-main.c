@@ -27,17 +27,22 @@
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 #include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include <glib/gi18n.h>
 #include <locale.h>
 #include <polkit/polkit.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "fu-cab.h"
 #include "fu-cleanup.h"
 #include "fu-debug.h"
 #include "fu-device.h"
 #include "fu-keyring.h"
+#include "fu-main-batch.h"
+#include "fu-main-snapshot.h"
+#include "fu-main-store.h"
 #include "fu-pending.h"
 #include "fu-provider.h"
 #include "fu-provider-rpi.h"
@@ -52,24 +57,167 @@
   #include "fu-provider-uefi.h"
 #endif
 
+#define FU_MAIN_METADATA_CHUNK_SIZE	0x8000	/* bytes */
+#define FU_MAIN_METADATA_CACHE		"/var/cache/app-info/xmls/fwupd.xml"
+#define FU_MAIN_SIGNAL_DELAY		250	/* ms */
+#define FU_MAIN_SIGNAL_DELAY_MAX	2000	/* ms */
+#define FU_MAIN_STAT_BUCKETS		17	/* <1ms, then powers of two to 32s */
+#define FU_MAIN_SNAPSHOT_DELAY		5000	/* ms */
+
+typedef struct {
+	gchar			*dirname;
+	FuKeyring		*keyring;	/* or NULL if not loaded */
+	GFileMonitor		*monitor;
+} FuMainKeyring;
+
 typedef struct {
 	GDBusConnection		*connection;
 	GDBusNodeInfo		*introspection_daemon;
 	GDBusProxy		*proxy_uid;
 	GMainLoop		*loop;
-	GPtrArray		*devices;
+	GPtrArray		*devices;	/* of FuDeviceItem */
+	GHashTable		*devices_by_id;	/* id:FuDeviceItem */
+	GHashTable		*devices_by_guid; /* guid:GPtrArray of FuDeviceItem */
 	GPtrArray		*providers;
 	PolkitAuthority		*authority;
 	FwupdStatus		 status;
+	guint			 percentage;
+	guint64			 bytes_written;
 	FuPending		*pending;
 	AsStore			*store;
+	GHashTable		*releases_by_guid; /* guid:FuMainRelease */
+	guint64			 generation;
+	GVariant		*devices_variant; /* for generation */
+	GVariant		*updates_variant; /* for generation */
+	FuMainKeyring		*keyring_firmware;
+	FuMainKeyring		*keyring_metadata;
+	gchar			*metadata_revision; /* or NULL if unknown */
+	GHashTable		*signal_added;	/* id */
+	GHashTable		*signal_removed; /* id */
+	GHashTable		*signal_changed; /* id:GHashTable of keys, or NULL for all */
+	guint			 signal_id;
+	gint64			 signal_first;	/* us */
+	GHashTable		*stats;		/* phase:FuMainStat */
+	GHashTable		*devices_restored; /* id */
+	gboolean		 coldplug_done;
+	guint			 snapshot_id;
+	gint64			 snapshot_last;	/* us */
+	GHashTable		*jobs;		/* id:FuMainJob */
+	guint64			 jobs_seq;
 } FuMainPrivate;
 
+typedef struct {
+	guint			 refcount;	/* updates and verifies */
+	FwupdStatus		 status;
+	guint64			 seq;		/* of the last status change */
+	guint			 percentage;
+	guint64			 bytes_written;
+	guint64			 progress_seq;	/* of the last progress, or 0 */
+} FuMainJob;
+
+typedef struct {
+	guint64			 count;
+	guint64			 failed;
+	guint64			 total;		/* us */
+	guint64			 min;		/* us */
+	guint64			 max;		/* us */
+	guint64			 buckets[FU_MAIN_STAT_BUCKETS];
+} FuMainStat;
+
 typedef struct {
 	FuDevice		*device;
 	FuProvider		*provider;
 } FuDeviceItem;
 
+/**
+ * fu_main_stat_add_elapsed:
+ *
+ * Adds one sample to the latency histogram for @phase, where bucket 0
+ * is anything under 1ms and bucket N is from 2^(N-1)ms to 2^N ms.
+ **/
+static void
+fu_main_stat_add_elapsed (FuMainPrivate *priv,
+			  const gchar *phase,
+			  guint64 elapsed,
+			  gboolean success)
+{
+	FuMainStat *stat;
+	guint64 ms;
+	guint i;
+
+	stat = g_hash_table_lookup (priv->stats, phase);
+	if (stat == NULL) {
+		stat = g_new0 (FuMainStat, 1);
+		stat->min = G_MAXUINT64;
+		g_hash_table_insert (priv->stats, g_strdup (phase), stat);
+	}
+	stat->count++;
+	if (!success)
+		stat->failed++;
+	stat->total += elapsed;
+	stat->min = MIN (stat->min, elapsed);
+	stat->max = MAX (stat->max, elapsed);
+	ms = elapsed / 1000;
+	for (i = 0; ms > 0 && i < FU_MAIN_STAT_BUCKETS - 1; i++)
+		ms >>= 1;
+	stat->buckets[i]++;
+}
+
+/**
+ * fu_main_stat_add:
+ *
+ * Adds a sample for a phase that started at @start, as returned by
+ * g_get_monotonic_time().
+ **/
+static void
+fu_main_stat_add (FuMainPrivate *priv,
+		  const gchar *phase,
+		  gint64 start,
+		  gboolean success)
+{
+	fu_main_stat_add_elapsed (priv, phase,
+				  (guint64) (g_get_monotonic_time () - start),
+				  success);
+}
+
+/**
+ * fu_main_stats_to_variant:
+ **/
+static GVariant *
+fu_main_stats_to_variant (FuMainPrivate *priv)
+{
+	FuMainStat *stat;
+	GHashTableIter iter;
+	GVariantBuilder builder;
+	gpointer key;
+	gpointer value;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+	g_hash_table_iter_init (&iter, priv->stats);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GVariantBuilder builder_stat;
+		stat = (FuMainStat *) value;
+		g_variant_builder_init (&builder_stat, G_VARIANT_TYPE ("a{sv}"));
+		g_variant_builder_add (&builder_stat, "{sv}", "Count",
+				       g_variant_new_uint64 (stat->count));
+		g_variant_builder_add (&builder_stat, "{sv}", "Failed",
+				       g_variant_new_uint64 (stat->failed));
+		g_variant_builder_add (&builder_stat, "{sv}", "Total",
+				       g_variant_new_uint64 (stat->total));
+		g_variant_builder_add (&builder_stat, "{sv}", "Minimum",
+				       g_variant_new_uint64 (stat->min));
+		g_variant_builder_add (&builder_stat, "{sv}", "Maximum",
+				       g_variant_new_uint64 (stat->max));
+		g_variant_builder_add (&builder_stat, "{sv}", "Histogram",
+				       g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+								  stat->buckets,
+								  FU_MAIN_STAT_BUCKETS,
+								  sizeof (guint64)));
+		g_variant_builder_add (&builder, "{sa{sv}}", key, &builder_stat);
+	}
+	return g_variant_new ("(a{sa{sv}})", &builder);
+}
+
 /**
  * fu_main_emit_changed:
  **/
@@ -87,6 +235,278 @@ fu_main_emit_changed (FuMainPrivate *priv)
 				       NULL, NULL);
 }
 
+/* the keys that GetResults and ClearResults can modify */
+static const gchar *fu_main_results_keys[] = {
+	FU_DEVICE_KEY_PENDING_STATE,
+	FU_DEVICE_KEY_PENDING_ERROR,
+	FU_DEVICE_KEY_VERSION,
+	FU_DEVICE_KEY_UPDATE_VERSION,
+	NULL };
+
+/**
+ * fu_main_signal_keys_free:
+ **/
+static void
+fu_main_signal_keys_free (GHashTable *keys)
+{
+	if (keys != NULL)
+		g_hash_table_unref (keys);
+}
+
+/**
+ * fu_main_signal_emit_ids:
+ **/
+static void
+fu_main_signal_emit_ids (FuMainPrivate *priv,
+			 const gchar *signal_name,
+			 GHashTable *ids)
+{
+	GHashTableIter iter;
+	GVariantBuilder builder;
+	gpointer key;
+
+	if (g_hash_table_size (ids) == 0)
+		return;
+	g_debug ("Emitting %s() for %u devices",
+		 signal_name, g_hash_table_size (ids));
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+	g_hash_table_iter_init (&iter, ids);
+	while (g_hash_table_iter_next (&iter, &key, NULL))
+		g_variant_builder_add (&builder, "s", key);
+	g_dbus_connection_emit_signal (priv->connection,
+				       NULL,
+				       FWUPD_DBUS_PATH,
+				       FWUPD_DBUS_INTERFACE,
+				       signal_name,
+				       g_variant_new ("(as)", &builder),
+				       NULL);
+}
+
+/**
+ * fu_main_signal_emit_changed:
+ **/
+static void
+fu_main_signal_emit_changed (FuMainPrivate *priv)
+{
+	GHashTableIter iter;
+	GHashTableIter iter_keys;
+	GVariantBuilder builder;
+	gpointer id;
+	gpointer keys;
+	gpointer key;
+
+	if (g_hash_table_size (priv->signal_changed) == 0)
+		return;
+	g_debug ("Emitting DeviceChanged() for %u devices",
+		 g_hash_table_size (priv->signal_changed));
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+	g_hash_table_iter_init (&iter, priv->signal_changed);
+	while (g_hash_table_iter_next (&iter, &id, &keys)) {
+		g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sas}"));
+		g_variant_builder_add (&builder, "s", id);
+		g_variant_builder_open (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+		if (keys != NULL) {
+			g_hash_table_iter_init (&iter_keys, keys);
+			while (g_hash_table_iter_next (&iter_keys, &key, NULL))
+				g_variant_builder_add (&builder, "s", key);
+		}
+		g_variant_builder_close (&builder);
+		g_variant_builder_close (&builder);
+	}
+	g_dbus_connection_emit_signal (priv->connection,
+				       NULL,
+				       FWUPD_DBUS_PATH,
+				       FWUPD_DBUS_INTERFACE,
+				       "DeviceChanged",
+				       g_variant_new ("(a{sas})", &builder),
+				       NULL);
+}
+
+/**
+ * fu_main_snapshot_get_filename:
+ **/
+static gchar *
+fu_main_snapshot_get_filename (void)
+{
+	return g_build_filename (LOCALSTATEDIR, "lib", "fwupd",
+				 "devices.snapshot", NULL);
+}
+
+/**
+ * fu_main_snapshot_write:
+ **/
+static void
+fu_main_snapshot_write (FuMainPrivate *priv)
+{
+	FuDeviceItem *item;
+	guint i;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+
+	priv->snapshot_last = g_get_monotonic_time ();
+	devices = g_ptr_array_new ();
+	for (i = 0; i < priv->devices->len; i++) {
+		item = g_ptr_array_index (priv->devices, i);
+		g_ptr_array_add (devices, item->device);
+	}
+	filename = fu_main_snapshot_get_filename ();
+	if (!fu_main_snapshot_save (filename, priv->providers, devices, &error))
+		g_warning ("Failed to save device snapshot: %s", error->message);
+}
+
+/**
+ * fu_main_snapshot_write_cb:
+ **/
+static gboolean
+fu_main_snapshot_write_cb (gpointer user_data)
+{
+	FuMainPrivate *priv = (FuMainPrivate *) user_data;
+	priv->snapshot_id = 0;
+	fu_main_snapshot_write (priv);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_main_snapshot_schedule:
+ *
+ * Saves the snapshot once the device list is complete, but no more than
+ * once every FU_MAIN_SNAPSHOT_DELAY as each hotplug event changes it.
+ **/
+static void
+fu_main_snapshot_schedule (FuMainPrivate *priv)
+{
+	gint64 delay;
+
+	/* the device list is not complete yet */
+	if (!priv->coldplug_done)
+		return;
+
+	/* already going to be saved */
+	if (priv->snapshot_id != 0)
+		return;
+	delay = priv->snapshot_last +
+		FU_MAIN_SNAPSHOT_DELAY * G_TIME_SPAN_MILLISECOND -
+		g_get_monotonic_time ();
+	if (priv->snapshot_last == 0 || delay <= 0) {
+		fu_main_snapshot_write (priv);
+		return;
+	}
+	priv->snapshot_id = g_timeout_add (delay / G_TIME_SPAN_MILLISECOND + 1,
+					   fu_main_snapshot_write_cb, priv);
+}
+
+/**
+ * fu_main_signal_flush_cb:
+ *
+ * Emits everything that happened since the last flush as one signal of
+ * each type, followed by the legacy Changed signal.
+ **/
+static gboolean
+fu_main_signal_flush_cb (gpointer user_data)
+{
+	FuMainPrivate *priv = (FuMainPrivate *) user_data;
+
+	priv->signal_id = 0;
+	if (priv->connection != NULL) {
+		fu_main_signal_emit_ids (priv, "DeviceRemoved", priv->signal_removed);
+		fu_main_signal_emit_ids (priv, "DeviceAdded", priv->signal_added);
+		fu_main_signal_emit_changed (priv);
+		fu_main_emit_changed (priv);
+	}
+	g_hash_table_remove_all (priv->signal_removed);
+	g_hash_table_remove_all (priv->signal_added);
+	g_hash_table_remove_all (priv->signal_changed);
+	fu_main_snapshot_schedule (priv);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_main_signal_schedule:
+ *
+ * Waits for events to stop arriving before emitting, but never delays a
+ * continuous stream of events by more than FU_MAIN_SIGNAL_DELAY_MAX.
+ **/
+static void
+fu_main_signal_schedule (FuMainPrivate *priv)
+{
+	gint64 now = g_get_monotonic_time ();
+
+	if (priv->signal_id != 0) {
+		if (now - priv->signal_first > FU_MAIN_SIGNAL_DELAY_MAX * 1000)
+			return;
+		g_source_remove (priv->signal_id);
+	} else {
+		priv->signal_first = now;
+	}
+	priv->signal_id = g_timeout_add (FU_MAIN_SIGNAL_DELAY,
+					 fu_main_signal_flush_cb, priv);
+}
+
+/**
+ * fu_main_signal_device_added:
+ **/
+static void
+fu_main_signal_device_added (FuMainPrivate *priv, const gchar *id)
+{
+	g_hash_table_remove (priv->signal_changed, id);
+	g_hash_table_add (priv->signal_added, g_strdup (id));
+	fu_main_signal_schedule (priv);
+}
+
+/**
+ * fu_main_signal_device_removed:
+ **/
+static void
+fu_main_signal_device_removed (FuMainPrivate *priv, const gchar *id)
+{
+	g_hash_table_remove (priv->signal_changed, id);
+
+	/* the client never knew about this device */
+	if (g_hash_table_remove (priv->signal_added, id))
+		return;
+	g_hash_table_add (priv->signal_removed, g_strdup (id));
+	fu_main_signal_schedule (priv);
+}
+
+/**
+ * fu_main_signal_device_changed:
+ *
+ * If @keys is %NULL then any of the device metadata may have changed.
+ **/
+static void
+fu_main_signal_device_changed (FuMainPrivate *priv,
+			       const gchar *id,
+			       const gchar **keys)
+{
+	GHashTable *keys_changed;
+	gpointer value = NULL;
+	guint i;
+
+	/* the client will get all the metadata anyway */
+	if (g_hash_table_contains (priv->signal_added, id))
+		return;
+
+	/* already everything */
+	if (g_hash_table_lookup_extended (priv->signal_changed, id, NULL, &value) &&
+	    value == NULL)
+		return;
+	if (keys == NULL) {
+		g_hash_table_insert (priv->signal_changed, g_strdup (id), NULL);
+		fu_main_signal_schedule (priv);
+		return;
+	}
+	keys_changed = value;
+	if (keys_changed == NULL) {
+		keys_changed = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free, NULL);
+		g_hash_table_insert (priv->signal_changed, g_strdup (id), keys_changed);
+	}
+	for (i = 0; keys[i] != NULL; i++)
+		g_hash_table_add (keys_changed, g_strdup (keys[i]));
+	fu_main_signal_schedule (priv);
+}
+
 /**
  * fu_main_emit_property_changed:
  **/
@@ -123,22 +543,182 @@ fu_main_emit_property_changed (FuMainPrivate *priv,
 	g_variant_builder_clear (&invalidated_builder);
 }
 
+/**
+ * fu_main_invalidate:
+ *
+ * Called when the device set, or the metadata on any device, has changed.
+ **/
+static void
+fu_main_invalidate (FuMainPrivate *priv)
+{
+	priv->generation++;
+	if (priv->devices_variant != NULL) {
+		g_variant_unref (priv->devices_variant);
+		priv->devices_variant = NULL;
+	}
+	if (priv->updates_variant != NULL) {
+		g_variant_unref (priv->updates_variant);
+		priv->updates_variant = NULL;
+	}
+	fu_main_emit_property_changed (priv, "Generation",
+				       g_variant_new_uint64 (priv->generation));
+}
+
+/**
+ * fu_main_set_progress:
+ **/
+static void
+fu_main_set_progress (FuMainPrivate *priv, guint percentage, guint64 bytes_written)
+{
+	GVariantBuilder builder;
+	GVariantBuilder invalidated_builder;
+
+	if (priv->percentage == percentage && priv->bytes_written == bytes_written)
+		return;
+	priv->percentage = percentage;
+	priv->bytes_written = bytes_written;
+
+	/* not yet connected */
+	if (priv->connection == NULL)
+		return;
+
+	/* both properties in the same signal */
+	g_debug ("Emitting PropertyChanged('Percentage'=%u,'BytesWritten'=%"
+		 G_GUINT64_FORMAT ")", percentage, bytes_written);
+	g_variant_builder_init (&invalidated_builder, G_VARIANT_TYPE ("as"));
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
+	g_variant_builder_add (&builder, "{sv}", "Percentage",
+			       g_variant_new_uint32 (percentage));
+	g_variant_builder_add (&builder, "{sv}", "BytesWritten",
+			       g_variant_new_uint64 (bytes_written));
+	g_dbus_connection_emit_signal (priv->connection,
+				       NULL,
+				       FWUPD_DBUS_PATH,
+				       "org.freedesktop.DBus.Properties",
+				       "PropertiesChanged",
+				       g_variant_new ("(sa{sv}as)",
+				       FWUPD_DBUS_INTERFACE,
+				       &builder,
+				       &invalidated_builder),
+				       NULL);
+	g_variant_builder_clear (&builder);
+	g_variant_builder_clear (&invalidated_builder);
+}
+
+/**
+ * fu_main_job_get_status:
+ *
+ * Returns the status most recently reported by any running job.
+ **/
+static FwupdStatus
+fu_main_job_get_status (FuMainPrivate *priv)
+{
+	FuMainJob *job;
+	FuMainJob *job_last = NULL;
+	GHashTableIter iter;
+
+	g_hash_table_iter_init (&iter, priv->jobs);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &job)) {
+		if (job_last == NULL || job->seq > job_last->seq)
+			job_last = job;
+	}
+	return job_last != NULL ? job_last->status : FWUPD_STATUS_UNKNOWN;
+}
+
+/**
+ * fu_main_job_get_progress:
+ *
+ * Returns the running job that most recently reported progress.
+ **/
+static FuMainJob *
+fu_main_job_get_progress (FuMainPrivate *priv)
+{
+	FuMainJob *job;
+	FuMainJob *job_last = NULL;
+	GHashTableIter iter;
+
+	g_hash_table_iter_init (&iter, priv->jobs);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &job)) {
+		if (job->progress_seq == 0)
+			continue;
+		if (job_last == NULL || job->progress_seq > job_last->progress_seq)
+			job_last = job;
+	}
+	return job_last;
+}
+
 /**
  * fu_main_set_status:
+ *
+ * Sets the daemon status. The daemon does not go back to idle until all
+ * the updates and verifications that are running have finished.
  **/
 static void
 fu_main_set_status (FuMainPrivate *priv, FwupdStatus status)
 {
+	/* another job is still running */
+	if (status == FWUPD_STATUS_IDLE && g_hash_table_size (priv->jobs) > 0) {
+		status = fu_main_job_get_status (priv);
+		if (status == FWUPD_STATUS_UNKNOWN)
+			return;
+	}
 	if (priv->status == status)
 		return;
 	priv->status = status;
 
+	/* no transfer in progress */
+	if (status == FWUPD_STATUS_IDLE)
+		fu_main_set_progress (priv, 0, 0);
+
 	/* emit changed */
 	g_debug ("Emitting PropertyChanged('Status'='%s')",
 		 fwupd_status_to_string (status));
 	fu_main_emit_property_changed (priv, "Status", g_variant_new_uint32 (status));
 }
 
+/**
+ * fu_main_job_add:
+ **/
+static void
+fu_main_job_add (FuMainPrivate *priv, FuDevice *device)
+{
+	FuMainJob *job;
+
+	job = g_hash_table_lookup (priv->jobs, fu_device_get_id (device));
+	if (job == NULL) {
+		job = g_new0 (FuMainJob, 1);
+		job->status = FWUPD_STATUS_UNKNOWN;
+		g_hash_table_insert (priv->jobs, g_strdup (fu_device_get_id (device)), job);
+	}
+	job->refcount++;
+}
+
+/**
+ * fu_main_job_remove:
+ *
+ * Removes a job that has finished, setting the daemon status from any
+ * other jobs that are still running.
+ **/
+static void
+fu_main_job_remove (FuMainPrivate *priv, FuDevice *device)
+{
+	FuMainJob *job;
+
+	job = g_hash_table_lookup (priv->jobs, fu_device_get_id (device));
+	if (job == NULL)
+		return;
+	if (--job->refcount == 0)
+		g_hash_table_remove (priv->jobs, fu_device_get_id (device));
+
+	/* show the progress of a write that is still running */
+	job = fu_main_job_get_progress (priv);
+	if (job != NULL)
+		fu_main_set_progress (priv, job->percentage, job->bytes_written);
+	else
+		fu_main_set_progress (priv, 0, 0);
+	fu_main_set_status (priv, FWUPD_STATUS_IDLE);
+}
+
 /**
  * fu_main_device_array_to_variant:
  **/
@@ -185,32 +765,169 @@ fu_main_item_free (FuDeviceItem *item)
 static FuDeviceItem *
 fu_main_get_item_by_id (FuMainPrivate *priv, const gchar *id)
 {
-	FuDeviceItem *item;
-	guint i;
+	if (id == NULL)
+		return NULL;
+	return g_hash_table_lookup (priv->devices_by_id, id);
+}
 
-	for (i = 0; i < priv->devices->len; i++) {
-		item = g_ptr_array_index (priv->devices, i);
-		if (g_strcmp0 (fu_device_get_id (item->device), id) == 0)
-			return item;
+/**
+ * fu_main_item_check_ready:
+ *
+ * Devices restored from the snapshot are shown to clients straight away,
+ * but cannot be used until the coldplug has found them again.
+ **/
+static gboolean
+fu_main_item_check_ready (FuMainPrivate *priv, FuDeviceItem *item, GError **error)
+{
+	const gchar *id = fu_device_get_id (item->device);
+	if (g_hash_table_contains (priv->devices_restored, id)) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_NOT_READY,
+			     "device %s is not ready", id);
+		return FALSE;
 	}
-	return NULL;
+	return TRUE;
 }
 
 /**
- * fu_main_get_item_by_guid:
+ * fu_main_device_to_compact_variant:
  **/
-static FuDeviceItem *
-fu_main_get_item_by_guid (FuMainPrivate *priv, const gchar *guid)
+static GVariant *
+fu_main_device_to_compact_variant (FuDevice *device, const gchar **keys)
+{
+	GVariantBuilder builder;
+	const gchar *tmp;
+	guint i;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+	for (i = 0; keys[i] != NULL; i++) {
+		tmp = fu_device_get_metadata (device, keys[i]);
+		g_variant_builder_add (&builder, "s", tmp != NULL ? tmp : "");
+	}
+	return g_variant_new ("(stas)",
+			      fu_device_get_id (device),
+			      fu_device_get_flags (device),
+			      &builder);
+}
+
+/**
+ * fu_main_device_array_to_compact_variant:
+ *
+ * Returns just the requested keys for each device, in the same order as
+ * @keys, with missing values returned as empty strings.
+ **/
+static GVariant *
+fu_main_device_array_to_compact_variant (FuMainPrivate *priv,
+					 const gchar **keys,
+					 const gchar **ids,
+					 GError **error)
 {
 	FuDeviceItem *item;
+	GVariantBuilder builder;
+	guint cnt = 0;
 	guint i;
 
-	for (i = 0; i < priv->devices->len; i++) {
-		item = g_ptr_array_index (priv->devices, i);
-		if (g_strcmp0 (fu_device_get_guid (item->device), guid) == 0)
-			return item;
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(stas)"));
+	if (ids[0] == NULL) {
+		for (i = 0; i < priv->devices->len; i++) {
+			item = g_ptr_array_index (priv->devices, i);
+			g_variant_builder_add_value (&builder,
+						     fu_main_device_to_compact_variant (item->device, keys));
+			cnt++;
+		}
+	} else {
+		for (i = 0; ids[i] != NULL; i++) {
+			item = fu_main_get_item_by_id (priv, ids[i]);
+			if (item == NULL)
+				continue;
+			g_variant_builder_add_value (&builder,
+						     fu_main_device_to_compact_variant (item->device, keys));
+			cnt++;
+		}
 	}
-	return NULL;
+
+	/* no devices */
+	if (cnt == 0) {
+		g_variant_builder_clear (&builder);
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_NOTHING_TO_DO,
+				     "no devices");
+		return NULL;
+	}
+	return g_variant_new ("(a(stas))", &builder);
+}
+
+/**
+ * fu_main_get_item_by_guid:
+ **/
+static FuDeviceItem *
+fu_main_get_item_by_guid (FuMainPrivate *priv, const gchar *guid)
+{
+	GPtrArray *items;
+
+	if (guid == NULL)
+		return NULL;
+	items = g_hash_table_lookup (priv->devices_by_guid, guid);
+	if (items == NULL || items->len == 0)
+		return NULL;
+	return g_ptr_array_index (items, 0);
+}
+
+/**
+ * fu_main_item_add:
+ *
+ * Adds the item to the device list and all the indexes, taking ownership.
+ **/
+static void
+fu_main_item_add (FuMainPrivate *priv, FuDeviceItem *item)
+{
+	GPtrArray *items;
+	const gchar *guid;
+
+	g_ptr_array_add (priv->devices, item);
+	g_hash_table_insert (priv->devices_by_id,
+			     g_strdup (fu_device_get_id (item->device)),
+			     item);
+
+	/* several devices can share the same GUID */
+	guid = fu_device_get_guid (item->device);
+	if (guid == NULL)
+		return;
+	items = g_hash_table_lookup (priv->devices_by_guid, guid);
+	if (items == NULL) {
+		items = g_ptr_array_new ();
+		g_hash_table_insert (priv->devices_by_guid, g_strdup (guid), items);
+	}
+	g_ptr_array_add (items, item);
+}
+
+/**
+ * fu_main_item_remove:
+ *
+ * Removes the item from all the indexes and frees it.
+ **/
+static void
+fu_main_item_remove (FuMainPrivate *priv, FuDeviceItem *item)
+{
+	GPtrArray *items;
+	const gchar *guid;
+
+	guid = fu_device_get_guid (item->device);
+	if (guid != NULL) {
+		items = g_hash_table_lookup (priv->devices_by_guid, guid);
+		if (items != NULL) {
+			g_ptr_array_remove (items, item);
+			if (items->len == 0)
+				g_hash_table_remove (priv->devices_by_guid, guid);
+		}
+	}
+	if (g_hash_table_lookup (priv->devices_by_id,
+				 fu_device_get_id (item->device)) == item)
+		g_hash_table_remove (priv->devices_by_id,
+				     fu_device_get_id (item->device));
+	g_ptr_array_remove (priv->devices, item);
 }
 
 /**
@@ -230,6 +947,77 @@ fu_main_get_provider_by_name (FuMainPrivate *priv, const gchar *name)
 	return NULL;
 }
 
+/**
+ * fu_main_snapshot_restore:
+ *
+ * Adds the devices from the last snapshot if nothing has changed since it
+ * was saved. Devices that the coldplug does not find again are removed
+ * when it completes.
+ *
+ * Returns: the number of devices restored
+ **/
+static guint
+fu_main_snapshot_restore (FuMainPrivate *priv)
+{
+	FuDevice *device;
+	FuDeviceItem *item;
+	FuProvider *provider;
+	guint i;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+
+	filename = fu_main_snapshot_get_filename ();
+	devices = fu_main_snapshot_load (filename, priv->providers, NULL);
+	if (devices == NULL)
+		return 0;
+	for (i = 0; i < devices->len; i++) {
+		device = g_ptr_array_index (devices, i);
+		if (fu_main_get_item_by_id (priv, fu_device_get_id (device)) != NULL)
+			continue;
+		provider = fu_main_get_provider_by_name (priv,
+							 fu_device_get_metadata (device,
+										 FU_DEVICE_KEY_PROVIDER));
+		item = g_new0 (FuDeviceItem, 1);
+		item->device = g_object_ref (device);
+		item->provider = g_object_ref (provider);
+		fu_main_item_add (priv, item);
+		g_hash_table_add (priv->devices_restored,
+				  g_strdup (fu_device_get_id (device)));
+	}
+	g_debug ("restored %u devices from snapshot",
+		 g_hash_table_size (priv->devices_restored));
+	return g_hash_table_size (priv->devices_restored);
+}
+
+/**
+ * fu_main_snapshot_revalidate:
+ *
+ * Removes any restored devices that the coldplug did not add again.
+ **/
+static void
+fu_main_snapshot_revalidate (FuMainPrivate *priv)
+{
+	FuDeviceItem *item;
+	GHashTableIter iter;
+	gpointer id;
+
+	priv->coldplug_done = TRUE;
+	g_hash_table_iter_init (&iter, priv->devices_restored);
+	while (g_hash_table_iter_next (&iter, &id, NULL)) {
+		item = fu_main_get_item_by_id (priv, id);
+		if (item == NULL)
+			continue;
+		g_debug ("restored device %s has gone away", (const gchar *) id);
+		fu_main_signal_device_removed (priv, id);
+		fu_main_item_remove (priv, item);
+	}
+	if (g_hash_table_size (priv->devices_restored) > 0) {
+		g_hash_table_remove_all (priv->devices_restored);
+		fu_main_invalidate (priv);
+	}
+	fu_main_snapshot_schedule (priv);
+}
+
 typedef struct {
 	GDBusMethodInvocation	*invocation;
 	FuCab			*cab;
@@ -239,9 +1027,44 @@ typedef struct {
 	gint			 firmware_fd;
 	gint			 cab_fd;
 	gint			 vercmp;
+	GCancellable		*cancellable;
+	guint			 watch_id;
+	gint64			 start;		/* us */
 	FuMainPrivate		*priv;
 } FuMainAuthHelper;
 
+/**
+ * fu_main_sender_vanished_cb:
+ **/
+static void
+fu_main_sender_vanished_cb (GDBusConnection *connection,
+			    const gchar *name,
+			    gpointer user_data)
+{
+	GCancellable *cancellable = G_CANCELLABLE (user_data);
+	g_debug ("%s went away, cancelling request", name);
+	g_cancellable_cancel (cancellable);
+}
+
+/**
+ * fu_main_watch_sender:
+ *
+ * Cancels @cancellable if the client that made the request disconnects.
+ **/
+static guint
+fu_main_watch_sender (FuMainPrivate *priv,
+		      const gchar *sender,
+		      GCancellable *cancellable)
+{
+	return g_bus_watch_name_on_connection (priv->connection,
+					       sender,
+					       G_BUS_NAME_WATCHER_FLAGS_NONE,
+					       NULL,
+					       fu_main_sender_vanished_cb,
+					       g_object_ref (cancellable),
+					       g_object_unref);
+}
+
 /**
  * fu_main_helper_free:
  **/
@@ -258,16 +1081,50 @@ fu_main_helper_free (FuMainAuthHelper *helper)
 	if (helper->firmware_fd > 0)
 		close (helper->firmware_fd);
 
+	/* the device metadata may have changed */
+	fu_main_invalidate (helper->priv);
+
 	/* free */
+	if (helper->watch_id != 0)
+		g_bus_unwatch_name (helper->watch_id);
 	g_free (helper->id);
 	if (helper->device != NULL)
 		g_object_unref (helper->device);
+	g_object_unref (helper->cancellable);
 	g_object_unref (helper->invocation);
 	g_free (helper);
 }
 
+/**
+ * fu_main_provider_update_cb:
+ **/
+static void
+fu_main_provider_update_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuMainAuthHelper *helper = (FuMainAuthHelper *) user_data;
+	gboolean ret;
+	_cleanup_error_free_ GError *error = NULL;
+
+	ret = fu_provider_update_finish (FU_PROVIDER (source), res, &error);
+	fu_main_stat_add (helper->priv, "provider-update", helper->start, ret);
+	if (!ret) {
+		g_dbus_method_invocation_return_gerror (helper->invocation, error);
+	} else {
+		g_dbus_method_invocation_return_value (helper->invocation, NULL);
+	}
+
+	/* the version and pending state may have changed either way */
+	fu_main_signal_device_changed (helper->priv,
+				       fu_device_get_id (helper->device),
+				       NULL);
+	fu_main_job_remove (helper->priv, helper->device);
+	fu_main_helper_free (helper);
+}
+
 /**
  * fu_main_provider_update_authenticated:
+ *
+ * Starts the update, taking ownership of @helper unless %FALSE is returned.
  **/
 static gboolean
 fu_main_provider_update_authenticated (FuMainAuthHelper *helper, GError **error)
@@ -284,14 +1141,21 @@ fu_main_provider_update_authenticated (FuMainAuthHelper *helper, GError **error)
 			     fu_device_get_id (helper->device));
 		return FALSE;
 	}
+	if (!fu_main_item_check_ready (helper->priv, item, error))
+		return FALSE;
 
 	/* run the correct provider that added this */
-	return fu_provider_update (item->provider,
-				   item->device,
-				   fu_cab_get_stream (helper->cab),
-				   helper->firmware_fd,
-				   helper->flags,
-				   error);
+	helper->start = g_get_monotonic_time ();
+	fu_main_job_add (helper->priv, helper->device);
+	fu_provider_update_async (item->provider,
+				  item->device,
+				  fu_cab_get_stream (helper->cab),
+				  helper->firmware_fd,
+				  helper->flags,
+				  helper->cancellable,
+				  fu_main_provider_update_cb,
+				  helper);
+	return TRUE;
 }
 
 /**
@@ -330,47 +1194,29 @@ fu_main_check_authorization_cb (GObject *source, GAsyncResult *res, gpointer use
 	/* we're good to go */
 	if (!fu_main_provider_update_authenticated (helper, &error)) {
 		g_dbus_method_invocation_return_gerror (helper->invocation, error);
+		fu_main_set_status (helper->priv, FWUPD_STATUS_IDLE);
 		fu_main_helper_free (helper);
-		return;
 	}
-
-	/* success */
-	g_dbus_method_invocation_return_value (helper->invocation, NULL);
-	fu_main_helper_free (helper);
 }
 
 /**
- * fu_main_update_helper:
+ * fu_main_check_device:
+ *
+ * Checks the firmware in @cab can be applied to @device with @flags.
  **/
 static gboolean
-fu_main_update_helper (FuMainAuthHelper *helper, GError **error)
+fu_main_check_device (FuCab *cab,
+		      FuDevice *device,
+		      FuProviderFlags flags,
+		      gint *vercmp,
+		      GError **error)
 {
 	const gchar *guid;
 	const gchar *tmp;
 	const gchar *version;
 
-	/* load cab file */
-	fu_main_set_status (helper->priv, FWUPD_STATUS_LOADING);
-	if (!fu_cab_load_fd (helper->cab, helper->cab_fd, NULL, error))
-		return FALSE;
-
-	/* are we matching *any* hardware */
-	guid = fu_cab_get_guid (helper->cab);
-	if (helper->device == NULL) {
-		FuDeviceItem *item;
-		item = fu_main_get_item_by_guid (helper->priv, guid);
-		if (item == NULL) {
-			g_set_error (error,
-				     FWUPD_ERROR,
-				     FWUPD_ERROR_INVALID_FILE,
-				     "no hardware matched %s",
-				     guid);
-			return FALSE;
-		}
-		helper->device = g_object_ref (item->device);
-	}
-
-	tmp = fu_device_get_guid (helper->device);
+	guid = fu_cab_get_guid (cab);
+	tmp = fu_device_get_guid (device);
 	if (g_strcmp0 (guid, tmp) != 0) {
 		g_set_error (error,
 			     FWUPD_ERROR,
@@ -381,11 +1227,11 @@ fu_main_update_helper (FuMainAuthHelper *helper, GError **error)
 	}
 
 	/* parse the DriverVer */
-	version = fu_cab_get_version (helper->cab);
-	fu_device_set_metadata (helper->device, FU_DEVICE_KEY_UPDATE_VERSION, version);
+	version = fu_cab_get_version (cab);
+	fu_device_set_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION, version);
 
 	/* compare to the lowest supported version, if it exists */
-	tmp = fu_device_get_metadata (helper->device, FU_DEVICE_KEY_VERSION_LOWEST);
+	tmp = fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION_LOWEST);
 	if (tmp != NULL && as_utils_vercmp (tmp, version) > 0) {
 		g_set_error (error,
 			     FWUPD_ERROR,
@@ -396,17 +1242,17 @@ fu_main_update_helper (FuMainAuthHelper *helper, GError **error)
 	}
 
 	/* compare the versions of what we have installed */
-	tmp = fu_device_get_metadata (helper->device, FU_DEVICE_KEY_VERSION);
+	tmp = fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION);
 	if (tmp == NULL) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_INTERNAL,
 			     "Device %s does not yet have a current version",
-			     fu_device_get_id (helper->device));
+			     fu_device_get_id (device));
 		return FALSE;
 	}
-	helper->vercmp = as_utils_vercmp (tmp, version);
-	if (helper->vercmp == 0 && (helper->flags & FU_PROVIDER_UPDATE_FLAG_ALLOW_REINSTALL) == 0) {
+	*vercmp = as_utils_vercmp (tmp, version);
+	if (*vercmp == 0 && (flags & FU_PROVIDER_UPDATE_FLAG_ALLOW_REINSTALL) == 0) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_VERSION_SAME,
@@ -414,7 +1260,7 @@ fu_main_update_helper (FuMainAuthHelper *helper, GError **error)
 			     tmp);
 		return FALSE;
 	}
-	if (helper->vercmp > 0 && (helper->flags & FU_PROVIDER_UPDATE_FLAG_ALLOW_OLDER) == 0) {
+	if (*vercmp > 0 && (flags & FU_PROVIDER_UPDATE_FLAG_ALLOW_OLDER) == 0) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_VERSION_NEWER,
@@ -422,26 +1268,66 @@ fu_main_update_helper (FuMainAuthHelper *helper, GError **error)
 			     tmp, version);
 		return FALSE;
 	}
+	return TRUE;
+}
+
+/**
+ * fu_main_update_helper:
+ **/
+static gboolean
+fu_main_update_helper (FuMainAuthHelper *helper, GError **error)
+{
+	const gchar *guid;
+	gboolean ret;
+	gint64 start;
+
+	/* load cab file */
+	fu_main_set_status (helper->priv, FWUPD_STATUS_LOADING);
+	start = g_get_monotonic_time ();
+	ret = fu_cab_load_fd (helper->cab, helper->cab_fd, NULL, error);
+	fu_main_stat_add (helper->priv, "cab-load", start, ret);
+	if (!ret)
+		return FALSE;
+
+	/* are we matching *any* hardware */
+	guid = fu_cab_get_guid (helper->cab);
+	if (helper->device == NULL) {
+		FuDeviceItem *item;
+		item = fu_main_get_item_by_guid (helper->priv, guid);
+		if (item == NULL) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "no hardware matched %s",
+				     guid);
+			return FALSE;
+		}
+		if (!fu_main_item_check_ready (helper->priv, item, error))
+			return FALSE;
+		helper->device = g_object_ref (item->device);
+	}
+	if (!fu_main_check_device (helper->cab, helper->device,
+				   helper->flags, &helper->vercmp, error))
+		return FALSE;
 
 	/* now extract the firmware and set any trust flags */
 	fu_main_set_status (helper->priv, FWUPD_STATUS_DECOMPRESSING);
-	if (!fu_cab_extract (helper->cab, FU_CAB_EXTRACT_FLAG_FIRMWARE |
-					  FU_CAB_EXTRACT_FLAG_SIGNATURE, error))
+	start = g_get_monotonic_time ();
+	ret = fu_cab_extract (helper->cab, FU_CAB_EXTRACT_FLAG_FIRMWARE |
+					   FU_CAB_EXTRACT_FLAG_SIGNATURE, error);
+	fu_main_stat_add (helper->priv, "cab-extract", start, ret);
+	if (!ret)
 		return FALSE;
-	if (!fu_cab_verify (helper->cab, error))
+	start = g_get_monotonic_time ();
+	ret = fu_cab_verify (helper->cab, error);
+	fu_main_stat_add (helper->priv, "cab-verify", start, ret);
+	if (!ret)
 		return FALSE;
 
 	/* and open it */
-	helper->firmware_fd = g_open (fu_cab_get_filename_firmware (helper->cab),
-				      O_CLOEXEC, 0);
-	if (helper->firmware_fd < 0) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_READ,
-			     "failed to open %s",
-			     fu_cab_get_filename_firmware (helper->cab));
+	helper->firmware_fd = fu_cab_get_firmware_fd (helper->cab, error);
+	if (helper->firmware_fd < 0)
 		return FALSE;
-	}
 	return TRUE;
 }
 
@@ -487,6 +1373,7 @@ fu_main_get_item_by_id_fallback_pending (FuMainPrivate *priv, const gchar *id, G
 	const gchar *tmp;
 	guint i;
 	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices_failed = NULL;
 
 	/* not a wildcard */
 	if (g_strcmp0 (id, FWUPD_DEVICE_ID_ANY) != 0) {
@@ -496,21 +1383,30 @@ fu_main_get_item_by_id_fallback_pending (FuMainPrivate *priv, const gchar *id, G
 				     FWUPD_ERROR,
 				     FWUPD_ERROR_NOT_FOUND,
 				     "no suitable device found for %s", id);
+			return NULL;
 		}
+		if (!fu_main_item_check_ready (priv, item, error))
+			return NULL;
 		return item;
 	}
 
-	/* allow '*' for any */
-	devices = fu_pending_get_devices (priv->pending, error);
+	/* allow '*' for any device that has been updated offline */
+	devices = fu_pending_get_devices_by_state (priv->pending,
+						   FU_PENDING_STATE_SUCCESS,
+						   error);
 	if (devices == NULL)
 		return NULL;
+	devices_failed = fu_pending_get_devices_by_state (priv->pending,
+							  FU_PENDING_STATE_FAILED,
+							  error);
+	if (devices_failed == NULL)
+		return NULL;
+	for (i = 0; i < devices_failed->len; i++) {
+		dev = g_ptr_array_index (devices_failed, i);
+		g_ptr_array_add (devices, g_object_ref (dev));
+	}
 	for (i = 0; i < devices->len; i++) {
 		dev = g_ptr_array_index (devices, i);
-		tmp = fu_device_get_metadata (dev, FU_DEVICE_KEY_PENDING_STATE);
-		if (tmp == NULL)
-			continue;
-		if (g_strcmp0 (tmp, "scheduled") == 0)
-			continue;
 
 		/* if the device is not still connected, fake a FuDeviceItem */
 		item = fu_main_get_item_by_id (priv, fu_device_get_id (dev));
@@ -522,14 +1418,19 @@ fu_main_get_item_by_id_fallback_pending (FuMainPrivate *priv, const gchar *id, G
 					     FWUPD_ERROR,
 					     FWUPD_ERROR_NOT_FOUND,
 					     "no provider %s found", tmp);
+				return NULL;
 			}
 			item = g_new0 (FuDeviceItem, 1);
 			item->device = g_object_ref (dev);
 			item->provider = g_object_ref (provider);
-			g_ptr_array_add (priv->devices, item);
+			fu_main_item_add (priv, item);
 
 			/* FIXME: just a boolean on FuDeviceItem? */
 			fu_device_set_metadata (dev, "FakeDevice", "TRUE");
+			fu_main_invalidate (priv);
+			fu_main_signal_device_added (priv, fu_device_get_id (dev));
+		} else if (!fu_main_item_check_ready (priv, item, error)) {
+			return NULL;
 		}
 		break;
 	}
@@ -545,20 +1446,15 @@ fu_main_get_item_by_id_fallback_pending (FuMainPrivate *priv, const gchar *id, G
 }
 
 /**
- * fu_main_get_action_id_for_device:
+ * fu_main_get_action_id:
  **/
 static const gchar *
-fu_main_get_action_id_for_device (FuMainAuthHelper *helper)
+fu_main_get_action_id (gboolean is_internal,
+		       gboolean is_downgrade,
+		       gboolean is_trusted)
 {
-	gboolean is_trusted;
-	gboolean is_downgrade;
-
-	/* only test the payload */
-	is_trusted = (fu_cab_get_trust_flags (helper->cab) & FWUPD_TRUST_FLAG_PAYLOAD) > 0;
-	is_downgrade = helper->vercmp > 0;
-
 	/* relax authentication checks for removable devices */
-	if ((fu_device_get_flags (helper->device) & FU_DEVICE_FLAG_INTERNAL) == 0) {
+	if (!is_internal) {
 		if (is_downgrade)
 			return "org.freedesktop.fwupd.downgrade-hotplug";
 		if (is_trusted)
@@ -575,252 +1471,1340 @@ fu_main_get_action_id_for_device (FuMainAuthHelper *helper)
 }
 
 /**
- * _as_store_set_priority:
+ * fu_main_get_action_id_for_device:
  **/
-static void
-_as_store_set_priority (AsStore *store, gint priority)
+static const gchar *
+fu_main_get_action_id_for_device (FuMainAuthHelper *helper)
 {
-	AsApp *app;
-	GPtrArray *apps;
-	guint i;
+	gboolean is_internal;
+	gboolean is_trusted;
 
-	apps = as_store_get_apps (store);
-	for (i = 0; i < apps->len; i++) {
-		app = g_ptr_array_index (apps, i);
-		as_app_set_priority (app, priority);
-	}
+	/* only test the payload */
+	is_trusted = (fu_cab_get_trust_flags (helper->cab) & FWUPD_TRUST_FLAG_PAYLOAD) > 0;
+	is_internal = (fu_device_get_flags (helper->device) & FU_DEVICE_FLAG_INTERNAL) > 0;
+	return fu_main_get_action_id (is_internal, helper->vercmp > 0, is_trusted);
+}
+
+typedef struct {
+	GDBusMethodInvocation	*invocation;
+	FuCab			*cab;
+	FuProviderFlags		 flags;
+	gint			 cab_fd;
+	GPtrArray		*jobs;		/* of FuMainBatchJob */
+	GCancellable		*cancellable;
+	guint			 watch_id;
+	FuMainPrivate		*priv;
+} FuMainBatchHelper;
+
+/**
+ * fu_main_batch_helper_free:
+ **/
+static void
+fu_main_batch_helper_free (FuMainBatchHelper *batch)
+{
+	fu_cab_delete_temp_files (batch->cab, NULL);
+	g_object_unref (batch->cab);
+	if (batch->cab_fd >= 0)
+		close (batch->cab_fd);
+	g_ptr_array_unref (batch->jobs);
+
+	/* the device metadata may have changed */
+	fu_main_invalidate (batch->priv);
+
+	if (batch->watch_id != 0)
+		g_bus_unwatch_name (batch->watch_id);
+	g_object_unref (batch->cancellable);
+	g_object_unref (batch->invocation);
+	g_free (batch);
 }
 
 /**
- * fu_main_daemon_update_metadata:
+ * fu_main_batch_install_job_cb:
  *
- * Supports optionally GZipped AppStream files up to 1MiB in size.
+ * Tracks the status of each device, and tells the client how far the
+ * batch has got.
  **/
-static gboolean
-fu_main_daemon_update_metadata (FuMainPrivate *priv, gint fd, gint fd_sig, GError **error)
+static void
+fu_main_batch_install_job_cb (FuMainBatchJob *job,
+			      const gchar *state,
+			      guint n_done,
+			      gpointer user_data)
 {
-	guint8 magic[2];
-	_cleanup_bytes_unref_ GBytes *bytes = NULL;
-	_cleanup_bytes_unref_ GBytes *bytes_raw = NULL;
-	_cleanup_bytes_unref_ GBytes *bytes_sig = NULL;
-	_cleanup_object_unref_ AsStore *store = NULL;
-	_cleanup_object_unref_ FuKeyring *kr = NULL;
-	_cleanup_object_unref_ GConverter *converter = NULL;
-	_cleanup_object_unref_ GFile *file = NULL;
-	_cleanup_object_unref_ GInputStream *stream_buf = NULL;
-	_cleanup_object_unref_ GInputStream *stream_fd = NULL;
-	_cleanup_object_unref_ GInputStream *stream = NULL;
-	_cleanup_object_unref_ GInputStream *stream_sig = NULL;
+	FuMainBatchHelper *batch = (FuMainBatchHelper *) user_data;
 
-	/* open existing file if it exists */
-	store = as_store_new ();
-	file = g_file_new_for_path ("/var/cache/app-info/xmls/fwupd.xml");
-	if (g_file_query_exists (file, NULL)) {
-		if (!as_store_from_file (store, file, NULL, NULL, error))
-			return FALSE;
-		/* ensure we don't merge existing entries */
-		_as_store_set_priority (store, -1);
+	if (g_strcmp0 (state, "installing") == 0) {
+		fu_main_job_add (batch->priv, job->device);
+	} else {
+		fu_main_stat_add (batch->priv,
+				  batch->flags & FU_PROVIDER_UPDATE_FLAG_OFFLINE ?
+				  "provider-stage" : "provider-update",
+				  job->start, job->error_msg == NULL);
+		fu_main_job_remove (batch->priv, job->device);
 	}
+	if (batch->priv->connection == NULL)
+		return;
+	g_dbus_connection_emit_signal (batch->priv->connection,
+				       NULL,
+				       FWUPD_DBUS_PATH,
+				       FWUPD_DBUS_INTERFACE,
+				       "InstallProgress",
+				       g_variant_new ("(ssuu)",
+						      fu_device_get_id (job->device),
+						      state,
+						      n_done,
+						      batch->jobs->len),
+				       NULL);
+}
 
-	/* read the entire file into memory */
-	stream_fd = g_unix_input_stream_new (fd, TRUE);
-	bytes_raw = g_input_stream_read_bytes (stream_fd, 0x100000, NULL, error);
-	if (bytes_raw == NULL)
+/**
+ * fu_main_batch_install_done_cb:
+ *
+ * Returns the per-device results to the caller once every job is done.
+ **/
+static void
+fu_main_batch_install_done_cb (gpointer user_data)
+{
+	FuMainBatchHelper *batch = (FuMainBatchHelper *) user_data;
+
+	g_dbus_method_invocation_return_value (batch->invocation,
+					       g_variant_new ("(@a{ss})",
+							      fu_main_batch_get_results (batch->jobs)));
+	fu_main_set_status (batch->priv, FWUPD_STATUS_IDLE);
+	fu_main_batch_helper_free (batch);
+}
+
+/**
+ * fu_main_batch_install:
+ *
+ * Flashes every device that passed the checks and still exists, taking
+ * ownership of @batch.
+ **/
+static void
+fu_main_batch_install (FuMainBatchHelper *batch)
+{
+	FuMainBatchJob *job;
+	guint i;
+
+	for (i = 0; i < batch->jobs->len; i++) {
+		job = g_ptr_array_index (batch->jobs, i);
+		if (job->error_msg != NULL)
+			continue;
+		if (fu_main_get_item_by_id (batch->priv, fu_device_get_id (job->device)) == NULL) {
+			job->error_msg = g_strdup_printf ("device %s was removed",
+							  fu_device_get_id (job->device));
+		}
+	}
+	fu_main_batch_run (batch->jobs,
+			   fu_cab_get_stream (batch->cab),
+			   batch->flags,
+			   batch->cancellable,
+			   fu_main_batch_install_job_cb,
+			   fu_main_batch_install_done_cb,
+			   batch);
+}
+
+/**
+ * fu_main_batch_prepare:
+ *
+ * Loads, extracts and verifies the cabinet file once, then checks it
+ * against every device with a matching GUID.
+ **/
+static gboolean
+fu_main_batch_prepare (FuMainBatchHelper *batch, GError **error)
+{
+	FuDeviceItem *item;
+	FuMainBatchJob *job;
+	GPtrArray *items;
+	const gchar *guid;
+	gboolean ret;
+	gint64 start;
+	guint i;
+	guint n_ok = 0;
+	_cleanup_error_free_ GError *error_first = NULL;
+
+	/* load cab file */
+	fu_main_set_status (batch->priv, FWUPD_STATUS_LOADING);
+	start = g_get_monotonic_time ();
+	ret = fu_cab_load_fd (batch->cab, batch->cab_fd, NULL, error);
+	fu_main_stat_add (batch->priv, "cab-load", start, ret);
+	if (!ret)
+		return FALSE;
+
+	/* find all the hardware */
+	guid = fu_cab_get_guid (batch->cab);
+	items = g_hash_table_lookup (batch->priv->devices_by_guid, guid);
+	if (items == NULL || items->len == 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INVALID_FILE,
+			     "no hardware matched %s",
+			     guid);
+		return FALSE;
+	}
+	for (i = 0; i < items->len; i++) {
+		_cleanup_error_free_ GError *error_local = NULL;
+		item = g_ptr_array_index (items, i);
+		job = fu_main_batch_job_new (item->device, item->provider);
+		g_ptr_array_add (batch->jobs, job);
+		if (!fu_main_item_check_ready (batch->priv, item, &error_local) ||
+		    !fu_main_check_device (batch->cab, job->device, batch->flags,
+					   &job->vercmp, &error_local)) {
+			job->error_msg = g_strdup (error_local->message);
+			if (error_first == NULL) {
+				error_first = error_local;
+				error_local = NULL;
+			}
+			continue;
+		}
+		n_ok++;
+	}
+
+	/* nothing to do */
+	if (n_ok == 0) {
+		g_propagate_error (error, error_first);
+		error_first = NULL;
+		return FALSE;
+	}
+
+	/* now extract the firmware and set any trust flags */
+	fu_main_set_status (batch->priv, FWUPD_STATUS_DECOMPRESSING);
+	start = g_get_monotonic_time ();
+	ret = fu_cab_extract (batch->cab, FU_CAB_EXTRACT_FLAG_FIRMWARE |
+					  FU_CAB_EXTRACT_FLAG_SIGNATURE, error);
+	fu_main_stat_add (batch->priv, "cab-extract", start, ret);
+	if (!ret)
+		return FALSE;
+	start = g_get_monotonic_time ();
+	ret = fu_cab_verify (batch->cab, error);
+	fu_main_stat_add (batch->priv, "cab-verify", start, ret);
+	if (!ret)
+		return FALSE;
+
+	/* each device reads the firmware from its own fd */
+	for (i = 0; i < batch->jobs->len; i++) {
+		job = g_ptr_array_index (batch->jobs, i);
+		if (job->error_msg != NULL)
+			continue;
+		job->firmware_fd = fu_cab_get_firmware_fd (batch->cab, error);
+		if (job->firmware_fd < 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_main_get_action_id_for_batch:
+ *
+ * Returns the strictest action required by any of the devices.
+ **/
+static const gchar *
+fu_main_get_action_id_for_batch (FuMainBatchHelper *batch)
+{
+	FuMainBatchJob *job;
+	gboolean is_downgrade = FALSE;
+	gboolean is_internal = FALSE;
+	gboolean is_trusted;
+	guint i;
+
+	/* only test the payload */
+	is_trusted = (fu_cab_get_trust_flags (batch->cab) & FWUPD_TRUST_FLAG_PAYLOAD) > 0;
+	for (i = 0; i < batch->jobs->len; i++) {
+		job = g_ptr_array_index (batch->jobs, i);
+		if (job->error_msg != NULL)
+			continue;
+		if (fu_device_get_flags (job->device) & FU_DEVICE_FLAG_INTERNAL)
+			is_internal = TRUE;
+		if (job->vercmp > 0)
+			is_downgrade = TRUE;
+	}
+	return fu_main_get_action_id (is_internal, is_downgrade, is_trusted);
+}
+
+/**
+ * fu_main_check_authorization_batch_cb:
+ **/
+static void
+fu_main_check_authorization_batch_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuMainBatchHelper *batch = (FuMainBatchHelper *) user_data;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_object_unref_ PolkitAuthorizationResult *auth = NULL;
+
+	/* get result */
+	auth = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source),
+							    res, &error);
+	if (auth == NULL) {
+		g_dbus_method_invocation_return_error (batch->invocation,
+						       FWUPD_ERROR,
+						       FWUPD_ERROR_AUTH_FAILED,
+						       "could not check for auth: %s",
+						       error->message);
+		fu_main_set_status (batch->priv, FWUPD_STATUS_IDLE);
+		fu_main_batch_helper_free (batch);
+		return;
+	}
+
+	/* did not auth */
+	if (!polkit_authorization_result_get_is_authorized (auth)) {
+		g_dbus_method_invocation_return_error (batch->invocation,
+						       FWUPD_ERROR,
+						       FWUPD_ERROR_AUTH_FAILED,
+						       "failed to obtain auth");
+		fu_main_set_status (batch->priv, FWUPD_STATUS_IDLE);
+		fu_main_batch_helper_free (batch);
+		return;
+	}
+
+	/* we're good to go */
+	fu_main_batch_install (batch);
+}
+
+/**
+ * fu_main_debug_log_return:
+ **/
+static void
+fu_main_debug_log_return (GDBusMethodInvocation *invocation)
+{
+	_cleanup_free_ gchar *log = NULL;
+
+	log = fu_debug_get_log ();
+	if (log == NULL) {
+		g_dbus_method_invocation_return_error (invocation,
+						       FWUPD_ERROR,
+						       FWUPD_ERROR_NOT_SUPPORTED,
+						       "daemon not started with --log-buffer");
+		return;
+	}
+	g_dbus_method_invocation_return_value (invocation,
+					       g_variant_new ("(s)", log));
+}
+
+/**
+ * fu_main_check_authorization_debug_log_cb:
+ **/
+static void
+fu_main_check_authorization_debug_log_cb (GObject *source,
+					  GAsyncResult *res,
+					  gpointer user_data)
+{
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_object_unref_ GDBusMethodInvocation *invocation = user_data;
+	_cleanup_object_unref_ PolkitAuthorizationResult *auth = NULL;
+
+	/* get result */
+	auth = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source),
+							    res, &error);
+	if (auth == NULL) {
+		g_dbus_method_invocation_return_error (invocation,
+						       FWUPD_ERROR,
+						       FWUPD_ERROR_AUTH_FAILED,
+						       "could not check for auth: %s",
+						       error->message);
+		return;
+	}
+
+	/* did not auth */
+	if (!polkit_authorization_result_get_is_authorized (auth)) {
+		g_dbus_method_invocation_return_error (invocation,
+						       FWUPD_ERROR,
+						       FWUPD_ERROR_AUTH_FAILED,
+						       "failed to obtain auth");
+		return;
+	}
+	fu_main_debug_log_return (invocation);
+}
+
+/**
+ * fu_main_get_install_flags:
+ **/
+static FuProviderFlags
+fu_main_get_install_flags (GVariantIter *iter)
+{
+	FuProviderFlags flags = FU_PROVIDER_UPDATE_FLAG_NONE;
+	GVariant *prop_value;
+	gchar *prop_key;
+
+	while (g_variant_iter_next (iter, "{&sv}",
+				    &prop_key, &prop_value)) {
+		g_debug ("got option %s", prop_key);
+		if (g_strcmp0 (prop_key, "offline") == 0 &&
+		    g_variant_get_boolean (prop_value) == TRUE)
+			flags |= FU_PROVIDER_UPDATE_FLAG_OFFLINE;
+		if (g_strcmp0 (prop_key, "allow-older") == 0 &&
+		    g_variant_get_boolean (prop_value) == TRUE)
+			flags |= FU_PROVIDER_UPDATE_FLAG_ALLOW_OLDER;
+		if (g_strcmp0 (prop_key, "allow-reinstall") == 0 &&
+		    g_variant_get_boolean (prop_value) == TRUE)
+			flags |= FU_PROVIDER_UPDATE_FLAG_ALLOW_REINSTALL;
+		if (g_strcmp0 (prop_key, "no-pending") == 0 &&
+		    g_variant_get_boolean (prop_value) == TRUE)
+			flags |= FU_PROVIDER_UPDATE_FLAG_NO_PENDING;
+		g_variant_unref (prop_value);
+	}
+	return flags;
+}
+
+typedef struct {
+	GDBusMethodInvocation	*invocation;
+	FuDevice		*device;
+	GCancellable		*cancellable;
+	guint			 watch_id;
+	gint64			 start;		/* us */
+	FuMainPrivate		*priv;
+} FuMainVerifyHelper;
+
+/**
+ * fu_main_verify_helper_free:
+ **/
+static void
+fu_main_verify_helper_free (FuMainVerifyHelper *helper)
+{
+	if (helper->watch_id != 0)
+		g_bus_unwatch_name (helper->watch_id);
+	g_object_unref (helper->cancellable);
+	g_object_unref (helper->device);
+	g_object_unref (helper->invocation);
+	g_free (helper);
+}
+
+/**
+ * fu_main_verify_device:
+ *
+ * Compares the firmware hash read from the device with the metadata.
+ **/
+static gboolean
+fu_main_verify_device (FuMainPrivate *priv, FuDevice *device, GError **error)
+{
+	AsApp *app;
+	AsChecksum *csum;
+	AsRelease *release;
+	const gchar *hash = NULL;
+	const gchar *version = NULL;
+
+	/* find component in metadata */
+	app = as_store_get_app_by_id (priv->store, fu_device_get_guid (device));
+	if (app == NULL) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_NOT_SUPPORTED,
+				     "No metadata");
+		return FALSE;
+	}
+
+	/* find version in metadata */
+	version = fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION);
+	release = as_app_get_release (app, version);
+	if (release == NULL) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_NOT_SUPPORTED,
+			     "No version %s",
+			     version);
 		return FALSE;
-	stream_buf = g_memory_input_stream_new ();
-	g_memory_input_stream_add_bytes (G_MEMORY_INPUT_STREAM (stream_buf), bytes_raw);
+	}
 
-	/* peek the file type and get data */
-	if (g_input_stream_read (stream_buf, magic, 2, NULL, error) == -1)
+	/* find checksum */
+	csum = as_release_get_checksum_by_target (release, AS_CHECKSUM_TARGET_CONTENT);
+	if (csum == NULL) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_NOT_SUPPORTED,
+			     "No content checksum for %s",
+			     version);
 		return FALSE;
+	}
+	hash = fu_device_get_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH);
+	if (g_strcmp0 (as_checksum_get_value (csum), hash) != 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_NOT_SUPPORTED,
+			     "For v%s expected %s, got %s",
+			     version,
+			     as_checksum_get_value (csum),
+			     hash);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_main_provider_verify_cb:
+ **/
+static void
+fu_main_provider_verify_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuMainVerifyHelper *helper = (FuMainVerifyHelper *) user_data;
+	gboolean ret;
+	_cleanup_error_free_ GError *error = NULL;
+
+	/* set the device firmware hash */
+	ret = fu_provider_verify_finish (FU_PROVIDER (source), res, &error);
+	fu_main_stat_add (helper->priv, "provider-verify", helper->start, ret);
+	fu_main_job_remove (helper->priv, helper->device);
+	if (!ret) {
+		g_dbus_method_invocation_return_gerror (helper->invocation, error);
+		fu_main_verify_helper_free (helper);
+		return;
+	}
+	fu_main_invalidate (helper->priv);
+
+	/* check it against the metadata */
+	if (!fu_main_verify_device (helper->priv, helper->device, &error)) {
+		g_dbus_method_invocation_return_gerror (helper->invocation, error);
+		fu_main_verify_helper_free (helper);
+		return;
+	}
+	g_dbus_method_invocation_return_value (helper->invocation, NULL);
+	fu_main_verify_helper_free (helper);
+}
+
+typedef struct {
+	GDBusMethodInvocation	*invocation;
+	GCancellable		*cancellable;
+	GVariantBuilder		 builder;
+	guint			 watch_id;
+	guint			 pending;
+	gint64			 start;		/* us */
+	FuMainPrivate		*priv;
+} FuMainVerifyAllHelper;
+
+typedef struct {
+	FuMainVerifyAllHelper	*helper;
+	FuDevice		*device;
+	gint64			 start;		/* us */
+} FuMainVerifyAllJob;
+
+/**
+ * fu_main_verify_all_helper_free:
+ **/
+static void
+fu_main_verify_all_helper_free (FuMainVerifyAllHelper *helper)
+{
+	if (helper->watch_id != 0)
+		g_bus_unwatch_name (helper->watch_id);
+	g_object_unref (helper->cancellable);
+	g_object_unref (helper->invocation);
+	g_free (helper);
+}
+
+/**
+ * fu_main_provider_verify_all_cb:
+ **/
+static void
+fu_main_provider_verify_all_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuMainVerifyAllJob *job = (FuMainVerifyAllJob *) user_data;
+	FuMainVerifyAllHelper *helper = job->helper;
+	GVariantBuilder builder;
+	const gchar *hash;
+	gboolean ret;
+	_cleanup_error_free_ GError *error = NULL;
+
+	/* set the device firmware hash, then check it against the metadata */
+	ret = fu_provider_verify_finish (FU_PROVIDER (source), res, &error);
+	fu_main_stat_add (helper->priv, "provider-verify", job->start, ret);
+	fu_main_job_remove (helper->priv, job->device);
+	if (ret)
+		ret = fu_main_verify_device (helper->priv, job->device, &error);
+
+	/* add the result for this device */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	g_variant_builder_add (&builder, "{sv}", "Success",
+			       g_variant_new_boolean (ret));
+	hash = fu_device_get_metadata (job->device, FU_DEVICE_KEY_FIRMWARE_HASH);
+	if (hash != NULL) {
+		g_variant_builder_add (&builder, "{sv}", FU_DEVICE_KEY_FIRMWARE_HASH,
+				       g_variant_new_string (hash));
+	}
+	if (error != NULL) {
+		g_variant_builder_add (&builder, "{sv}", "Error",
+				       g_variant_new_string (error->message));
+	}
+	g_variant_builder_add (&helper->builder, "{sa{sv}}",
+			       fu_device_get_id (job->device), &builder);
+	g_object_unref (job->device);
+	g_free (job);
+
+	/* wait for the other devices */
+	if (--helper->pending > 0)
+		return;
+	fu_main_invalidate (helper->priv);
+	fu_main_stat_add (helper->priv, "verify-all", helper->start, TRUE);
+	g_dbus_method_invocation_return_value (helper->invocation,
+					       g_variant_new ("(a{sa{sv}})",
+							      &helper->builder));
+	fu_main_verify_all_helper_free (helper);
+}
+
+/**
+ * fu_main_verify_all:
+ *
+ * Reads back the firmware from every device that supports it, returning
+ * the results when the last device has finished.
+ **/
+static void
+fu_main_verify_all (FuMainPrivate *priv,
+		    const gchar *sender,
+		    GDBusMethodInvocation *invocation)
+{
+	FuDeviceItem *item;
+	FuMainVerifyAllHelper *helper;
+	FuMainVerifyAllJob *job;
+	guint i;
+	_cleanup_ptrarray_unref_ GPtrArray *items = NULL;
+
+	/* only some providers can read back the firmware */
+	items = g_ptr_array_new ();
+	for (i = 0; i < priv->devices->len; i++) {
+		item = g_ptr_array_index (priv->devices, i);
+		if (FU_PROVIDER_GET_CLASS (item->provider)->verify == NULL)
+			continue;
+		if (g_hash_table_contains (priv->devices_restored,
+					   fu_device_get_id (item->device)))
+			continue;
+		g_ptr_array_add (items, item);
+	}
+
+	helper = g_new0 (FuMainVerifyAllHelper, 1);
+	helper->invocation = g_object_ref (invocation);
+	helper->cancellable = g_cancellable_new ();
+	helper->watch_id = fu_main_watch_sender (priv, sender, helper->cancellable);
+	helper->priv = priv;
+	helper->start = g_get_monotonic_time ();
+	g_variant_builder_init (&helper->builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+	/* nothing to do */
+	if (items->len == 0) {
+		g_dbus_method_invocation_return_value (helper->invocation,
+						       g_variant_new ("(a{sa{sv}})",
+								      &helper->builder));
+		fu_main_verify_all_helper_free (helper);
+		return;
+	}
+
+	/* verifies are done in worker threads, at the same time for the
+	 * providers that allow it and one at a time for the rest, so a slow
+	 * provider only delays its own devices */
+	helper->pending = items->len;
+	for (i = 0; i < items->len; i++) {
+		item = g_ptr_array_index (items, i);
+		job = g_new0 (FuMainVerifyAllJob, 1);
+		job->helper = helper;
+		job->device = g_object_ref (item->device);
+		job->start = g_get_monotonic_time ();
+		fu_main_job_add (priv, job->device);
+		fu_provider_verify_async (item->provider, item->device,
+					  FU_PROVIDER_VERIFY_FLAG_NONE,
+					  helper->cancellable,
+					  fu_main_provider_verify_all_cb,
+					  job);
+	}
+}
+
+/**
+ * fu_main_daemon_update_metadata_spool:
+ *
+ * Copies the untrusted metadata to a temporary file in chunks, returning
+ * the filename. The suffix is chosen from the file magic.
+ **/
+static gchar *
+fu_main_daemon_update_metadata_spool (gint fd, GError **error)
+{
+	const guint8 *magic;
+	const gchar *tmpl;
+	gint fd_tmp;
+	gsize len;
+	_cleanup_bytes_unref_ GBytes *bytes_head = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ GInputStream *stream_fd = NULL;
+	_cleanup_object_unref_ GOutputStream *stream_tmp = NULL;
+
+	/* peek the file type */
+	stream_fd = g_unix_input_stream_new (fd, TRUE);
+	bytes_head = g_input_stream_read_bytes (stream_fd, FU_MAIN_METADATA_CHUNK_SIZE,
+						NULL, error);
+	if (bytes_head == NULL)
+		return NULL;
+	magic = g_bytes_get_data (bytes_head, &len);
+	if (len < 2) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "file too small");
+		return NULL;
+	}
 	if (magic[0] == 0x1f && magic[1] == 0x8b) {
 		g_debug ("using GZip decompressor for data");
-		if (!g_seekable_seek (G_SEEKABLE (stream_buf), 0, G_SEEK_SET, NULL, error))
-			return FALSE;
-		converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
-		stream = g_converter_input_stream_new (stream_buf, converter);
-		bytes = g_input_stream_read_bytes (stream, 0x100000, NULL, error);
-		if (bytes == NULL)
-			return FALSE;
+		tmpl = "fwupd-metadata-XXXXXX.xml.gz";
 	} else if (magic[0] == '<' && magic[1] == '?') {
 		g_debug ("using no decompressor for data");
-		bytes = g_bytes_ref (bytes_raw);
+		tmpl = "fwupd-metadata-XXXXXX.xml";
 	} else {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_INVALID_FILE,
 			     "file type '0x%02x,0x%02x' not supported",
 			     magic[0], magic[1]);
+		return NULL;
+	}
+
+	/* copy the rest of the stream without any size limit */
+	fd_tmp = g_file_open_tmp (tmpl, &filename, error);
+	if (fd_tmp < 0)
+		return NULL;
+	stream_tmp = g_unix_output_stream_new (fd_tmp, TRUE);
+	if (!g_output_stream_write_all (stream_tmp,
+					g_bytes_get_data (bytes_head, NULL),
+					len, NULL, NULL, error) ||
+	    g_output_stream_splice (stream_tmp, stream_fd,
+				    G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+				    G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+				    NULL, error) < 0) {
+		g_unlink (filename);
+		return NULL;
+	}
+	return g_strdup (filename);
+}
+
+/**
+ * fu_main_keyring_changed_cb:
+ **/
+static void
+fu_main_keyring_changed_cb (GFileMonitor *monitor,
+			    GFile *file, GFile *other_file,
+			    GFileMonitorEvent event_type,
+			    gpointer user_data)
+{
+	FuMainKeyring *mk = (FuMainKeyring *) user_data;
+
+	/* reload the keys the next time they are used */
+	if (mk->keyring == NULL)
+		return;
+	g_debug ("%s changed, invalidating keyring", mk->dirname);
+	g_object_unref (mk->keyring);
+	mk->keyring = NULL;
+}
+
+/**
+ * fu_main_keyring_new:
+ **/
+static FuMainKeyring *
+fu_main_keyring_new (const gchar *dirname)
+{
+	FuMainKeyring *mk;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	mk = g_new0 (FuMainKeyring, 1);
+	mk->dirname = g_strdup (dirname);
+	file = g_file_new_for_path (dirname);
+	mk->monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE,
+						NULL, &error);
+	if (mk->monitor == NULL) {
+		g_warning ("failed to monitor %s: %s", dirname, error->message);
+		return mk;
+	}
+	g_signal_connect (mk->monitor, "changed",
+			  G_CALLBACK (fu_main_keyring_changed_cb), mk);
+	return mk;
+}
+
+/**
+ * fu_main_keyring_free:
+ **/
+static void
+fu_main_keyring_free (FuMainKeyring *mk)
+{
+	if (mk->monitor != NULL)
+		g_object_unref (mk->monitor);
+	if (mk->keyring != NULL)
+		g_object_unref (mk->keyring);
+	g_free (mk->dirname);
+	g_free (mk);
+}
+
+/**
+ * fu_main_keyring_get:
+ *
+ * Returns the keyring with all the keys in the directory imported, which
+ * is only done again if the directory contents change.
+ **/
+static FuKeyring *
+fu_main_keyring_get (FuMainKeyring *mk, GError **error)
+{
+	_cleanup_object_unref_ FuKeyring *kr = NULL;
+
+	if (mk->keyring != NULL)
+		return mk->keyring;
+	kr = fu_keyring_new ();
+	fu_keyring_set_use_cache (kr, TRUE);
+	if (!fu_keyring_add_public_keys (kr, mk->dirname, error))
+		return NULL;
+	mk->keyring = g_object_ref (kr);
+	return mk->keyring;
+}
+
+/**
+ * fu_main_set_cab_keyring:
+ **/
+static void
+fu_main_set_cab_keyring (FuMainPrivate *priv, FuCab *cab)
+{
+	FuKeyring *kr;
+	_cleanup_error_free_ GError *error = NULL;
+
+	/* the cab will report the error itself when verifying */
+	kr = fu_main_keyring_get (priv->keyring_firmware, &error);
+	if (kr == NULL) {
+		g_debug ("failed to load firmware keyring: %s", error->message);
+		return;
+	}
+	fu_cab_set_keyring (cab, kr);
+}
+
+/**
+ * fu_main_metadata_revision_get_filename:
+ **/
+static gchar *
+fu_main_metadata_revision_get_filename (void)
+{
+	return g_build_filename (LOCALSTATEDIR, "lib", "fwupd",
+				 "metadata-revision", NULL);
+}
+
+/**
+ * fu_main_metadata_revision_load:
+ **/
+static void
+fu_main_metadata_revision_load (FuMainPrivate *priv)
+{
+	gchar *data = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+
+	filename = fu_main_metadata_revision_get_filename ();
+	if (!g_file_get_contents (filename, &data, NULL, NULL))
+		return;
+	priv->metadata_revision = g_strstrip (data);
+	g_debug ("metadata revision is %s", priv->metadata_revision);
+}
+
+/**
+ * fu_main_metadata_revision_set:
+ **/
+static gboolean
+fu_main_metadata_revision_set (FuMainPrivate *priv,
+			       const gchar *revision,
+			       GError **error)
+{
+	_cleanup_free_ gchar *dirname = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+
+	g_debug ("metadata revision now %s", revision);
+	g_free (priv->metadata_revision);
+	priv->metadata_revision = g_strdup (revision);
+	filename = fu_main_metadata_revision_get_filename ();
+	dirname = g_path_get_dirname (filename);
+	if (g_mkdir_with_parents (dirname, 0755) != 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "Failed to create %s",
+			     dirname);
 		return FALSE;
 	}
+	return g_file_set_contents (filename, revision, -1, error);
+}
 
-	/* read signature */
-	stream_sig = g_unix_input_stream_new (fd_sig, TRUE);
-	bytes_sig = g_input_stream_read_bytes (stream_sig, 0x800, NULL, error);
-	if (bytes_sig == NULL)
+/**
+ * fu_main_daemon_update_metadata_get_removed:
+ *
+ * Returns: the IDs of the components in @store that are not in @store_new
+ **/
+static GPtrArray *
+fu_main_daemon_update_metadata_get_removed (AsStore *store, AsStore *store_new)
+{
+	AsApp *app;
+	GPtrArray *apps;
+	GPtrArray *ids_removed;
+	guint i;
+
+	ids_removed = g_ptr_array_new_with_free_func (g_free);
+	apps = as_store_get_apps (store);
+	for (i = 0; i < apps->len; i++) {
+		app = g_ptr_array_index (apps, i);
+		if (as_store_get_app_by_id (store_new, as_app_get_id (app)) != NULL)
+			continue;
+		g_ptr_array_add (ids_removed, g_strdup (as_app_get_id (app)));
+	}
+	return ids_removed;
+}
+
+/**
+ * fu_main_daemon_update_metadata_apply:
+ *
+ * Applies the added, changed and removed components to the running daemon
+ * and to the AppStream cache. If @ids_removed is %NULL then @store_new is
+ * the full metadata, and anything in the cache that is not in it is removed
+ * so that the cache matches the revision of the file.
+ **/
+static gboolean
+fu_main_daemon_update_metadata_apply (FuMainPrivate *priv,
+				      AsStore *store_new,
+				      GPtrArray *ids_removed,
+				      GError **error)
+{
+	guint cnt;
+	_cleanup_object_unref_ AsStore *store = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *ids_replaced = NULL;
+
+	/* open existing cache if it exists */
+	store = as_store_new ();
+	file = g_file_new_for_path (FU_MAIN_METADATA_CACHE);
+	if (g_file_query_exists (file, NULL)) {
+		if (!as_store_from_file (store, file, NULL, NULL, error))
+			return FALSE;
+	}
+	if (ids_removed == NULL) {
+		ids_replaced = fu_main_daemon_update_metadata_get_removed (store, store_new);
+		ids_removed = ids_replaced;
+	}
+
+	/* save the new cache without any formatting, before the running
+	 * daemon is changed so that both still agree if the write fails */
+	cnt = fu_main_store_merge (store, store_new);
+	cnt += fu_main_store_remove (store, ids_removed);
+	if (cnt > 0) {
+		as_store_set_api_version (store, 0.9);
+		if (!as_store_to_file (store, file,
+				       AS_NODE_TO_XML_FLAG_ADD_HEADER,
+				       NULL, error)) {
+			return FALSE;
+		}
+	}
+
+	/* apply just the changes to the running daemon */
+	cnt = fu_main_store_merge (priv->store, store_new);
+	cnt += fu_main_store_remove (priv->store, ids_removed);
+	g_debug ("%u of %u components changed, %u removed",
+		 cnt, as_store_get_size (store_new), ids_removed->len);
+	if (cnt == 0)
+		return TRUE;
+	fu_main_release_index_rebuild (priv->releases_by_guid, priv->store);
+	fu_main_invalidate (priv);
+	return TRUE;
+}
+
+/**
+ * fu_main_daemon_update_metadata_verify:
+ *
+ * Verifies the raw file without loading it into memory.
+ **/
+static gboolean
+fu_main_daemon_update_metadata_verify (FuMainPrivate *priv,
+				       GFile *file_tmp,
+				       GBytes *bytes_sig,
+				       GError **error)
+{
+	FuKeyring *kr;
+	_cleanup_object_unref_ GInputStream *stream = NULL;
+
+	stream = G_INPUT_STREAM (g_file_read (file_tmp, NULL, error));
+	if (stream == NULL)
+		return FALSE;
+	kr = fu_main_keyring_get (priv->keyring_metadata, error);
+	if (kr == NULL)
 		return FALSE;
+	return fu_keyring_verify_stream (kr, stream, bytes_sig, error);
+}
 
-	/* verify file */
-	kr = fu_keyring_new ();
-	if (!fu_keyring_add_public_keys (kr, "/etc/pki/fwupd-metadata", error))
+/**
+ * fu_main_daemon_update_metadata_from_file:
+ **/
+static gboolean
+fu_main_daemon_update_metadata_from_file (FuMainPrivate *priv,
+					  GFile *file_tmp,
+					  GError **error)
+{
+	gboolean ret;
+	gint64 start;
+	_cleanup_free_ gchar *checksum = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_mapped_file_unref_ GMappedFile *mapped = NULL;
+	_cleanup_object_unref_ AsStore *store_new = NULL;
+
+	/* parse the new contents, decompressing in chunks */
+	store_new = as_store_new ();
+	as_store_add_filter (store_new, AS_ID_KIND_FIRMWARE);
+	if (!as_store_from_file (store_new, file_tmp, NULL, NULL, error))
 		return FALSE;
-	if (!fu_keyring_verify_data (kr, bytes_raw, bytes_sig, error))
+	start = g_get_monotonic_time ();
+	ret = fu_main_daemon_update_metadata_apply (priv, store_new, NULL, error);
+	fu_main_stat_add (priv, "metadata-merge", start, ret);
+	if (!ret)
 		return FALSE;
 
-	/* merge in the new contents */
-	g_debug ("Store was %i size", as_store_get_size (store));
-	if (!as_store_from_xml (store,
-				g_bytes_get_data (bytes, NULL),
-				NULL, error))
+	/* deltas are made against the checksum of the full file */
+	filename = g_file_get_path (file_tmp);
+	mapped = g_mapped_file_new (filename, FALSE, error);
+	if (mapped == NULL)
 		return FALSE;
-	g_debug ("Store now %i size", as_store_get_size (store));
-
-	/* save the new file */
-	as_store_set_api_version (store, 0.9);
-	if (!as_store_to_file (store, file,
-			       AS_NODE_TO_XML_FLAG_ADD_HEADER |
-			       AS_NODE_TO_XML_FLAG_FORMAT_MULTILINE |
-			       AS_NODE_TO_XML_FLAG_FORMAT_INDENT,
-			       NULL, error)) {
+	checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+						(const guchar *) g_mapped_file_get_contents (mapped),
+						g_mapped_file_get_length (mapped));
+	return fu_main_metadata_revision_set (priv, checksum, error);
+}
+
+typedef struct {
+	gboolean		 found;
+	gboolean		 is_delta;
+} FuMainMetadataRoot;
+
+/**
+ * fu_main_daemon_update_metadata_root_cb:
+ **/
+static void
+fu_main_daemon_update_metadata_root_cb (GMarkupParseContext *context,
+					const gchar *element_name,
+					const gchar **attribute_names,
+					const gchar **attribute_values,
+					gpointer user_data,
+					GError **error)
+{
+	FuMainMetadataRoot *root = (FuMainMetadataRoot *) user_data;
+
+	/* nothing after the root node is needed, so stop parsing */
+	root->found = TRUE;
+	root->is_delta = g_strcmp0 (element_name, "delta") == 0;
+	g_set_error_literal (error,
+			     G_MARKUP_ERROR,
+			     G_MARKUP_ERROR_INVALID_CONTENT,
+			     "found root node");
+}
+
+/**
+ * fu_main_daemon_update_metadata_is_delta:
+ *
+ * Checks the name of the root node of the decompressed file, only reading
+ * as much of the file as is needed to find it.
+ **/
+static gboolean
+fu_main_daemon_update_metadata_is_delta (GFile *file_tmp, GError **error)
+{
+	FuMainMetadataRoot root = { FALSE, FALSE };
+	GMarkupParser parser = { fu_main_daemon_update_metadata_root_cb,
+				 NULL, NULL, NULL, NULL };
+	gchar buf[0x1000];
+	gssize len;
+	_cleanup_free_ gchar *basename = NULL;
+	_cleanup_markup_parse_context_unref_ GMarkupParseContext *ctx = NULL;
+	_cleanup_object_unref_ GInputStream *stream = NULL;
+	_cleanup_object_unref_ GInputStream *stream_raw = NULL;
+
+	stream_raw = G_INPUT_STREAM (g_file_read (file_tmp, NULL, error));
+	if (stream_raw == NULL)
 		return FALSE;
+	basename = g_file_get_basename (file_tmp);
+	if (g_str_has_suffix (basename, ".gz")) {
+		_cleanup_object_unref_ GConverter *conv = NULL;
+		conv = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+		stream = g_converter_input_stream_new (stream_raw, conv);
+	} else {
+		stream = g_object_ref (stream_raw);
+	}
+	ctx = g_markup_parse_context_new (&parser, 0, &root, NULL);
+	while (!root.found) {
+		_cleanup_error_free_ GError *error_local = NULL;
+		len = g_input_stream_read (stream, buf, sizeof (buf), NULL, error);
+		if (len < 0)
+			return FALSE;
+		if (len == 0)
+			break;
+		if (!g_markup_parse_context_parse (ctx, buf, len, &error_local) &&
+		    !root.found) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "failed to parse metadata: %s",
+				     error_local->message);
+			return FALSE;
+		}
 	}
+	return root.is_delta;
+}
 
-	/* force the store to reload */
-        if (!as_store_load (priv->store,
-                            AS_STORE_LOAD_FLAG_APP_INFO_SYSTEM,
-                            NULL, error)) {
-                return FALSE;
+/**
+ * fu_main_daemon_update_metadata_components:
+ **/
+static gboolean
+fu_main_daemon_update_metadata_components (AsStore *store, GString *xml, GError **error)
+{
+	gboolean ret;
+	gint fd;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	fd = g_file_open_tmp ("fwupd-delta-XXXXXX.xml", &filename, error);
+	if (fd < 0)
+		return FALSE;
+	close (fd);
+	if (!g_file_set_contents (filename, xml->str, xml->len, error)) {
+		g_unlink (filename);
+		return FALSE;
+	}
+	file = g_file_new_for_path (filename);
+	ret = as_store_from_file (store, file, NULL, NULL, error);
+	g_unlink (filename);
+	return ret;
+}
+
+/**
+ * fu_main_daemon_update_metadata_delta:
+ *
+ * A delta looks like this, and is signed in the same way as the full file:
+ *
+ *   <delta base="sha1-of-full-file" revision="sha1-of-new-full-file">
+ *     <remove>com.hughski.ColorHug.firmware</remove>
+ *     <components version="0.9">...added or changed...</components>
+ *   </delta>
+ **/
+static gboolean
+fu_main_daemon_update_metadata_delta (FuMainPrivate *priv,
+				      GFile *file_tmp,
+				      GError **error)
+{
+	GNode *c;
+	GNode *n;
+	GNode *root;
+	const gchar *base;
+	const gchar *revision;
+	gboolean ret = FALSE;
+	gint64 start;
+	_cleanup_object_unref_ AsStore *store_new = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *ids_removed = NULL;
+	_cleanup_string_free_ GString *xml = NULL;
+
+	root = as_node_from_file (file_tmp, AS_NODE_FROM_XML_FLAG_NONE, NULL, error);
+	if (root == NULL)
+		return FALSE;
+	n = as_node_find (root, "delta");
+	if (n == NULL) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "no delta node");
+		goto out;
+	}
+
+	/* the client has to send the full file instead */
+	base = as_node_get_attribute (n, "base");
+	revision = as_node_get_attribute (n, "revision");
+	if (revision == NULL) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "delta has no revision");
+		goto out;
+	}
+	if (g_strcmp0 (revision, priv->metadata_revision) == 0) {
+		g_debug ("metadata is already at revision %s", revision);
+		ret = TRUE;
+		goto out;
+	}
+	if (priv->metadata_revision == NULL ||
+	    g_strcmp0 (base, priv->metadata_revision) != 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_NOT_SUPPORTED,
+			     "delta is against %s but metadata is %s",
+			     base, priv->metadata_revision);
+		goto out;
+	}
+
+	/* get the removed components */
+	ids_removed = g_ptr_array_new_with_free_func (g_free);
+	for (c = n->children; c != NULL; c = c->next) {
+		if (g_strcmp0 (as_node_get_name (c), "remove") != 0)
+			continue;
+		if (as_node_get_data (c) == NULL)
+			continue;
+		g_ptr_array_add (ids_removed, g_strdup (as_node_get_data (c)));
+	}
+
+	/* parse the added and changed components */
+	store_new = as_store_new ();
+	as_store_add_filter (store_new, AS_ID_KIND_FIRMWARE);
+	c = as_node_find (n, "components");
+	if (c != NULL) {
+		xml = as_node_to_xml (c, AS_NODE_TO_XML_FLAG_ADD_HEADER);
+		if (!fu_main_daemon_update_metadata_components (store_new, xml, error))
+			goto out;
+	}
+	g_debug ("delta %s..%s removes %u components",
+		 base, revision, ids_removed->len);
+	start = g_get_monotonic_time ();
+	ret = fu_main_daemon_update_metadata_apply (priv, store_new, ids_removed, error);
+	fu_main_stat_add (priv, "metadata-merge", start, ret);
+	if (!ret)
+		goto out;
+	ret = fu_main_metadata_revision_set (priv, revision, error);
+out:
+	as_node_unref (root);
+	return ret;
+}
+
+/**
+ * fu_main_daemon_update_metadata:
+ *
+ * Supports optionally GZipped AppStream files of any size, or a delta
+ * against the last metadata that was loaded.
+ **/
+static gboolean
+fu_main_daemon_update_metadata (FuMainPrivate *priv, gint fd, gint fd_sig, GError **error)
+{
+	gboolean ret;
+	_cleanup_bytes_unref_ GBytes *bytes_sig = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ GFile *file_tmp = NULL;
+	_cleanup_object_unref_ GInputStream *stream_sig = NULL;
+
+	/* read signature */
+	stream_sig = g_unix_input_stream_new (fd_sig, TRUE);
+	bytes_sig = g_input_stream_read_bytes (stream_sig, 0x800, NULL, error);
+	if (bytes_sig == NULL) {
+		close (fd);
+		return FALSE;
+	}
+
+	/* copy the data somewhere we can read it twice */
+	filename = fu_main_daemon_update_metadata_spool (fd, error);
+	if (filename == NULL)
+		return FALSE;
+	file_tmp = g_file_new_for_path (filename);
+	ret = fu_main_daemon_update_metadata_verify (priv, file_tmp, bytes_sig, error);
+	if (ret) {
+		_cleanup_error_free_ GError *error_local = NULL;
+		if (fu_main_daemon_update_metadata_is_delta (file_tmp, &error_local)) {
+			ret = fu_main_daemon_update_metadata_delta (priv, file_tmp, error);
+		} else if (error_local != NULL) {
+			g_propagate_error (error, error_local);
+			error_local = NULL;
+			ret = FALSE;
+		} else {
+			ret = fu_main_daemon_update_metadata_from_file (priv, file_tmp, error);
+		}
 	}
-
-	return TRUE;
+	g_unlink (filename);
+	return ret;
 }
 
 /**
- * fu_main_get_updates:
+ * fu_main_daemon_get_updates:
  **/
 static GPtrArray *
-fu_main_get_updates (FuMainPrivate *priv, GError **error)
+fu_main_daemon_get_updates (FuMainPrivate *priv, GError **error)
 {
-	AsApp *app;
-	AsRelease *rel;
+	FuDevice *device;
 	FuDeviceItem *item;
 	GPtrArray *updates;
 	guint i;
-	const gchar *tmp;
+	_cleanup_ptrarray_unref_ GPtrArray *changed = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices_updates = NULL;
 
-	/* find any updates using the AppStream metadata */
-	updates = g_ptr_array_new ();
+	devices = g_ptr_array_new ();
 	for (i = 0; i < priv->devices->len; i++) {
-		const gchar *version;
-		AsChecksum *csum;
-
 		item = g_ptr_array_index (priv->devices, i);
-
-		/* get device version */
-		version = fu_device_get_metadata (item->device, FU_DEVICE_KEY_VERSION);
-		if (version == NULL)
-			continue;
-
-		/* match the GUID in the XML */
-		app = as_store_get_app_by_provide (priv->store,
-						   AS_PROVIDE_KIND_FIRMWARE_FLASHED,
-						   fu_device_get_guid (item->device));
-		if (app == NULL)
-			continue;
-
-		/* get latest release */
-		rel = as_app_get_release_default (app);
-		if (rel == NULL) {
-			g_debug ("%s has no firmware update metadata",
-				 fu_device_get_id (item->device));
-			continue;
-		}
-
-		/* check if actually newer than what we have installed */
-		if (as_utils_vercmp (as_release_get_version (rel), version) <= 0) {
-			g_debug ("%s has no firmware updates",
-				 fu_device_get_id (item->device));
-			continue;
-		}
-
-		/* add application metadata */
-		tmp = as_app_get_developer_name (app, NULL);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_VENDOR, tmp);
-		}
-		tmp = as_app_get_name (app, NULL);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_NAME, tmp);
-		}
-		tmp = as_app_get_comment (app, NULL);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_SUMMARY, tmp);
-		}
-		tmp = as_app_get_description (app, NULL);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_DESCRIPTION, tmp);
-		}
-		tmp = as_app_get_url_item (app, AS_URL_KIND_HOMEPAGE);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_URL_HOMEPAGE, tmp);
-		}
-		tmp = as_app_get_project_license (app);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_LICENSE, tmp);
-		}
-
-		/* add release information */
-		tmp = as_release_get_version (rel);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_UPDATE_VERSION, tmp);
-		}
-		csum = as_release_get_checksum_by_target (rel, AS_CHECKSUM_TARGET_CONTAINER);
-		if (csum != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_UPDATE_HASH,
-						as_checksum_get_value (csum));
-		}
-		tmp = as_release_get_location_default (rel);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_UPDATE_URI, tmp);
-		}
-		tmp = as_release_get_description (rel, NULL);
-		if (tmp != NULL) {
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_UPDATE_DESCRIPTION,
-						tmp);
-		}
-		g_ptr_array_add (updates, item);
+		g_ptr_array_add (devices, item->device);
 	}
+	changed = g_ptr_array_new ();
+	devices_updates = fu_main_get_updates (priv->releases_by_guid, devices, changed);
+	for (i = 0; i < changed->len; i++) {
+		device = g_ptr_array_index (changed, i);
+		fu_main_signal_device_changed (priv, fu_device_get_id (device), NULL);
+	}
+	if (changed->len > 0)
+		fu_main_invalidate (priv);
 
+	/* return the items so the provider is known */
+	updates = g_ptr_array_new ();
+	for (i = 0; i < devices_updates->len; i++) {
+		device = g_ptr_array_index (devices_updates, i);
+		item = fu_main_get_item_by_id (priv, fu_device_get_id (device));
+		if (item != NULL)
+			g_ptr_array_add (updates, item);
+	}
 	return updates;
 }
 
 /**
- * fu_main_daemon_method_call:
+ * fu_main_daemon_method_dispatch:
  **/
 static void
-fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
-			    const gchar *object_path, const gchar *interface_name,
-			    const gchar *method_name, GVariant *parameters,
-			    GDBusMethodInvocation *invocation, gpointer user_data)
+fu_main_daemon_method_dispatch (GDBusConnection *connection, const gchar *sender,
+				const gchar *object_path, const gchar *interface_name,
+				const gchar *method_name, GVariant *parameters,
+				GDBusMethodInvocation *invocation, gpointer user_data)
 {
 	FuMainPrivate *priv = (FuMainPrivate *) user_data;
 	GVariant *val;
 
+	/* return 'a{sa{sv}}' */
+	if (g_strcmp0 (method_name, "GetStatistics") == 0) {
+		g_debug ("Called %s()", method_name);
+		val = fu_main_stats_to_variant (priv);
+		g_dbus_method_invocation_return_value (invocation, val);
+		return;
+	}
+
+	/* return 's' */
+	if (g_strcmp0 (method_name, "GetDebugLog") == 0) {
+		_cleanup_object_unref_ PolkitSubject *subject = NULL;
+		g_debug ("Called %s()", method_name);
+
+		/* the log can contain serial numbers and file paths */
+		if (fu_main_dbus_get_uid (priv, sender) == 0) {
+			fu_main_debug_log_return (invocation);
+			return;
+		}
+		subject = polkit_system_bus_name_new (sender);
+		polkit_authority_check_authorization (priv->authority, subject,
+						      "org.freedesktop.fwupd.get-debug-log",
+						      NULL,
+						      POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
+						      NULL,
+						      fu_main_check_authorization_debug_log_cb,
+						      g_object_ref (invocation));
+		return;
+	}
+
 	/* return 'as' */
 	if (g_strcmp0 (method_name, "GetDevices") == 0) {
 		_cleanup_error_free_ GError *error = NULL;
 		g_debug ("Called %s()", method_name);
-		val = fu_main_device_array_to_variant (priv->devices, &error);
+		if (priv->devices_variant == NULL) {
+			val = fu_main_device_array_to_variant (priv->devices, &error);
+			if (val == NULL) {
+				g_dbus_method_invocation_return_gerror (invocation, error);
+				return;
+			}
+			priv->devices_variant = g_variant_ref_sink (val);
+		}
+		g_dbus_method_invocation_return_value (invocation, priv->devices_variant);
+		fu_main_set_status (priv, FWUPD_STATUS_IDLE);
+		return;
+	}
+
+	/* return 'a(stas)' */
+	if (g_strcmp0 (method_name, "GetDevicesCompact") == 0) {
+		_cleanup_error_free_ GError *error = NULL;
+		_cleanup_free_ const gchar **ids = NULL;
+		_cleanup_free_ const gchar **keys = NULL;
+		g_variant_get (parameters, "(^a&s^a&s)", &keys, &ids);
+		g_debug ("Called %s(%u keys,%u ids)", method_name,
+			 g_strv_length ((gchar **) keys),
+			 g_strv_length ((gchar **) ids));
+		val = fu_main_device_array_to_compact_variant (priv, keys, ids, &error);
 		if (val == NULL) {
 			g_dbus_method_invocation_return_gerror (invocation, error);
 			return;
@@ -835,17 +2819,20 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 		_cleanup_error_free_ GError *error = NULL;
 		_cleanup_ptrarray_unref_ GPtrArray *updates = NULL;
 		g_debug ("Called %s()", method_name);
-		updates = fu_main_get_updates (priv, &error);
-		if (updates == NULL) {
-			g_dbus_method_invocation_return_gerror (invocation, error);
-			return;
-		}
-		val = fu_main_device_array_to_variant (updates, &error);
-		if (val == NULL) {
-			g_dbus_method_invocation_return_gerror (invocation, error);
-			return;
+		if (priv->updates_variant == NULL) {
+			updates = fu_main_daemon_get_updates (priv, &error);
+			if (updates == NULL) {
+				g_dbus_method_invocation_return_gerror (invocation, error);
+				return;
+			}
+			val = fu_main_device_array_to_variant (updates, &error);
+			if (val == NULL) {
+				g_dbus_method_invocation_return_gerror (invocation, error);
+				return;
+			}
+			priv->updates_variant = g_variant_ref_sink (val);
 		}
-		g_dbus_method_invocation_return_value (invocation, val);
+		g_dbus_method_invocation_return_value (invocation, priv->updates_variant);
 		fu_main_set_status (priv, FWUPD_STATUS_IDLE);
 		return;
 	}
@@ -871,6 +2858,9 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 			g_dbus_method_invocation_return_gerror (invocation, error);
 			return;
 		}
+		fu_main_invalidate (priv);
+		fu_main_signal_device_changed (priv, fu_device_get_id (item->device),
+					       fu_main_results_keys);
 
 		/* success */
 		g_dbus_method_invocation_return_value (invocation, NULL);
@@ -898,8 +2888,10 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 			g_dbus_method_invocation_return_gerror (invocation, error);
 			return;
 		}
+		fu_main_invalidate (priv);
 
-		/* success */
+		/* success, and reading the results does not change them so
+		 * there is nothing to signal */
 		val = fu_device_get_metadata_as_variant (item->device);
 		g_dbus_method_invocation_return_value (invocation, val);
 		return;
@@ -943,13 +2935,9 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 
 	/* return 's' */
 	if (g_strcmp0 (method_name, "Verify") == 0) {
-		AsApp *app;
-		AsChecksum *csum;
-		AsRelease *release;
 		FuDeviceItem *item = NULL;
-		const gchar *hash = NULL;
+		FuMainVerifyHelper *helper;
 		const gchar *id = NULL;
-		const gchar *version = NULL;
 		_cleanup_error_free_ GError *error = NULL;
 
 		/* check the id exists */
@@ -964,58 +2952,32 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 							       id);
 			return;
 		}
-
-		/* set the device firmware hash */
-		if (!fu_provider_verify (item->provider, item->device,
-					 FU_PROVIDER_VERIFY_FLAG_NONE, &error)) {
+		if (!fu_main_item_check_ready (priv, item, &error)) {
 			g_dbus_method_invocation_return_gerror (invocation, error);
 			return;
 		}
 
-		/* find component in metadata */
-		app = as_store_get_app_by_id (priv->store, fu_device_get_guid (item->device));
-		if (app == NULL) {
-			g_dbus_method_invocation_return_error (invocation,
-							       FWUPD_ERROR,
-							       FWUPD_ERROR_NOT_SUPPORTED,
-							       "No metadata");
-			return;
-		}
-
-		/* find version in metadata */
-		version = fu_device_get_metadata (item->device, FU_DEVICE_KEY_VERSION);
-		release = as_app_get_release (app, version);
-		if (release == NULL) {
-			g_dbus_method_invocation_return_error (invocation,
-							       FWUPD_ERROR,
-							       FWUPD_ERROR_NOT_SUPPORTED,
-							       "No version %s",
-							       version);
-			return;
-		}
+		/* set the device firmware hash */
+		helper = g_new0 (FuMainVerifyHelper, 1);
+		helper->invocation = g_object_ref (invocation);
+		helper->device = g_object_ref (item->device);
+		helper->cancellable = g_cancellable_new ();
+		helper->watch_id = fu_main_watch_sender (priv, sender, helper->cancellable);
+		helper->priv = priv;
+		helper->start = g_get_monotonic_time ();
+		fu_main_job_add (priv, helper->device);
+		fu_provider_verify_async (item->provider, item->device,
+					  FU_PROVIDER_VERIFY_FLAG_NONE,
+					  helper->cancellable,
+					  fu_main_provider_verify_cb,
+					  helper);
+		return;
+	}
 
-		/* find checksum */
-		csum = as_release_get_checksum_by_target (release, AS_CHECKSUM_TARGET_CONTENT);
-		if (csum == NULL) {
-			g_dbus_method_invocation_return_error (invocation,
-							       FWUPD_ERROR,
-							       FWUPD_ERROR_NOT_SUPPORTED,
-							       "No content checksum for %s",
-							       version);
-			return;
-		}
-		hash = fu_device_get_metadata (item->device, FU_DEVICE_KEY_FIRMWARE_HASH);
-		if (g_strcmp0 (as_checksum_get_value (csum), hash) != 0) {
-			g_dbus_method_invocation_return_error (invocation,
-							       FWUPD_ERROR,
-							       FWUPD_ERROR_NOT_SUPPORTED,
-							       "For v%s expected %s, got %s",
-							       version,
-							       as_checksum_get_value (csum),
-							       hash);
-			return;
-		}
-		g_dbus_method_invocation_return_value (invocation, NULL);
+	/* return 'a{sa{sv}}' */
+	if (g_strcmp0 (method_name, "VerifyAll") == 0) {
+		g_debug ("Called %s()", method_name);
+		fu_main_verify_all (priv, sender, invocation);
 		return;
 	}
 
@@ -1023,13 +2985,11 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 	if (g_strcmp0 (method_name, "Install") == 0) {
 		FuDeviceItem *item = NULL;
 		FuMainAuthHelper *helper;
-		FuProviderFlags flags = FU_PROVIDER_UPDATE_FLAG_NONE;
+		FuProviderFlags flags;
 		GDBusMessage *message;
 		GUnixFDList *fd_list;
-		GVariant *prop_value;
 		const gchar *action_id;
 		const gchar *id = NULL;
-		gchar *prop_key;
 		gint32 fd_handle = 0;
 		gint fd;
 		_cleanup_error_free_ GError *error = NULL;
@@ -1049,23 +3009,14 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 								       id);
 				return;
 			}
+			if (!fu_main_item_check_ready (priv, item, &error)) {
+				g_dbus_method_invocation_return_gerror (invocation, error);
+				return;
+			}
 		}
 
 		/* get options */
-		while (g_variant_iter_next (iter, "{&sv}",
-					    &prop_key, &prop_value)) {
-			g_debug ("got option %s", prop_key);
-			if (g_strcmp0 (prop_key, "offline") == 0 &&
-			    g_variant_get_boolean (prop_value) == TRUE)
-				flags |= FU_PROVIDER_UPDATE_FLAG_OFFLINE;
-			if (g_strcmp0 (prop_key, "allow-older") == 0 &&
-			    g_variant_get_boolean (prop_value) == TRUE)
-				flags |= FU_PROVIDER_UPDATE_FLAG_ALLOW_OLDER;
-			if (g_strcmp0 (prop_key, "allow-reinstall") == 0 &&
-			    g_variant_get_boolean (prop_value) == TRUE)
-				flags |= FU_PROVIDER_UPDATE_FLAG_ALLOW_REINSTALL;
-			g_variant_unref (prop_value);
-		}
+		flags = fu_main_get_install_flags (iter);
 
 		/* get the fd */
 		message = g_dbus_method_invocation_get_message (invocation);
@@ -1091,7 +3042,11 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 		helper->id = g_strdup (id);
 		helper->flags = flags;
 		helper->priv = priv;
+		helper->cancellable = g_cancellable_new ();
+		helper->watch_id = fu_main_watch_sender (priv, sender, helper->cancellable);
 		helper->cab = fu_cab_new ();
+		fu_cab_set_in_memory (helper->cab, TRUE);
+		fu_main_set_cab_keyring (priv, helper->cab);
 		if (item != NULL)
 			helper->device = g_object_ref (item->device);
 		if (!fu_main_update_helper (helper, &error)) {
@@ -1106,11 +3061,9 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 		if (fu_main_dbus_get_uid (priv, sender) == 0) {
 			if (!fu_main_provider_update_authenticated (helper, &error)) {
 				g_dbus_method_invocation_return_gerror (invocation, error);
-			} else {
-				g_dbus_method_invocation_return_value (invocation, NULL);
+				fu_main_set_status (priv, FWUPD_STATUS_IDLE);
+				fu_main_helper_free (helper);
 			}
-			fu_main_set_status (priv, FWUPD_STATUS_IDLE);
-			fu_main_helper_free (helper);
 			return;
 		}
 
@@ -1127,6 +3080,77 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 		return;
 	}
 
+	/* return 'a{ss}' */
+	if (g_strcmp0 (method_name, "InstallBatch") == 0) {
+		FuMainBatchHelper *batch;
+		GDBusMessage *message;
+		GUnixFDList *fd_list;
+		const gchar *action_id;
+		gint32 fd_handle = 0;
+		gint fd;
+		_cleanup_error_free_ GError *error = NULL;
+		_cleanup_object_unref_ PolkitSubject *subject = NULL;
+		_cleanup_variant_iter_free_ GVariantIter *iter = NULL;
+
+		g_variant_get (parameters, "(ha{sv})", &fd_handle, &iter);
+		g_debug ("Called %s(%i)", method_name, fd_handle);
+
+		/* get the fd */
+		message = g_dbus_method_invocation_get_message (invocation);
+		fd_list = g_dbus_message_get_unix_fd_list (message);
+		if (fd_list == NULL || g_unix_fd_list_get_length (fd_list) != 1) {
+			g_dbus_method_invocation_return_error (invocation,
+							       FWUPD_ERROR,
+							       FWUPD_ERROR_INTERNAL,
+							       "invalid handle");
+			return;
+		}
+		fd = g_unix_fd_list_get (fd_list, fd_handle, &error);
+		if (fd < 0) {
+			g_dbus_method_invocation_return_gerror (invocation,
+								error);
+			return;
+		}
+
+		/* parse and verify the firmware once for all the devices */
+		batch = g_new0 (FuMainBatchHelper, 1);
+		batch->invocation = g_object_ref (invocation);
+		batch->cab_fd = fd;
+		batch->flags = fu_main_get_install_flags (iter);
+		batch->priv = priv;
+		batch->jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_main_batch_job_free);
+		batch->cancellable = g_cancellable_new ();
+		batch->watch_id = fu_main_watch_sender (priv, sender, batch->cancellable);
+		batch->cab = fu_cab_new ();
+		fu_cab_set_in_memory (batch->cab, TRUE);
+		fu_main_set_cab_keyring (priv, batch->cab);
+		if (!fu_main_batch_prepare (batch, &error)) {
+			g_dbus_method_invocation_return_gerror (batch->invocation,
+								error);
+			fu_main_set_status (priv, FWUPD_STATUS_IDLE);
+			fu_main_batch_helper_free (batch);
+			return;
+		}
+
+		/* is root */
+		if (fu_main_dbus_get_uid (priv, sender) == 0) {
+			fu_main_batch_install (batch);
+			return;
+		}
+
+		/* authenticate once for all the devices */
+		action_id = fu_main_get_action_id_for_batch (batch);
+		subject = polkit_system_bus_name_new (sender);
+		polkit_authority_check_authorization (priv->authority, subject,
+						      action_id,
+						      NULL,
+						      POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
+						      NULL,
+						      fu_main_check_authorization_batch_cb,
+						      batch);
+		return;
+	}
+
 	/* return 'a{sv}' */
 	if (g_strcmp0 (method_name, "GetDetails") == 0) {
 		GDBusMessage *message;
@@ -1162,6 +3186,7 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 
 		/* load file */
 		cab = fu_cab_new ();
+		fu_cab_set_in_memory (cab, TRUE);
 		if (!fu_cab_load_fd (cab, fd, NULL, &error)) {
 			g_dbus_method_invocation_return_gerror (invocation, error);
 			return;
@@ -1245,6 +3270,29 @@ fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
 					       method_name);
 }
 
+/**
+ * fu_main_daemon_method_call:
+ *
+ * Only the synchronous part of each method is timed; asynchronous
+ * provider work is recorded in its own phase.
+ **/
+static void
+fu_main_daemon_method_call (GDBusConnection *connection, const gchar *sender,
+			    const gchar *object_path, const gchar *interface_name,
+			    const gchar *method_name, GVariant *parameters,
+			    GDBusMethodInvocation *invocation, gpointer user_data)
+{
+	FuMainPrivate *priv = (FuMainPrivate *) user_data;
+	gchar phase[64];
+	gint64 start = g_get_monotonic_time ();
+
+	fu_main_daemon_method_dispatch (connection, sender, object_path,
+					interface_name, method_name, parameters,
+					invocation, user_data);
+	g_snprintf (phase, sizeof (phase), "dbus:%s", method_name);
+	fu_main_stat_add (priv, phase, start, TRUE);
+}
+
 /**
  * fu_main_daemon_get_property:
  **/
@@ -1262,6 +3310,15 @@ fu_main_daemon_get_property (GDBusConnection *connection_, const gchar *sender,
 	if (g_strcmp0 (property_name, "Status") == 0)
 		return g_variant_new_string (fwupd_status_to_string (priv->status));
 
+	if (g_strcmp0 (property_name, "Generation") == 0)
+		return g_variant_new_uint64 (priv->generation);
+
+	if (g_strcmp0 (property_name, "Percentage") == 0)
+		return g_variant_new_uint32 (priv->percentage);
+
+	if (g_strcmp0 (property_name, "BytesWritten") == 0)
+		return g_variant_new_uint64 (priv->bytes_written);
+
 	/* return an error */
 	g_set_error (error,
 		     G_DBUS_ERROR,
@@ -1271,21 +3328,154 @@ fu_main_daemon_get_property (GDBusConnection *connection_, const gchar *sender,
 	return NULL;
 }
 
+typedef struct {
+	FuProvider		*provider;
+	GError			*error;
+	gdouble			 elapsed;	/* ms */
+} FuMainColdplugHelper;
+
+/**
+ * fu_main_provider_coldplug_one:
+ **/
+static void
+fu_main_provider_coldplug_one (FuMainColdplugHelper *helper)
+{
+	_cleanup_timer_destroy_ GTimer *timer = g_timer_new ();
+
+	fu_provider_coldplug (helper->provider, &helper->error);
+	helper->elapsed = g_timer_elapsed (timer, NULL) * 1000.f;
+}
+
+/**
+ * fu_main_providers_coldplug_done:
+ *
+ * Records the coldplug results, and frees @helpers.
+ **/
+static void
+fu_main_providers_coldplug_done (FuMainPrivate *priv,
+				 FuMainColdplugHelper *helpers,
+				 guint len)
+{
+	guint i;
+
+	for (i = 0; i < len; i++) {
+		fu_main_stat_add_elapsed (priv, "coldplug",
+					  (guint64) (helpers[i].elapsed * 1000.f),
+					  helpers[i].error == NULL);
+		if (helpers[i].error != NULL) {
+			g_warning ("Failed to coldplug %s: %s",
+				   fu_provider_get_name (helpers[i].provider),
+				   helpers[i].error->message);
+			g_error_free (helpers[i].error);
+		}
+		g_debug ("Coldplug %s took %.0fms",
+			 fu_provider_get_name (helpers[i].provider),
+			 helpers[i].elapsed);
+		g_object_unref (helpers[i].provider);
+	}
+	g_free (helpers);
+}
+
+/**
+ * fu_main_providers_coldplug_helpers_new:
+ **/
+static FuMainColdplugHelper *
+fu_main_providers_coldplug_helpers_new (FuMainPrivate *priv)
+{
+	FuMainColdplugHelper *helpers;
+	guint i;
+
+	helpers = g_new0 (FuMainColdplugHelper, priv->providers->len);
+	for (i = 0; i < priv->providers->len; i++)
+		helpers[i].provider = g_object_ref (g_ptr_array_index (priv->providers, i));
+	return helpers;
+}
+
 /**
  * fu_main_providers_coldplug:
+ *
+ * Coldplugs each provider in turn in the main context, blocking until they
+ * have all finished. The providers share their USB and udev contexts with the
+ * main thread, so they are not coldplugged concurrently; only the time each
+ * one takes is logged.
  **/
 static void
 fu_main_providers_coldplug (FuMainPrivate *priv)
 {
-	FuProvider *provider;
+	FuMainColdplugHelper *helpers;
 	guint i;
+	guint len = priv->providers->len;
+	_cleanup_timer_destroy_ GTimer *timer = g_timer_new ();
+
+	helpers = fu_main_providers_coldplug_helpers_new (priv);
+	for (i = 0; i < len; i++)
+		fu_main_provider_coldplug_one (&helpers[i]);
+	fu_main_providers_coldplug_done (priv, helpers, len);
+	g_debug ("Coldplug of %u providers took %.0fms",
+		 len, g_timer_elapsed (timer, NULL) * 1000.f);
+
+	/* the snapshot is saved when the device-added signals are flushed */
+	priv->coldplug_done = TRUE;
+}
 
-	for (i = 0; i < priv->providers->len; i++) {
-		_cleanup_error_free_ GError *error = NULL;
-		provider = g_ptr_array_index (priv->providers, i);
-		if (!fu_provider_coldplug (FU_PROVIDER (provider), &error))
-			g_warning ("Failed to coldplug: %s", error->message);
+typedef struct {
+	FuMainPrivate		*priv;
+	FuMainColdplugHelper	*helpers;
+	guint			 len;
+	guint			 idx;		/* of the next provider */
+	gint64			 start;		/* us */
+} FuMainColdplugBatch;
+
+/**
+ * fu_main_providers_coldplug_idle_cb:
+ *
+ * Coldplugs one provider each time the main loop is idle. This is done in
+ * the main context as providers dispatch their hotplug events here, so the
+ * main loop is only blocked by one provider at a time. The device-added
+ * signals are handled before this returns, so once the last provider is
+ * done the restored devices can be revalidated.
+ **/
+static gboolean
+fu_main_providers_coldplug_idle_cb (gpointer user_data)
+{
+	FuMainColdplugBatch *batch = (FuMainColdplugBatch *) user_data;
+
+	fu_main_provider_coldplug_one (&batch->helpers[batch->idx++]);
+	if (batch->idx < batch->len)
+		return G_SOURCE_CONTINUE;
+	fu_main_providers_coldplug_done (batch->priv, batch->helpers, batch->len);
+	g_debug ("Background coldplug of %u providers took %.0fms",
+		 batch->len,
+		 (g_get_monotonic_time () - batch->start) / 1000.f);
+	fu_main_snapshot_revalidate (batch->priv);
+	g_free (batch);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_main_providers_coldplug_async:
+ *
+ * Coldplugs all the providers without blocking the main loop for long,
+ * used when the devices have already been restored from the snapshot.
+ **/
+static void
+fu_main_providers_coldplug_async (FuMainPrivate *priv)
+{
+	FuMainColdplugBatch *batch;
+
+	batch = g_new0 (FuMainColdplugBatch, 1);
+	batch->priv = priv;
+	batch->len = priv->providers->len;
+	batch->helpers = fu_main_providers_coldplug_helpers_new (priv);
+	batch->start = g_get_monotonic_time ();
+	if (batch->len == 0) {
+		fu_main_providers_coldplug_done (priv, batch->helpers, 0);
+		fu_main_snapshot_revalidate (priv);
+		g_free (batch);
+		return;
 	}
+	g_idle_add_full (G_PRIORITY_LOW, fu_main_providers_coldplug_idle_cb,
+			 batch, NULL);
 }
 
 /**
@@ -1315,8 +3505,11 @@ fu_main_on_bus_acquired_cb (GDBusConnection *connection,
 							     NULL); /* GError** */
 	g_assert (registration_id > 0);
 
-	/* add devices */
-	fu_main_providers_coldplug (priv);
+	/* add devices, in the background if we already have some */
+	if (g_hash_table_size (priv->devices_restored) > 0)
+		fu_main_providers_coldplug_async (priv);
+	else
+		fu_main_providers_coldplug (priv);
 
 	/* connect to D-Bus directly */
 	priv->proxy_uid =
@@ -1402,18 +3595,30 @@ cd_main_provider_device_added_cb (FuProvider *provider,
 {
 	FuMainPrivate *priv = (FuMainPrivate *) user_data;
 	FuDeviceItem *item;
+	gboolean was_fake = FALSE;
 
 	/* remove any fake device */
 	item = fu_main_get_item_by_id (priv, fu_device_get_id (device));
-	if (item != NULL)
-		g_ptr_array_remove (priv->devices, item);
+	if (item != NULL) {
+		fu_main_item_remove (priv, item);
+		was_fake = TRUE;
+	}
 
 	/* create new device */
 	item = g_new0 (FuDeviceItem, 1);
 	item->device = g_object_ref (device);
 	item->provider = g_object_ref (provider);
-	g_ptr_array_add (priv->devices, item);
-	fu_main_emit_changed (priv);
+	fu_main_item_add (priv, item);
+	fu_main_invalidate (priv);
+
+	/* clients already know about devices restored from the snapshot, and
+	 * about fake devices that were added for the pending results */
+	if (g_hash_table_remove (priv->devices_restored, fu_device_get_id (device)) ||
+	    was_fake) {
+		fu_main_signal_device_changed (priv, fu_device_get_id (device), NULL);
+		return;
+	}
+	fu_main_signal_device_added (priv, fu_device_get_id (device));
 }
 
 /**
@@ -1432,8 +3637,9 @@ cd_main_provider_device_removed_cb (FuProvider *provider,
 		g_warning ("can't remove device %s", fu_device_get_id (device));
 		return;
 	}
-	g_ptr_array_remove (priv->devices, item);
-	fu_main_emit_changed (priv);
+	fu_main_signal_device_removed (priv, fu_device_get_id (device));
+	fu_main_item_remove (priv, item);
+	fu_main_invalidate (priv);
 }
 
 /**
@@ -1442,12 +3648,61 @@ cd_main_provider_device_removed_cb (FuProvider *provider,
 static void
 cd_main_provider_status_changed_cb (FuProvider *provider,
 				    FwupdStatus status,
+				    FuDevice *device,
 				    gpointer user_data)
 {
 	FuMainPrivate *priv = (FuMainPrivate *) user_data;
+	FuMainJob *job = NULL;
+
+	/* remember which job this was for */
+	if (device != NULL)
+		job = g_hash_table_lookup (priv->jobs, fu_device_get_id (device));
+	if (job != NULL) {
+		job->status = status;
+		job->seq = ++priv->jobs_seq;
+	}
 	fu_main_set_status (priv, status);
 }
 
+/**
+ * cd_main_provider_progress_changed_cb:
+ *
+ * Emits the progress for the device, and shows it in the Percentage and
+ * BytesWritten properties as the most recent progress of any device.
+ **/
+static void
+cd_main_provider_progress_changed_cb (FuProvider *provider,
+				      guint64 done,
+				      guint64 total,
+				      FuDevice *device,
+				      gpointer user_data)
+{
+	FuMainPrivate *priv = (FuMainPrivate *) user_data;
+	FuMainJob *job = NULL;
+	guint percentage = total > 0 ? (guint) (done * 100 / total) : 0;
+
+	if (device != NULL)
+		job = g_hash_table_lookup (priv->jobs, fu_device_get_id (device));
+	if (job != NULL) {
+		job->percentage = percentage;
+		job->bytes_written = done;
+		job->progress_seq = ++priv->jobs_seq;
+	}
+	if (device != NULL && priv->connection != NULL) {
+		g_dbus_connection_emit_signal (priv->connection,
+					       NULL,
+					       FWUPD_DBUS_PATH,
+					       FWUPD_DBUS_INTERFACE,
+					       "DeviceProgress",
+					       g_variant_new ("(sut)",
+							      fu_device_get_id (device),
+							      percentage,
+							      done),
+					       NULL);
+	}
+	fu_main_set_progress (priv, percentage, done);
+}
+
 /**
  * fu_main_add_provider:
  **/
@@ -1463,6 +3718,9 @@ fu_main_add_provider (FuMainPrivate *priv, FuProvider *provider)
 	g_signal_connect (provider, "status-changed",
 			  G_CALLBACK (cd_main_provider_status_changed_cb),
 			  priv);
+	g_signal_connect (provider, "progress-changed",
+			  G_CALLBACK (cd_main_provider_progress_changed_cb),
+			  priv);
 	g_ptr_array_add (priv->providers, provider);
 }
 
@@ -1490,6 +3748,7 @@ main (int argc, char *argv[])
 	};
 	_cleanup_error_free_ GError *error = NULL;
 	_cleanup_free_ gchar *config_file = NULL;
+	_cleanup_free_ gchar *pki_dir = NULL;
 	_cleanup_keyfile_unref_ GKeyFile *config = NULL;
 
 	setlocale (LC_ALL, "");
@@ -1516,9 +3775,26 @@ main (int argc, char *argv[])
 	priv = g_new0 (FuMainPrivate, 1);
 	priv->status = FWUPD_STATUS_IDLE;
 	priv->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_main_item_free);
+	priv->devices_by_id = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, NULL);
+	priv->devices_by_guid = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       g_free, (GDestroyNotify) g_ptr_array_unref);
+	priv->stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->jobs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->signal_added = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	priv->signal_removed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	priv->signal_changed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						      (GDestroyNotify) fu_main_signal_keys_free);
+	priv->devices_restored = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 	priv->loop = g_main_loop_new (NULL, FALSE);
 	priv->pending = fu_pending_new ();
 	priv->store = as_store_new ();
+	priv->releases_by_guid = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, (GDestroyNotify) fu_main_release_free);
+	pki_dir = g_build_filename (SYSCONFDIR, "pki", "fwupd", NULL);
+	priv->keyring_firmware = fu_main_keyring_new (pki_dir);
+	priv->keyring_metadata = fu_main_keyring_new ("/etc/pki/fwupd-metadata");
+	fu_main_metadata_revision_load (priv);
 
 	/* load AppStream */
 	as_store_add_filter (priv->store, AS_ID_KIND_FIRMWARE);
@@ -1529,6 +3805,7 @@ main (int argc, char *argv[])
 			   error->message);
 		return FALSE;
 	}
+	fu_main_release_index_rebuild (priv->releases_by_guid, priv->store);
 
 	/* read config file */
 	config = g_key_file_new ();
@@ -1555,6 +3832,9 @@ main (int argc, char *argv[])
 	fu_main_add_provider (priv, fu_provider_uefi_new ());
 #endif
 
+	/* answer GetDevices straight away if nothing has changed */
+	fu_main_snapshot_restore (priv);
+
 	/* load introspection from file */
 	priv->introspection_daemon = fu_main_load_introspection (FWUPD_DBUS_INTERFACE ".xml",
 								 &error);
@@ -1593,10 +3873,19 @@ main (int argc, char *argv[])
 	g_info ("Daemon ready for requests");
 	g_main_loop_run (priv->loop);
 
+	/* make the next activation fast */
+	if (priv->snapshot_id != 0) {
+		g_source_remove (priv->snapshot_id);
+		priv->snapshot_id = 0;
+	}
+	if (priv->coldplug_done)
+		fu_main_snapshot_write (priv);
+
 	/* success */
 	retval = 0;
 out:
 	g_option_context_free (context);
+	fu_debug_destroy ();
 	if (owner_id > 0)
 		g_bus_unown_name (owner_id);
 	if (priv != NULL) {
@@ -1610,11 +3899,34 @@ out:
 			g_object_unref (priv->authority);
 		if (priv->store != NULL)
 			g_object_unref (priv->store);
+		if (priv->releases_by_guid != NULL)
+			g_hash_table_unref (priv->releases_by_guid);
+		if (priv->devices_variant != NULL)
+			g_variant_unref (priv->devices_variant);
+		if (priv->updates_variant != NULL)
+			g_variant_unref (priv->updates_variant);
 		if (priv->introspection_daemon != NULL)
 			g_dbus_node_info_unref (priv->introspection_daemon);
+		if (priv->keyring_firmware != NULL)
+			fu_main_keyring_free (priv->keyring_firmware);
+		if (priv->keyring_metadata != NULL)
+			fu_main_keyring_free (priv->keyring_metadata);
+		g_free (priv->metadata_revision);
 		g_object_unref (priv->pending);
 		if (priv->providers != NULL)
 			g_ptr_array_unref (priv->providers);
+		if (priv->signal_id != 0)
+			g_source_remove (priv->signal_id);
+		if (priv->snapshot_id != 0)
+			g_source_remove (priv->snapshot_id);
+		g_hash_table_unref (priv->signal_added);
+		g_hash_table_unref (priv->stats);
+		g_hash_table_unref (priv->jobs);
+		g_hash_table_unref (priv->signal_removed);
+		g_hash_table_unref (priv->signal_changed);
+		g_hash_table_unref (priv->devices_restored);
+		g_hash_table_unref (priv->devices_by_guid);
+		g_hash_table_unref (priv->devices_by_id);
 		g_ptr_array_unref (priv->devices);
 		g_free (priv);
 	}
@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <fwupd.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fu-memfd.h"
+
+/* only in newer kernel headers */
+#define FU_MEMFD_MFD_CLOEXEC		0x0001
+#define FU_MEMFD_MFD_ALLOW_SEALING	0x0002
+
+/**
+ * fu_memfd_copy:
+ **/
+static gboolean
+fu_memfd_copy (gint fd_in, gint fd_out, GError **error)
+{
+	guint8 buf[0x8000];
+
+	while (TRUE) {
+		gsize offset = 0;
+		gssize len = read (fd_in, buf, sizeof (buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_READ,
+				     "failed to read: %s",
+				     g_strerror (errno));
+			return FALSE;
+		}
+		if (len == 0)
+			break;
+		while (offset < (gsize) len) {
+			gssize wrote = write (fd_out, buf + offset, len - offset);
+			if (wrote < 0) {
+				if (errno == EINTR)
+					continue;
+				g_set_error (error,
+					     FWUPD_ERROR,
+					     FWUPD_ERROR_WRITE,
+					     "failed to write: %s",
+					     g_strerror (errno));
+				return FALSE;
+			}
+			offset += wrote;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * fu_memfd_new_for_file:
+ *
+ * Copies @filename into a memfd that is sealed against being shrunk or
+ * written, so the daemon can map it rather than copying it again. If the
+ * kernel does not support sealing the fd is still usable, and if it has no
+ * memfd support at all the file itself is opened, as the daemon copies
+ * anything that is not sealed.
+ *
+ * Returns: a file descriptor the caller has to close, or -1 for error
+ **/
+gint
+fu_memfd_new_for_file (const gchar *filename, GError **error)
+{
+	gint fd;
+	gint fd_mem = -1;
+
+	fd = g_open (filename, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INVALID_FILE,
+			     "failed to open %s",
+			     filename);
+		return -1;
+	}
+#ifdef __NR_memfd_create
+	fd_mem = syscall (__NR_memfd_create, "fwupd-cab",
+			  FU_MEMFD_MFD_CLOEXEC | FU_MEMFD_MFD_ALLOW_SEALING);
+#endif
+	if (fd_mem < 0) {
+		g_debug ("no memfd support, sending %s as-is", filename);
+		return fd;
+	}
+
+	/* copy and seal */
+	if (!fu_memfd_copy (fd, fd_mem, error)) {
+		close (fd);
+		close (fd_mem);
+		return -1;
+	}
+	close (fd);
+	if (fcntl (fd_mem, F_ADD_SEALS,
+		   F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		g_debug ("failed to seal memfd: %s", g_strerror (errno));
+	if (lseek (fd_mem, 0, SEEK_SET) < 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_READ,
+			     "failed to rewind memfd: %s",
+			     g_strerror (errno));
+		close (fd_mem);
+		return -1;
+	}
+	return fd_mem;
+}
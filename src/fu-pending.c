@@ -25,7 +25,6 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 #include <sqlite3.h>
-#include <stdlib.h>
 
 #include "fu-cleanup.h"
 #include "fu-pending.h"
@@ -34,6 +33,8 @@ static void fu_pending_finalize			 (GObject *object);
 
 #define FU_PENDING_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), FU_TYPE_PENDING, FuPendingPrivate))
 
+#define FU_PENDING_SCHEMA_VERSION	2
+
 /**
  * FuPendingPrivate:
  *
@@ -42,47 +43,163 @@ static void fu_pending_finalize			 (GObject *object);
 struct _FuPendingPrivate
 {
 	sqlite3				*db;
+	GHashTable			*stmts;		/* SQL:sqlite3_stmt */
+	gchar				*filename;	/* or NULL for the default */
 };
 
 G_DEFINE_TYPE (FuPending, fu_pending, G_TYPE_OBJECT)
 
 /**
- * fu_pending_load:
+ * fu_pending_exec:
+ *
+ * Runs SQL that takes no parameters and returns no results.
  **/
 static gboolean
-fu_pending_load (FuPending *pending, GError **error)
+fu_pending_exec (FuPending *pending, const gchar *statement, GError **error)
 {
 	char *error_msg = NULL;
-	const char *statement;
 	gint rc;
-	_cleanup_free_ gchar *dirname = NULL;
-	_cleanup_free_ gchar *filename = NULL;
-	_cleanup_object_unref_ GFile *file = NULL;
 
-	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
-	g_return_val_if_fail (pending->priv->db == NULL, FALSE);
+	rc = sqlite3_exec (pending->priv->db, statement, NULL, NULL, &error_msg);
+	if (rc != SQLITE_OK) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "SQL error: %s",
+			     error_msg);
+		sqlite3_free (error_msg);
+		return FALSE;
+	}
+	return TRUE;
+}
 
-	/* create directory */
-	dirname = g_build_filename (LOCALSTATEDIR, "lib", "fwupd", NULL);
-	file = g_file_new_for_path (dirname);
-	if (!g_file_query_exists (file, NULL)) {
-		if (!g_file_make_directory_with_parents (file, NULL, error))
-			return FALSE;
+/**
+ * fu_pending_prepare:
+ *
+ * Returns a compiled statement for @statement, which must be a static
+ * string as it is used as the cache key. Each statement is only parsed
+ * once for the lifetime of the database connection.
+ **/
+static sqlite3_stmt *
+fu_pending_prepare (FuPending *pending, const gchar *statement, GError **error)
+{
+	FuPendingPrivate *priv = pending->priv;
+	sqlite3_stmt *stmt;
+	gint rc;
+
+	/* already compiled */
+	stmt = g_hash_table_lookup (priv->stmts, statement);
+	if (stmt != NULL) {
+		sqlite3_reset (stmt);
+		sqlite3_clear_bindings (stmt);
+		return stmt;
 	}
 
-	/* open */
-	filename = g_build_filename (dirname, "pending.db", NULL);
-	g_debug ("FuPending: trying to open database '%s'", filename);
-	rc = sqlite3_open (filename, &pending->priv->db);
+	rc = sqlite3_prepare_v2 (priv->db, statement, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
 		g_set_error (error,
 			     FWUPD_ERROR,
-			     FWUPD_ERROR_READ,
-			     "Can't open %s: %s",
-			     filename, sqlite3_errmsg (pending->priv->db));
-		sqlite3_close (pending->priv->db);
+			     FWUPD_ERROR_INTERNAL,
+			     "Failed to prepare '%s': %s",
+			     statement, sqlite3_errmsg (priv->db));
+		return NULL;
+	}
+	g_hash_table_insert (priv->stmts, (gpointer) statement, stmt);
+	return stmt;
+}
+
+/**
+ * fu_pending_step:
+ *
+ * Runs a statement that returns no results.
+ **/
+static gboolean
+fu_pending_step (FuPending *pending, sqlite3_stmt *stmt, GError **error)
+{
+	gint rc;
+
+	rc = sqlite3_step (stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "SQL error: %s",
+			     sqlite3_errmsg (pending->priv->db));
+		sqlite3_reset (stmt);
 		return FALSE;
 	}
+	sqlite3_reset (stmt);
+	return TRUE;
+}
+
+/**
+ * fu_pending_transaction_begin:
+ **/
+static gboolean
+fu_pending_transaction_begin (FuPending *pending, GError **error)
+{
+	return fu_pending_exec (pending, "BEGIN IMMEDIATE TRANSACTION;", error);
+}
+
+/**
+ * fu_pending_transaction_commit:
+ **/
+static gboolean
+fu_pending_transaction_commit (FuPending *pending, GError **error)
+{
+	return fu_pending_exec (pending, "COMMIT TRANSACTION;", error);
+}
+
+/**
+ * fu_pending_transaction_rollback:
+ **/
+static void
+fu_pending_transaction_rollback (FuPending *pending)
+{
+	_cleanup_error_free_ GError *error = NULL;
+	if (!fu_pending_exec (pending, "ROLLBACK TRANSACTION;", &error))
+		g_warning ("FuPending: failed to roll back: %s", error->message);
+}
+
+/**
+ * fu_pending_get_schema_version:
+ *
+ * Returns the schema version, or 0 for databases created before the
+ * version was recorded.
+ **/
+static guint
+fu_pending_get_schema_version (FuPending *pending)
+{
+	guint version = 0;
+	sqlite3_stmt *stmt = NULL;
+	gint rc;
+
+	rc = sqlite3_prepare_v2 (pending->priv->db,
+				 "SELECT version FROM schema LIMIT 1;",
+				 -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		g_debug ("FuPending: no schema version: %s",
+			 sqlite3_errmsg (pending->priv->db));
+		return 0;
+	}
+	if (sqlite3_step (stmt) == SQLITE_ROW)
+		version = sqlite3_column_int (stmt, 0);
+	sqlite3_finalize (stmt);
+	return version;
+}
+
+/**
+ * fu_pending_create_legacy:
+ *
+ * Creates or repairs the pending table in databases without a schema
+ * version.
+ **/
+static gboolean
+fu_pending_create_legacy (FuPending *pending, GError **error)
+{
+	char *error_msg = NULL;
+	const char *statement;
+	gint rc;
 
 	/* check devices */
 	rc = sqlite3_exec (pending->priv->db, "SELECT * FROM pending LIMIT 1",
@@ -99,16 +216,7 @@ fu_pending_load (FuPending *pending, GError **error)
 			    "provider TEXT,"
 			    "version_old TEXT,"
 			    "version_new TEXT);";
-		rc = sqlite3_exec (pending->priv->db, statement, NULL, NULL, &error_msg);
-		if (rc != SQLITE_OK) {
-			g_set_error (error,
-				     FWUPD_ERROR,
-				     FWUPD_ERROR_WRITE,
-				     "Cannot create database: %s",
-				     error_msg);
-			sqlite3_free (error_msg);
-			return FALSE;
-		}
+		return fu_pending_exec (pending, statement, error);
 	}
 
 	/* check pending has state and provider (since 0.1.1) */
@@ -125,21 +233,168 @@ fu_pending_load (FuPending *pending, GError **error)
 		statement = "ALTER TABLE pending ADD COLUMN provider TEXT;";
 		sqlite3_exec (pending->priv->db, statement, NULL, NULL, NULL);
 	}
+	return TRUE;
+}
+
+/**
+ * fu_pending_migrate:
+ **/
+static gboolean
+fu_pending_migrate (FuPending *pending, guint version, GError **error)
+{
+	sqlite3_stmt *stmt;
+
+	g_debug ("FuPending: migrating schema from v%u to v%u",
+		 version, (guint) FU_PENDING_SCHEMA_VERSION);
+	if (version < 1) {
+		if (!fu_pending_create_legacy (pending, error))
+			return FALSE;
+		if (!fu_pending_exec (pending,
+				      "CREATE TABLE IF NOT EXISTS schema ("
+				      "version INTEGER);",
+				      error))
+			return FALSE;
+	}
+	if (version < 2) {
+		if (!fu_pending_exec (pending,
+				      "CREATE INDEX IF NOT EXISTS idx_pending_state "
+				      "ON pending (state);",
+				      error))
+			return FALSE;
+	}
+
+	/* save new version */
+	if (!fu_pending_exec (pending, "DELETE FROM schema;", error))
+		return FALSE;
+	stmt = fu_pending_prepare (pending,
+				   "INSERT INTO schema (version) VALUES (?1);",
+				   error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_int (stmt, 1, FU_PENDING_SCHEMA_VERSION);
+	return fu_pending_step (pending, stmt, error);
+}
+
+/**
+ * fu_pending_load:
+ **/
+static gboolean
+fu_pending_load (FuPending *pending, GError **error)
+{
+	guint version;
+	gint rc;
+	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_free_ gchar *dirname = NULL;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
+	g_return_val_if_fail (pending->priv->db == NULL, FALSE);
 
+	/* create directory */
+	if (pending->priv->filename != NULL) {
+		filename = g_strdup (pending->priv->filename);
+		dirname = g_path_get_dirname (filename);
+	} else {
+		dirname = g_build_filename (LOCALSTATEDIR, "lib", "fwupd", NULL);
+		filename = g_build_filename (dirname, "pending.db", NULL);
+	}
+	file = g_file_new_for_path (dirname);
+	if (!g_file_query_exists (file, NULL)) {
+		if (!g_file_make_directory_with_parents (file, NULL, error))
+			return FALSE;
+	}
+
+	/* open */
+	g_debug ("FuPending: trying to open database '%s'", filename);
+	rc = sqlite3_open (filename, &pending->priv->db);
+	if (rc != SQLITE_OK) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_READ,
+			     "Can't open %s: %s",
+			     filename, sqlite3_errmsg (pending->priv->db));
+		sqlite3_close (pending->priv->db);
+		pending->priv->db = NULL;
+		return FALSE;
+	}
+
+	/* the daemon and the providers may have the database open at once */
+	sqlite3_busy_timeout (pending->priv->db, 5000);
+
+	/* only fsync the log on commit rather than the whole database */
+	if (!fu_pending_exec (pending, "PRAGMA journal_mode=WAL;", &error_local)) {
+		g_debug ("FuPending: failed to use WAL: %s", error_local->message);
+	} else {
+		fu_pending_exec (pending, "PRAGMA synchronous=NORMAL;", NULL);
+	}
+
+	/* create or upgrade the schema */
+	version = fu_pending_get_schema_version (pending);
+	if (version < FU_PENDING_SCHEMA_VERSION) {
+		if (!fu_pending_transaction_begin (pending, error))
+			return FALSE;
+		if (!fu_pending_migrate (pending, version, error)) {
+			fu_pending_transaction_rollback (pending);
+			return FALSE;
+		}
+		if (!fu_pending_transaction_commit (pending, error))
+			return FALSE;
+	}
 	return TRUE;
 }
 
+/**
+ * fu_pending_bind_text:
+ **/
+static void
+fu_pending_bind_text (sqlite3_stmt *stmt, gint idx, const gchar *value)
+{
+	if (value == NULL) {
+		sqlite3_bind_null (stmt, idx);
+		return;
+	}
+	sqlite3_bind_text (stmt, idx, value, -1, SQLITE_TRANSIENT);
+}
+
+/**
+ * fu_pending_add_device_internal:
+ **/
+static gboolean
+fu_pending_add_device_internal (FuPending *pending, FuDevice *device, GError **error)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = fu_pending_prepare (pending,
+				   "INSERT INTO pending (device_id,"
+						        "state,"
+						        "filename,"
+						        "display_name,"
+						        "provider,"
+						        "version_old,"
+						        "version_new) "
+				   "VALUES (?1,?2,?3,?4,?5,?6,?7);",
+				   error);
+	if (stmt == NULL)
+		return FALSE;
+	fu_pending_bind_text (stmt, 1, fu_device_get_id (device));
+	sqlite3_bind_int (stmt, 2, FU_PENDING_STATE_SCHEDULED);
+	fu_pending_bind_text (stmt, 3, fu_device_get_metadata (device, FU_DEVICE_KEY_FILENAME_CAB));
+	fu_pending_bind_text (stmt, 4, fu_device_get_display_name (device));
+	fu_pending_bind_text (stmt, 5, fu_device_get_metadata (device, FU_DEVICE_KEY_PROVIDER));
+	fu_pending_bind_text (stmt, 6, fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION));
+	fu_pending_bind_text (stmt, 7, fu_device_get_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION));
+
+	/* insert entry */
+	return fu_pending_step (pending, stmt, error);
+}
+
 /**
  * fu_pending_add_device:
  **/
 gboolean
 fu_pending_add_device (FuPending *pending, FuDevice *device, GError **error)
 {
-	char *error_msg = NULL;
-	char *statement;
-	gboolean ret = TRUE;
-	gint rc;
-
 	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
 
 	/* lazy load */
@@ -149,37 +404,7 @@ fu_pending_add_device (FuPending *pending, FuDevice *device, GError **error)
 	}
 
 	g_debug ("FuPending: add device %s", fu_device_get_id (device));
-	statement = sqlite3_mprintf ("INSERT INTO pending (device_id,"
-							  "state,"
-							  "filename,"
-							  "display_name,"
-							  "provider,"
-							  "version_old,"
-							  "version_new) "
-				     "VALUES ('%q','%i','%q','%q','%q','%q','%q')",
-				     fu_device_get_id (device),
-				     FU_PENDING_STATE_SCHEDULED,
-				     fu_device_get_metadata (device, FU_DEVICE_KEY_FILENAME_CAB),
-				     fu_device_get_display_name (device),
-				     fu_device_get_metadata (device, FU_DEVICE_KEY_PROVIDER),
-				     fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION),
-				     fu_device_get_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION));
-
-	/* insert entry */
-	rc = sqlite3_exec (pending->priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "SQL error: %s",
-			     error_msg);
-		sqlite3_free (error_msg);
-		ret = FALSE;
-		goto out;
-	}
-out:
-	sqlite3_free (statement);
-	return ret;
+	return fu_pending_add_device_internal (pending, device, error);
 }
 
 /**
@@ -188,10 +413,7 @@ out:
 gboolean
 fu_pending_remove_device (FuPending *pending, FuDevice *device, GError **error)
 {
-	char *error_msg = NULL;
-	char *statement;
-	gboolean ret = TRUE;
-	gint rc;
+	sqlite3_stmt *stmt;
 
 	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
 
@@ -202,85 +424,100 @@ fu_pending_remove_device (FuPending *pending, FuDevice *device, GError **error)
 	}
 
 	g_debug ("FuPending: remove device %s", fu_device_get_id (device));
-	statement = sqlite3_mprintf ("DELETE FROM pending WHERE "
-				     "device_id = '%q';",
-				     fu_device_get_id (device));
+	stmt = fu_pending_prepare (pending,
+				   "DELETE FROM pending WHERE device_id = ?1;",
+				   error);
+	if (stmt == NULL)
+		return FALSE;
+	fu_pending_bind_text (stmt, 1, fu_device_get_id (device));
 
 	/* remove entry */
-	rc = sqlite3_exec (pending->priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "SQL error: %s",
-			     error_msg);
-		sqlite3_free (error_msg);
-		ret = FALSE;
-		goto out;
-	}
-out:
-	sqlite3_free (statement);
-	return ret;
+	return fu_pending_step (pending, stmt, error);
 }
 
 /**
- * fu_pending_device_sqlite_cb:
+ * fu_pending_device_from_stmt:
  **/
-static gint
-fu_pending_device_sqlite_cb (void *data,
-			gint argc,
-			gchar **argv,
-			gchar **col_name)
+static FuDevice *
+fu_pending_device_from_stmt (sqlite3_stmt *stmt)
 {
-	GPtrArray *array = (GPtrArray *) data;
 	FuDevice *device;
 	gint i;
 
 	/* create new result */
 	device = fu_device_new ();
-	g_ptr_array_add (array, device);
+	for (i = 0; i < sqlite3_column_count (stmt); i++) {
+		const gchar *col_name = sqlite3_column_name (stmt, i);
+		const gchar *value = (const gchar *) sqlite3_column_text (stmt, i);
 
-	g_debug ("FuPending: got sql result %s", argv[0]);
-	for (i = 0; i < argc; i++) {
-		if (g_strcmp0 (col_name[i], "device_id") == 0) {
-			fu_device_set_id (device, argv[i]);
+		if (g_strcmp0 (col_name, "state") == 0) {
+			FuPendingState state = sqlite3_column_int (stmt, i);
+			fu_device_set_metadata (device, FU_DEVICE_KEY_PENDING_STATE,
+						fu_pending_state_to_string (state));
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "filename") == 0) {
-			fu_device_set_metadata (device, FU_DEVICE_KEY_FILENAME_CAB, argv[i]);
+		if (value == NULL)
+			continue;
+		if (g_strcmp0 (col_name, "device_id") == 0) {
+			g_debug ("FuPending: got sql result %s", value);
+			fu_device_set_id (device, value);
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "display_name") == 0) {
-			fu_device_set_display_name (device, argv[i]);
+		if (g_strcmp0 (col_name, "filename") == 0) {
+			fu_device_set_metadata (device, FU_DEVICE_KEY_FILENAME_CAB, value);
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "version_old") == 0) {
-			fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, argv[i]);
+		if (g_strcmp0 (col_name, "display_name") == 0) {
+			fu_device_set_display_name (device, value);
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "version_new") == 0) {
-			fu_device_set_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION, argv[i]);
+		if (g_strcmp0 (col_name, "version_old") == 0) {
+			fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, value);
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "provider") == 0) {
-			fu_device_set_metadata (device, FU_DEVICE_KEY_PROVIDER, argv[i]);
+		if (g_strcmp0 (col_name, "version_new") == 0) {
+			fu_device_set_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION, value);
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "state") == 0) {
-			FuPendingState state = atoi (argv[i]);
-			fu_device_set_metadata (device, FU_DEVICE_KEY_PENDING_STATE,
-						fu_pending_state_to_string (state));
+		if (g_strcmp0 (col_name, "provider") == 0) {
+			fu_device_set_metadata (device, FU_DEVICE_KEY_PROVIDER, value);
 			continue;
 		}
-		if (g_strcmp0 (col_name[i], "error") == 0) {
-			if (argv[i] != NULL)
-				fu_device_set_metadata (device, FU_DEVICE_KEY_PENDING_ERROR, argv[i]);
+		if (g_strcmp0 (col_name, "error") == 0) {
+			fu_device_set_metadata (device, FU_DEVICE_KEY_PENDING_ERROR, value);
 			continue;
 		}
-		g_warning ("unhandled %s=%s", col_name[i], argv[i]);
+		g_warning ("unhandled %s=%s", col_name, value);
 	}
+	return device;
+}
+
+/**
+ * fu_pending_get_devices_for_stmt:
+ **/
+static GPtrArray *
+fu_pending_get_devices_for_stmt (FuPending *pending,
+				 sqlite3_stmt *stmt,
+				 GError **error)
+{
+	GPtrArray *array;
+	gint rc;
 
-	return 0;
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+		g_ptr_array_add (array, fu_pending_device_from_stmt (stmt));
+	if (rc != SQLITE_DONE) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_READ,
+			     "SQL error: %s",
+			     sqlite3_errmsg (pending->priv->db));
+		sqlite3_reset (stmt);
+		g_ptr_array_unref (array);
+		return NULL;
+	}
+	sqlite3_reset (stmt);
+	return array;
 }
 
 /**
@@ -289,10 +526,7 @@ fu_pending_device_sqlite_cb (void *data,
 FuDevice *
 fu_pending_get_device (FuPending *pending, const gchar *device_id, GError **error)
 {
-	FuDevice *device = NULL;
-	char *error_msg = NULL;
-	char *statement;
-	gint rc;
+	sqlite3_stmt *stmt;
 	_cleanup_ptrarray_unref_ GPtrArray *array_tmp = NULL;
 
 	g_return_val_if_fail (FU_IS_PENDING (pending), NULL);
@@ -305,35 +539,23 @@ fu_pending_get_device (FuPending *pending, const gchar *device_id, GError **erro
 
 	/* get all the devices */
 	g_debug ("FuPending: get device");
-	statement = sqlite3_mprintf ("SELECT * FROM pending WHERE "
-				     "device_id = '%q';",
-				     device_id);
-	array_tmp = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	rc = sqlite3_exec (pending->priv->db,
-			   statement,
-			   fu_pending_device_sqlite_cb,
-			   array_tmp,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_READ,
-			     "SQL error: %s",
-			     error_msg);
-		sqlite3_free (error_msg);
-		goto out;
-	}
+	stmt = fu_pending_prepare (pending,
+				   "SELECT * FROM pending WHERE device_id = ?1;",
+				   error);
+	if (stmt == NULL)
+		return NULL;
+	fu_pending_bind_text (stmt, 1, device_id);
+	array_tmp = fu_pending_get_devices_for_stmt (pending, stmt, error);
+	if (array_tmp == NULL)
+		return NULL;
 	if (array_tmp->len == 0) {
 		g_set_error_literal (error,
 				     FWUPD_ERROR,
 				     FWUPD_ERROR_NOT_FOUND,
 				     "No devices found");
-		goto out;
+		return NULL;
 	}
-	device = g_object_ref (g_ptr_array_index (array_tmp, 0));
-out:
-	sqlite3_free (statement);
-	return device;
+	return g_object_ref (g_ptr_array_index (array_tmp, 0));
 }
 
 /**
@@ -342,11 +564,7 @@ out:
 GPtrArray *
 fu_pending_get_devices (FuPending *pending, GError **error)
 {
-	GPtrArray *array = NULL;
-	char *error_msg = NULL;
-	char *statement;
-	gint rc;
-	_cleanup_ptrarray_unref_ GPtrArray *array_tmp = NULL;
+	sqlite3_stmt *stmt;
 
 	g_return_val_if_fail (FU_IS_PENDING (pending), NULL);
 
@@ -358,28 +576,10 @@ fu_pending_get_devices (FuPending *pending, GError **error)
 
 	/* get all the devices */
 	g_debug ("FuPending: get devices");
-	statement = sqlite3_mprintf ("SELECT * FROM pending;");
-	array_tmp = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	rc = sqlite3_exec (pending->priv->db,
-			   statement,
-			   fu_pending_device_sqlite_cb,
-			   array_tmp,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_READ,
-			     "SQL error: %s",
-			     error_msg);
-		sqlite3_free (error_msg);
-		goto out;
-	}
-
-	/* success */
-	array = g_ptr_array_ref (array_tmp);
-out:
-	sqlite3_free (statement);
-	return array;
+	stmt = fu_pending_prepare (pending, "SELECT * FROM pending;", error);
+	if (stmt == NULL)
+		return NULL;
+	return fu_pending_get_devices_for_stmt (pending, stmt, error);
 }
 
 /**
@@ -399,6 +599,27 @@ fu_pending_state_to_string (FuPendingState state)
 	return NULL;
 }
 
+/**
+ * fu_pending_set_state_internal:
+ **/
+static gboolean
+fu_pending_set_state_internal (FuPending *pending,
+			       FuDevice *device,
+			       FuPendingState state,
+			       GError **error)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = fu_pending_prepare (pending,
+				   "UPDATE pending SET state = ?1 WHERE device_id = ?2;",
+				   error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_int (stmt, 1, state);
+	fu_pending_bind_text (stmt, 2, fu_device_get_id (device));
+	return fu_pending_step (pending, stmt, error);
+}
+
 /**
  * fu_pending_set_state:
  **/
@@ -408,11 +629,6 @@ fu_pending_set_state (FuPending *pending,
 		      FuPendingState state,
 		      GError **error)
 {
-	char *error_msg = NULL;
-	char *statement;
-	gboolean ret = TRUE;
-	gint rc;
-
 	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
 
 	/* lazy load */
@@ -424,25 +640,7 @@ fu_pending_set_state (FuPending *pending,
 	g_debug ("FuPending: set state of %s to %s",
 		 fu_device_get_id (device),
 		 fu_pending_state_to_string (state));
-	statement = sqlite3_mprintf ("UPDATE pending SET state='%i' WHERE "
-				     "device_id = '%q';",
-				     state, fu_device_get_id (device));
-
-	/* remove entry */
-	rc = sqlite3_exec (pending->priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "SQL error: %s",
-			     error_msg);
-		sqlite3_free (error_msg);
-		ret = FALSE;
-		goto out;
-	}
-out:
-	sqlite3_free (statement);
-	return ret;
+	return fu_pending_set_state_internal (pending, device, state, error);
 }
 
 /**
@@ -451,13 +649,10 @@ out:
 gboolean
 fu_pending_set_error_msg (FuPending *pending,
 			  FuDevice *device,
-			  const gchar *error_msg2,
+			  const gchar *error_msg,
 			  GError **error)
 {
-	char *error_msg = NULL;
-	char *statement;
-	gboolean ret = TRUE;
-	gint rc;
+	sqlite3_stmt *stmt;
 
 	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
 
@@ -468,27 +663,113 @@ fu_pending_set_error_msg (FuPending *pending,
 	}
 
 	g_debug ("FuPending: add comment to %s: %s",
-		 fu_device_get_id (device), error_msg2);
-	statement = sqlite3_mprintf ("UPDATE pending SET error='%q' WHERE "
-				     "device_id = '%q';",
-				     error_msg2,
-				     fu_device_get_id (device));
+		 fu_device_get_id (device), error_msg);
+	stmt = fu_pending_prepare (pending,
+				   "UPDATE pending SET error = ?1 WHERE device_id = ?2;",
+				   error);
+	if (stmt == NULL)
+		return FALSE;
+	fu_pending_bind_text (stmt, 1, error_msg);
+	fu_pending_bind_text (stmt, 2, fu_device_get_id (device));
+	return fu_pending_step (pending, stmt, error);
+}
 
-	/* remove entry */
-	rc = sqlite3_exec (pending->priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "SQL error: %s",
-			     error_msg);
-		sqlite3_free (error_msg);
-		ret = FALSE;
-		goto out;
+/**
+ * fu_pending_add_devices:
+ *
+ * Adds all the devices in a single transaction; if any of them cannot be
+ * added then none of them are.
+ **/
+gboolean
+fu_pending_add_devices (FuPending *pending, GPtrArray *devices, GError **error)
+{
+	FuDevice *device;
+	guint i;
+
+	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
+
+	/* lazy load */
+	if (pending->priv->db == NULL) {
+		if (!fu_pending_load (pending, error))
+			return FALSE;
+	}
+
+	g_debug ("FuPending: add %u devices", devices->len);
+	if (!fu_pending_transaction_begin (pending, error))
+		return FALSE;
+	for (i = 0; i < devices->len; i++) {
+		device = g_ptr_array_index (devices, i);
+		if (!fu_pending_add_device_internal (pending, device, error)) {
+			fu_pending_transaction_rollback (pending);
+			return FALSE;
+		}
+	}
+	return fu_pending_transaction_commit (pending, error);
+}
+
+/**
+ * fu_pending_set_states:
+ *
+ * Sets the state of all the devices in a single transaction.
+ **/
+gboolean
+fu_pending_set_states (FuPending *pending,
+		       GPtrArray *devices,
+		       FuPendingState state,
+		       GError **error)
+{
+	FuDevice *device;
+	guint i;
+
+	g_return_val_if_fail (FU_IS_PENDING (pending), FALSE);
+
+	/* lazy load */
+	if (pending->priv->db == NULL) {
+		if (!fu_pending_load (pending, error))
+			return FALSE;
+	}
+
+	g_debug ("FuPending: set state of %u devices to %s",
+		 devices->len, fu_pending_state_to_string (state));
+	if (!fu_pending_transaction_begin (pending, error))
+		return FALSE;
+	for (i = 0; i < devices->len; i++) {
+		device = g_ptr_array_index (devices, i);
+		if (!fu_pending_set_state_internal (pending, device, state, error)) {
+			fu_pending_transaction_rollback (pending);
+			return FALSE;
+		}
+	}
+	return fu_pending_transaction_commit (pending, error);
+}
+
+/**
+ * fu_pending_get_devices_by_state:
+ **/
+GPtrArray *
+fu_pending_get_devices_by_state (FuPending *pending,
+				 FuPendingState state,
+				 GError **error)
+{
+	sqlite3_stmt *stmt;
+
+	g_return_val_if_fail (FU_IS_PENDING (pending), NULL);
+
+	/* lazy load */
+	if (pending->priv->db == NULL) {
+		if (!fu_pending_load (pending, error))
+			return NULL;
 	}
-out:
-	sqlite3_free (statement);
-	return ret;
+
+	g_debug ("FuPending: get devices with state %s",
+		 fu_pending_state_to_string (state));
+	stmt = fu_pending_prepare (pending,
+				   "SELECT * FROM pending WHERE state = ?1;",
+				   error);
+	if (stmt == NULL)
+		return NULL;
+	sqlite3_bind_int (stmt, 1, state);
+	return fu_pending_get_devices_for_stmt (pending, stmt, error);
 }
 
 /**
@@ -509,6 +790,8 @@ static void
 fu_pending_init (FuPending *pending)
 {
 	pending->priv = FU_PENDING_GET_PRIVATE (pending);
+	pending->priv->stmts = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      NULL, (GDestroyNotify) sqlite3_finalize);
 }
 
 /**
@@ -520,12 +803,30 @@ fu_pending_finalize (GObject *object)
 	FuPending *pending = FU_PENDING (object);
 	FuPendingPrivate *priv = pending->priv;
 
+	/* statements have to be finalized before the database is closed */
+	g_hash_table_unref (priv->stmts);
 	if (priv->db != NULL)
 		sqlite3_close (priv->db);
+	g_free (priv->filename);
 
 	G_OBJECT_CLASS (fu_pending_parent_class)->finalize (object);
 }
 
+/**
+ * fu_pending_set_filename:
+ *
+ * Uses a database other than the system one, which has to be set before
+ * the database is first used.
+ **/
+void
+fu_pending_set_filename (FuPending *pending, const gchar *filename)
+{
+	g_return_if_fail (FU_IS_PENDING (pending));
+	g_return_if_fail (pending->priv->db == NULL);
+	g_free (pending->priv->filename);
+	pending->priv->filename = g_strdup (filename);
+}
+
 /**
  * fu_pending_new:
  **/
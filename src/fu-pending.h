@@ -63,6 +63,8 @@ typedef enum {
 GType		 fu_pending_get_type			(void);
 FuPending	*fu_pending_new				(void);
 const gchar	*fu_pending_state_to_string		(FuPendingState	 state);
+void		 fu_pending_set_filename		(FuPending	*pending,
+							 const gchar	*filename);
 
 gboolean	 fu_pending_add_device			(FuPending	*pending,
 							 FuDevice	*device,
@@ -83,6 +85,16 @@ FuDevice	*fu_pending_get_device			(FuPending	*pending,
 							 GError		**error);
 GPtrArray	*fu_pending_get_devices			(FuPending	*pending,
 							 GError		**error);
+gboolean	 fu_pending_add_devices			(FuPending	*pending,
+							 GPtrArray	*devices,
+							 GError		**error);
+gboolean	 fu_pending_set_states			(FuPending	*pending,
+							 GPtrArray	*devices,
+							 FuPendingState	 state,
+							 GError		**error);
+GPtrArray	*fu_pending_get_devices_by_state	(FuPending	*pending,
+							 FuPendingState	 state,
+							 GError		**error);
 
 G_END_DECLS
 
@@ -28,6 +28,7 @@
 #include <gio/gunixinputstream.h>
 #include <glib-object.h>
 #include <gusb.h>
+#include <string.h>
 
 #include "fu-cleanup.h"
 #include "fu-device.h"
@@ -39,6 +40,7 @@ static void     fu_provider_chug_finalize	(GObject	*object);
 
 #define FU_PROVIDER_CHUG_POLL_REOPEN		5		/* seconds */
 #define FU_PROVIDER_CHUG_FIRMWARE_MAX		(64 * 1024)	/* bytes */
+#define FU_PROVIDER_CHUG_BLOCK_SIZE		CH_FLASH_ERASE_BLOCK_SIZE
 
 /**
  * FuProviderChugPrivate:
@@ -46,21 +48,24 @@ static void     fu_provider_chug_finalize	(GObject	*object);
 struct _FuProviderChugPrivate
 {
 	GHashTable		*devices;
+	GMutex			 devices_mutex;	/* for devices */
 	GUsbContext		*usb_ctx;
-	ChDeviceQueue		*device_queue;
+	GThread			*thread;	/* that owns usb_ctx */
 };
 
 typedef struct {
 	ChDeviceMode		 mode;
 	FuDevice		*device;
 	FuProviderChug		*provider_chug;
-	GMainLoop		*loop;
-	GUsbDevice		*usb_device;
+	GUsbDevice		*usb_device;	/* replaced under reconnect_mutex */
 	gboolean		 got_version;
 	gboolean		 is_bootloader;
 	guint			 timeout_open_id;
-	guint			 reconnect_id;
 	GBytes			*fw_bin;
+	GMutex			 reconnect_mutex;
+	GCond			 reconnect_cond;
+	gboolean		 reconnected;
+	GTimer			*reconnect_timer;
 } FuProviderChugItem;
 
 G_DEFINE_TYPE (FuProviderChug, fu_provider_chug, FU_TYPE_PROVIDER)
@@ -80,7 +85,9 @@ fu_provider_chug_get_name (FuProvider *provider)
 static void
 fu_provider_chug_device_free (FuProviderChugItem *item)
 {
-	g_main_loop_unref (item->loop);
+	g_mutex_clear (&item->reconnect_mutex);
+	g_cond_clear (&item->reconnect_cond);
+	g_timer_destroy (item->reconnect_timer);
 	g_object_unref (item->device);
 	g_object_unref (item->provider_chug);
 	g_object_unref (item->usb_device);
@@ -88,52 +95,219 @@ fu_provider_chug_device_free (FuProviderChugItem *item)
 		g_bytes_unref (item->fw_bin);
 	if (item->timeout_open_id != 0)
 		g_source_remove (item->timeout_open_id);
-	if (item->reconnect_id != 0)
-		g_source_remove (item->reconnect_id);
 }
 
 /**
- * fu_provider_chug_reconnect_timeout_cb:
+ * fu_provider_chug_get_usb_device:
+ *
+ * The USB device is replaced each time the device re-enumerates, so any
+ * thread that uses it has to hold its own reference.
+ *
+ * Returns: (transfer full): the current USB device
+ **/
+static GUsbDevice *
+fu_provider_chug_get_usb_device (FuProviderChugItem *item)
+{
+	GUsbDevice *usb_device;
+
+	g_mutex_lock (&item->reconnect_mutex);
+	usb_device = g_object_ref (item->usb_device);
+	g_mutex_unlock (&item->reconnect_mutex);
+	return usb_device;
+}
+
+/**
+ * fu_provider_chug_reconnect_prepare:
+ *
+ * Must be called before the device is asked to reset, so that a reconnect
+ * that happens before fu_provider_chug_wait_for_connect() is not missed.
+ **/
+static void
+fu_provider_chug_reconnect_prepare (FuProviderChugItem *item)
+{
+	g_mutex_lock (&item->reconnect_mutex);
+	item->reconnected = FALSE;
+	g_timer_start (item->reconnect_timer);
+	g_mutex_unlock (&item->reconnect_mutex);
+}
+
+/**
+ * fu_provider_chug_reconnect_complete:
+ *
+ * Called from the device-added handler when the device re-enumerates.
+ **/
+static void
+fu_provider_chug_reconnect_complete (FuProviderChugItem *item)
+{
+	g_mutex_lock (&item->reconnect_mutex);
+	item->reconnected = TRUE;
+	g_timer_stop (item->reconnect_timer);
+	g_cond_signal (&item->reconnect_cond);
+	g_mutex_unlock (&item->reconnect_mutex);
+}
+
+/**
+ * fu_provider_chug_wakeup_cb:
  **/
 static gboolean
-fu_provider_chug_reconnect_timeout_cb (gpointer user_data)
+fu_provider_chug_wakeup_cb (gpointer user_data)
 {
-	FuProviderChugItem *item = (FuProviderChugItem *) user_data;
-	item->reconnect_id = 0;
-	g_main_loop_quit (item->loop);
+	guint *wakeup_id = (guint *) user_data;
+	*wakeup_id = 0;
 	return FALSE;
 }
 
 /**
  * fu_provider_chug_wait_for_connect:
+ *
+ * Waits until the device has re-enumerated, returning as soon as the
+ * device-added event arrives rather than after a fixed delay.
  **/
 static gboolean
 fu_provider_chug_wait_for_connect (FuProviderChugItem *item, GError **error)
 {
-	item->reconnect_id = g_timeout_add (CH_DEVICE_USB_TIMEOUT,
-				fu_provider_chug_reconnect_timeout_cb, item);
-	g_main_loop_run (item->loop);
-	if (item->reconnect_id == 0) {
+	FuProviderChugPrivate *priv = item->provider_chug->priv;
+	gboolean reconnected;
+	gdouble elapsed;
+	gint64 end_time;
+	_cleanup_free_ gchar *elapsed_str = NULL;
+
+	if (g_thread_self () == priv->thread) {
+		guint wakeup_id;
+
+		/* the hotplug event has to be dispatched on this thread */
+		wakeup_id = g_timeout_add (CH_DEVICE_USB_TIMEOUT,
+					   fu_provider_chug_wakeup_cb,
+					   &wakeup_id);
+		while (TRUE) {
+			g_mutex_lock (&item->reconnect_mutex);
+			reconnected = item->reconnected;
+			g_mutex_unlock (&item->reconnect_mutex);
+			if (reconnected || wakeup_id == 0)
+				break;
+			g_main_context_iteration (NULL, TRUE);
+		}
+		if (wakeup_id != 0)
+			g_source_remove (wakeup_id);
+	} else {
+		end_time = g_get_monotonic_time () +
+			   CH_DEVICE_USB_TIMEOUT * G_TIME_SPAN_MILLISECOND;
+		g_mutex_lock (&item->reconnect_mutex);
+		while (!item->reconnected) {
+			if (!g_cond_wait_until (&item->reconnect_cond,
+						&item->reconnect_mutex,
+						end_time))
+				break;
+		}
+		reconnected = item->reconnected;
+		g_mutex_unlock (&item->reconnect_mutex);
+	}
+	if (!reconnected) {
 		g_set_error_literal (error,
 				     FWUPD_ERROR,
 				     FWUPD_ERROR_NOT_FOUND,
 				     "request timed out");
 		return FALSE;
 	}
-	g_source_remove (item->reconnect_id);
-	item->reconnect_id = 0;
+
+	/* save how long the device took to come back */
+	elapsed = g_timer_elapsed (item->reconnect_timer, NULL) * 1000;
+	g_debug ("ColorHug: %s reconnected after %.0fms",
+		 fu_device_get_id (item->device), elapsed);
+	elapsed_str = g_strdup_printf ("%.0f", elapsed);
+	fu_provider_set_device_metadata (FU_PROVIDER (item->provider_chug),
+					 item->device,
+					 FU_DEVICE_KEY_RECONNECT_TIME,
+					 elapsed_str);
+	return TRUE;
+}
+
+typedef struct {
+	GMainLoop		*loop;
+	GError			*error;
+	gboolean		 ret;
+} FuProviderChugProcessHelper;
+
+/**
+ * fu_provider_chug_queue_process_cb:
+ **/
+static void
+fu_provider_chug_queue_process_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuProviderChugProcessHelper *helper = (FuProviderChugProcessHelper *) user_data;
+	helper->ret = ch_device_queue_process_finish (CH_DEVICE_QUEUE (source),
+						      res, &helper->error);
+	g_main_loop_quit (helper->loop);
+}
+
+/**
+ * fu_provider_chug_queue_process:
+ *
+ * ch_device_queue_process() runs a loop on the global default context, so
+ * a worker thread would either block until it owns that context or run the
+ * daemon's sources. Workers use a private context for the transfers.
+ **/
+static gboolean
+fu_provider_chug_queue_process (FuProviderChug *provider_chug,
+				ChDeviceQueue *device_queue,
+				GError **error)
+{
+	FuProviderChugProcessHelper helper;
+	GMainContext *context;
+
+	if (g_thread_self () == provider_chug->priv->thread) {
+		return ch_device_queue_process (device_queue,
+						CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
+						NULL, error);
+	}
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+	helper.loop = g_main_loop_new (context, FALSE);
+	helper.error = NULL;
+	helper.ret = FALSE;
+	ch_device_queue_process_async (device_queue,
+				       CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
+				       NULL,
+				       fu_provider_chug_queue_process_cb,
+				       &helper);
+	g_main_loop_run (helper.loop);
+	g_main_loop_unref (helper.loop);
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+	if (!helper.ret) {
+		g_propagate_error (error, helper.error);
+		return FALSE;
+	}
 	return TRUE;
 }
 
+/**
+ * fu_provider_chug_get_item:
+ *
+ * This may be called from any thread.
+ **/
+static FuProviderChugItem *
+fu_provider_chug_get_item (FuProviderChug *provider_chug, FuDevice *device)
+{
+	FuProviderChugPrivate *priv = provider_chug->priv;
+	FuProviderChugItem *item;
+
+	g_mutex_lock (&priv->devices_mutex);
+	item = g_hash_table_lookup (priv->devices, fu_device_get_id (device));
+	g_mutex_unlock (&priv->devices_mutex);
+	return item;
+}
 
 /**
  * fu_provider_chug_open:
  **/
 static gboolean
-fu_provider_chug_open (FuProviderChugItem *item, GError **error)
+fu_provider_chug_open (FuProviderChugItem *item,
+		       GUsbDevice *usb_device,
+		       GError **error)
 {
 	_cleanup_error_free_ GError *error_local = NULL;
-	if (!ch_device_open (item->usb_device, &error_local)) {
+	if (!ch_device_open (usb_device, &error_local)) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_READ,
@@ -157,68 +331,65 @@ fu_provider_chug_get_id (GUsbDevice *device)
 
 /**
  * fu_provider_chug_get_firmware_version:
+ *
+ * Returns: the firmware version, or %NULL if the device could not be opened
  **/
-static void
-fu_provider_chug_get_firmware_version (FuProviderChugItem *item)
+static gchar *
+fu_provider_chug_get_firmware_version (FuProviderChug *provider_chug,
+				       GUsbDevice *usb_device)
 {
-	FuProviderChugPrivate *priv = item->provider_chug->priv;
 	guint16 major;
 	guint16 micro;
 	guint16 minor;
 #if G_USB_CHECK_VERSION(0,2,5)
 	guint8 idx;
 #endif
+	gchar *version = NULL;
 	_cleanup_error_free_ GError *error = NULL;
-	_cleanup_free_ gchar *version = NULL;
+	_cleanup_object_unref_ ChDeviceQueue *device_queue = NULL;
 
 	/* try to get the version without claiming interface */
 #if G_USB_CHECK_VERSION(0,2,5)
-	if (!g_usb_device_open (item->usb_device, &error)) {
+	if (!g_usb_device_open (usb_device, &error)) {
 		g_debug ("Failed to open, polling: %s", error->message);
-		return;
+		return NULL;
 	}
-	idx = g_usb_device_get_custom_index (item->usb_device,
+	idx = g_usb_device_get_custom_index (usb_device,
 					     G_USB_DEVICE_CLASS_VENDOR_SPECIFIC,
 					     'F', 'W', NULL);
 	if (idx != 0x00) {
-		_cleanup_free_ gchar *tmp = NULL;
-		tmp = g_usb_device_get_string_descriptor (item->usb_device,
-							  idx, NULL);
-		if (tmp != NULL) {
-			item->got_version = TRUE;
-			g_debug ("obtained fwver using extension '%s'", tmp);
-			fu_device_set_metadata (item->device,
-						FU_DEVICE_KEY_VERSION, tmp);
+		version = g_usb_device_get_string_descriptor (usb_device,
+							      idx, NULL);
+		if (version != NULL) {
+			g_debug ("obtained fwver using extension '%s'", version);
 			goto out;
 		}
 	}
-	g_usb_device_close (item->usb_device, NULL);
+	g_usb_device_close (usb_device, NULL);
 #endif
 
 	/* attempt to open the device and get the serial number */
-	if (!ch_device_open (item->usb_device, &error)) {
+	if (!ch_device_open (usb_device, &error)) {
 		g_debug ("Failed to claim interface, polling: %s", error->message);
-		return;
+		return NULL;
 	}
-	ch_device_queue_get_firmware_ver (priv->device_queue, item->usb_device,
+	device_queue = ch_device_queue_new ();
+	ch_device_queue_get_firmware_ver (device_queue, usb_device,
 					  &major, &minor, &micro);
-	if (!ch_device_queue_process (priv->device_queue,
-				      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-				      NULL, &error)) {
+	if (!fu_provider_chug_queue_process (provider_chug, device_queue, &error)) {
 		g_warning ("Failed to get serial: %s", error->message);
 		goto out;
 	}
 
 	/* got things the old fashioned way */
-	item->got_version = TRUE;
 	version = g_strdup_printf ("%i.%i.%i", major, minor, micro);
 	g_debug ("obtained fwver using API '%s'", version);
-	fu_device_set_metadata (item->device, FU_DEVICE_KEY_VERSION, version);
 
 out:
 	/* we're done here */
-	if (!g_usb_device_close (item->usb_device, &error))
+	if (!g_usb_device_close (usb_device, &error))
 		g_debug ("Failed to close: %s", error->message);
+	return version;
 }
 
 /**
@@ -231,15 +402,16 @@ fu_provider_chug_verify (FuProvider *provider,
 			 GError **error)
 {
 	FuProviderChug *provider_chug = FU_PROVIDER_CHUG (provider);
-	FuProviderChugPrivate *priv = provider_chug->priv;
 	FuProviderChugItem *item;
 	gsize len;
 	_cleanup_error_free_ GError *error_local = NULL;
 	_cleanup_free_ gchar *hash = NULL;
 	_cleanup_free_ guint8 *data = NULL;
+	_cleanup_object_unref_ ChDeviceQueue *device_queue = NULL;
+	_cleanup_object_unref_ GUsbDevice *usb_device = NULL;
 
 	/* find item */
-	item = g_hash_table_lookup (priv->devices, fu_device_get_id (device));
+	item = fu_provider_chug_get_item (provider_chug, device);
 	if (item == NULL) {
 		g_set_error (error,
 			     FWUPD_ERROR,
@@ -248,6 +420,7 @@ fu_provider_chug_verify (FuProvider *provider,
 			     fu_device_get_id (device));
 		return FALSE;
 	}
+	usb_device = fu_provider_chug_get_usb_device (item);
 
 #if !CD_CHECK_VERSION(1,2,12)
 	/* recompile colord */
@@ -259,39 +432,234 @@ fu_provider_chug_verify (FuProvider *provider,
 #endif
 
 	/* open */
-	if (!fu_provider_chug_open (item, error))
+	if (!fu_provider_chug_open (item, usb_device, error))
 		return FALSE;
 
 	/* get the firmware from the device */
 	g_debug ("ColorHug: Verifying firmware");
+	device_queue = ch_device_queue_new ();
 #if CD_CHECK_VERSION(1,2,12)
-	ch_device_queue_read_firmware (priv->device_queue, item->usb_device,
+	ch_device_queue_read_firmware (device_queue, usb_device,
 				       &data, &len);
 #endif
 	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_VERIFY);
-	if (!ch_device_queue_process (priv->device_queue,
-				      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-				      NULL, &error_local)) {
+	if (!fu_provider_chug_queue_process (provider_chug,
+					     device_queue,
+					     &error_local)) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_WRITE,
 			     "failed to dump firmware: %s",
 			     error_local->message);
-		g_usb_device_close (item->usb_device, NULL);
+		g_usb_device_close (usb_device, NULL);
 		return FALSE;
 	}
 
 	/* get the SHA1 hash */
 	hash = g_compute_checksum_for_data (G_CHECKSUM_SHA1, (guchar *) data, len);
-	fu_device_set_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH, hash);
+	fu_provider_set_device_metadata (provider, device,
+					 FU_DEVICE_KEY_FIRMWARE_HASH, hash);
 
 	/* we're done here */
-	if (!g_usb_device_close (item->usb_device, &error_local))
+	if (!g_usb_device_close (usb_device, &error_local))
 		g_debug ("Failed to close: %s", error_local->message);
 
 	return TRUE;
 }
 
+/**
+ * fu_provider_chug_queue_read_block:
+ **/
+static void
+fu_provider_chug_queue_read_block (ChDeviceQueue *device_queue,
+				   GUsbDevice *usb_device,
+				   guint16 address,
+				   guint8 *data,
+				   gsize len)
+{
+	gsize i;
+	for (i = 0; i < len; i += CH_FLASH_TRANSFER_BLOCK_SIZE) {
+		ch_device_queue_read_flash (device_queue, usb_device,
+					    address + i, data + i,
+					    MIN (CH_FLASH_TRANSFER_BLOCK_SIZE, len - i));
+	}
+}
+
+/**
+ * fu_provider_chug_queue_write_block:
+ **/
+static void
+fu_provider_chug_queue_write_block (ChDeviceQueue *device_queue,
+				    GUsbDevice *usb_device,
+				    guint16 address,
+				    const guint8 *data,
+				    gsize len)
+{
+	gsize i;
+
+	ch_device_queue_erase_flash (device_queue, usb_device, address, len);
+	for (i = 0; i < len; i += CH_FLASH_TRANSFER_BLOCK_SIZE) {
+		ch_device_queue_write_flash (device_queue, usb_device,
+					     address + i, (guint8 *) data + i,
+					     MIN (CH_FLASH_TRANSFER_BLOCK_SIZE, len - i));
+	}
+	for (i = 0; i < len; i += CH_FLASH_TRANSFER_BLOCK_SIZE) {
+		ch_device_queue_verify_flash (device_queue, usb_device,
+					      address + i, (guint8 *) data + i,
+					      MIN (CH_FLASH_TRANSFER_BLOCK_SIZE, len - i));
+	}
+}
+
+/**
+ * fu_provider_chug_write_pipelined:
+ *
+ * Writes and verifies the firmware one erase block at a time, skipping
+ * any block that already matches. The queue for each block also reads the
+ * current contents of the next block, so every block costs one round trip
+ * to the device rather than a full write pass followed by a full verify.
+ *
+ * Returns %FWUPD_ERROR_NOT_SUPPORTED if the flash could not be read.
+ **/
+static gboolean
+fu_provider_chug_write_pipelined (FuProvider *provider,
+				  FuProviderChugItem *item,
+				  GUsbDevice *usb_device,
+				  ChDeviceQueue *device_queue,
+				  GError **error)
+{
+	const guint8 *data;
+	gsize bytes_done = 0;
+	gsize len;
+	guint16 runcode_addr;
+	guint i;
+	guint n_blocks;
+	guint n_skipped = 0;
+	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_free_ guint8 *current = NULL;
+
+	data = g_bytes_get_data (item->fw_bin, &len);
+	runcode_addr = ch_device_get_runcode_address (usb_device);
+	n_blocks = (len + FU_PROVIDER_CHUG_BLOCK_SIZE - 1) / FU_PROVIDER_CHUG_BLOCK_SIZE;
+	current = g_new0 (guint8, FU_PROVIDER_CHUG_BLOCK_SIZE);
+	fu_provider_set_progress (provider, 0, len);
+
+	/* read what is in the first block */
+	fu_provider_chug_queue_read_block (device_queue, usb_device,
+					   runcode_addr, current,
+					   MIN (FU_PROVIDER_CHUG_BLOCK_SIZE, len));
+	if (!fu_provider_chug_queue_process (FU_PROVIDER_CHUG (provider),
+					     device_queue,
+					     &error_local)) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_NOT_SUPPORTED,
+			     "failed to read flash: %s",
+			     error_local->message);
+		return FALSE;
+	}
+
+	for (i = 0; i < n_blocks; i++) {
+		gboolean queued = FALSE;
+		gsize offset = i * FU_PROVIDER_CHUG_BLOCK_SIZE;
+		gsize block_len = MIN (FU_PROVIDER_CHUG_BLOCK_SIZE, len - offset);
+
+		/* only write blocks that are different */
+		if (memcmp (current, data + offset, block_len) != 0) {
+			fu_provider_chug_queue_write_block (device_queue,
+							    usb_device,
+							    runcode_addr + offset,
+							    data + offset,
+							    block_len);
+			queued = TRUE;
+		} else {
+			n_skipped++;
+		}
+
+		/* read the next block in the same transaction */
+		if (i + 1 < n_blocks) {
+			gsize offset_next = offset + FU_PROVIDER_CHUG_BLOCK_SIZE;
+			fu_provider_chug_queue_read_block (device_queue,
+							   usb_device,
+							   runcode_addr + offset_next,
+							   current,
+							   MIN (FU_PROVIDER_CHUG_BLOCK_SIZE,
+								len - offset_next));
+			queued = TRUE;
+		}
+		if (queued &&
+		    !fu_provider_chug_queue_process (FU_PROVIDER_CHUG (provider),
+						     device_queue,
+						     &error_local)) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_WRITE,
+				     "failed to write block @0x%04x: %s",
+				     (guint) (runcode_addr + offset),
+				     error_local->message);
+			return FALSE;
+		}
+		bytes_done += block_len;
+		fu_provider_set_progress (provider, bytes_done, len);
+	}
+	g_debug ("ColorHug: skipped %u/%u blocks that already matched",
+		 n_skipped, n_blocks);
+	return TRUE;
+}
+
+/**
+ * fu_provider_chug_write_image:
+ *
+ * Writes the whole image and then reads it all back to verify it.
+ **/
+static gboolean
+fu_provider_chug_write_image (FuProvider *provider,
+			      FuProviderChugItem *item,
+			      GUsbDevice *usb_device,
+			      ChDeviceQueue *device_queue,
+			      GError **error)
+{
+	gsize len = g_bytes_get_size (item->fw_bin);
+	_cleanup_error_free_ GError *error_local = NULL;
+
+	/* write firmware, which is one transaction so only the start and
+	 * end can be reported */
+	fu_provider_set_progress (provider, 0, len);
+	ch_device_queue_write_firmware (device_queue, usb_device,
+					g_bytes_get_data (item->fw_bin, NULL),
+					len);
+	if (!fu_provider_chug_queue_process (FU_PROVIDER_CHUG (provider),
+					     device_queue,
+					     &error_local)) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "failed to write firmware: %s",
+			     error_local->message);
+		g_usb_device_close (usb_device, NULL);
+		return FALSE;
+	}
+	fu_provider_set_progress (provider, len, len);
+
+	/* verify firmware */
+	g_debug ("ColorHug: Verifying firmware");
+	ch_device_queue_verify_firmware (device_queue, usb_device,
+					 g_bytes_get_data (item->fw_bin, NULL),
+					 g_bytes_get_size (item->fw_bin));
+	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_VERIFY);
+	if (!fu_provider_chug_queue_process (FU_PROVIDER_CHUG (provider),
+					     device_queue,
+					     &error_local)) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "failed to verify firmware: %s",
+			     error_local->message);
+		g_usb_device_close (usb_device, NULL);
+		return FALSE;
+	}
+	return TRUE;
+}
+
 /**
  * fu_provider_chug_update:
  **/
@@ -303,14 +671,16 @@ fu_provider_chug_update (FuProvider *provider,
 			 GError **error)
 {
 	FuProviderChug *provider_chug = FU_PROVIDER_CHUG (provider);
-	FuProviderChugPrivate *priv = provider_chug->priv;
 	FuProviderChugItem *item;
+	_cleanup_object_unref_ ChDeviceQueue *device_queue = NULL;
 	_cleanup_object_unref_ GInputStream *stream = NULL;
+	_cleanup_object_unref_ GUsbDevice *usb_device = NULL;
 	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_error_free_ GError *error_pipelined = NULL;
+	_cleanup_free_ gchar *version = NULL;
 
 	/* find item */
-	item = g_hash_table_lookup (provider_chug->priv->devices,
-				    fu_device_get_id (device));
+	item = fu_provider_chug_get_item (provider_chug, device);
 	if (item == NULL) {
 		g_set_error (error,
 			     FWUPD_ERROR,
@@ -319,9 +689,12 @@ fu_provider_chug_update (FuProvider *provider,
 			     fu_device_get_id (device));
 		return FALSE;
 	}
+	usb_device = fu_provider_chug_get_usb_device (item);
 
 	/* this file is so small, just slurp it all in one go */
 	stream = g_unix_input_stream_new (fd, TRUE);
+	if (item->fw_bin != NULL)
+		g_bytes_unref (item->fw_bin);
 	item->fw_bin = g_input_stream_read_bytes (stream,
 						  FU_PROVIDER_CHUG_FIRMWARE_MAX,
 						  NULL, error);
@@ -329,7 +702,7 @@ fu_provider_chug_update (FuProvider *provider,
 		return FALSE;
 
 	/* check this firmware is actually for this device */
-	if (!ch_device_check_firmware (item->usb_device,
+	if (!ch_device_check_firmware (usb_device,
 				       g_bytes_get_data (item->fw_bin, NULL),
 				       g_bytes_get_size (item->fw_bin),
 				       &error_local)) {
@@ -341,121 +714,122 @@ fu_provider_chug_update (FuProvider *provider,
 		return FALSE;
 	}
 
+	/* each update uses its own queue */
+	device_queue = ch_device_queue_new ();
+
+	/* the device has not been touched yet */
+	if (!fu_provider_check_cancelled (provider, error))
+		return FALSE;
+
 	/* switch to bootloader mode */
 	if (!item->is_bootloader) {
 		g_debug ("ColorHug: Switching to bootloader mode");
-		if (!fu_provider_chug_open (item, error))
+		if (!fu_provider_chug_open (item, usb_device, error))
 			return FALSE;
-		ch_device_queue_reset (priv->device_queue, item->usb_device);
+		fu_provider_chug_reconnect_prepare (item);
+		ch_device_queue_reset (device_queue, usb_device);
 		fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_RESTART);
-		if (!ch_device_queue_process (priv->device_queue,
-					      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-					      NULL, &error_local)) {
+		if (!fu_provider_chug_queue_process (provider_chug,
+						     device_queue,
+						     &error_local)) {
 			g_set_error (error,
 				     FWUPD_ERROR,
 				     FWUPD_ERROR_WRITE,
 				     "failed to reset device: %s",
 				     error_local->message);
-			g_usb_device_close (item->usb_device, NULL);
+			g_usb_device_close (usb_device, NULL);
 			return FALSE;
 		}
 
 		/* this device has just gone away, no error possible */
-		g_usb_device_close (item->usb_device, NULL);
+		g_usb_device_close (usb_device, NULL);
 
 		/* wait for reconnection */
 		if (!fu_provider_chug_wait_for_connect (item, error))
 			return FALSE;
+		g_object_unref (usb_device);
+		usb_device = fu_provider_chug_get_usb_device (item);
 	}
 
+	/* the bootloader can be left running if the client has gone away */
+	if (!fu_provider_check_cancelled (provider, error))
+		return FALSE;
+
 	/* open the device, which is now in bootloader mode */
-	if (!fu_provider_chug_open (item, error))
+	if (!fu_provider_chug_open (item, usb_device, error))
 		return FALSE;
 
-	/* write firmware */
+	/* write and verify firmware block by block */
 	g_debug ("ColorHug: Writing firmware");
-	ch_device_queue_write_firmware (priv->device_queue, item->usb_device,
-					g_bytes_get_data (item->fw_bin, NULL),
-					g_bytes_get_size (item->fw_bin));
 	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_WRITE);
-	if (!ch_device_queue_process (priv->device_queue,
-				      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-				      NULL, &error_local)) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "failed to write firmware: %s",
-			     error_local->message);
-		g_usb_device_close (item->usb_device, NULL);
-		return FALSE;
-	}
-
-	/* verify firmware */
-	g_debug ("ColorHug: Veifying firmware");
-	ch_device_queue_verify_firmware (priv->device_queue, item->usb_device,
-					 g_bytes_get_data (item->fw_bin, NULL),
-					 g_bytes_get_size (item->fw_bin));
-	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_VERIFY);
-	if (!ch_device_queue_process (priv->device_queue,
-				      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-				      NULL, &error_local)) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_WRITE,
-			     "failed to verify firmware: %s",
-			     error_local->message);
-		g_usb_device_close (item->usb_device, NULL);
-		return FALSE;
+	if (!fu_provider_chug_write_pipelined (provider, item, usb_device,
+					       device_queue, &error_pipelined)) {
+		if (!g_error_matches (error_pipelined,
+				      FWUPD_ERROR,
+				      FWUPD_ERROR_NOT_SUPPORTED)) {
+			g_propagate_error (error, error_pipelined);
+			error_pipelined = NULL;
+			g_usb_device_close (usb_device, NULL);
+			return FALSE;
+		}
+		g_debug ("ColorHug: %s, writing whole image",
+			 error_pipelined->message);
+		if (!fu_provider_chug_write_image (provider, item, usb_device,
+						   device_queue, error))
+			return FALSE;
 	}
 
 	/* boot into the new firmware */
 	g_debug ("ColorHug: Booting new firmware");
-	ch_device_queue_boot_flash (priv->device_queue, item->usb_device);
+	fu_provider_chug_reconnect_prepare (item);
+	ch_device_queue_boot_flash (device_queue, usb_device);
 	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_RESTART);
-	if (!ch_device_queue_process (priv->device_queue,
-				      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-				      NULL, &error_local)) {
+	if (!fu_provider_chug_queue_process (provider_chug,
+					     device_queue,
+					     &error_local)) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_WRITE,
 			     "failed to boot flash: %s",
 			     error_local->message);
-		g_usb_device_close (item->usb_device, NULL);
+		g_usb_device_close (usb_device, NULL);
 		return FALSE;
 	}
 
 	/* this device has just gone away, no error possible */
-	g_usb_device_close (item->usb_device, NULL);
+	g_usb_device_close (usb_device, NULL);
 
 	/* wait for firmware mode */
 	if (!fu_provider_chug_wait_for_connect (item, error))
 		return FALSE;
-	if (!fu_provider_chug_open (item, error))
+	g_object_unref (usb_device);
+	usb_device = fu_provider_chug_get_usb_device (item);
+	if (!fu_provider_chug_open (item, usb_device, error))
 		return FALSE;
 
 	/* set flash success */
 	g_debug ("ColorHug: Setting flash success");
-	ch_device_queue_set_flash_success (priv->device_queue, item->usb_device, 1);
-	if (!ch_device_queue_process (priv->device_queue,
-				      CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
-				      NULL, &error_local)) {
+	ch_device_queue_set_flash_success (device_queue, usb_device, 1);
+	if (!fu_provider_chug_queue_process (provider_chug,
+					     device_queue,
+					     &error_local)) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_WRITE,
 			     "failed to set flash success: %s",
 			     error_local->message);
-		g_usb_device_close (item->usb_device, NULL);
+		g_usb_device_close (usb_device, NULL);
 		return FALSE;
 	}
 
 	/* close, orderly */
-	if (!g_usb_device_close (item->usb_device, &error_local)) {
+	if (!g_usb_device_close (usb_device, &error_local)) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_WRITE,
 			     "failed to close device: %s",
 			     error_local->message);
-		g_usb_device_close (item->usb_device, NULL);
+		g_usb_device_close (usb_device, NULL);
 		return FALSE;
 	}
 
@@ -465,11 +839,12 @@ fu_provider_chug_update (FuProvider *provider,
 
 	/* get the new firmware version */
 	g_debug ("ColorHug: Getting new firmware version");
-	item->got_version = FALSE;
-	fu_provider_chug_get_firmware_version (item);
-
-	if (item->got_version)
+	version = fu_provider_chug_get_firmware_version (provider_chug, usb_device);
+	if (version != NULL) {
+		fu_provider_set_device_metadata (provider, device,
+						 FU_DEVICE_KEY_VERSION, version);
 		g_debug ("ColorHug: DONE!");
+	}
 
 	return TRUE;
 }
@@ -481,13 +856,17 @@ static gboolean
 fu_provider_chug_open_cb (gpointer user_data)
 {
 	FuProviderChugItem *item = (FuProviderChugItem *) user_data;
+	_cleanup_free_ gchar *version = NULL;
 
 	g_debug ("attempt to open %s",
 		 g_usb_device_get_platform_id (item->usb_device));
-	fu_provider_chug_get_firmware_version (item);
+	version = fu_provider_chug_get_firmware_version (item->provider_chug,
+							 item->usb_device);
 
 	/* success! */
-	if (item->got_version) {
+	if (version != NULL) {
+		fu_device_set_metadata (item->device, FU_DEVICE_KEY_VERSION, version);
+		item->got_version = TRUE;
 		item->timeout_open_id = 0;
 		return FALSE;
 	}
@@ -524,54 +903,16 @@ ch_device_get_guid (GUsbDevice *device)
 #endif
 
 /**
- * fu_provider_chug_device_added_cb:
+ * fu_provider_chug_item_publish:
+ *
+ * Adds the device to the daemon, which is also done each time the device
+ * re-enumerates as it may have changed mode.
  **/
 static void
-fu_provider_chug_device_added_cb (GUsbContext *ctx,
-				  GUsbDevice *device,
-				  FuProviderChug *provider_chug)
+fu_provider_chug_item_publish (FuProviderChug *provider_chug,
+			       FuProviderChugItem *item,
+			       ChDeviceMode mode)
 {
-	FuProviderChugItem *item;
-	ChDeviceMode mode;
-	_cleanup_free_ gchar *id = NULL;
-
-	/* ignore */
-	mode = ch_device_get_mode (device);
-	if (mode == CH_DEVICE_MODE_UNKNOWN)
-		return;
-
-	/* is already in database */
-	id = fu_provider_chug_get_id (device);
-	item = g_hash_table_lookup (provider_chug->priv->devices, id);
-	if (item == NULL) {
-		item = g_new0 (FuProviderChugItem, 1);
-		item->loop = g_main_loop_new (NULL, FALSE);
-		item->provider_chug = g_object_ref (provider_chug);
-		item->usb_device = g_object_ref (device);
-		item->device = fu_device_new ();
-		item->mode = mode;
-		fu_device_set_id (item->device, id);
-		fu_device_set_guid (item->device, ch_device_get_guid (device));
-		fu_device_add_flag (item->device, FU_DEVICE_FLAG_ALLOW_OFFLINE);
-		fu_device_add_flag (item->device, FU_DEVICE_FLAG_ALLOW_ONLINE);
-
-		/* try to get the serial number -- if opening failed then
-		 * poll until the device is not busy */
-		fu_provider_chug_get_firmware_version (item);
-		if (!item->got_version && item->timeout_open_id == 0) {
-			item->timeout_open_id = g_timeout_add_seconds (FU_PROVIDER_CHUG_POLL_REOPEN,
-				fu_provider_chug_open_cb, item);
-		}
-
-		/* insert to hash */
-		g_hash_table_insert (provider_chug->priv->devices,
-				     g_strdup (id), item);
-	} else {
-		/* update the device */
-		g_object_unref (item->usb_device);
-		item->usb_device = g_object_ref (device);
-	}
-
 	/* set the display name */
 	switch (mode) {
 	case CH_DEVICE_MODE_BOOTLOADER:
@@ -610,24 +951,85 @@ fu_provider_chug_device_added_cb (GUsbContext *ctx,
 	}
 	fu_provider_device_add (FU_PROVIDER (provider_chug), item->device);
 
-	/* are we waiting for the device to show up */
-	if (g_main_loop_is_running (item->loop))
-		g_main_loop_quit (item->loop);
+	/* complete any waiting for the device to show up */
+	fu_provider_chug_reconnect_complete (item);
 }
 
 /**
- * fu_provider_chug_device_removed_cb:
+ * fu_provider_chug_hotplug_probe:
+ *
+ * This is run in a worker thread, so the device is not opened here; the
+ * version is read in fu_provider_chug_hotplug_added() on the main thread.
+ **/
+static gpointer
+fu_provider_chug_hotplug_probe (FuProvider *provider, GObject *object)
+{
+	FuProviderChug *provider_chug = FU_PROVIDER_CHUG (provider);
+	FuProviderChugItem *item;
+	GUsbDevice *device = G_USB_DEVICE (object);
+	_cleanup_free_ gchar *id = NULL;
+
+	id = fu_provider_chug_get_id (device);
+	item = g_new0 (FuProviderChugItem, 1);
+	g_mutex_init (&item->reconnect_mutex);
+	g_cond_init (&item->reconnect_cond);
+	item->reconnect_timer = g_timer_new ();
+	item->provider_chug = g_object_ref (provider_chug);
+	item->usb_device = g_object_ref (device);
+	item->device = fu_device_new ();
+	item->mode = ch_device_get_mode (device);
+	fu_device_set_id (item->device, id);
+	fu_device_set_guid (item->device, ch_device_get_guid (device));
+	fu_device_add_flag (item->device, FU_DEVICE_FLAG_ALLOW_OFFLINE);
+	fu_device_add_flag (item->device, FU_DEVICE_FLAG_ALLOW_ONLINE);
+	return item;
+}
+
+/**
+ * fu_provider_chug_hotplug_added:
  **/
 static void
-fu_provider_chug_device_removed_cb (GUsbContext *ctx,
-				    GUsbDevice *device,
-				    FuProviderChug *provider_chug)
+fu_provider_chug_hotplug_added (FuProvider *provider, GObject *object, gpointer data)
 {
+	FuProviderChug *provider_chug = FU_PROVIDER_CHUG (provider);
+	FuProviderChugItem *item = (FuProviderChugItem *) data;
+	_cleanup_free_ gchar *version = NULL;
+
+	/* try to get the serial number, which can be set directly as the
+	 * device has not been added to the daemon yet */
+	version = fu_provider_chug_get_firmware_version (provider_chug,
+							 item->usb_device);
+	if (version != NULL) {
+		fu_device_set_metadata (item->device, FU_DEVICE_KEY_VERSION, version);
+		item->got_version = TRUE;
+	}
+
+	/* if opening failed then poll until the device is not busy */
+	if (!item->got_version && item->timeout_open_id == 0) {
+		item->timeout_open_id = g_timeout_add_seconds (FU_PROVIDER_CHUG_POLL_REOPEN,
+			fu_provider_chug_open_cb, item);
+	}
+
+	/* insert to hash */
+	g_mutex_lock (&provider_chug->priv->devices_mutex);
+	g_hash_table_insert (provider_chug->priv->devices,
+			     g_strdup (fu_device_get_id (item->device)), item);
+	g_mutex_unlock (&provider_chug->priv->devices_mutex);
+	fu_provider_chug_item_publish (provider_chug, item, item->mode);
+}
+
+/**
+ * fu_provider_chug_hotplug_removed:
+ **/
+static void
+fu_provider_chug_hotplug_removed (FuProvider *provider, GObject *object)
+{
+	FuProviderChug *provider_chug = FU_PROVIDER_CHUG (provider);
 	FuProviderChugItem *item;
 	_cleanup_free_ gchar *id = NULL;
 
 	/* already in database */
-	id = fu_provider_chug_get_id (device);
+	id = fu_provider_chug_get_id (G_USB_DEVICE (object));
 	item = g_hash_table_lookup (provider_chug->priv->devices, id);
 	if (item == NULL)
 		return;
@@ -640,6 +1042,62 @@ fu_provider_chug_device_removed_cb (GUsbContext *ctx,
 	fu_provider_device_remove (FU_PROVIDER (provider_chug), item->device);
 }
 
+/**
+ * fu_provider_chug_device_added_cb:
+ **/
+static void
+fu_provider_chug_device_added_cb (GUsbContext *ctx,
+				  GUsbDevice *device,
+				  FuProviderChug *provider_chug)
+{
+	FuProviderChugItem *item;
+	ChDeviceMode mode;
+	_cleanup_free_ gchar *id = NULL;
+
+	/* ignore */
+	mode = ch_device_get_mode (device);
+	if (mode == CH_DEVICE_MODE_UNKNOWN)
+		return;
+
+	/* a new device is slow to open, so probe in batches */
+	id = fu_provider_chug_get_id (device);
+	item = g_hash_table_lookup (provider_chug->priv->devices, id);
+	if (item == NULL) {
+		fu_provider_hotplug_add (FU_PROVIDER (provider_chug), id,
+					 G_OBJECT (device));
+		return;
+	}
+
+	/* the device has re-enumerated, perhaps in the middle of an update,
+	 * so handle it straight away */
+	g_mutex_lock (&item->reconnect_mutex);
+	g_object_unref (item->usb_device);
+	item->usb_device = g_object_ref (device);
+	g_mutex_unlock (&item->reconnect_mutex);
+	fu_provider_chug_item_publish (provider_chug, item, mode);
+}
+
+/**
+ * fu_provider_chug_device_removed_cb:
+ **/
+static void
+fu_provider_chug_device_removed_cb (GUsbContext *ctx,
+				    GUsbDevice *device,
+				    FuProviderChug *provider_chug)
+{
+	_cleanup_free_ gchar *id = NULL;
+
+	/* a device that is waiting to be probed just gets dropped, but the
+	 * removal of a known device must not be reordered with a reconnect */
+	id = fu_provider_chug_get_id (device);
+	if (g_hash_table_lookup (provider_chug->priv->devices, id) == NULL) {
+		fu_provider_hotplug_remove (FU_PROVIDER (provider_chug), id,
+					    G_OBJECT (device));
+		return;
+	}
+	fu_provider_chug_hotplug_removed (FU_PROVIDER (provider_chug), G_OBJECT (device));
+}
+
 /**
  * fu_provider_chug_coldplug:
  **/
@@ -651,6 +1109,15 @@ fu_provider_chug_coldplug (FuProvider *provider, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_chug_get_snapshot_key:
+ **/
+static gchar *
+fu_provider_chug_get_snapshot_key (FuProvider *provider)
+{
+	return fu_provider_get_sysfs_key ("/sys/bus/usb/devices");
+}
+
 /**
  * fu_provider_chug_class_init:
  **/
@@ -662,6 +1129,10 @@ fu_provider_chug_class_init (FuProviderChugClass *klass)
 
 	provider_class->get_name = fu_provider_chug_get_name;
 	provider_class->coldplug = fu_provider_chug_coldplug;
+	provider_class->hotplug_probe = fu_provider_chug_hotplug_probe;
+	provider_class->hotplug_added = fu_provider_chug_hotplug_added;
+	provider_class->hotplug_removed = fu_provider_chug_hotplug_removed;
+	provider_class->get_snapshot_key = fu_provider_chug_get_snapshot_key;
 	provider_class->update_online = fu_provider_chug_update;
 	provider_class->verify = fu_provider_chug_verify;
 	object_class->finalize = fu_provider_chug_finalize;
@@ -679,7 +1150,8 @@ fu_provider_chug_init (FuProviderChug *provider_chug)
 	provider_chug->priv->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
 							      g_free, (GDestroyNotify) fu_provider_chug_device_free);
 	provider_chug->priv->usb_ctx = g_usb_context_new (NULL);
-	provider_chug->priv->device_queue = ch_device_queue_new ();
+	provider_chug->priv->thread = g_thread_self ();
+	g_mutex_init (&provider_chug->priv->devices_mutex);
 	g_signal_connect (provider_chug->priv->usb_ctx, "device-added",
 			  G_CALLBACK (fu_provider_chug_device_added_cb),
 			  provider_chug);
@@ -698,8 +1170,8 @@ fu_provider_chug_finalize (GObject *object)
 	FuProviderChugPrivate *priv = provider_chug->priv;
 
 	g_hash_table_unref (priv->devices);
+	g_mutex_clear (&priv->devices_mutex);
 	g_object_unref (priv->usb_ctx);
-	g_object_unref (priv->device_queue);
 
 	G_OBJECT_CLASS (fu_provider_chug_parent_class)->finalize (object);
 }
@@ -39,6 +39,9 @@ static void     fu_provider_fake_finalize	(GObject	*object);
 struct _FuProviderFakePrivate
 {
 	GHashTable		*devices;
+	gchar			*snapshot_key;
+	gint			 verify_active;
+	gint			 verify_active_max;
 };
 
 G_DEFINE_TYPE (FuProviderFake, fu_provider_fake, FU_TYPE_PROVIDER)
@@ -54,6 +57,8 @@ fu_provider_fake_get_name (FuProvider *provider)
 
 /**
  * fu_provider_fake_update:
+ *
+ * Devices with an ID ending in "Broken" fail to be written.
  **/
 static gboolean
 fu_provider_fake_update (FuProvider *provider,
@@ -62,6 +67,8 @@ fu_provider_fake_update (FuProvider *provider,
 			 FuProviderFlags flags,
 			 GError **error)
 {
+	guint i;
+
 	if (flags & FU_PROVIDER_UPDATE_FLAG_OFFLINE) {
 		g_set_error_literal (error,
 				     FWUPD_ERROR,
@@ -70,9 +77,70 @@ fu_provider_fake_update (FuProvider *provider,
 	}
 	fu_provider_set_status (provider, FWUPD_STATUS_DECOMPRESSING);
 	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_WRITE);
+	if (g_str_has_suffix (fu_device_get_id (device), "Broken")) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_WRITE,
+				     "cannot write firmware");
+		return FALSE;
+	}
+	for (i = 0; i <= 10; i++)
+		fu_provider_set_progress (provider, i * 0x100, 10 * 0x100);
 	return TRUE;
 }
 
+/**
+ * fu_provider_fake_verify:
+ *
+ * Devices with an ID ending in "Broken" cannot be read back.
+ **/
+static gboolean
+fu_provider_fake_verify (FuProvider *provider,
+			 FuDevice *device,
+			 FuProviderVerifyFlags flags,
+			 GError **error)
+{
+	FuProviderFake *provider_fake = FU_PROVIDER_FAKE (provider);
+	FuProviderFakePrivate *priv = provider_fake->priv;
+	gint active;
+	gint active_max;
+	_cleanup_free_ gchar *hash = NULL;
+
+	/* record how many verifies are running at the same time */
+	active = g_atomic_int_add (&priv->verify_active, 1) + 1;
+	do {
+		active_max = g_atomic_int_get (&priv->verify_active_max);
+	} while (active > active_max &&
+		 !g_atomic_int_compare_and_exchange (&priv->verify_active_max,
+						     active_max, active));
+	g_usleep (G_USEC_PER_SEC / 100);
+	g_atomic_int_add (&priv->verify_active, -1);
+
+	if (g_str_has_suffix (fu_device_get_id (device), "Broken")) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_READ,
+				     "cannot read firmware");
+		return FALSE;
+	}
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+					      fu_device_get_id (device), -1);
+	fu_provider_set_device_metadata (provider, device,
+					 FU_DEVICE_KEY_FIRMWARE_HASH, hash);
+	return TRUE;
+}
+
+/**
+ * fu_provider_fake_get_verify_max:
+ *
+ * Gets the most verifies that have ever been running at the same time.
+ **/
+guint
+fu_provider_fake_get_verify_max (FuProviderFake *provider_fake)
+{
+	return g_atomic_int_get (&provider_fake->priv->verify_active_max);
+}
+
 /**
  * fu_provider_fake_coldplug:
  **/
@@ -87,6 +155,62 @@ fu_provider_fake_coldplug (FuProvider *provider, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_fake_hotplug_probe:
+ *
+ * The hotplug object is the FuDevice itself, so there is nothing to open.
+ * Devices with an ID ending in "Slow" take half a second to probe.
+ **/
+static gpointer
+fu_provider_fake_hotplug_probe (FuProvider *provider, GObject *object)
+{
+	if (g_str_has_suffix (fu_device_get_id (FU_DEVICE (object)), "Slow"))
+		g_usleep (G_USEC_PER_SEC / 2);
+	return g_object_ref (object);
+}
+
+/**
+ * fu_provider_fake_hotplug_added:
+ **/
+static void
+fu_provider_fake_hotplug_added (FuProvider *provider, GObject *object, gpointer data)
+{
+	_cleanup_object_unref_ FuDevice *device = FU_DEVICE (data);
+	fu_provider_device_add (provider, device);
+}
+
+/**
+ * fu_provider_fake_hotplug_removed:
+ **/
+static void
+fu_provider_fake_hotplug_removed (FuProvider *provider, GObject *object)
+{
+	fu_provider_device_remove (provider, FU_DEVICE (object));
+}
+
+/**
+ * fu_provider_fake_get_snapshot_key:
+ **/
+static gchar *
+fu_provider_fake_get_snapshot_key (FuProvider *provider)
+{
+	FuProviderFake *provider_fake = FU_PROVIDER_FAKE (provider);
+	return g_strdup (provider_fake->priv->snapshot_key);
+}
+
+/**
+ * fu_provider_fake_set_snapshot_key:
+ *
+ * Sets the key that describes the fake hardware, or %NULL if the devices
+ * should not be saved in the snapshot.
+ **/
+void
+fu_provider_fake_set_snapshot_key (FuProviderFake *provider_fake, const gchar *key)
+{
+	g_free (provider_fake->priv->snapshot_key);
+	provider_fake->priv->snapshot_key = g_strdup (key);
+}
+
 /**
  * fu_provider_fake_class_init:
  **/
@@ -98,7 +222,12 @@ fu_provider_fake_class_init (FuProviderFakeClass *klass)
 
 	provider_class->get_name = fu_provider_fake_get_name;
 	provider_class->coldplug = fu_provider_fake_coldplug;
+	provider_class->hotplug_probe = fu_provider_fake_hotplug_probe;
+	provider_class->hotplug_added = fu_provider_fake_hotplug_added;
+	provider_class->hotplug_removed = fu_provider_fake_hotplug_removed;
+	provider_class->get_snapshot_key = fu_provider_fake_get_snapshot_key;
 	provider_class->update_online = fu_provider_fake_update;
+	provider_class->verify = fu_provider_fake_verify;
 	object_class->finalize = fu_provider_fake_finalize;
 
 	g_type_class_add_private (klass, sizeof (FuProviderFakePrivate));
@@ -111,6 +240,7 @@ static void
 fu_provider_fake_init (FuProviderFake *provider_fake)
 {
 	provider_fake->priv = FU_PROVIDER_FAKE_GET_PRIVATE (provider_fake);
+	fu_provider_set_allow_parallel (FU_PROVIDER (provider_fake), TRUE);
 }
 
 /**
@@ -119,6 +249,10 @@ fu_provider_fake_init (FuProviderFake *provider_fake)
 static void
 fu_provider_fake_finalize (GObject *object)
 {
+	FuProviderFake *provider_fake = FU_PROVIDER_FAKE (object);
+
+	g_free (provider_fake->priv->snapshot_key);
+
 	G_OBJECT_CLASS (fu_provider_fake_parent_class)->finalize (object);
 }
 
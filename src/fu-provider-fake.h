@@ -50,6 +50,9 @@ struct _FuProviderFakeClass
 
 GType		 fu_provider_fake_get_type	(void);
 FuProvider	*fu_provider_fake_new		(void);
+void		 fu_provider_fake_set_snapshot_key (FuProviderFake *provider_fake,
+						 const gchar	*key);
+guint		 fu_provider_fake_get_verify_max (FuProviderFake *provider_fake);
 
 G_END_DECLS
 
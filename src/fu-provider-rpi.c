@@ -28,16 +28,19 @@
 #include <gio/gio.h>
 #include <glib-object.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "fu-cleanup.h"
 #include "fu-device.h"
 #include "fu-provider-rpi.h"
+#include "fu-scanner.h"
 
 static void     fu_provider_rpi_finalize	(GObject	*object);
 
 #define FU_PROVIDER_RPI_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), FU_TYPE_PROVIDER_RPI, FuProviderRpiPrivate))
 
 #define FU_PROVIDER_RPI_FIRMWARE_FILENAME		"start.elf"
+#define FU_PROVIDER_RPI_CHUNK_SIZE			(32 * 1024)	/* bytes */
 
 /**
  * FuProviderRpiPrivate:
@@ -62,47 +65,47 @@ fu_provider_rpi_get_name (FuProvider *provider)
  * fu_provider_rpi_strstr:
  **/
 static gchar *
-fu_provider_rpi_strstr (const guint8 *haystack,
-			gsize haystack_len,
+fu_provider_rpi_strstr (FuScanner *scanner,
+			const guint8 *haystack,
 			const gchar *needle,
 			guint *offset)
 {
-	guint i;
-	guint needle_len;
+	gssize idx;
 
-	if (needle == NULL || needle[0] == '\0')
-		return NULL;
-	if (haystack == NULL || haystack_len == 0)
+	idx = fu_scanner_find (scanner, needle, offset != NULL ? *offset : 0);
+	if (idx < 0)
 		return NULL;
-	needle_len = strlen (needle);
-	if (needle_len > haystack_len)
-		return NULL;
-	for (i = 0; i < haystack_len - needle_len; i++) {
-		if (memcmp (haystack + i, needle, needle_len) == 0) {
-			if (offset != NULL)
-				*offset = i + needle_len;
-			return g_strdup ((const gchar *) &haystack[i + needle_len]);
-		}
-	}
-	return NULL;
+	idx += strlen (needle);
+	if (offset != NULL)
+		*offset = idx;
+	return g_strdup ((const gchar *) &haystack[idx]);
 }
 
 /**
- * fu_provider_rpi_parse_firmware:
+ * fu_provider_rpi_parse_firmware_data:
+ *
+ * Finds the VC build info in the contents of start.elf, which must have a
+ * trailing NUL byte that is not included in @len.
  **/
 static gboolean
-fu_provider_rpi_parse_firmware (FuDevice *device, const gchar *fn, GError **error)
+fu_provider_rpi_parse_firmware_data (FuProvider *provider,
+				     FuDevice *device,
+				     const guint8 *data,
+				     gsize len,
+				     GError **error)
 {
 	GDate *date;
-	gsize len = 0;
-	guint offset;
+	guint offset = 0;
+	const gchar *needles[] = { "VC_BUILD_ID_PLATFORM: ",
+				   "VC_BUILD_ID_TIME: ",
+				   NULL };
 	_cleanup_free_ gchar *fwver = NULL;
 	_cleanup_free_ gchar *platform = NULL;
 	_cleanup_free_ gchar *vc_date = NULL;
 	_cleanup_free_ gchar *vc_time = NULL;
-	_cleanup_free_ guint8 *data = NULL;
+	_cleanup_object_unref_ FuScanner *scanner = NULL;
 
-	/* read file -- things we can find are:
+	/* things we can find are:
 	 *
 	 * VC_BUILD_ID_USER: dc4
 	 * VC_BUILD_ID_TIME: 14:58:37
@@ -112,11 +115,13 @@ fu_provider_rpi_parse_firmware (FuDevice *device, const gchar *fn, GError **erro
 	 * VC_BUILD_ID_PLATFORM: raspberrypi_linux
 	 * VC_BUILD_ID_VERSION: 4b51d81eb0068a875b336f4cc2c468cbdd06d0c5 (clean)
 	 */
-	if (!g_file_get_contents (fn, (gchar **) &data, &len, error))
-		return FALSE;
+
+	/* find all the strings in one pass */
+	scanner = fu_scanner_new (needles);
+	fu_scanner_scan (scanner, data, len);
 
 	/* check the platform matches */
-	platform = fu_provider_rpi_strstr (data, len,
+	platform = fu_provider_rpi_strstr (scanner, data,
 					   "VC_BUILD_ID_PLATFORM: ",
 					   NULL);
 	if (g_strcmp0 (platform, "raspberrypi_linux") != 0) {
@@ -130,7 +135,7 @@ fu_provider_rpi_parse_firmware (FuDevice *device, const gchar *fn, GError **erro
 
 	/* find the VC_BUILD info which paradoxically is split into two
 	 * string segments */
-	vc_time = fu_provider_rpi_strstr (data, len,
+	vc_time = fu_provider_rpi_strstr (scanner, data,
 					  "VC_BUILD_ID_TIME: ", &offset);
 	if (vc_time == NULL) {
 		g_set_error_literal (error,
@@ -139,8 +144,8 @@ fu_provider_rpi_parse_firmware (FuDevice *device, const gchar *fn, GError **erro
 				     "Failed to get 1st VC_BUILD_ID_TIME");
 		return FALSE;
 	}
-	vc_date = fu_provider_rpi_strstr (data + offset, len - offset,
-					  "VC_BUILD_ID_TIME: ", NULL);
+	vc_date = fu_provider_rpi_strstr (scanner, data,
+					  "VC_BUILD_ID_TIME: ", &offset);
 	if (vc_date == NULL) {
 		g_set_error_literal (error,
 				     FWUPD_ERROR,
@@ -166,30 +171,166 @@ fu_provider_rpi_parse_firmware (FuDevice *device, const gchar *fn, GError **erro
 				 g_date_get_year (date),
 				 g_date_get_month (date),
 				 g_date_get_day (date));
-	fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, fwver);
+	fu_provider_set_device_metadata (provider, device,
+					 FU_DEVICE_KEY_VERSION, fwver);
 
 	g_date_free (date);
 	return TRUE;
 }
 
 /**
- * fu_provider_rpi_explode_file:
+ * fu_provider_rpi_parse_firmware:
  **/
 static gboolean
-fu_provider_rpi_explode_file (struct archive_entry *entry, const gchar *dir)
+fu_provider_rpi_parse_firmware (FuProvider *provider,
+				FuDevice *device,
+				const gchar *fn,
+				GError **error)
+{
+	gsize len = 0;
+	_cleanup_free_ guint8 *data = NULL;
+
+	if (!g_file_get_contents (fn, (gchar **) &data, &len, error))
+		return FALSE;
+	return fu_provider_rpi_parse_firmware_data (provider, device,
+						    data, len, error);
+}
+
+/**
+ * fu_provider_rpi_get_entry_name:
+ *
+ * Returns the path of @entry without any leading "./", as tar files made
+ * with `tar -C dir -cf fw.tar .` prefix everything with it.
+ **/
+static const gchar *
+fu_provider_rpi_get_entry_name (struct archive_entry *entry)
+{
+	const gchar *tmp = archive_entry_pathname (entry);
+	if (tmp == NULL)
+		return NULL;
+	while (g_str_has_prefix (tmp, "./"))
+		tmp += 2;
+	return tmp;
+}
+
+/**
+ * fu_provider_rpi_get_entry_filename:
+ *
+ * Returns the destination of @entry in @dir, or %NULL if the path would
+ * escape from @dir.
+ **/
+static gchar *
+fu_provider_rpi_get_entry_filename (struct archive_entry *entry, const gchar *dir)
 {
 	const gchar *tmp;
-	_cleanup_free_ gchar *buf = NULL;
+	guint i;
+	_cleanup_strv_free_ gchar **split = NULL;
 
 	/* no output file */
-	if (archive_entry_pathname (entry) == NULL)
-		return FALSE;
+	tmp = fu_provider_rpi_get_entry_name (entry);
+	if (tmp == NULL || tmp[0] == '\0')
+		return NULL;
+	if (g_path_is_absolute (tmp))
+		return NULL;
+	split = g_strsplit (tmp, "/", -1);
+	for (i = 0; split[i] != NULL; i++) {
+		if (g_strcmp0 (split[i], "..") == 0)
+			return NULL;
+	}
+	return g_build_filename (dir, tmp, NULL);
+}
 
-	/* update output path */
-	tmp = archive_entry_pathname (entry);
-	buf = g_build_filename (dir, tmp, NULL);
-	archive_entry_update_pathname_utf8 (entry, buf);
-	return TRUE;
+/**
+ * fu_provider_rpi_read_entry:
+ *
+ * Reads the current entry into memory, with a trailing NUL byte that is
+ * not included in the length.
+ **/
+static GByteArray *
+fu_provider_rpi_read_entry (struct archive *arch,
+			    struct archive_entry *entry,
+			    GError **error)
+{
+	GByteArray *buf;
+	guint8 tmp[FU_PROVIDER_RPI_CHUNK_SIZE];
+	guint8 nul = '\0';
+	gssize r;
+
+	/* the decompressed size is checked as well in case the header lies */
+	if (archive_entry_size_is_set (entry) &&
+	    archive_entry_size (entry) > FU_PROVIDER_FIRMWARE_MAX) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INVALID_FILE,
+			     "%s is too large: %" G_GINT64_FORMAT " bytes",
+			     archive_entry_pathname (entry),
+			     (gint64) archive_entry_size (entry));
+		return NULL;
+	}
+
+	buf = g_byte_array_new ();
+	for (;;) {
+		r = archive_read_data (arch, tmp, sizeof (tmp));
+		if (r == 0)
+			break;
+		if (r < 0) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INTERNAL,
+				     "Cannot read data: %s",
+				     archive_error_string (arch));
+			g_byte_array_unref (buf);
+			return NULL;
+		}
+		if (buf->len + (gsize) r > FU_PROVIDER_FIRMWARE_MAX) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "%s is too large to extract",
+				     archive_entry_pathname (entry));
+			g_byte_array_unref (buf);
+			return NULL;
+		}
+		g_byte_array_append (buf, tmp, (guint) r);
+	}
+	g_byte_array_append (buf, &nul, 1);
+	g_byte_array_set_size (buf, buf->len - 1);
+	return buf;
+}
+
+/**
+ * fu_provider_rpi_write_entry:
+ *
+ * Atomically replaces @fn with @buf, unless the contents are already the
+ * same which avoids needless writes to the SD card.
+ **/
+static gboolean
+fu_provider_rpi_write_entry (const gchar *fn, GByteArray *buf, GError **error)
+{
+	_cleanup_free_ gchar *dirname = NULL;
+	_cleanup_mapped_file_unref_ GMappedFile *mapped = NULL;
+
+	/* unchanged */
+	mapped = g_mapped_file_new (fn, FALSE, NULL);
+	if (mapped != NULL &&
+	    g_mapped_file_get_length (mapped) == buf->len &&
+	    memcmp (g_mapped_file_get_contents (mapped), buf->data, buf->len) == 0) {
+		g_debug ("%s is unchanged", fn);
+		return TRUE;
+	}
+
+	/* write to a temp file and rename over the old file */
+	dirname = g_path_get_dirname (fn);
+	if (g_mkdir_with_parents (dirname, 0755) != 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_WRITE,
+			     "Cannot create %s",
+			     dirname);
+		return FALSE;
+	}
+	g_debug ("writing %s", fn);
+	return g_file_set_contents (fn, (const gchar *) buf->data, buf->len, error);
 }
 
 /**
@@ -203,14 +344,16 @@ fu_provider_rpi_update (FuProvider *provider,
 			GError **error)
 {
 	FuProviderRpi *provider_rpi = FU_PROVIDER_RPI (provider);
+	gboolean parsed = FALSE;
 	gboolean ret = TRUE;
-	gboolean valid;
 	int r;
+	guint64 total = 0;
 	struct archive *arch = NULL;
 	struct archive_entry *entry;
+	struct stat st;
 	_cleanup_free_ gchar *fwfn = NULL;
 
-	/* decompress anything matching either glob */
+	/* decompress each file in turn, writing only what has changed */
 	fu_provider_set_status (provider, FWUPD_STATUS_DECOMPRESSING);
 	arch = archive_read_new ();
 	archive_read_support_format_all (arch);
@@ -225,9 +368,22 @@ fu_provider_rpi_update (FuProvider *provider,
 			     archive_error_string (arch));
 		goto out;
 	}
+
+	/* nothing has been written yet */
+	if (!fu_provider_check_cancelled (provider, error)) {
+		ret = FALSE;
+		goto out;
+	}
 	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_WRITE);
+
+	/* progress is how much of the archive has been consumed */
+	if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+		total = (guint64) st.st_size;
+	if (total > 0)
+		fu_provider_set_progress (provider, 0, total);
 	for (;;) {
 		_cleanup_free_ gchar *path = NULL;
+		_cleanup_bytearray_unref_ GByteArray *buf = NULL;
 		r = archive_read_next_header (arch, &entry);
 		if (r == ARCHIVE_EOF)
 			break;
@@ -242,28 +398,68 @@ fu_provider_rpi_update (FuProvider *provider,
 		}
 
 		/* only extract if valid */
-		valid = fu_provider_rpi_explode_file (entry, provider_rpi->priv->fw_dir);
-		if (!valid)
+		path = fu_provider_rpi_get_entry_filename (entry, provider_rpi->priv->fw_dir);
+		if (path == NULL) {
+			g_debug ("ignoring %s", archive_entry_pathname (entry));
 			continue;
-		r = archive_read_extract (arch, entry, 0);
-		if (r != ARCHIVE_OK) {
+		}
+		if (archive_entry_filetype (entry) == AE_IFDIR) {
+			if (g_mkdir_with_parents (path, 0755) != 0) {
+				ret = FALSE;
+				g_set_error (error,
+					     FWUPD_ERROR,
+					     FWUPD_ERROR_WRITE,
+					     "Cannot create %s",
+					     path);
+				goto out;
+			}
+			continue;
+		}
+		if (archive_entry_filetype (entry) != AE_IFREG) {
+			g_debug ("ignoring non-regular file %s", path);
+			continue;
+		}
+		buf = fu_provider_rpi_read_entry (arch, entry, error);
+		if (buf == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		if (!fu_provider_rpi_write_entry (path, buf, error)) {
 			ret = FALSE;
-			g_set_error (error,
-				     FWUPD_ERROR,
-				     FWUPD_ERROR_INTERNAL,
-				     "Cannot extract: %s",
-				     archive_error_string (arch));
 			goto out;
 		}
+
+		/* get the new VC build info without reading it back */
+		if (g_strcmp0 (fu_provider_rpi_get_entry_name (entry),
+			       FU_PROVIDER_RPI_FIRMWARE_FILENAME) == 0) {
+			if (!fu_provider_rpi_parse_firmware_data (provider, device,
+								  buf->data,
+								  buf->len,
+								  error)) {
+				ret = FALSE;
+				goto out;
+			}
+			parsed = TRUE;
+		}
+		if (total > 0) {
+			fu_provider_set_progress (provider,
+						  MIN ((guint64) archive_filter_bytes (arch, -1), total),
+						  total);
+		}
 	}
+	if (total > 0)
+		fu_provider_set_progress (provider, total, total);
 
-	/* get the new VC build info */
+	/* the archive did not contain the firmware */
 	fu_provider_set_status (provider, FWUPD_STATUS_DEVICE_VERIFY);
-	fwfn = g_build_filename (provider_rpi->priv->fw_dir,
-				 FU_PROVIDER_RPI_FIRMWARE_FILENAME,
-				 NULL);
-	if (!fu_provider_rpi_parse_firmware (device, fwfn, error))
-		return FALSE;
+	if (!parsed) {
+		fwfn = g_build_filename (provider_rpi->priv->fw_dir,
+					 FU_PROVIDER_RPI_FIRMWARE_FILENAME,
+					 NULL);
+		if (!fu_provider_rpi_parse_firmware (provider, device,
+						     fwfn, error))
+			ret = FALSE;
+	}
 out:
 	if (arch != NULL) {
 		archive_read_close (arch);
@@ -302,7 +498,7 @@ fu_provider_rpi_coldplug (FuProvider *provider, GError **error)
 	fu_device_add_flag (device, FU_DEVICE_FLAG_ALLOW_ONLINE);
 
 	/* get the VC build info */
-	if (!fu_provider_rpi_parse_firmware (device, fwfn, error))
+	if (!fu_provider_rpi_parse_firmware (provider, device, fwfn, error))
 		return FALSE;
 
 	fu_provider_device_add (provider, device);
@@ -24,6 +24,7 @@
 #include <fwupd.h>
 #include <appstream-glib.h>
 #include <glib-object.h>
+#include <glib/gstdio.h>
 #include <gudev/gudev.h>
 #include <string.h>
 
@@ -43,8 +44,28 @@ struct _FuProviderUdevPrivate
 {
 	GHashTable		*devices;
 	GUdevClient		*gudev_client;
+	GKeyFile		*rom_cache;
+	gchar			*rom_cache_fn;
+	GHashTable		*digests;	/* rom_fn : FuProviderUdevDigest */
+	GMutex			 digests_mutex;
+	guint			 digests_generation;
 };
 
+typedef struct {
+	guint64			 size;
+	guint64			 mtime;
+	gchar			*checksum;
+} FuProviderUdevDigest;
+
+typedef struct {
+	FuProviderUdev		*provider_udev;
+	FuDevice		*device;
+	gchar			*rom_fn;
+	gchar			*revision;
+	gchar			*version;
+	gchar			*guid;
+} FuProviderUdevRomHelper;
+
 G_DEFINE_TYPE (FuProviderUdev, fu_provider_udev, FU_TYPE_PROVIDER)
 
 /**
@@ -68,6 +89,97 @@ fu_provider_udev_get_id (GUdevDevice *device)
 	return id;
 }
 
+/**
+ * fu_provider_udev_digest_free:
+ **/
+static void
+fu_provider_udev_digest_free (FuProviderUdevDigest *digest)
+{
+	g_free (digest->checksum);
+	g_free (digest);
+}
+
+/**
+ * fu_provider_udev_digest_lookup:
+ *
+ * Returns the cached checksum for the ROM if neither the size nor the
+ * modification time have changed since it was last hashed.
+ *
+ * This is called from worker threads.
+ **/
+static gchar *
+fu_provider_udev_digest_lookup (FuProviderUdev *provider_udev,
+				const gchar *rom_fn,
+				guint64 size,
+				guint64 mtime,
+				guint *generation)
+{
+	FuProviderUdevPrivate *priv = provider_udev->priv;
+	FuProviderUdevDigest *digest;
+	gchar *checksum = NULL;
+
+	g_mutex_lock (&priv->digests_mutex);
+	*generation = priv->digests_generation;
+	digest = g_hash_table_lookup (priv->digests, rom_fn);
+	if (digest != NULL && digest->size == size && digest->mtime == mtime)
+		checksum = g_strdup (digest->checksum);
+	g_mutex_unlock (&priv->digests_mutex);
+	return checksum;
+}
+
+/**
+ * fu_provider_udev_digest_insert:
+ *
+ * Adds the checksum unless the cache was invalidated while the ROM was
+ * being read, in which case it may describe the old firmware.
+ *
+ * This is called from worker threads.
+ **/
+static void
+fu_provider_udev_digest_insert (FuProviderUdev *provider_udev,
+				const gchar *rom_fn,
+				guint64 size,
+				guint64 mtime,
+				guint generation,
+				const gchar *checksum)
+{
+	FuProviderUdevPrivate *priv = provider_udev->priv;
+	FuProviderUdevDigest *digest;
+
+	digest = g_new0 (FuProviderUdevDigest, 1);
+	digest->size = size;
+	digest->mtime = mtime;
+	digest->checksum = g_strdup (checksum);
+	g_mutex_lock (&priv->digests_mutex);
+	if (generation == priv->digests_generation) {
+		g_hash_table_insert (priv->digests, g_strdup (rom_fn), digest);
+		digest = NULL;
+	}
+	g_mutex_unlock (&priv->digests_mutex);
+	if (digest != NULL)
+		fu_provider_udev_digest_free (digest);
+}
+
+/**
+ * fu_provider_udev_digest_invalidate:
+ *
+ * Forgets the checksum for the ROM of @device, as the kernel does not
+ * update the mtime of the sysfs file when the firmware changes.
+ **/
+static void
+fu_provider_udev_digest_invalidate (FuProviderUdev *provider_udev,
+				    GUdevDevice *device)
+{
+	FuProviderUdevPrivate *priv = provider_udev->priv;
+	_cleanup_free_ gchar *rom_fn = NULL;
+
+	rom_fn = g_build_filename (g_udev_device_get_sysfs_path (device), "rom", NULL);
+	g_mutex_lock (&priv->digests_mutex);
+	priv->digests_generation++;
+	g_hash_table_remove (priv->digests, rom_fn);
+	g_mutex_unlock (&priv->digests_mutex);
+}
+
 /**
  * fu_provider_udev_verify:
  **/
@@ -77,8 +189,14 @@ fu_provider_udev_verify (FuProvider *provider,
 			 FuProviderVerifyFlags flags,
 			 GError **error)
 {
+	FuProviderUdev *provider_udev = FU_PROVIDER_UDEV (provider);
 	const gchar *rom_fn;
+	guint generation;
+	guint64 mtime;
+	guint64 size;
+	_cleanup_free_ gchar *checksum = NULL;
 	_cleanup_object_unref_ GFile *file = NULL;
+	_cleanup_object_unref_ GFileInfo *info = NULL;
 	_cleanup_object_unref_ FuRom *rom = NULL;
 
 	/* open the file */
@@ -91,14 +209,158 @@ fu_provider_udev_verify (FuProvider *provider,
 		return FALSE;
 	}
 	file = g_file_new_for_path (rom_fn);
+
+	/* reading the whole ROM is slow, so reuse the last checksum if the
+	 * ROM has not changed since */
+	info = g_file_query_info (file,
+				  G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+				  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+				  G_FILE_QUERY_INFO_NONE,
+				  NULL, error);
+	if (info == NULL)
+		return FALSE;
+	size = g_file_info_get_size (info);
+	mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	checksum = fu_provider_udev_digest_lookup (provider_udev, rom_fn,
+						   size, mtime, &generation);
+	if (checksum != NULL) {
+		g_debug ("using cached checksum for %s", rom_fn);
+		fu_provider_set_device_metadata (provider, device,
+						 FU_DEVICE_KEY_FIRMWARE_HASH,
+						 checksum);
+		return TRUE;
+	}
+
 	rom = fu_rom_new ();
 	if (!fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_BLANK_PPID, NULL, error))
 		return FALSE;
-	fu_device_set_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH,
-				fu_rom_get_checksum (rom));
+	fu_provider_udev_digest_insert (provider_udev, rom_fn, size, mtime,
+					generation, fu_rom_get_checksum (rom));
+	fu_provider_set_device_metadata (provider, device,
+					 FU_DEVICE_KEY_FIRMWARE_HASH,
+					 fu_rom_get_checksum (rom));
 	return TRUE;
 }
 
+/**
+ * fu_provider_udev_rom_cache_save:
+ **/
+static void
+fu_provider_udev_rom_cache_save (FuProviderUdev *provider_udev)
+{
+	FuProviderUdevPrivate *priv = provider_udev->priv;
+	gsize len;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_free_ gchar *data = NULL;
+	_cleanup_free_ gchar *dirname = NULL;
+
+	dirname = g_path_get_dirname (priv->rom_cache_fn);
+	if (g_mkdir_with_parents (dirname, 0755) < 0) {
+		g_warning ("Failed to create %s", dirname);
+		return;
+	}
+	data = g_key_file_to_data (priv->rom_cache, &len, NULL);
+	if (!g_file_set_contents (priv->rom_cache_fn, data, len, &error))
+		g_warning ("Failed to save ROM cache: %s", error->message);
+}
+
+/**
+ * fu_provider_udev_rom_helper_free:
+ **/
+static void
+fu_provider_udev_rom_helper_free (FuProviderUdevRomHelper *helper)
+{
+	g_object_unref (helper->provider_udev);
+	g_object_unref (helper->device);
+	g_free (helper->rom_fn);
+	g_free (helper->revision);
+	g_free (helper->version);
+	g_free (helper->guid);
+	g_free (helper);
+}
+
+/**
+ * fu_provider_udev_rom_load_thread_cb:
+ **/
+static void
+fu_provider_udev_rom_load_thread_cb (GTask *task,
+				     gpointer source_object,
+				     gpointer task_data,
+				     GCancellable *cancellable)
+{
+	FuProviderUdevRomHelper *helper = (FuProviderUdevRomHelper *) task_data;
+	GError *error = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+	_cleanup_object_unref_ FuRom *rom = NULL;
+
+	file = g_file_new_for_path (helper->rom_fn);
+	rom = fu_rom_new ();
+	if (!fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_HEADER_ONLY,
+			       cancellable, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	helper->version = g_strdup (fu_rom_get_version (rom));
+	helper->guid = g_strdup (fu_rom_get_guid (rom));
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * fu_provider_udev_rom_loaded_cb:
+ **/
+static void
+fu_provider_udev_rom_loaded_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuProviderUdevRomHelper *helper;
+	FuProviderUdev *provider_udev = FU_PROVIDER_UDEV (source);
+	FuDevice *dev;
+	_cleanup_error_free_ GError *error = NULL;
+
+	helper = g_task_get_task_data (G_TASK (res));
+	if (!g_task_propagate_boolean (G_TASK (res), &error)) {
+		g_warning ("Failed to parse ROM from %s: %s",
+			   helper->rom_fn, error->message);
+	}
+
+	/* save for next time, even if the device has gone away */
+	if (helper->version != NULL) {
+		const gchar *id = fu_device_get_id (helper->device);
+		g_key_file_set_string (provider_udev->priv->rom_cache,
+				       id, "Revision",
+				       helper->revision != NULL ? helper->revision : "");
+		g_key_file_set_string (provider_udev->priv->rom_cache,
+				       id, FU_DEVICE_KEY_VERSION, helper->version);
+		if (helper->guid != NULL) {
+			g_key_file_set_string (provider_udev->priv->rom_cache,
+					       id, FU_DEVICE_KEY_GUID, helper->guid);
+		}
+		fu_provider_udev_rom_cache_save (provider_udev);
+	}
+
+	/* device was removed while we were reading the ROM */
+	dev = g_hash_table_lookup (provider_udev->priv->devices,
+				   fu_device_get_id (helper->device));
+	if (dev != helper->device)
+		return;
+
+	/* the device is no use without a version, as before the ROM was
+	 * parsed in the background */
+	fu_provider_device_remove (FU_PROVIDER (provider_udev), dev);
+	if (helper->version == NULL) {
+		g_debug ("no ROM version for %s, removing", fu_device_get_id (dev));
+		g_hash_table_remove (provider_udev->priv->devices,
+				     fu_device_get_id (helper->device));
+		return;
+	}
+
+	/* prefer the GUID from the firmware, and re-add the device so that
+	 * any listeners can index the new data */
+	fu_device_set_metadata (dev, FU_DEVICE_KEY_VERSION, helper->version);
+	if (helper->guid != NULL)
+		fu_device_set_guid (dev, helper->guid);
+	fu_provider_device_add (FU_PROVIDER (provider_udev), dev);
+}
+
 /**
  * fu_provider_udev_client_add:
  **/
@@ -109,7 +371,9 @@ fu_provider_udev_client_add (FuProviderUdev *provider_udev, GUdevDevice *device)
 	const gchar *display_name;
 	const gchar *guid;
 	const gchar *product;
+	const gchar *revision;
 	const gchar *vendor;
+	gboolean rom_pending = FALSE;
 	_cleanup_free_ gchar *guid_new = NULL;
 	_cleanup_free_ gchar *id = NULL;
 	_cleanup_free_ gchar *rom_fn = NULL;
@@ -156,29 +420,34 @@ fu_provider_udev_client_add (FuProviderUdev *provider_udev, GUdevDevice *device)
 		version = g_strdup (split[2]);
 	}
 
-	/* get the FW version from the rom */
+	/* get the FW version from the rom, using the cache if the
+	 * hardware revision has not changed */
 	rom_fn = g_build_filename (g_udev_device_get_sysfs_path (device), "rom", NULL);
 	if (g_file_test (rom_fn, G_FILE_TEST_EXISTS)) {
-		_cleanup_error_free_ GError *error = NULL;
-		_cleanup_object_unref_ GFile *file = NULL;
-		_cleanup_object_unref_ FuRom *rom = NULL;
-		file = g_file_new_for_path (rom_fn);
-		rom = fu_rom_new ();
-		if (!fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_BLANK_PPID, NULL, &error)) {
-			g_warning ("Failed to parse ROM from %s: %s",
-				   rom_fn, error->message);
+		_cleanup_free_ gchar *revision_old = NULL;
+		revision = g_udev_device_get_sysfs_attr (device, "revision");
+		revision_old = g_key_file_get_string (provider_udev->priv->rom_cache,
+						      id, "Revision", NULL);
+		if (revision_old != NULL &&
+		    g_strcmp0 (revision_old, revision != NULL ? revision : "") == 0) {
+			g_free (version);
+			version = g_key_file_get_string (provider_udev->priv->rom_cache,
+							 id, FU_DEVICE_KEY_VERSION, NULL);
+
+			/* prefer the GUID from the firmware rather than the
+			 * hardware as the firmware may be more generic, which
+			 * also allows us to match the GUID when doing 'verify'
+			 * on a device with a different PID to the firmware */
+			guid_new = g_key_file_get_string (provider_udev->priv->rom_cache,
+							  id, FU_DEVICE_KEY_GUID, NULL);
+			g_debug ("using cached ROM data for %s", id);
+		} else {
+			rom_pending = TRUE;
 		}
-		version = g_strdup (fu_rom_get_version (rom));
-
-		/* prefer the GUID from the firmware rather than the
-		 * hardware as the firmware may be more generic, which
-		 * also allows us to match the GUID when doing 'verify'
-		 * on a device with a different PID to the firmware */
-		guid_new = g_strdup (fu_rom_get_guid (rom));
 	}
 
 	/* we failed */
-	if (version == NULL)
+	if (version == NULL && !rom_pending)
 		return;
 
 	/* no GUID from the ROM, so fix up the VID:PID */
@@ -206,13 +475,30 @@ fu_provider_udev_client_add (FuProviderUdev *provider_udev, GUdevDevice *device)
 		vendor = g_udev_device_get_property (device, "ID_VENDOR_FROM_DATABASE");
 	if (vendor != NULL)
 		fu_device_set_metadata (dev, FU_DEVICE_KEY_VENDOR, vendor);
-	fu_device_set_metadata (dev, FU_DEVICE_KEY_VERSION, version);
+	if (version != NULL)
+		fu_device_set_metadata (dev, FU_DEVICE_KEY_VERSION, version);
 	if (g_file_test (rom_fn, G_FILE_TEST_EXISTS))
 		fu_device_set_metadata (dev, "RomFilename", rom_fn);
 
 	/* insert to hash */
 	g_hash_table_insert (provider_udev->priv->devices, g_strdup (id), dev);
 	fu_provider_device_add (FU_PROVIDER (provider_udev), dev);
+
+	/* parse the ROM without blocking startup */
+	if (rom_pending) {
+		FuProviderUdevRomHelper *helper;
+		_cleanup_object_unref_ GTask *task = NULL;
+		helper = g_new0 (FuProviderUdevRomHelper, 1);
+		helper->provider_udev = g_object_ref (provider_udev);
+		helper->device = g_object_ref (dev);
+		helper->rom_fn = g_strdup (rom_fn);
+		helper->revision = g_strdup (g_udev_device_get_sysfs_attr (device, "revision"));
+		task = g_task_new (provider_udev, NULL,
+				   fu_provider_udev_rom_loaded_cb, NULL);
+		g_task_set_task_data (task, helper,
+				      (GDestroyNotify) fu_provider_udev_rom_helper_free);
+		g_task_run_in_thread (task, fu_provider_udev_rom_load_thread_cb);
+	}
 }
 
 /**
@@ -234,6 +520,7 @@ fu_provider_udev_client_remove (FuProviderUdev *provider_udev, GUdevDevice *devi
 	if (dev == NULL)
 		return;
 	fu_provider_device_remove (FU_PROVIDER (provider_udev), dev);
+	g_hash_table_remove (provider_udev->priv->devices, id);
 }
 
 /**
@@ -245,6 +532,9 @@ fu_provider_udev_client_uevent_cb (GUdevClient *gudev_client,
 				   GUdevDevice *udev_device,
 				   FuProviderUdev *provider_udev)
 {
+	/* the device may have been reflashed or replaced */
+	fu_provider_udev_digest_invalidate (provider_udev, udev_device);
+
 	if (g_strcmp0 (action, "remove") == 0) {
 		fu_provider_udev_client_remove (provider_udev, udev_device);
 		return;
@@ -283,6 +573,23 @@ fu_provider_udev_coldplug (FuProvider *provider, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_udev_get_snapshot_key:
+ **/
+static gchar *
+fu_provider_udev_get_snapshot_key (FuProvider *provider)
+{
+	_cleanup_free_ gchar *pci = NULL;
+	_cleanup_free_ gchar *usb = NULL;
+
+	/* both subsystems are enumerated on coldplug */
+	pci = fu_provider_get_sysfs_key ("/sys/bus/pci/devices");
+	usb = fu_provider_get_sysfs_key ("/sys/bus/usb/devices");
+	if (pci == NULL || usb == NULL)
+		return NULL;
+	return g_strdup_printf ("%s:%s", pci, usb);
+}
+
 /**
  * fu_provider_udev_class_init:
  **/
@@ -294,6 +601,7 @@ fu_provider_udev_class_init (FuProviderUdevClass *klass)
 
 	provider_class->get_name = fu_provider_udev_get_name;
 	provider_class->coldplug = fu_provider_udev_coldplug;
+	provider_class->get_snapshot_key = fu_provider_udev_get_snapshot_key;
 	provider_class->verify = fu_provider_udev_verify;
 	object_class->finalize = fu_provider_udev_finalize;
 
@@ -311,6 +619,18 @@ fu_provider_udev_init (FuProviderUdev *provider_udev)
 	provider_udev->priv->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
 							      g_free, (GDestroyNotify) g_object_unref);
 	provider_udev->priv->gudev_client = g_udev_client_new (subsystems);
+	provider_udev->priv->rom_cache = g_key_file_new ();
+	provider_udev->priv->rom_cache_fn = g_build_filename (LOCALSTATEDIR, "lib", "fwupd",
+							      "rom-cache.conf", NULL);
+	g_key_file_load_from_file (provider_udev->priv->rom_cache,
+				   provider_udev->priv->rom_cache_fn,
+				   G_KEY_FILE_NONE, NULL);
+	provider_udev->priv->digests = g_hash_table_new_full (g_str_hash, g_str_equal,
+							      g_free, (GDestroyNotify) fu_provider_udev_digest_free);
+	g_mutex_init (&provider_udev->priv->digests_mutex);
+
+	/* reading back each ROM is independent */
+	fu_provider_set_allow_parallel (FU_PROVIDER (provider_udev), TRUE);
 	g_signal_connect (provider_udev->priv->gudev_client, "uevent",
 			  G_CALLBACK (fu_provider_udev_client_uevent_cb), provider_udev);
 }
@@ -326,6 +646,10 @@ fu_provider_udev_finalize (GObject *object)
 
 	g_hash_table_unref (priv->devices);
 	g_object_unref (priv->gudev_client);
+	g_key_file_unref (priv->rom_cache);
+	g_free (priv->rom_cache_fn);
+	g_hash_table_unref (priv->digests);
+	g_mutex_clear (&priv->digests_mutex);
 
 	G_OBJECT_CLASS (fu_provider_udev_parent_class)->finalize (object);
 }
@@ -25,6 +25,7 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 #include <fwup.h>
+#include <unistd.h>
 
 #include "fu-cleanup.h"
 #include "fu-device.h"
@@ -240,6 +241,146 @@ out:
 	return ret;
 }
 
+/**
+ * fu_provider_uefi_stage_offline:
+ *
+ * Looks up all the resources in one pass over the ESRT and checks they
+ * exist before any capsule is written to the ESP. libfwup cannot undo a
+ * capsule once it has been set up, so if one fails to be written the
+ * others are still staged and the failure is recorded on that capsule.
+ **/
+static gboolean
+fu_provider_uefi_stage_offline (FuProvider *provider,
+				GPtrArray *capsules,
+				FuProviderFlags flags,
+				GError **error)
+{
+	FuProviderCapsule *capsule;
+	FuProviderCapsule *capsule_first;
+	fwup_resource_iter *iter = NULL;
+	fwup_resource *re = NULL;
+	gboolean ret = TRUE;
+	guint64 hardware_instance = 0;	/* FIXME */
+	guint i;
+	guint staged = 0;
+	_cleanup_hashtable_unref_ GHashTable *firsts = NULL;
+	_cleanup_hashtable_unref_ GHashTable *guids = NULL;
+	_cleanup_hashtable_unref_ GHashTable *jobs = NULL;
+
+	/* the iterator reuses the resource, so only keep the GUIDs */
+	guids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	fwup_resource_iter_create (&iter);
+	while (fwup_resource_iter_next (iter, &re) > 0) {
+		efi_guid_t *guid_raw;
+		gchar *guid = NULL;
+		fwup_get_guid (re, &guid_raw);
+		if (efi_guid_to_str (guid_raw, &guid) < 0) {
+			g_warning ("failed to convert guid to string");
+			continue;
+		}
+		g_hash_table_add (guids, guid);
+	}
+	fwup_resource_iter_destroy (&iter);
+
+	/* validate, and only write one capsule per resource */
+	firsts = g_hash_table_new (g_str_hash, g_str_equal);
+	jobs = g_hash_table_new (g_str_hash, g_str_equal);
+	for (i = 0; i < capsules->len; i++) {
+		const gchar *guid;
+		capsule = g_ptr_array_index (capsules, i);
+		guid = fu_device_get_guid (capsule->device);
+		if (!g_hash_table_contains (guids, guid)) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_NOT_SUPPORTED,
+				     "No UEFI firmware matched %s",
+				     guid);
+			return FALSE;
+		}
+		if (g_hash_table_contains (firsts, guid)) {
+			g_debug ("capsule for %s already staged", guid);
+			capsule->merged = TRUE;
+			continue;
+		}
+		g_hash_table_insert (firsts, (gpointer) guid, capsule);
+		g_hash_table_insert (jobs, (gpointer) guid, capsule);
+	}
+	if (g_hash_table_size (jobs) == 0)
+		return TRUE;
+
+	/* perform the updates while the resource is current */
+	g_debug ("Performing %u UEFI capsule updates", g_hash_table_size (jobs));
+	fu_provider_set_status (provider, FWUPD_STATUS_SCHEDULING);
+	fwup_resource_iter_create (&iter);
+	while (fwup_resource_iter_next (iter, &re) > 0) {
+		efi_guid_t *guid_raw;
+		_cleanup_free_ gchar *guid = NULL;
+		fwup_get_guid (re, &guid_raw);
+		if (efi_guid_to_str (guid_raw, &guid) < 0)
+			continue;
+		capsule = g_hash_table_lookup (jobs, guid);
+		if (capsule == NULL)
+			continue;
+		g_hash_table_remove (jobs, guid);
+		if (fwup_set_up_update (re, hardware_instance, capsule->fd) < 0) {
+			g_set_error (&capsule->error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_NOT_SUPPORTED,
+				     "UEFI firmware update failed: %s",
+				     strerror (errno));
+			g_warning ("failed to stage %s: %s",
+				   fu_device_get_id (capsule->device),
+				   capsule->error->message);
+			continue;
+		}
+		staged++;
+	}
+
+	/* the hardware went away between the two passes */
+	if (g_hash_table_size (jobs) > 0) {
+		GHashTableIter hash_iter;
+		g_hash_table_iter_init (&hash_iter, jobs);
+		while (g_hash_table_iter_next (&hash_iter, NULL, (gpointer *) &capsule)) {
+			g_set_error (&capsule->error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_NOT_SUPPORTED,
+				     "No UEFI firmware matched %s",
+				     fu_device_get_guid (capsule->device));
+		}
+	}
+
+	/* nothing was written, so return the error of the first capsule */
+	if (staged == 0) {
+		for (i = 0; i < capsules->len; i++) {
+			capsule = g_ptr_array_index (capsules, i);
+			if (capsule->merged || capsule->error == NULL)
+				continue;
+			g_propagate_error (error, capsule->error);
+			capsule->error = NULL;
+			break;
+		}
+		ret = FALSE;
+		goto out;
+	}
+
+	/* the capsules sharing a resource share its result */
+	for (i = 0; i < capsules->len; i++) {
+		capsule = g_ptr_array_index (capsules, i);
+		if (!capsule->merged)
+			continue;
+		capsule_first = g_hash_table_lookup (firsts,
+						     fu_device_get_guid (capsule->device));
+		if (capsule_first->error != NULL)
+			capsule->error = g_error_copy (capsule_first->error);
+	}
+
+	/* flush all the capsules to the ESP at once */
+	sync ();
+out:
+	fwup_resource_iter_destroy (&iter);
+	return ret;
+}
+
 /**
  * fu_provider_uefi_coldplug:
  **/
@@ -309,6 +450,15 @@ fu_provider_uefi_coldplug (FuProvider *provider, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_uefi_get_snapshot_key:
+ **/
+static gchar *
+fu_provider_uefi_get_snapshot_key (FuProvider *provider)
+{
+	return fu_provider_get_sysfs_key ("/sys/firmware/efi/esrt/entries");
+}
+
 /**
  * fu_provider_uefi_class_init:
  **/
@@ -320,7 +470,9 @@ fu_provider_uefi_class_init (FuProviderUefiClass *klass)
 
 	provider_class->get_name = fu_provider_uefi_get_name;
 	provider_class->coldplug = fu_provider_uefi_coldplug;
+	provider_class->get_snapshot_key = fu_provider_uefi_get_snapshot_key;
 	provider_class->update_offline = fu_provider_uefi_update;
+	provider_class->stage_offline = fu_provider_uefi_stage_offline;
 	provider_class->clear_results = fu_provider_uefi_clear_results;
 	provider_class->get_results = fu_provider_uefi_get_results;
 	object_class->finalize = fu_provider_uefi_finalize;
@@ -64,14 +64,15 @@ fu_provider_usb_get_id (GUsbDevice *device)
 }
 
 /**
- * fu_provider_usb_device_added_cb:
+ * fu_provider_usb_hotplug_probe:
+ *
+ * This is run in a worker thread.
  **/
-static void
-fu_provider_usb_device_added_cb (GUsbContext *ctx,
-				 GUsbDevice *device,
-				 FuProviderUsb *provider_usb)
+static gpointer
+fu_provider_usb_hotplug_probe (FuProvider *provider, GObject *object)
 {
-	FuDevice *dev;
+	GUsbDevice *device = G_USB_DEVICE (object);
+	FuDevice *dev = NULL;
 	guint8 idx = 0x00;
 	_cleanup_error_free_ GError *error = NULL;
 	_cleanup_free_ gchar *guid = NULL;
@@ -79,30 +80,11 @@ fu_provider_usb_device_added_cb (GUsbContext *ctx,
 	_cleanup_free_ gchar *product = NULL;
 	_cleanup_free_ gchar *version = NULL;
 
-	/* ignore hubs */
-#if G_USB_CHECK_VERSION(0,2,5)
-	if (g_usb_device_get_device_class (device) == G_USB_DEVICE_CLASS_HUB)
-		return;
-#endif
-
-	/* handled by another provider */
-	id = fu_provider_usb_get_id (device);
-	if (g_usb_device_get_vid (device) == 0x273f) {
-		g_debug ("handling %s in another provider", id);
-		return;
-	}
-
-	/* is already in database */
-	dev = g_hash_table_lookup (provider_usb->priv->devices, id);
-	if (dev != NULL) {
-		g_debug ("ignoring duplicate %s", id);
-		return;
-	}
-
 	/* try to get the version without claiming interface */
+	id = fu_provider_usb_get_id (device);
 	if (!g_usb_device_open (device, &error)) {
 		g_debug ("Failed to open: %s", error->message);
-		return;
+		return NULL;
 	}
 #if G_USB_CHECK_VERSION(0,2,5)
 	idx = g_usb_device_get_custom_index (device,
@@ -129,11 +111,6 @@ fu_provider_usb_device_added_cb (GUsbContext *ctx,
 		fu_device_set_guid (dev, guid);
 		fu_device_set_display_name (dev, product);
 		fu_device_set_metadata (dev, FU_DEVICE_KEY_VERSION, version);
-
-		/* insert to hash */
-		g_hash_table_insert (provider_usb->priv->devices,
-				     g_strdup (id), dev);
-		fu_provider_device_add (FU_PROVIDER (provider_usb), dev);
 	} else {
 		g_debug ("ignoring %s [%s:%s:%s]", id,
 			 product != NULL ? product : "",
@@ -144,25 +121,91 @@ fu_provider_usb_device_added_cb (GUsbContext *ctx,
 	/* we're done here */
 	if (!g_usb_device_close (device, &error))
 		g_debug ("Failed to close: %s", error->message);
+	return dev;
 }
 
 /**
- * fu_provider_usb_device_removed_cb:
+ * fu_provider_usb_hotplug_added:
  **/
 static void
-fu_provider_usb_device_removed_cb (GUsbContext *ctx,
-				   GUsbDevice *device,
-				   FuProviderUsb *provider_usb)
+fu_provider_usb_hotplug_added (FuProvider *provider, GObject *object, gpointer data)
 {
+	FuProviderUsb *provider_usb = FU_PROVIDER_USB (provider);
+	FuDevice *dev = FU_DEVICE (data);
+
+	/* insert to hash */
+	g_hash_table_insert (provider_usb->priv->devices,
+			     g_strdup (fu_device_get_id (dev)), dev);
+	fu_provider_device_add (provider, dev);
+}
+
+/**
+ * fu_provider_usb_hotplug_removed:
+ **/
+static void
+fu_provider_usb_hotplug_removed (FuProvider *provider, GObject *object)
+{
+	FuProviderUsb *provider_usb = FU_PROVIDER_USB (provider);
 	FuDevice *dev;
 	_cleanup_free_ gchar *id = NULL;
 
 	/* already in database */
-	id = fu_provider_usb_get_id (device);
+	id = fu_provider_usb_get_id (G_USB_DEVICE (object));
 	dev = g_hash_table_lookup (provider_usb->priv->devices, id);
 	if (dev == NULL)
 		return;
-	fu_provider_device_remove (FU_PROVIDER (provider_usb), dev);
+	fu_provider_device_remove (provider, dev);
+	g_hash_table_remove (provider_usb->priv->devices, id);
+}
+
+/**
+ * fu_provider_usb_device_added_cb:
+ **/
+static void
+fu_provider_usb_device_added_cb (GUsbContext *ctx,
+				 GUsbDevice *device,
+				 FuProviderUsb *provider_usb)
+{
+	FuDevice *dev;
+	_cleanup_free_ gchar *id = NULL;
+
+	/* ignore hubs */
+#if G_USB_CHECK_VERSION(0,2,5)
+	if (g_usb_device_get_device_class (device) == G_USB_DEVICE_CLASS_HUB)
+		return;
+#endif
+
+	/* handled by another provider */
+	id = fu_provider_usb_get_id (device);
+	if (g_usb_device_get_vid (device) == 0x273f) {
+		g_debug ("handling %s in another provider", id);
+		return;
+	}
+
+	/* is already in database, unless it was unplugged so recently that
+	 * the removal has not been processed yet */
+	dev = g_hash_table_lookup (provider_usb->priv->devices, id);
+	if (dev != NULL &&
+	    !fu_provider_hotplug_has_removal (FU_PROVIDER (provider_usb), id)) {
+		g_debug ("ignoring duplicate %s", id);
+		return;
+	}
+
+	/* opening the device is slow, so probe in batches */
+	fu_provider_hotplug_add (FU_PROVIDER (provider_usb), id, G_OBJECT (device));
+}
+
+/**
+ * fu_provider_usb_device_removed_cb:
+ **/
+static void
+fu_provider_usb_device_removed_cb (GUsbContext *ctx,
+				   GUsbDevice *device,
+				   FuProviderUsb *provider_usb)
+{
+	_cleanup_free_ gchar *id = NULL;
+	id = fu_provider_usb_get_id (device);
+	fu_provider_hotplug_remove (FU_PROVIDER (provider_usb), id, G_OBJECT (device));
 }
 
 /**
@@ -176,6 +219,15 @@ fu_provider_usb_coldplug (FuProvider *provider, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_usb_get_snapshot_key:
+ **/
+static gchar *
+fu_provider_usb_get_snapshot_key (FuProvider *provider)
+{
+	return fu_provider_get_sysfs_key ("/sys/bus/usb/devices");
+}
+
 /**
  * fu_provider_usb_class_init:
  **/
@@ -187,6 +239,10 @@ fu_provider_usb_class_init (FuProviderUsbClass *klass)
 
 	provider_class->get_name = fu_provider_usb_get_name;
 	provider_class->coldplug = fu_provider_usb_coldplug;
+	provider_class->hotplug_probe = fu_provider_usb_hotplug_probe;
+	provider_class->hotplug_added = fu_provider_usb_hotplug_added;
+	provider_class->hotplug_removed = fu_provider_usb_hotplug_removed;
+	provider_class->get_snapshot_key = fu_provider_usb_get_snapshot_key;
 	object_class->finalize = fu_provider_usb_finalize;
 
 	g_type_class_add_private (klass, sizeof (FuProviderUsbPrivate));
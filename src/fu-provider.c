@@ -24,10 +24,13 @@
 #include <fwupd.h>
 #include <appstream-glib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib-object.h>
 #include <gio/gio.h>
 #include <gio/gunixinputstream.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "fu-cleanup.h"
 #include "fu-device.h"
@@ -35,15 +38,61 @@
 #include "fu-provider-uefi.h"
 
 static void     fu_provider_finalize	(GObject	*object);
+static void     fu_provider_hotplug_schedule	(FuProvider	*provider);
 
 #define FU_PROVIDER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), FU_TYPE_PROVIDER, FuProviderPrivate))
 
-#define FU_PROVIDER_FIRMWARE_MAX	(32 * 1024 * 1024)	/* bytes */
+#define FU_PROVIDER_PROGRESS_INTERVAL	250			/* ms */
+#define FU_PROVIDER_HOTPLUG_DELAY	100			/* ms */
+#define FU_PROVIDER_HOTPLUG_DELAY_MAX	1000			/* ms */
+#define FU_PROVIDER_HOTPLUG_PROBE_MAX	4			/* threads */
+
+/**
+ * FuProviderPrivate:
+ **/
+typedef struct {
+	GThread			*thread;	/* that created the provider */
+	gboolean		 allow_parallel;
+	GThreadPool		*task_pool;	/* if not allow_parallel */
+	GMutex			 progress_mutex;
+	gint64			 progress_time;	/* us, of last emit */
+	guint			 progress_percentage;
+	GMutex			 hotplug_mutex;	/* for all the hotplug_ members */
+	GHashTable		*hotplug_events; /* id:FuProviderHotplugEvent */
+	guint			 hotplug_id;
+	gint64			 hotplug_first;	/* us */
+	gboolean		 hotplug_coldplug;
+	gpointer		 hotplug_batch;	/* FuProviderHotplugBatch, if probing */
+	GThreadPool		*hotplug_pool;
+} FuProviderPrivate;
+
+typedef struct {
+	GObject			*removed;
+	GObject			*added;
+} FuProviderHotplugEvent;
+
+typedef struct {
+	volatile gint		 refcount;	/* the owner, each probe and the idle */
+	FuProvider		*provider;
+	GPtrArray		*items;		/* of FuProviderHotplugItem */
+	GMutex			 mutex;		/* for pending and wait */
+	GCond			 cond;
+	guint			 pending;
+	gboolean		 wait;
+	gboolean		 published;	/* only used in the main thread */
+} FuProviderHotplugBatch;
+
+typedef struct {
+	FuProviderHotplugBatch	*batch;
+	GObject			*object;
+	gpointer		 data;
+} FuProviderHotplugItem;
 
 enum {
 	SIGNAL_DEVICE_ADDED,
 	SIGNAL_DEVICE_REMOVED,
 	SIGNAL_STATUS_CHANGED,
+	SIGNAL_PROGRESS_CHANGED,
 	SIGNAL_LAST
 };
 
@@ -87,9 +136,10 @@ fu_provider_offline_setup (GError **error)
 
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-	/* create symlink for the systemd-system-update-generator */
+	/* create symlink for the systemd-system-update-generator, which
+	 * may already exist if something else was scheduled this boot */
 	rc = symlink ("/var/lib/fwupd", FU_OFFLINE_TRIGGER_FILENAME);
-	if (rc < 0) {
+	if (rc < 0 && errno != EEXIST) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_INTERNAL,
@@ -101,6 +151,365 @@ fu_provider_offline_setup (GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_hotplug_event_free:
+ **/
+static void
+fu_provider_hotplug_event_free (FuProviderHotplugEvent *event)
+{
+	if (event->removed != NULL)
+		g_object_unref (event->removed);
+	if (event->added != NULL)
+		g_object_unref (event->added);
+	g_free (event);
+}
+
+/**
+ * fu_provider_hotplug_batch_ref:
+ **/
+static FuProviderHotplugBatch *
+fu_provider_hotplug_batch_ref (FuProviderHotplugBatch *batch)
+{
+	g_atomic_int_inc (&batch->refcount);
+	return batch;
+}
+
+/**
+ * fu_provider_hotplug_batch_unref:
+ **/
+static void
+fu_provider_hotplug_batch_unref (FuProviderHotplugBatch *batch)
+{
+	FuProviderHotplugItem *item;
+	guint i;
+
+	if (!g_atomic_int_dec_and_test (&batch->refcount))
+		return;
+	for (i = 0; i < batch->items->len; i++) {
+		item = g_ptr_array_index (batch->items, i);
+		g_object_unref (item->object);
+		g_free (item);
+	}
+	g_ptr_array_unref (batch->items);
+	g_mutex_clear (&batch->mutex);
+	g_cond_clear (&batch->cond);
+	g_object_unref (batch->provider);
+	g_free (batch);
+}
+
+/**
+ * fu_provider_hotplug_publish:
+ *
+ * Adds all the devices from the batch at once, so that they are sent to
+ * clients together. This drops the reference held by the provider, and does
+ * nothing if the batch has already been published.
+ **/
+static void
+fu_provider_hotplug_publish (FuProviderHotplugBatch *batch)
+{
+	FuProvider *provider = batch->provider;
+	FuProviderClass *klass = FU_PROVIDER_GET_CLASS (provider);
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderHotplugItem *item;
+	gboolean reschedule;
+	guint i;
+
+	if (batch->published)
+		return;
+	batch->published = TRUE;
+	g_debug ("publishing hotplug batch of %u devices", batch->items->len);
+	for (i = 0; i < batch->items->len; i++) {
+		item = g_ptr_array_index (batch->items, i);
+		if (item->data != NULL)
+			klass->hotplug_added (provider, item->object, item->data);
+	}
+
+	/* anything that arrived while we were probing */
+	g_mutex_lock (&priv->hotplug_mutex);
+	priv->hotplug_batch = NULL;
+	reschedule = g_hash_table_size (priv->hotplug_events) > 0 &&
+		     !priv->hotplug_coldplug;
+	g_mutex_unlock (&priv->hotplug_mutex);
+	if (reschedule)
+		fu_provider_hotplug_schedule (provider);
+	fu_provider_hotplug_batch_unref (batch);
+}
+
+/**
+ * fu_provider_hotplug_publish_cb:
+ **/
+static gboolean
+fu_provider_hotplug_publish_cb (gpointer user_data)
+{
+	FuProviderHotplugBatch *batch = (FuProviderHotplugBatch *) user_data;
+	fu_provider_hotplug_publish (batch);
+	fu_provider_hotplug_batch_unref (batch);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_provider_hotplug_probe_cb:
+ *
+ * Runs in the thread pool, so at most FU_PROVIDER_HOTPLUG_PROBE_MAX
+ * devices are opened at the same time. Each probe holds a reference on the
+ * batch, as a waiting thread may publish it as soon as the last one is done.
+ **/
+static void
+fu_provider_hotplug_probe_cb (gpointer data, gpointer user_data)
+{
+	FuProviderHotplugItem *item = (FuProviderHotplugItem *) data;
+	FuProviderHotplugBatch *batch = item->batch;
+	FuProviderClass *klass = FU_PROVIDER_GET_CLASS (batch->provider);
+
+	item->data = klass->hotplug_probe (batch->provider, item->object);
+
+	g_mutex_lock (&batch->mutex);
+	if (--batch->pending == 0) {
+		if (batch->wait) {
+			g_cond_signal (&batch->cond);
+		} else {
+			g_idle_add (fu_provider_hotplug_publish_cb,
+				    fu_provider_hotplug_batch_ref (batch));
+		}
+	}
+	g_mutex_unlock (&batch->mutex);
+	fu_provider_hotplug_batch_unref (batch);
+}
+
+/**
+ * fu_provider_hotplug_batch_wait:
+ *
+ * Waits for all the devices in the batch to be probed and then publishes
+ * it, even if it was started without waiting and its idle is queued.
+ **/
+static void
+fu_provider_hotplug_batch_wait (FuProviderHotplugBatch *batch)
+{
+	g_mutex_lock (&batch->mutex);
+	batch->wait = TRUE;
+	while (batch->pending > 0)
+		g_cond_wait (&batch->cond, &batch->mutex);
+	g_mutex_unlock (&batch->mutex);
+	fu_provider_hotplug_publish (batch);
+}
+
+/**
+ * fu_provider_hotplug_flush:
+ *
+ * Removes the devices that have gone away and then probes the new ones,
+ * waiting for the results if @wait is set. Only one batch is probed at a
+ * time, so events for the same device are always handled in order, and
+ * when waiting any batch that is already being probed is published first.
+ *
+ * This must be called from the main thread.
+ **/
+static void
+fu_provider_hotplug_flush (FuProvider *provider, gboolean wait)
+{
+	FuProviderClass *klass = FU_PROVIDER_GET_CLASS (provider);
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderHotplugBatch *batch;
+	FuProviderHotplugEvent *event;
+	FuProviderHotplugItem *item;
+	GHashTableIter iter;
+	guint i;
+	_cleanup_ptrarray_unref_ GPtrArray *removed = NULL;
+
+	/* the current batch flushes again when it is published */
+	g_mutex_lock (&priv->hotplug_mutex);
+	batch = priv->hotplug_batch;
+	if (batch != NULL) {
+		if (!wait) {
+			g_mutex_unlock (&priv->hotplug_mutex);
+			return;
+		}
+		fu_provider_hotplug_batch_ref (batch);
+		g_mutex_unlock (&priv->hotplug_mutex);
+		fu_provider_hotplug_batch_wait (batch);
+		fu_provider_hotplug_batch_unref (batch);
+		g_mutex_lock (&priv->hotplug_mutex);
+	}
+	removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	batch = g_new0 (FuProviderHotplugBatch, 1);
+	batch->refcount = 1;
+	batch->provider = g_object_ref (provider);
+	batch->items = g_ptr_array_new ();
+	batch->wait = wait;
+	g_mutex_init (&batch->mutex);
+	g_cond_init (&batch->cond);
+	g_hash_table_iter_init (&iter, priv->hotplug_events);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &event)) {
+		if (event->removed != NULL)
+			g_ptr_array_add (removed, g_object_ref (event->removed));
+		if (event->added != NULL) {
+			item = g_new0 (FuProviderHotplugItem, 1);
+			item->batch = batch;
+			item->object = g_object_ref (event->added);
+			g_ptr_array_add (batch->items, item);
+		}
+	}
+	g_hash_table_remove_all (priv->hotplug_events);
+	batch->pending = batch->items->len;
+	if (batch->pending > 0) {
+		priv->hotplug_batch = batch;
+		if (priv->hotplug_pool == NULL) {
+			priv->hotplug_pool = g_thread_pool_new (fu_provider_hotplug_probe_cb,
+								NULL,
+								FU_PROVIDER_HOTPLUG_PROBE_MAX,
+								FALSE, NULL);
+		}
+	}
+	g_mutex_unlock (&priv->hotplug_mutex);
+
+	/* devices that have gone away */
+	for (i = 0; i < removed->len; i++)
+		klass->hotplug_removed (provider, g_ptr_array_index (removed, i));
+	if (batch->pending == 0) {
+		fu_provider_hotplug_batch_unref (batch);
+		return;
+	}
+
+	/* probe the new devices */
+	g_debug ("probing hotplug batch of %u devices", batch->items->len);
+	for (i = 0; i < batch->items->len; i++) {
+		fu_provider_hotplug_batch_ref (batch);
+		g_thread_pool_push (priv->hotplug_pool, g_ptr_array_index (batch->items, i), NULL);
+	}
+	if (wait)
+		fu_provider_hotplug_batch_wait (batch);
+}
+
+/**
+ * fu_provider_hotplug_flush_cb:
+ **/
+static gboolean
+fu_provider_hotplug_flush_cb (gpointer user_data)
+{
+	FuProvider *provider = FU_PROVIDER (user_data);
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+
+	priv->hotplug_id = 0;
+	fu_provider_hotplug_flush (provider, FALSE);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_provider_hotplug_schedule:
+ *
+ * Waits for hotplug events to stop arriving, for instance when a hub full
+ * of devices is plugged in, but never for longer than
+ * FU_PROVIDER_HOTPLUG_DELAY_MAX.
+ **/
+static void
+fu_provider_hotplug_schedule (FuProvider *provider)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	gint64 now = g_get_monotonic_time ();
+
+	if (priv->hotplug_id != 0) {
+		if (now - priv->hotplug_first > FU_PROVIDER_HOTPLUG_DELAY_MAX * 1000)
+			return;
+		g_source_remove (priv->hotplug_id);
+	} else {
+		priv->hotplug_first = now;
+	}
+	priv->hotplug_id = g_timeout_add (FU_PROVIDER_HOTPLUG_DELAY,
+					  fu_provider_hotplug_flush_cb, provider);
+}
+
+/**
+ * fu_provider_hotplug_get_event:
+ *
+ * Must be called with hotplug_mutex held.
+ **/
+static FuProviderHotplugEvent *
+fu_provider_hotplug_get_event (FuProviderPrivate *priv, const gchar *id)
+{
+	FuProviderHotplugEvent *event;
+
+	event = g_hash_table_lookup (priv->hotplug_events, id);
+	if (event == NULL) {
+		event = g_new0 (FuProviderHotplugEvent, 1);
+		g_hash_table_insert (priv->hotplug_events, g_strdup (id), event);
+	}
+	return event;
+}
+
+/**
+ * fu_provider_hotplug_add:
+ *
+ * Queues a new device to be probed using the hotplug_probe vfunc and then
+ * added using hotplug_added. Devices that appear during coldplug are added
+ * before fu_provider_coldplug() returns.
+ **/
+void
+fu_provider_hotplug_add (FuProvider *provider, const gchar *id, GObject *object)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderHotplugEvent *event;
+	gboolean coldplug;
+
+	g_mutex_lock (&priv->hotplug_mutex);
+	event = fu_provider_hotplug_get_event (priv, id);
+	if (event->added != NULL)
+		g_object_unref (event->added);
+	event->added = g_object_ref (object);
+	coldplug = priv->hotplug_coldplug;
+	g_mutex_unlock (&priv->hotplug_mutex);
+	if (!coldplug)
+		fu_provider_hotplug_schedule (provider);
+}
+
+/**
+ * fu_provider_hotplug_remove:
+ *
+ * Queues the device to be removed using the hotplug_removed vfunc, or just
+ * drops it if it was added so recently that it has not been probed yet.
+ **/
+void
+fu_provider_hotplug_remove (FuProvider *provider, const gchar *id, GObject *object)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderHotplugEvent *event;
+	gboolean coldplug;
+
+	g_mutex_lock (&priv->hotplug_mutex);
+	event = fu_provider_hotplug_get_event (priv, id);
+	if (event->added != NULL) {
+		g_object_unref (event->added);
+		event->added = NULL;
+	} else if (event->removed == NULL) {
+		event->removed = g_object_ref (object);
+	}
+	if (event->added == NULL && event->removed == NULL)
+		g_hash_table_remove (priv->hotplug_events, id);
+	coldplug = priv->hotplug_coldplug;
+	g_mutex_unlock (&priv->hotplug_mutex);
+	if (!coldplug)
+		fu_provider_hotplug_schedule (provider);
+}
+
+/**
+ * fu_provider_hotplug_has_removal:
+ *
+ * Returns: %TRUE if the device has gone away but the removal is still
+ * waiting to be processed, in which case a device that is plugged back in
+ * has to be queued with fu_provider_hotplug_add() rather than ignored.
+ **/
+gboolean
+fu_provider_hotplug_has_removal (FuProvider *provider, const gchar *id)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderHotplugEvent *event;
+	gboolean ret;
+
+	g_mutex_lock (&priv->hotplug_mutex);
+	event = g_hash_table_lookup (priv->hotplug_events, id);
+	ret = event != NULL && event->removed != NULL;
+	g_mutex_unlock (&priv->hotplug_mutex);
+	return ret;
+}
+
 /**
  * fu_provider_coldplug:
  **/
@@ -108,39 +517,127 @@ gboolean
 fu_provider_coldplug (FuProvider *provider, GError **error)
 {
 	FuProviderClass *klass = FU_PROVIDER_GET_CLASS (provider);
-	if (klass->coldplug != NULL)
-		return klass->coldplug (provider, error);
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	gboolean reschedule;
+	gboolean ret;
+
+	if (klass->coldplug == NULL)
+		return TRUE;
+
+	/* probe everything found during enumeration in one batch */
+	g_mutex_lock (&priv->hotplug_mutex);
+	priv->hotplug_coldplug = TRUE;
+	g_mutex_unlock (&priv->hotplug_mutex);
+	ret = klass->coldplug (provider, error);
+	fu_provider_hotplug_flush (provider, TRUE);
+	g_mutex_lock (&priv->hotplug_mutex);
+	priv->hotplug_coldplug = FALSE;
+	reschedule = g_hash_table_size (priv->hotplug_events) > 0;
+	g_mutex_unlock (&priv->hotplug_mutex);
+
+	/* anything that arrived while the batch was being probed */
+	if (reschedule)
+		fu_provider_hotplug_schedule (provider);
+	return ret;
+}
+
+/**
+ * fu_provider_sync_filename:
+ **/
+static gboolean
+fu_provider_sync_filename (const gchar *filename, GError **error)
+{
+	gint fd;
+
+	fd = g_open (filename, O_RDONLY, 0);
+	if (fd < 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INTERNAL,
+			     "Failed to open %s: %s",
+			     filename, strerror (errno));
+		return FALSE;
+	}
+	if (fsync (fd) < 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INTERNAL,
+			     "Failed to sync %s: %s",
+			     filename, strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+	close (fd);
 	return TRUE;
 }
 
 /**
- * fu_provider_schedule_update:
+ * fu_provider_pending_device_new:
+ *
+ * Copies what the pending database needs from @device, as this may be
+ * running in a worker thread while the daemon changes the device.
+ **/
+static FuDevice *
+fu_provider_pending_device_new (FuDevice *device, const gchar *filename)
+{
+	FuDevice *device_pending;
+	guint i;
+	const gchar *keys[] = { FU_DEVICE_KEY_DISPLAY_NAME,
+				FU_DEVICE_KEY_PROVIDER,
+				FU_DEVICE_KEY_VERSION,
+				FU_DEVICE_KEY_UPDATE_VERSION,
+				NULL };
+
+	device_pending = fu_device_new ();
+	fu_device_set_id (device_pending, fu_device_get_id (device));
+	fu_device_set_metadata (device_pending, FU_DEVICE_KEY_FILENAME_CAB, filename);
+	for (i = 0; keys[i] != NULL; i++) {
+		_cleanup_free_ gchar *value = NULL;
+		value = fu_device_dup_metadata (device, keys[i]);
+		if (value != NULL)
+			fu_device_set_metadata (device_pending, keys[i], value);
+	}
+	return device_pending;
+}
+
+/**
+ * fu_provider_schedule_updates:
+ *
+ * Copies the cabinet into the pending store once for all the @devices,
+ * and adds them all to the database in a single transaction.
  **/
 static gboolean
-fu_provider_schedule_update (FuProvider *provider,
-			     FuDevice *device,
-			     GInputStream *stream,
-			     GError **error)
+fu_provider_schedule_updates (FuProvider *provider,
+			      GPtrArray *devices,
+			      GInputStream *stream,
+			      GError **error)
 {
+	FuDevice *device;
 	gchar tmpname[] = {"XXXXXX.cap"};
+	gssize written;
 	guint i;
-	_cleanup_bytes_unref_ GBytes *fwbin = NULL;
 	_cleanup_free_ gchar *dirname = NULL;
 	_cleanup_free_ gchar *filename = NULL;
-	_cleanup_object_unref_ FuDevice *device_tmp = NULL;
 	_cleanup_object_unref_ FuPending *pending = NULL;
 	_cleanup_object_unref_ GFile *file = NULL;
+	_cleanup_object_unref_ GFile *file_cab = NULL;
+	_cleanup_object_unref_ GOutputStream *stream_out = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices_pending = NULL;
 
-	/* id already exists */
+	/* check all the ids before writing anything */
 	pending = fu_pending_new ();
-	device_tmp = fu_pending_get_device (pending, fu_device_get_id (device), NULL);
-	if (device_tmp != NULL) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_ALREADY_PENDING,
-			     "%s is already scheduled to be updated",
-			     fu_device_get_id (device));
-		return FALSE;
+	for (i = 0; i < devices->len; i++) {
+		_cleanup_object_unref_ FuDevice *device_tmp = NULL;
+		device = g_ptr_array_index (devices, i);
+		device_tmp = fu_pending_get_device (pending, fu_device_get_id (device), NULL);
+		if (device_tmp != NULL) {
+			g_set_error (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_ALREADY_PENDING,
+				     "%s is already scheduled to be updated",
+				     fu_device_get_id (device));
+			return FALSE;
+		}
 	}
 
 	/* create directory */
@@ -156,34 +653,190 @@ fu_provider_schedule_update (FuProvider *provider,
 		tmpname[i] = g_random_int_range ('A', 'Z');
 	filename = g_build_filename (dirname, tmpname, NULL);
 
-	/* just copy to the temp file */
+	/* just copy to the temp file, without reading it all into RAM */
 	fu_provider_set_status (provider, FWUPD_STATUS_SCHEDULING);
 	if (!g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, error))
 		return FALSE;
-	fwbin = g_input_stream_read_bytes (stream,
-					   FU_PROVIDER_FIRMWARE_MAX,
-					   NULL, error);
-	if (fwbin == NULL)
+	file_cab = g_file_new_for_path (filename);
+	stream_out = G_OUTPUT_STREAM (g_file_replace (file_cab, NULL, FALSE,
+						      G_FILE_CREATE_NONE,
+						      NULL, error));
+	if (stream_out == NULL)
+		return FALSE;
+	written = g_output_stream_splice (stream_out, stream,
+					  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+					  NULL, error);
+	if (written < 0)
+		return FALSE;
+	if (written > FU_PROVIDER_FIRMWARE_MAX) {
+		g_file_delete (file_cab, NULL, NULL);
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INVALID_FILE,
+			     "firmware too large: %" G_GSSIZE_FORMAT " bytes",
+			     written);
 		return FALSE;
-	if (!g_file_set_contents (filename,
-				  g_bytes_get_data (fwbin, NULL),
-				  g_bytes_get_size (fwbin),
-				  error))
+	}
+
+	/* make sure the file survives the reboot before recording it */
+	if (!fu_provider_sync_filename (filename, error) ||
+	    !fu_provider_sync_filename (dirname, error)) {
+		g_file_delete (file_cab, NULL, NULL);
 		return FALSE;
+	}
 
 	/* schedule for next boot */
-	g_debug ("schedule %s to be installed to %s on next boot",
-		 filename, fu_device_get_id (device));
-	fu_device_set_metadata (device, FU_DEVICE_KEY_FILENAME_CAB, filename);
+	devices_pending = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = 0; i < devices->len; i++) {
+		device = g_ptr_array_index (devices, i);
+		g_debug ("schedule %s to be installed to %s on next boot",
+			 filename, fu_device_get_id (device));
+		fu_provider_set_device_metadata (provider, device,
+						 FU_DEVICE_KEY_FILENAME_CAB,
+						 filename);
+		g_ptr_array_add (devices_pending,
+				 fu_provider_pending_device_new (device, filename));
+	}
 
 	/* add to database */
-	if (!fu_pending_add_device (pending, device, error))
+	if (!fu_pending_add_devices (pending, devices_pending, error)) {
+		g_file_delete (file_cab, NULL, NULL);
 		return FALSE;
+	}
 
 	/* next boot we run offline */
 	return fu_provider_offline_setup (error);
 }
 
+/**
+ * fu_provider_schedule_update:
+ **/
+static gboolean
+fu_provider_schedule_update (FuProvider *provider,
+			     FuDevice *device,
+			     GInputStream *stream,
+			     GError **error)
+{
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+
+	devices = g_ptr_array_new ();
+	g_ptr_array_add (devices, device);
+	return fu_provider_schedule_updates (provider, devices, stream, error);
+}
+
+/**
+ * fu_provider_capsule_free:
+ *
+ * Frees the capsule and its error; the device and fd are not owned.
+ **/
+void
+fu_provider_capsule_free (FuProviderCapsule *capsule)
+{
+	if (capsule->error != NULL)
+		g_error_free (capsule->error);
+	g_free (capsule);
+}
+
+/**
+ * fu_provider_capsule_find:
+ **/
+static FuProviderCapsule *
+fu_provider_capsule_find (GPtrArray *capsules, FuDevice *device)
+{
+	FuProviderCapsule *capsule;
+	guint i;
+
+	for (i = 0; i < capsules->len; i++) {
+		capsule = g_ptr_array_index (capsules, i);
+		if (g_strcmp0 (fu_device_get_id (capsule->device),
+			       fu_device_get_id (device)) == 0)
+			return capsule;
+	}
+	return NULL;
+}
+
+/**
+ * fu_provider_stage_offline:
+ *
+ * Schedules all the @capsules to be installed on the next boot in one
+ * operation. Duplicate devices are only staged once, and are marked as
+ * merged.
+ *
+ * If %FALSE is returned then nothing was staged. Otherwise a capsule that
+ * could not be staged after others had been written has its error set,
+ * and a merged capsule shares the result of the one it was merged into.
+ **/
+gboolean
+fu_provider_stage_offline (FuProvider *provider,
+			   GPtrArray *capsules,
+			   GInputStream *stream_cab,
+			   FuProviderFlags flags,
+			   GError **error)
+{
+	FuProviderCapsule *capsule;
+	FuProviderClass *klass = FU_PROVIDER_GET_CLASS (provider);
+	guint i;
+	_cleanup_hashtable_unref_ GHashTable *ids = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *unique = NULL;
+
+	g_return_val_if_fail (FU_IS_PROVIDER (provider), FALSE);
+
+	/* deduplicate */
+	ids = g_hash_table_new (g_str_hash, g_str_equal);
+	unique = g_ptr_array_new ();
+	devices = g_ptr_array_new ();
+	for (i = 0; i < capsules->len; i++) {
+		capsule = g_ptr_array_index (capsules, i);
+		g_clear_error (&capsule->error);
+		capsule->merged = FALSE;
+		if (g_hash_table_contains (ids, fu_device_get_id (capsule->device))) {
+			g_debug ("%s already staged", fu_device_get_id (capsule->device));
+			capsule->merged = TRUE;
+			continue;
+		}
+		g_hash_table_add (ids, (gpointer) fu_device_get_id (capsule->device));
+		g_ptr_array_add (unique, capsule);
+		g_ptr_array_add (devices, capsule->device);
+	}
+	if (unique->len == 0)
+		return TRUE;
+	g_debug ("staging %u capsules for %s",
+		 unique->len, fu_provider_get_name (provider));
+
+	/* handled in the provider */
+	if (klass->stage_offline != NULL) {
+		if (!klass->stage_offline (provider, unique, flags, error))
+			return FALSE;
+	} else if (klass->update_offline != NULL) {
+		for (i = 0; i < unique->len; i++) {
+			capsule = g_ptr_array_index (unique, i);
+			if (!klass->update_offline (provider, capsule->device,
+						    capsule->fd, flags,
+						    &capsule->error))
+				g_debug ("failed to stage %s: %s",
+					 fu_device_get_id (capsule->device),
+					 capsule->error->message);
+		}
+	} else {
+		/* copy the cabinet once for all the devices */
+		if (!fu_provider_schedule_updates (provider, devices, stream_cab, error))
+			return FALSE;
+	}
+
+	/* the duplicates share the result of the first capsule */
+	for (i = 0; i < capsules->len; i++) {
+		FuProviderCapsule *capsule_first;
+		capsule = g_ptr_array_index (capsules, i);
+		if (!capsule->merged)
+			continue;
+		capsule_first = fu_provider_capsule_find (unique, capsule->device);
+		if (capsule_first != NULL && capsule_first->error != NULL)
+			capsule->error = g_error_copy (capsule_first->error);
+	}
+	return TRUE;
+}
+
 /**
  * fu_provider_verify:
  **/
@@ -253,8 +906,10 @@ fu_provider_update (FuProvider *provider,
 	if (device_pending != NULL) {
 		const gchar *tmp;
 
-		/* update pending database */
-		fu_pending_set_state (pending, device, FU_PENDING_STATE_SUCCESS, NULL);
+		/* update pending database, unless the caller does it for all
+		 * the devices in one transaction */
+		if ((flags & FU_PROVIDER_UPDATE_FLAG_NO_PENDING) == 0)
+			fu_pending_set_state (pending, device, FU_PENDING_STATE_SUCCESS, NULL);
 
 		/* delete cab file */
 		tmp = fu_device_get_metadata (device_pending, FU_DEVICE_KEY_FILENAME_CAB);
@@ -276,6 +931,325 @@ fu_provider_update (FuProvider *provider,
 	return TRUE;
 }
 
+typedef struct {
+	FuDevice		*device;
+	GPtrArray		*capsules;	/* of FuProviderCapsule */
+	GInputStream		*stream_cab;
+	gint			 fd_fw;
+	FuProviderFlags		 flags;
+	FuProviderVerifyFlags	 verify_flags;
+	GTaskThreadFunc		 func;
+	gint64			 progress_time;	/* us, of last emit */
+	guint			 progress_percentage;
+} FuProviderTaskHelper;
+
+/**
+ * fu_provider_task_helper_free:
+ **/
+static void
+fu_provider_task_helper_free (FuProviderTaskHelper *helper)
+{
+	if (helper->device != NULL)
+		g_object_unref (helper->device);
+	if (helper->capsules != NULL)
+		g_ptr_array_unref (helper->capsules);
+	if (helper->stream_cab != NULL)
+		g_object_unref (helper->stream_cab);
+	g_free (helper);
+}
+
+/* the task running in this thread, if any */
+static GPrivate fu_provider_task_current = G_PRIVATE_INIT (NULL);
+
+/**
+ * fu_provider_task_exec:
+ *
+ * Runs the task in the calling thread. While it runs the cancellable is
+ * pushed so that the provider can check it between blocks, and status
+ * changes are attributed to the device of the task.
+ **/
+static void
+fu_provider_task_exec (GTask *task)
+{
+	FuProviderTaskHelper *helper = g_task_get_task_data (task);
+	GCancellable *cancellable = g_task_get_cancellable (task);
+
+	if (cancellable != NULL)
+		g_cancellable_push_current (cancellable);
+	g_private_set (&fu_provider_task_current, helper);
+	helper->func (task,
+		      g_task_get_source_object (task),
+		      helper,
+		      cancellable);
+	g_private_set (&fu_provider_task_current, NULL);
+	if (cancellable != NULL)
+		g_cancellable_pop_current (cancellable);
+}
+
+/**
+ * fu_provider_task_thread_cb:
+ **/
+static void
+fu_provider_task_thread_cb (GTask *task,
+			    gpointer source_object,
+			    gpointer task_data,
+			    GCancellable *cancellable)
+{
+	fu_provider_task_exec (task);
+}
+
+/**
+ * fu_provider_task_pool_cb:
+ **/
+static void
+fu_provider_task_pool_cb (gpointer data, gpointer user_data)
+{
+	GTask *task = G_TASK (data);
+	fu_provider_task_exec (task);
+	g_object_unref (task);
+}
+
+/**
+ * fu_provider_task_run:
+ *
+ * Runs the task in a worker thread. Providers that allow it run each
+ * task in its own thread, and the rest share a single worker so that
+ * their tasks are done one at a time without blocking the main loop.
+ **/
+static void
+fu_provider_task_run (FuProvider *provider, GTask *task)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+
+	if (fu_provider_get_allow_parallel (provider)) {
+		g_task_run_in_thread (task, fu_provider_task_thread_cb);
+		g_object_unref (task);
+		return;
+	}
+	if (priv->task_pool == NULL) {
+		priv->task_pool = g_thread_pool_new (fu_provider_task_pool_cb,
+						     NULL, 1, FALSE, NULL);
+	}
+	g_thread_pool_push (priv->task_pool, task, NULL);
+}
+
+/**
+ * fu_provider_check_cancelled:
+ *
+ * Called by providers at points in an update where it is still safe to
+ * stop, for instance before the device is switched into bootloader mode.
+ *
+ * Returns: %FALSE if the update should not continue
+ **/
+gboolean
+fu_provider_check_cancelled (FuProvider *provider, GError **error)
+{
+	GCancellable *cancellable = g_cancellable_get_current ();
+	if (cancellable == NULL)
+		return TRUE;
+	return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+/**
+ * fu_provider_update_task_cb:
+ **/
+static void
+fu_provider_update_task_cb (GTask *task,
+			    gpointer source_object,
+			    gpointer task_data,
+			    GCancellable *cancellable)
+{
+	FuProvider *provider = FU_PROVIDER (source_object);
+	FuProviderTaskHelper *helper = (FuProviderTaskHelper *) task_data;
+	GError *error = NULL;
+
+	/* once the device is being written it is not safe to stop */
+	if (g_task_return_error_if_cancelled (task))
+		return;
+	if (!fu_provider_update (provider,
+				 helper->device,
+				 helper->stream_cab,
+				 helper->fd_fw,
+				 helper->flags,
+				 &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * fu_provider_update_async:
+ *
+ * Updates the device without blocking the caller. The @cancellable only
+ * has an effect until the update has been started.
+ **/
+void
+fu_provider_update_async (FuProvider *provider,
+			  FuDevice *device,
+			  GInputStream *stream_cab,
+			  gint fd_fw,
+			  FuProviderFlags flags,
+			  GCancellable *cancellable,
+			  GAsyncReadyCallback callback,
+			  gpointer user_data)
+{
+	FuProviderTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (FU_IS_PROVIDER (provider));
+	g_return_if_fail (FU_IS_DEVICE (device));
+
+	helper = g_new0 (FuProviderTaskHelper, 1);
+	helper->device = g_object_ref (device);
+	if (stream_cab != NULL)
+		helper->stream_cab = g_object_ref (stream_cab);
+	helper->fd_fw = fd_fw;
+	helper->flags = flags;
+	helper->func = fu_provider_update_task_cb;
+	task = g_task_new (provider, cancellable, callback, user_data);
+	g_task_set_task_data (task, helper, (GDestroyNotify) fu_provider_task_helper_free);
+	fu_provider_task_run (provider, task);
+}
+
+/**
+ * fu_provider_update_finish:
+ **/
+gboolean
+fu_provider_update_finish (FuProvider *provider, GAsyncResult *res, GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, provider), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * fu_provider_stage_offline_task_cb:
+ **/
+static void
+fu_provider_stage_offline_task_cb (GTask *task,
+				   gpointer source_object,
+				   gpointer task_data,
+				   GCancellable *cancellable)
+{
+	FuProvider *provider = FU_PROVIDER (source_object);
+	FuProviderTaskHelper *helper = (FuProviderTaskHelper *) task_data;
+	GError *error = NULL;
+
+	if (g_task_return_error_if_cancelled (task))
+		return;
+	if (!fu_provider_stage_offline (provider,
+					helper->capsules,
+					helper->stream_cab,
+					helper->flags,
+					&error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * fu_provider_stage_offline_async:
+ *
+ * Stages the capsules without blocking the caller. The @capsules array
+ * is referenced until the operation has completed.
+ **/
+void
+fu_provider_stage_offline_async (FuProvider *provider,
+				 GPtrArray *capsules,
+				 GInputStream *stream_cab,
+				 FuProviderFlags flags,
+				 GCancellable *cancellable,
+				 GAsyncReadyCallback callback,
+				 gpointer user_data)
+{
+	FuProviderTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (FU_IS_PROVIDER (provider));
+
+	helper = g_new0 (FuProviderTaskHelper, 1);
+	helper->capsules = g_ptr_array_ref (capsules);
+	if (stream_cab != NULL)
+		helper->stream_cab = g_object_ref (stream_cab);
+	helper->flags = flags;
+	helper->func = fu_provider_stage_offline_task_cb;
+	task = g_task_new (provider, cancellable, callback, user_data);
+	g_task_set_task_data (task, helper, (GDestroyNotify) fu_provider_task_helper_free);
+	fu_provider_task_run (provider, task);
+}
+
+/**
+ * fu_provider_stage_offline_finish:
+ **/
+gboolean
+fu_provider_stage_offline_finish (FuProvider *provider, GAsyncResult *res, GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, provider), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * fu_provider_verify_task_cb:
+ **/
+static void
+fu_provider_verify_task_cb (GTask *task,
+			    gpointer source_object,
+			    gpointer task_data,
+			    GCancellable *cancellable)
+{
+	FuProvider *provider = FU_PROVIDER (source_object);
+	FuProviderTaskHelper *helper = (FuProviderTaskHelper *) task_data;
+	GError *error = NULL;
+
+	if (g_task_return_error_if_cancelled (task))
+		return;
+	if (!fu_provider_verify (provider,
+				 helper->device,
+				 helper->verify_flags,
+				 &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * fu_provider_verify_async:
+ **/
+void
+fu_provider_verify_async (FuProvider *provider,
+			  FuDevice *device,
+			  FuProviderVerifyFlags flags,
+			  GCancellable *cancellable,
+			  GAsyncReadyCallback callback,
+			  gpointer user_data)
+{
+	FuProviderTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (FU_IS_PROVIDER (provider));
+	g_return_if_fail (FU_IS_DEVICE (device));
+
+	helper = g_new0 (FuProviderTaskHelper, 1);
+	helper->device = g_object_ref (device);
+	helper->verify_flags = flags;
+	helper->func = fu_provider_verify_task_cb;
+	task = g_task_new (provider, cancellable, callback, user_data);
+	g_task_set_task_data (task, helper, (GDestroyNotify) fu_provider_task_helper_free);
+	fu_provider_task_run (provider, task);
+}
+
+/**
+ * fu_provider_verify_finish:
+ **/
+gboolean
+fu_provider_verify_finish (FuProvider *provider, GAsyncResult *res, GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, provider), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
 /**
  * fu_provider_clear_results:
  **/
@@ -366,6 +1340,72 @@ fu_provider_get_results (FuProvider *provider, FuDevice *device, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_provider_get_snapshot_key:
+ *
+ * Gets a string that changes whenever coldplug might find different
+ * devices, for instance when something is plugged in.
+ *
+ * Returns: a string, or %NULL if the devices should not be snapshotted
+ **/
+gchar *
+fu_provider_get_snapshot_key (FuProvider *provider)
+{
+	FuProviderClass *klass = FU_PROVIDER_GET_CLASS (provider);
+	if (klass->get_snapshot_key != NULL)
+		return klass->get_snapshot_key (provider);
+	return NULL;
+}
+
+/**
+ * fu_provider_sort_strings_cb:
+ **/
+static gint
+fu_provider_sort_strings_cb (gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0 (*((const gchar **) a), *((const gchar **) b));
+}
+
+/**
+ * fu_provider_get_sysfs_key:
+ *
+ * Hashes the names and inode numbers of everything in a sysfs directory,
+ * which is much cheaper than opening each device. The inode changes when
+ * a device is removed and added again, even into the same port.
+ *
+ * Returns: a checksum, or %NULL if the directory does not exist
+ **/
+gchar *
+fu_provider_get_sysfs_key (const gchar *path)
+{
+	const gchar *fn;
+	guint i;
+	_cleanup_dir_close_ GDir *dir = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *names = NULL;
+	_cleanup_string_free_ GString *str = NULL;
+
+	dir = g_dir_open (path, 0, NULL);
+	if (dir == NULL)
+		return NULL;
+	names = g_ptr_array_new_with_free_func (g_free);
+	while ((fn = g_dir_read_name (dir)) != NULL)
+		g_ptr_array_add (names, g_strdup (fn));
+	g_ptr_array_sort (names, fu_provider_sort_strings_cb);
+
+	str = g_string_new (path);
+	for (i = 0; i < names->len; i++) {
+		GStatBuf st;
+		_cleanup_free_ gchar *tmp = NULL;
+		fn = g_ptr_array_index (names, i);
+		tmp = g_build_filename (path, fn, NULL);
+		if (g_stat (tmp, &st) != 0)
+			continue;
+		g_string_append_printf (str, "\n%s:%" G_GUINT64_FORMAT,
+					fn, (guint64) st.st_ino);
+	}
+	return g_compute_checksum_for_string (G_CHECKSUM_SHA1, str->str, str->len);
+}
+
 /**
  * fu_provider_device_add:
  **/
@@ -378,6 +1418,93 @@ fu_provider_get_name (FuProvider *provider)
 	return NULL;
 }
 
+/**
+ * fu_provider_set_allow_parallel:
+ *
+ * Providers that can update several devices at the same time from
+ * different threads should set this to %TRUE.
+ **/
+void
+fu_provider_set_allow_parallel (FuProvider *provider, gboolean allow_parallel)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	priv->allow_parallel = allow_parallel;
+}
+
+/**
+ * fu_provider_get_allow_parallel:
+ **/
+gboolean
+fu_provider_get_allow_parallel (FuProvider *provider)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	return priv->allow_parallel;
+}
+
+typedef struct {
+	FuProvider		*provider;
+	FuDevice		*device;
+	FwupdStatus		 status;
+	guint64			 done;
+	guint64			 total;
+	guint			 signal_id;
+} FuProviderEmitHelper;
+
+/**
+ * fu_provider_emit_cb:
+ **/
+static gboolean
+fu_provider_emit_cb (gpointer user_data)
+{
+	FuProviderEmitHelper *helper = (FuProviderEmitHelper *) user_data;
+	if (helper->signal_id == signals[SIGNAL_PROGRESS_CHANGED]) {
+		g_signal_emit (helper->provider, helper->signal_id, 0,
+			       helper->done, helper->total, helper->device);
+	} else if (helper->signal_id == signals[SIGNAL_STATUS_CHANGED]) {
+		g_signal_emit (helper->provider, helper->signal_id, 0,
+			       helper->status, helper->device);
+	} else {
+		g_signal_emit (helper->provider, helper->signal_id, 0, helper->device);
+	}
+	if (helper->device != NULL)
+		g_object_unref (helper->device);
+	g_object_unref (helper->provider);
+	g_free (helper);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_provider_emit:
+ *
+ * Emits the signal directly, or in the main context if called from a
+ * worker thread, e.g. during a threaded coldplug.
+ **/
+static void
+fu_provider_emit (FuProvider *provider, guint signal_id,
+		  FuDevice *device, FwupdStatus status)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderEmitHelper *helper;
+
+	/* same thread */
+	if (g_thread_self () == priv->thread) {
+		if (signal_id == signals[SIGNAL_STATUS_CHANGED])
+			g_signal_emit (provider, signal_id, 0, status, device);
+		else
+			g_signal_emit (provider, signal_id, 0, device);
+		return;
+	}
+
+	/* marshal back to the main context */
+	helper = g_new0 (FuProviderEmitHelper, 1);
+	helper->provider = g_object_ref (provider);
+	if (device != NULL)
+		helper->device = g_object_ref (device);
+	helper->status = status;
+	helper->signal_id = signal_id;
+	g_idle_add_full (G_PRIORITY_HIGH, fu_provider_emit_cb, helper, NULL);
+}
+
 /**
  * fu_provider_device_add:
  **/
@@ -387,7 +1514,7 @@ fu_provider_device_add (FuProvider *provider, FuDevice *device)
 	g_debug ("emit added: %s", fu_device_get_id (device));
 	fu_device_set_metadata (device, FU_DEVICE_KEY_PROVIDER,
 				fu_provider_get_name (provider));
-	g_signal_emit (provider, signals[SIGNAL_DEVICE_ADDED], 0, device);
+	fu_provider_emit (provider, signals[SIGNAL_DEVICE_ADDED], device, 0);
 }
 
 /**
@@ -397,16 +1524,152 @@ void
 fu_provider_device_remove (FuProvider *provider, FuDevice *device)
 {
 	g_debug ("emit removed: %s", fu_device_get_id (device));
-	g_signal_emit (provider, signals[SIGNAL_DEVICE_REMOVED], 0, device);
+	fu_provider_emit (provider, signals[SIGNAL_DEVICE_REMOVED], device, 0);
+}
+
+typedef struct {
+	FuDevice		*device;
+	gchar			*key;
+	gchar			*value;
+} FuProviderMetadataHelper;
+
+/**
+ * fu_provider_set_device_metadata_cb:
+ **/
+static gboolean
+fu_provider_set_device_metadata_cb (gpointer user_data)
+{
+	FuProviderMetadataHelper *helper = (FuProviderMetadataHelper *) user_data;
+	fu_device_set_metadata (helper->device, helper->key, helper->value);
+	g_object_unref (helper->device);
+	g_free (helper->key);
+	g_free (helper->value);
+	g_free (helper);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * fu_provider_set_device_metadata:
+ *
+ * Sets metadata on a device that has been added to the daemon. The daemon
+ * borrows the values from the main thread, so a change made from a worker
+ * thread is done in the main context instead.
+ **/
+void
+fu_provider_set_device_metadata (FuProvider *provider,
+				 FuDevice *device,
+				 const gchar *key,
+				 const gchar *value)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderMetadataHelper *helper;
+
+	if (g_thread_self () == priv->thread) {
+		fu_device_set_metadata (device, key, value);
+		return;
+	}
+	helper = g_new0 (FuProviderMetadataHelper, 1);
+	helper->device = g_object_ref (device);
+	helper->key = g_strdup (key);
+	helper->value = g_strdup (value);
+	g_idle_add_full (G_PRIORITY_HIGH, fu_provider_set_device_metadata_cb,
+			 helper, NULL);
 }
 
 /**
  * fu_provider_set_status:
+ *
+ * Sets the status of the update or verification running in this thread,
+ * which is reported along with the device it applies to.
  **/
 void
 fu_provider_set_status (FuProvider *provider, FwupdStatus status)
 {
-	g_signal_emit (provider, signals[SIGNAL_STATUS_CHANGED], 0, status);
+	FuProviderTaskHelper *helper = g_private_get (&fu_provider_task_current);
+	fu_provider_emit (provider, signals[SIGNAL_STATUS_CHANGED],
+			  helper != NULL ? helper->device : NULL, status);
+}
+
+/**
+ * fu_provider_progress_is_due:
+ *
+ * Rate limits progress, always allowing the start and end of the write.
+ **/
+static gboolean
+fu_provider_progress_is_due (gint64 *progress_time,
+			     guint *progress_percentage,
+			     guint64 done,
+			     guint64 total)
+{
+	gint64 now = g_get_monotonic_time ();
+	guint percentage = total > 0 ? (guint) (done * 100 / total) : 0;
+
+	if (done != 0 && done != total &&
+	    (percentage == *progress_percentage ||
+	     now - *progress_time < FU_PROVIDER_PROGRESS_INTERVAL * 1000))
+		return FALSE;
+	*progress_percentage = percentage;
+	*progress_time = now;
+	return TRUE;
+}
+
+/**
+ * fu_provider_set_progress:
+ *
+ * Reports how many bytes of @total have been written to the device. This
+ * can be called for every block as the signal is only emitted when the
+ * percentage has changed and FU_PROVIDER_PROGRESS_INTERVAL has passed, or
+ * the write has started or finished.
+ *
+ * The rate limit applies to each update separately when several devices
+ * are being written at the same time, and the signal includes the device
+ * of the update running in this thread.
+ **/
+void
+fu_provider_set_progress (FuProvider *provider, guint64 done, guint64 total)
+{
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	FuProviderEmitHelper *helper;
+	FuProviderTaskHelper *task_helper = g_private_get (&fu_provider_task_current);
+	FuDevice *device = NULL;
+
+	g_return_if_fail (FU_IS_PROVIDER (provider));
+	g_return_if_fail (done <= total);
+
+	/* rate limit, where the task is only touched from this thread */
+	if (task_helper != NULL) {
+		if (!fu_provider_progress_is_due (&task_helper->progress_time,
+						  &task_helper->progress_percentage,
+						  done, total))
+			return;
+		device = task_helper->device;
+	} else {
+		gboolean is_due;
+		g_mutex_lock (&priv->progress_mutex);
+		is_due = fu_provider_progress_is_due (&priv->progress_time,
+						      &priv->progress_percentage,
+						      done, total);
+		g_mutex_unlock (&priv->progress_mutex);
+		if (!is_due)
+			return;
+	}
+
+	/* same thread */
+	if (g_thread_self () == priv->thread) {
+		g_signal_emit (provider, signals[SIGNAL_PROGRESS_CHANGED], 0,
+			       done, total, device);
+		return;
+	}
+
+	/* marshal back to the main context */
+	helper = g_new0 (FuProviderEmitHelper, 1);
+	helper->provider = g_object_ref (provider);
+	if (device != NULL)
+		helper->device = g_object_ref (device);
+	helper->done = done;
+	helper->total = total;
+	helper->signal_id = signals[SIGNAL_PROGRESS_CHANGED];
+	g_idle_add_full (G_PRIORITY_HIGH, fu_provider_emit_cb, helper, NULL);
 }
 
 /**
@@ -433,8 +1696,17 @@ fu_provider_class_init (FuProviderClass *klass)
 		g_signal_new ("status-changed",
 			      G_TYPE_FROM_CLASS (object_class), G_SIGNAL_RUN_LAST,
 			      G_STRUCT_OFFSET (FuProviderClass, status_changed),
-			      NULL, NULL, g_cclosure_marshal_VOID__UINT,
-			      G_TYPE_NONE, 1, G_TYPE_UINT);
+			      NULL, NULL, g_cclosure_marshal_generic,
+			      G_TYPE_NONE, 2, G_TYPE_UINT, FU_TYPE_DEVICE);
+	signals[SIGNAL_PROGRESS_CHANGED] =
+		g_signal_new ("progress-changed",
+			      G_TYPE_FROM_CLASS (object_class), G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (FuProviderClass, progress_changed),
+			      NULL, NULL, g_cclosure_marshal_generic,
+			      G_TYPE_NONE, 3, G_TYPE_UINT64, G_TYPE_UINT64,
+			      FU_TYPE_DEVICE);
+
+	g_type_class_add_private (klass, sizeof (FuProviderPrivate));
 }
 
 /**
@@ -443,6 +1715,12 @@ fu_provider_class_init (FuProviderClass *klass)
 static void
 fu_provider_init (FuProvider *provider)
 {
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (provider);
+	priv->thread = g_thread_self ();
+	g_mutex_init (&priv->progress_mutex);
+	g_mutex_init (&priv->hotplug_mutex);
+	priv->hotplug_events = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						      (GDestroyNotify) fu_provider_hotplug_event_free);
 }
 
 /**
@@ -451,5 +1729,17 @@ fu_provider_init (FuProvider *provider)
 static void
 fu_provider_finalize (GObject *object)
 {
+	FuProviderPrivate *priv = FU_PROVIDER_GET_PRIVATE (object);
+
+	if (priv->hotplug_id != 0)
+		g_source_remove (priv->hotplug_id);
+	if (priv->hotplug_pool != NULL)
+		g_thread_pool_free (priv->hotplug_pool, FALSE, TRUE);
+	if (priv->task_pool != NULL)
+		g_thread_pool_free (priv->task_pool, FALSE, TRUE);
+	g_hash_table_unref (priv->hotplug_events);
+	g_mutex_clear (&priv->hotplug_mutex);
+	g_mutex_clear (&priv->progress_mutex);
+
 	G_OBJECT_CLASS (fu_provider_parent_class)->finalize (object);
 }
@@ -29,6 +29,8 @@
 
 G_BEGIN_DECLS
 
+#define FU_PROVIDER_FIRMWARE_MAX	(32 * 1024 * 1024)	/* bytes */
+
 #define FU_TYPE_PROVIDER		(fu_provider_get_type ())
 #define FU_PROVIDER(o)			(G_TYPE_CHECK_INSTANCE_CAST ((o), FU_TYPE_PROVIDER, FuProvider))
 #define FU_PROVIDER_CLASS(k)		(G_TYPE_CHECK_CLASS_CAST((k), FU_TYPE_PROVIDER, FuProviderClass))
@@ -49,6 +51,7 @@ typedef enum {
 	FU_PROVIDER_UPDATE_FLAG_OFFLINE		= 1,
 	FU_PROVIDER_UPDATE_FLAG_ALLOW_REINSTALL	= 2,
 	FU_PROVIDER_UPDATE_FLAG_ALLOW_OLDER	= 4,
+	FU_PROVIDER_UPDATE_FLAG_NO_PENDING	= 8,	/* caller saves the state */
 	FU_PROVIDER_UPDATE_FLAG_LAST
 } FuProviderFlags;
 
@@ -57,6 +60,13 @@ typedef enum {
 	FU_PROVIDER_VERIFY_FLAG_LAST
 } FuProviderVerifyFlags;
 
+typedef struct {
+	FuDevice	*device;
+	gint		 fd;
+	GError		*error;		/* set if this capsule failed */
+	gboolean	 merged;	/* staged as part of another */
+} FuProviderCapsule;
+
 struct _FuProviderClass
 {
 	GObjectClass	parent_class;
@@ -79,12 +89,24 @@ struct _FuProviderClass
 						 gint		 fd,
 						 FuProviderFlags flags,
 						 GError		**error);
+	gboolean	 (*stage_offline)	(FuProvider	*provider,
+						 GPtrArray	*capsules,
+						 FuProviderFlags flags,
+						 GError		**error);
 	gboolean	 (*clear_results)	(FuProvider	*provider,
 						 FuDevice	*device,
 						 GError		**error);
 	gboolean	 (*get_results)		(FuProvider	*provider,
 						 FuDevice	*device,
 						 GError		**error);
+	gchar		*(*get_snapshot_key)	(FuProvider	*provider);
+	gpointer	 (*hotplug_probe)	(FuProvider	*provider,
+						 GObject	*object);
+	void		 (*hotplug_added)	(FuProvider	*provider,
+						 GObject	*object,
+						 gpointer	 data);
+	void		 (*hotplug_removed)	(FuProvider	*provider,
+						 GObject	*object);
 
 	/* signals */
 	void		 (* device_added)	(FuProvider	*provider,
@@ -92,37 +114,100 @@ struct _FuProviderClass
 	void		 (* device_removed)	(FuProvider	*provider,
 						 FuDevice	*device);
 	void		 (* status_changed)	(FuProvider	*provider,
-						 FwupdStatus	 status);
+						 FwupdStatus	 status,
+						 FuDevice	*device);
+	void		 (* progress_changed)	(FuProvider	*provider,
+						 guint64	 done,
+						 guint64	 total,
+						 FuDevice	*device);
 };
 
 #define FU_OFFLINE_TRIGGER_FILENAME	FU_OFFLINE_DESTDIR "/system-update"
 
 GType		 fu_provider_get_type		(void);
+void		 fu_provider_capsule_free	(FuProviderCapsule *capsule);
 void		 fu_provider_device_add		(FuProvider	*provider,
 						 FuDevice	*device);
 void		 fu_provider_device_remove	(FuProvider	*provider,
 						 FuDevice	*device);
+void		 fu_provider_set_device_metadata (FuProvider	*provider,
+						 FuDevice	*device,
+						 const gchar	*key,
+						 const gchar	*value);
 void		 fu_provider_set_status		(FuProvider	*provider,
 						 FwupdStatus	 status);
+void		 fu_provider_set_progress	(FuProvider	*provider,
+						 guint64	 done,
+						 guint64	 total);
 const gchar	*fu_provider_get_name		(FuProvider	*provider);
+void		 fu_provider_set_allow_parallel	(FuProvider	*provider,
+						 gboolean	 allow_parallel);
+gboolean	 fu_provider_get_allow_parallel	(FuProvider	*provider);
 gboolean	 fu_provider_coldplug		(FuProvider	*provider,
 						 GError		**error);
+gboolean	 fu_provider_check_cancelled	(FuProvider	*provider,
+						 GError		**error);
 gboolean	 fu_provider_update		(FuProvider	*provider,
 						 FuDevice	*device,
 						 GInputStream	*stream_cab,
 						 gint		 fd_fw,
 						 FuProviderFlags flags,
 						 GError		**error);
+gboolean	 fu_provider_stage_offline	(FuProvider	*provider,
+						 GPtrArray	*capsules,
+						 GInputStream	*stream_cab,
+						 FuProviderFlags flags,
+						 GError		**error);
+void		 fu_provider_stage_offline_async (FuProvider	*provider,
+						 GPtrArray	*capsules,
+						 GInputStream	*stream_cab,
+						 FuProviderFlags flags,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 fu_provider_stage_offline_finish (FuProvider	*provider,
+						 GAsyncResult	*res,
+						 GError		**error);
 gboolean	 fu_provider_verify		(FuProvider	*provider,
 						 FuDevice	*device,
 						 FuProviderVerifyFlags flags,
 						 GError		**error);
+void		 fu_provider_update_async	(FuProvider	*provider,
+						 FuDevice	*device,
+						 GInputStream	*stream_cab,
+						 gint		 fd_fw,
+						 FuProviderFlags flags,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 fu_provider_update_finish	(FuProvider	*provider,
+						 GAsyncResult	*res,
+						 GError		**error);
+void		 fu_provider_verify_async	(FuProvider	*provider,
+						 FuDevice	*device,
+						 FuProviderVerifyFlags flags,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 fu_provider_verify_finish	(FuProvider	*provider,
+						 GAsyncResult	*res,
+						 GError		**error);
 gboolean	 fu_provider_clear_results	(FuProvider	*provider,
 						 FuDevice	*device,
 						 GError		**error);
 gboolean	 fu_provider_get_results	(FuProvider	*provider,
 						 FuDevice	*device,
 						 GError		**error);
+gchar		*fu_provider_get_snapshot_key	(FuProvider	*provider);
+void		 fu_provider_hotplug_add	(FuProvider	*provider,
+						 const gchar	*id,
+						 GObject	*object);
+void		 fu_provider_hotplug_remove	(FuProvider	*provider,
+						 const gchar	*id,
+						 GObject	*object);
+gboolean	 fu_provider_hotplug_has_removal (FuProvider	*provider,
+						 const gchar	*id);
+gchar		*fu_provider_get_sysfs_key	(const gchar	*path);
 
 G_END_DECLS
 
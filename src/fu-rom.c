@@ -29,7 +29,9 @@
 #include <string.h>
 
 #include "fu-cleanup.h"
+#include "fu-debug.h"
 #include "fu-rom.h"
+#include "fu-scanner.h"
 
 static void fu_rom_finalize			 (GObject *object);
 
@@ -37,7 +39,7 @@ static void fu_rom_finalize			 (GObject *object);
 
 /* data from http://resources.infosecinstitute.com/pci-expansion-rom/ */
 typedef struct {
-	guint8		*rom_data;
+	guint8		*rom_data;	/* slice of FuRomPrivate->blob */
 	guint32		 rom_len;
 	guint32		 rom_offset;
 	guint32		 entry_point;
@@ -56,8 +58,22 @@ typedef struct {
 	guint32		 max_runtime_len;
 	guint16		 config_header_ptr;
 	guint16		 dmtf_clp_ptr;
+	FuScanner	*scanner;	/* of fu_rom_needles */
 } FuRomPciHeader;
 
+/* everything fu_rom_pci_strstr() can be asked to find */
+static const gchar *fu_rom_needles[] = {
+	"BIOS: ",
+	"Build Number:",
+	"PPID",
+	"VBIOS ",
+	"Version",
+	"Version ",
+	"Vension:",
+	" VER0",
+	" VR",
+	NULL };
+
 /**
  * FuRomPrivate:
  *
@@ -67,6 +83,8 @@ struct _FuRomPrivate
 {
 	GChecksum			*checksum_wip;
 	GInputStream			*stream;
+	GBytes				*blob;
+	FuRomLoadFlags			 flags;
 	FuRomKind			 kind;
 	gchar				*version;
 	gchar				*guid;
@@ -83,7 +101,8 @@ G_DEFINE_TYPE (FuRom, fu_rom, G_TYPE_OBJECT)
 static void
 fu_rom_pci_header_free (FuRomPciHeader *hdr)
 {
-	g_free (hdr->rom_data);
+	if (hdr->scanner != NULL)
+		g_object_unref (hdr->scanner);
 	g_free (hdr);
 }
 
@@ -108,14 +127,14 @@ fu_rom_kind_to_string (FuRomKind kind)
 
 /**
  * fu_rom_pci_strstr:
+ *
+ * The image is scanned for all the needles the first time this is called.
  **/
 static guint8 *
 fu_rom_pci_strstr (FuRomPciHeader *hdr, const gchar *needle)
 {
-	guint i;
-	guint needle_len;
+	gssize offset;
 	guint8 *haystack;
-	gsize haystack_len;
 
 	if (needle == NULL || needle[0] == '\0')
 		return NULL;
@@ -124,15 +143,15 @@ fu_rom_pci_strstr (FuRomPciHeader *hdr, const gchar *needle)
 	if (hdr->data_len > hdr->rom_len)
 		return NULL;
 	haystack = &hdr->rom_data[hdr->data_len];
-	haystack_len = hdr->rom_len - hdr->data_len;
-	needle_len = strlen (needle);
-	if (needle_len > haystack_len)
-		return NULL;
-	for (i = 0; i < haystack_len - needle_len; i++) {
-		if (memcmp (haystack + i, needle, needle_len) == 0)
-			return &haystack[i];
+	if (hdr->scanner == NULL) {
+		hdr->scanner = fu_scanner_new (fu_rom_needles);
+		fu_scanner_scan (hdr->scanner, haystack,
+				 hdr->rom_len - hdr->data_len);
 	}
-	return NULL;
+	offset = fu_scanner_find (hdr->scanner, needle, 0);
+	if (offset < 0)
+		return NULL;
+	return &haystack[offset];
 }
 
 /**
@@ -277,6 +296,10 @@ fu_rom_pci_print_header (FuRomPciHeader *hdr)
 	_cleanup_free_ gchar *data_str = NULL;
 	_cleanup_free_ gchar *reserved_str = NULL;
 
+	/* the hex dumps are expensive, and nobody is going to see them */
+	if (!fu_debug_is_enabled ())
+		return;
+
 	g_debug ("PCI Header");
 	g_debug (" RomOffset: 0x%04x", hdr->rom_offset);
 	g_debug (" RomSize:   0x%04x", hdr->rom_len);
@@ -466,6 +489,10 @@ fu_rom_pci_get_header (guint8 *buffer, gssize sz)
 {
 	FuRomPciHeader *hdr;
 
+	/* not enough data for the header */
+	if (sz < 0x1a)
+		return NULL;
+
 	/* check signature */
 	if (memcmp (buffer, "\x55\xaa", 2) != 0) {
 		if (memcmp (buffer, "\x56\x4e", 2) == 0) {
@@ -488,8 +515,8 @@ fu_rom_pci_get_header (guint8 *buffer, gssize sz)
 		hdr->rom_len = sz;
 	}
 
-	/* copy this locally to the header */
-	hdr->rom_data = g_memdup (buffer, hdr->rom_len);
+	/* this is fixed up to point into the blob once all data is read */
+	hdr->rom_data = buffer;
 
 	/* parse out CPI */
 	hdr->entry_point = ((guint32) buffer[0x05] << 16) +
@@ -500,6 +527,10 @@ fu_rom_pci_get_header (guint8 *buffer, gssize sz)
 
 	/* parse the header data */
 	g_debug ("looking for PCI DATA @ 0x%04x", hdr->cpi_ptr);
+	if (hdr->cpi_ptr + 0x1c > sz) {
+		g_debug ("PCI DATA @ 0x%04x out of range", hdr->cpi_ptr);
+		return hdr;
+	}
 	fu_rom_pci_parse_data (hdr);
 	return hdr;
 }
@@ -616,8 +647,79 @@ fu_rom_find_version (FuRomKind kind, FuRomPciHeader *hdr)
 	return NULL;
 }
 
+/**
+ * fu_rom_read_chunks:
+ **/
+static gssize
+fu_rom_read_chunks (GInputStream *stream, guint8 *buffer, gsize buffer_sz,
+		    GCancellable *cancellable, GError **error)
+{
+	gssize sz = 0;
+	guint number_reads = 0;
+
+	/* ensure we got enough data to fill the buffer */
+	while ((gsize) sz < buffer_sz) {
+		gssize sz_chunk;
+		sz_chunk = g_input_stream_read (stream,
+						buffer + sz,
+						buffer_sz - sz,
+						cancellable,
+						error);
+		if (sz_chunk == 0)
+			break;
+		if (sz_chunk < 0)
+			return -1;
+		if (sz > 0) {
+			g_debug ("ROM returned 0x%04x bytes, adding 0x%04x...",
+				 (guint) sz, (guint) sz_chunk);
+		}
+		sz += sz_chunk;
+
+		/* check the firmware isn't serving us small chunks */
+		if (number_reads++ > 17) {
+			g_set_error_literal (error,
+					     FWUPD_ERROR,
+					     FWUPD_ERROR_INVALID_FILE,
+					     "firmware not fulfilling requests");
+			return -1;
+		}
+	}
+	return sz;
+}
+
+/**
+ * fu_rom_ensure_data:
+ *
+ * Grows the buffer and reads from the stream until at least @len bytes are
+ * available, or the ROM runs out of data.
+ **/
+static gboolean
+fu_rom_ensure_data (FuRom *rom, guint8 **buffer, gssize *sz, gsize len,
+		    GCancellable *cancellable, GError **error)
+{
+	FuRomPrivate *priv = rom->priv;
+	gssize sz_chunk;
+
+	if ((gsize) *sz >= len)
+		return TRUE;
+	*buffer = g_realloc (*buffer, len);
+	sz_chunk = fu_rom_read_chunks (priv->stream, *buffer + *sz, len - *sz,
+				       cancellable, error);
+	if (sz_chunk < 0)
+		return FALSE;
+	*sz += sz_chunk;
+	return TRUE;
+}
+
 /**
  * fu_rom_load_file:
+ *
+ * Loads the option ROM. All the image headers reference slices of a single
+ * buffer rather than holding their own copies of the data.
+ *
+ * If %FU_ROM_LOAD_FLAG_HEADER_ONLY is used then only the first image is
+ * read, which is all that is required to get the kind, GUID and version.
+ * In this mode no checksum is available.
  **/
 gboolean
 fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
@@ -626,11 +728,12 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 	FuRomPrivate *priv = rom->priv;
 	FuRomPciHeader *hdr = NULL;
 	const gssize buffer_sz = 0x400000;
-	gssize sz;
+	gssize sz = 0;
+	gsize blob_sz;
 	guint32 jump = 0;
 	guint hdr_sz = 0;
 	guint i;
-	guint number_reads = 0;
+	guint8 *data;
 	_cleanup_error_free_ GError *error_local = NULL;
 	_cleanup_free_ gchar *fn = NULL;
 	_cleanup_free_ gchar *id = NULL;
@@ -640,6 +743,7 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 	g_return_val_if_fail (FU_IS_ROM (rom), FALSE);
 
 	/* open file */
+	priv->flags = flags;
 	priv->stream = G_INPUT_STREAM (g_file_read (file, cancellable, &error_local));
 	if (priv->stream == NULL) {
 		g_set_error_literal (error,
@@ -661,11 +765,10 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 			return FALSE;
 	}
 
-	/* read out the header */
-	buffer = g_malloc (buffer_sz);
-	sz = g_input_stream_read (priv->stream, buffer, buffer_sz,
-				  cancellable, error);
-	if (sz < 0)
+	/* read out the header, or the entire ROM */
+	if (!fu_rom_ensure_data (rom, &buffer, &sz,
+				 (flags & FU_ROM_LOAD_FLAG_HEADER_ONLY) ? 0x400 : buffer_sz,
+				 cancellable, error))
 		return FALSE;
 	if (sz < 1024) {
 		g_set_error (error,
@@ -675,37 +778,30 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 		return FALSE;
 	}
 
-	/* ensure we got enough data to fill the buffer */
-	while (sz < buffer_sz) {
-		gssize sz_chunk;
-		sz_chunk = g_input_stream_read (priv->stream,
-						buffer + sz,
-						buffer_sz - sz,
-						cancellable,
-						error);
-		if (sz_chunk == 0)
-			break;
-		g_debug ("ROM returned 0x%04x bytes, adding 0x%04x...",
-			 (guint) sz, (guint) sz_chunk);
-		if (sz_chunk < 0)
-			return FALSE;
-		sz += sz_chunk;
-
-		/* check the firmware isn't serving us small chunks */
-		if (number_reads++ > 16) {
-			g_set_error_literal (error,
-					     FWUPD_ERROR,
-					     FWUPD_ERROR_INVALID_FILE,
-					     "firmware not fulfilling requests");
-			return FALSE;
-		}
-	}
-	g_debug ("ROM buffer filled %likb/%likb", sz / 0x400, buffer_sz / 0x400);
-
 	/* detect optional IFR header and skip to option ROM */
 	if (memcmp (buffer, "NVGI", 4) == 0)
 		hdr_sz = GUINT16_FROM_BE (buffer[0x15]);
 
+	/* only read as far as the end of the first image */
+	if (flags & FU_ROM_LOAD_FLAG_HEADER_ONLY) {
+		gsize len;
+		if (!fu_rom_ensure_data (rom, &buffer, &sz, hdr_sz + 0x400,
+					 cancellable, error))
+			return FALSE;
+		len = buffer[hdr_sz + 0x02] * 512;
+		if (len == 0)
+			len = buffer_sz;
+		len += hdr_sz;
+
+		/* the intel VBT may be outside the first image */
+		if (memcmp (&buffer[hdr_sz + 0x06], "00000000000", 11) == 0)
+			len = MAX (len, ((buffer[0x1b] << 8) + buffer[0x1a]) + 0x10);
+		if (!fu_rom_ensure_data (rom, &buffer, &sz, len,
+					 cancellable, error))
+			return FALSE;
+	}
+	g_debug ("ROM buffer filled %likb", sz / 0x400);
+
 	/* read all the ROM headers */
 	while (sz > hdr_sz + jump) {
 		guint32 jump_sz;
@@ -715,8 +811,8 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 			gboolean found_data = FALSE;
 
 			/* check it's not just NUL padding */
-			for (i = 0; i < hdr_sz + jump; i++) {
-				if (buffer[hdr_sz + jump + i] != 0x00) {
+			for (i = hdr_sz + jump; i < MIN ((guint) sz, 2 * (hdr_sz + jump)); i++) {
+				if (buffer[i] != 0x00) {
 					found_data = TRUE;
 					break;
 				}
@@ -730,7 +826,6 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 				hdr->last_image = 0x80;
 				hdr->rom_offset = hdr_sz + jump;
 				hdr->rom_len = sz - hdr->rom_offset;
-				hdr->rom_data = g_memdup (&buffer[hdr->rom_offset], hdr->rom_len);
 				hdr->image_len = hdr->rom_len;
 				g_ptr_array_add (priv->hdrs, hdr);
 			} else {
@@ -755,13 +850,34 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 		jump += jump_sz;
 	}
 
+	/* an image may claim to be longer than the data we got, so pad the
+	 * blob with zeros rather than let the header read past the end */
+	blob_sz = sz;
+	for (i = 0; i < priv->hdrs->len; i++) {
+		hdr = g_ptr_array_index (priv->hdrs, i);
+		blob_sz = MAX (blob_sz, (gsize) hdr->rom_offset + hdr->rom_len);
+	}
+	buffer = g_realloc (buffer, blob_sz);
+	memset (buffer + sz, 0x00, blob_sz - sz);
+
+	/* all the headers now reference the one buffer */
+	data = buffer;
+	if (priv->blob != NULL)
+		g_bytes_unref (priv->blob);
+	priv->blob = g_bytes_new_take (buffer, blob_sz);
+	buffer = NULL;
+	for (i = 0; i < priv->hdrs->len; i++) {
+		hdr = g_ptr_array_index (priv->hdrs, i);
+		hdr->rom_data = data + hdr->rom_offset;
+	}
+
 	/* we found nothing */
 	if (priv->hdrs->len == 0) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_INVALID_FILE,
 			     "Failed to detect firmware header [%02x%02x]",
-			     buffer[0], buffer[1]);
+			     data[0], data[1]);
 		return FALSE;
 	}
 
@@ -779,7 +895,7 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 
 	/* detect intel header */
 	if (memcmp (hdr->reserved, "00000000000", 11) == 0)
-		hdr_sz = (buffer[0x1b] << 8) + buffer[0x1a];
+		hdr_sz = (data[0x1b] << 8) + data[0x1a];
 	if (hdr_sz > sz) {
 		g_set_error_literal (error,
 				     FWUPD_ERROR,
@@ -788,11 +904,11 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 		return FALSE;
 	}
 
-	if (memcmp (buffer + hdr_sz + 0x04, "K74", 3) == 0) {
+	if (memcmp (data + hdr_sz + 0x04, "K74", 3) == 0) {
 		priv->kind = FU_ROM_KIND_NVIDIA;
-	} else if (memcmp (buffer + hdr_sz, "$VBT", 4) == 0) {
+	} else if (memcmp (data + hdr_sz, "$VBT", 4) == 0) {
 		priv->kind = FU_ROM_KIND_INTEL;
-	} else if (memcmp(buffer + 0x30, " 761295520", 10) == 0) {
+	} else if (memcmp(data + 0x30, " 761295520", 10) == 0) {
 		priv->kind = FU_ROM_KIND_ATI;
 	}
 
@@ -812,12 +928,15 @@ fu_rom_load_file (FuRom *rom, GFile *file, FuRomLoadFlags flags,
 		g_strdelimit (priv->version, "\r\n ", '\0');
 	}
 
-	/* update checksum */
-	if (flags & FU_ROM_LOAD_FLAG_BLANK_PPID)
-		fu_rom_find_and_blank_serial_numbers (rom);
-	for (i = 0; i < priv->hdrs->len; i++) {
-		hdr = g_ptr_array_index (priv->hdrs, i);
-		g_checksum_update (priv->checksum_wip, hdr->rom_data, hdr->rom_len);
+	/* update checksum; we hold the only reference to the blob so it is
+	 * safe to blank the serial numbers in place */
+	if ((flags & FU_ROM_LOAD_FLAG_HEADER_ONLY) == 0) {
+		if (flags & FU_ROM_LOAD_FLAG_BLANK_PPID)
+			fu_rom_find_and_blank_serial_numbers (rom);
+		for (i = 0; i < priv->hdrs->len; i++) {
+			hdr = g_ptr_array_index (priv->hdrs, i);
+			g_checksum_update (priv->checksum_wip, hdr->rom_data, hdr->rom_len);
+		}
 	}
 
 	/* update guid */
@@ -890,12 +1009,15 @@ fu_rom_get_model (FuRom *rom)
 /**
  * fu_rom_get_checksum:
  *
- * This returns the checksum of the firmware.
+ * This returns the checksum of the firmware, or %NULL if only the header
+ * was loaded.
  **/
 const gchar *
 fu_rom_get_checksum (FuRom *rom)
 {
 	FuRomPrivate *priv = rom->priv;
+	if (priv->flags & FU_ROM_LOAD_FLAG_HEADER_ONLY)
+		return NULL;
 	return g_checksum_get_string (priv->checksum_wip);
 }
 
@@ -934,6 +1056,8 @@ fu_rom_finalize (GObject *object)
 	g_free (priv->version);
 	g_free (priv->guid);
 	g_ptr_array_unref (priv->hdrs);
+	if (priv->blob != NULL)
+		g_bytes_unref (priv->blob);
 	if (priv->stream != NULL)
 		g_object_unref (priv->stream);
 
@@ -62,6 +62,7 @@ typedef enum {
 typedef enum {
 	FU_ROM_LOAD_FLAG_NONE,
 	FU_ROM_LOAD_FLAG_BLANK_PPID = 1,
+	FU_ROM_LOAD_FLAG_HEADER_ONLY = 2,
 	FU_ROM_LOAD_FLAG_LAST
 } FuRomLoadFlags;
 
@@ -0,0 +1,189 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "fu-scanner.h"
+
+static void fu_scanner_finalize			 (GObject *object);
+
+#define FU_SCANNER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), FU_TYPE_SCANNER, FuScannerPrivate))
+
+/* one bit per needle in the first-byte table */
+#define FU_SCANNER_NEEDLES_MAX		32
+
+typedef struct {
+	guint		 idx;
+	gsize		 offset;
+} FuScannerMatch;
+
+/**
+ * FuScannerPrivate:
+ *
+ * Private #FuScanner data
+ **/
+struct _FuScannerPrivate
+{
+	GPtrArray		*needles;		/* of gchar */
+	gsize			 needle_len[FU_SCANNER_NEEDLES_MAX];
+	guint32			 first_byte[256];	/* bitmask of needles */
+	GArray			*matches;		/* of FuScannerMatch */
+};
+
+G_DEFINE_TYPE (FuScanner, fu_scanner, G_TYPE_OBJECT)
+
+/**
+ * fu_scanner_scan:
+ *
+ * Finds all the needles in one pass over the data. Only the needles that
+ * start with the current byte are compared, so most of the buffer is
+ * skipped with a single table lookup.
+ **/
+void
+fu_scanner_scan (FuScanner *scanner, const guint8 *data, gsize len)
+{
+	FuScannerPrivate *priv = scanner->priv;
+	gsize i;
+
+	g_return_if_fail (FU_IS_SCANNER (scanner));
+
+	g_array_set_size (priv->matches, 0);
+	if (data == NULL)
+		return;
+	for (i = 0; i < len; i++) {
+		guint32 mask = priv->first_byte[data[i]];
+		guint j;
+		for (j = 0; mask != 0; j++, mask >>= 1) {
+			FuScannerMatch match;
+			const gchar *needle;
+			if ((mask & 0x01) == 0)
+				continue;
+			if (i + priv->needle_len[j] > len)
+				continue;
+			needle = g_ptr_array_index (priv->needles, j);
+			if (memcmp (data + i + 1, needle + 1, priv->needle_len[j] - 1) != 0)
+				continue;
+			match.idx = j;
+			match.offset = i;
+			g_array_append_val (priv->matches, match);
+		}
+	}
+}
+
+/**
+ * fu_scanner_find:
+ *
+ * Returns the offset of the first match of @needle at or after @offset
+ * from the last scan, or -1 if there was none.
+ **/
+gssize
+fu_scanner_find (FuScanner *scanner, const gchar *needle, gsize offset)
+{
+	FuScannerPrivate *priv = scanner->priv;
+	FuScannerMatch *match;
+	guint i;
+	guint idx;
+
+	g_return_val_if_fail (FU_IS_SCANNER (scanner), -1);
+	g_return_val_if_fail (needle != NULL, -1);
+
+	/* find the needle index */
+	for (idx = 0; idx < priv->needles->len; idx++) {
+		if (g_strcmp0 (g_ptr_array_index (priv->needles, idx), needle) == 0)
+			break;
+	}
+	g_return_val_if_fail (idx < priv->needles->len, -1);
+
+	/* matches are sorted by offset */
+	for (i = 0; i < priv->matches->len; i++) {
+		match = &g_array_index (priv->matches, FuScannerMatch, i);
+		if (match->idx != idx || match->offset < offset)
+			continue;
+		return match->offset;
+	}
+	return -1;
+}
+
+/**
+ * fu_scanner_class_init:
+ **/
+static void
+fu_scanner_class_init (FuScannerClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = fu_scanner_finalize;
+	g_type_class_add_private (klass, sizeof (FuScannerPrivate));
+}
+
+/**
+ * fu_scanner_init:
+ **/
+static void
+fu_scanner_init (FuScanner *scanner)
+{
+	scanner->priv = FU_SCANNER_GET_PRIVATE (scanner);
+	scanner->priv->needles = g_ptr_array_new_with_free_func (g_free);
+	scanner->priv->matches = g_array_new (FALSE, FALSE, sizeof (FuScannerMatch));
+}
+
+/**
+ * fu_scanner_finalize:
+ **/
+static void
+fu_scanner_finalize (GObject *object)
+{
+	FuScanner *scanner = FU_SCANNER (object);
+	FuScannerPrivate *priv = scanner->priv;
+
+	g_ptr_array_unref (priv->needles);
+	g_array_unref (priv->matches);
+
+	G_OBJECT_CLASS (fu_scanner_parent_class)->finalize (object);
+}
+
+/**
+ * fu_scanner_new:
+ * @needles: a %NULL terminated array of non-empty strings
+ **/
+FuScanner *
+fu_scanner_new (const gchar * const *needles)
+{
+	FuScanner *scanner;
+	FuScannerPrivate *priv;
+	guint i;
+
+	scanner = g_object_new (FU_TYPE_SCANNER, NULL);
+	priv = scanner->priv;
+	for (i = 0; needles[i] != NULL; i++) {
+		if (priv->needles->len >= FU_SCANNER_NEEDLES_MAX) {
+			g_warning ("too many needles, ignoring %s", needles[i]);
+			continue;
+		}
+		if (needles[i][0] == '\0')
+			continue;
+		priv->needle_len[priv->needles->len] = strlen (needles[i]);
+		priv->first_byte[(guint8) needles[i][0]] |= 1u << priv->needles->len;
+		g_ptr_array_add (priv->needles, g_strdup (needles[i]));
+	}
+	return FU_SCANNER (scanner);
+}
@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __FU_SCANNER_H
+#define __FU_SCANNER_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define FU_TYPE_SCANNER		(fu_scanner_get_type ())
+#define FU_SCANNER(o)		(G_TYPE_CHECK_INSTANCE_CAST ((o), FU_TYPE_SCANNER, FuScanner))
+#define FU_SCANNER_CLASS(k)	(G_TYPE_CHECK_CLASS_CAST((k), FU_TYPE_SCANNER, FuScannerClass))
+#define FU_IS_SCANNER(o)	(G_TYPE_CHECK_INSTANCE_TYPE ((o), FU_TYPE_SCANNER))
+#define FU_IS_SCANNER_CLASS(k)	(G_TYPE_CHECK_CLASS_TYPE ((k), FU_TYPE_SCANNER))
+#define FU_SCANNER_GET_CLASS(o)	(G_TYPE_INSTANCE_GET_CLASS ((o), FU_TYPE_SCANNER, FuScannerClass))
+
+typedef struct _FuScannerPrivate	FuScannerPrivate;
+typedef struct _FuScanner		FuScanner;
+typedef struct _FuScannerClass		FuScannerClass;
+
+struct _FuScanner
+{
+	 GObject		 parent;
+	 FuScannerPrivate	*priv;
+};
+
+struct _FuScannerClass
+{
+	GObjectClass		 parent_class;
+};
+
+GType		 fu_scanner_get_type			(void);
+FuScanner	*fu_scanner_new				(const gchar * const *needles);
+
+void		 fu_scanner_scan			(FuScanner	*scanner,
+							 const guint8	*data,
+							 gsize		 len);
+gssize		 fu_scanner_find			(FuScanner	*scanner,
+							 const gchar	*needle,
+							 gsize		 offset);
+
+G_END_DECLS
+
+#endif /* __FU_SCANNER_H */
@@ -26,14 +26,22 @@
 #include <glib/gstdio.h>
 #include <gio/gfiledescriptorbased.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fu-cab.h"
 #include "fu-cleanup.h"
 #include "fu-keyring.h"
+#include "fu-main-batch.h"
+#include "fu-main-snapshot.h"
+#include "fu-main-store.h"
+#include "fu-memfd.h"
 #include "fu-pending.h"
 #include "fu-provider-fake.h"
 #include "fu-provider-rpi.h"
 #include "fu-rom.h"
+#include "fu-scanner.h"
 
 /**
  * fu_test_get_filename:
@@ -51,6 +59,39 @@ fu_test_get_filename (const gchar *filename)
 	return g_strdup (full_tmp);
 }
 
+/**
+ * fu_test_remove_pending_db:
+ **/
+static void
+fu_test_remove_pending_db (void)
+{
+	const gchar *suffixes[] = { "", "-wal", "-shm", NULL };
+	guint i;
+
+	for (i = 0; suffixes[i] != NULL; i++) {
+		_cleanup_free_ gchar *fn = NULL;
+		fn = g_strdup_printf ("%s/lib/fwupd/pending.db%s",
+				      LOCALSTATEDIR, suffixes[i]);
+		g_unlink (fn);
+	}
+}
+
+static void
+fu_scanner_func (void)
+{
+	const gchar *data = "xxVersion 1.2.3xx VR123xxVersion 4.5.6";
+	const gchar *needles[] = { "Version ", " VR", "Version", "PPID", NULL };
+	_cleanup_object_unref_ FuScanner *scanner = NULL;
+
+	scanner = fu_scanner_new (needles);
+	fu_scanner_scan (scanner, (const guint8 *) data, strlen (data));
+	g_assert_cmpint (fu_scanner_find (scanner, "Version ", 0), ==, 2);
+	g_assert_cmpint (fu_scanner_find (scanner, "Version ", 3), ==, 25);
+	g_assert_cmpint (fu_scanner_find (scanner, "Version", 0), ==, 2);
+	g_assert_cmpint (fu_scanner_find (scanner, " VR", 0), ==, 17);
+	g_assert_cmpint (fu_scanner_find (scanner, "PPID", 0), ==, -1);
+}
+
 static void
 fu_rom_func (void)
 {
@@ -119,6 +160,18 @@ fu_rom_func (void)
 		g_assert_cmpint (fu_rom_get_kind (rom), ==, data[i].kind);
 		g_assert_cmpint (fu_rom_get_vendor (rom), ==, data[i].vendor);
 		g_assert_cmpint (fu_rom_get_model (rom), ==, data[i].model);
+
+		/* only the first image is needed for the version */
+		g_object_unref (rom);
+		rom = fu_rom_new ();
+		ret = fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_HEADER_ONLY, NULL, &error);
+		g_assert_no_error (error);
+		g_assert (ret);
+		g_assert_cmpstr (fu_rom_get_version (rom), ==, data[i].ver);
+		g_assert_cmpstr (fu_rom_get_checksum (rom), ==, NULL);
+		g_assert_cmpint (fu_rom_get_kind (rom), ==, data[i].kind);
+		g_assert_cmpint (fu_rom_get_vendor (rom), ==, data[i].vendor);
+		g_assert_cmpint (fu_rom_get_model (rom), ==, data[i].model);
 	}
 }
 
@@ -222,12 +275,158 @@ fu_cab_func (void)
 }
 
 static void
-_provider_status_changed_cb (FuProvider *provider, FwupdStatus status, gpointer user_data)
+fu_cab_memory_func (void)
+{
+	GError *error = NULL;
+	gboolean ret;
+	gint fd;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ FuCab *cab = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	/* load file without using the filesystem */
+	cab = fu_cab_new ();
+	fu_cab_set_in_memory (cab, TRUE);
+	filename = fu_test_get_filename ("colorhug/colorhug-als-3.0.2.cab");
+	g_assert (filename != NULL);
+	file = g_file_new_for_path (filename);
+	ret = fu_cab_load_file (cab, file, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpstr (fu_cab_get_guid (cab), ==, "84f40464-9272-4ef7-9399-cd95f12da696");
+	g_assert_cmpstr (fu_cab_get_version (cab), ==, "3.0.2");
+	g_assert (fu_cab_get_filename_firmware (cab) == NULL);
+	g_assert (fu_cab_get_firmware_data (cab) != NULL);
+
+	/* get something we can pass to the provider */
+	fd = fu_cab_get_firmware_fd (cab, &error);
+	g_assert_no_error (error);
+	g_assert_cmpint (fd, >=, 0);
+	g_assert_cmpint (lseek (fd, 0, SEEK_END), ==,
+			 g_bytes_get_size (fu_cab_get_firmware_data (cab)));
+	close (fd);
+
+	/* uses the signature checked while decompressing */
+	ret = fu_cab_verify (cab, &error);
+	if (g_error_matches (error, FWUPD_ERROR, FWUPD_ERROR_NOT_FOUND)) {
+		g_clear_error (&error);
+	} else {
+		g_assert_no_error (error);
+		g_assert (ret);
+		g_assert_cmpint (fu_cab_get_trust_flags (cab), ==, FWUPD_TRUST_FLAG_PAYLOAD);
+	}
+}
+
+static void
+fu_cab_memfd_func (void)
+{
+	GError *error = NULL;
+	gboolean ret;
+	gint fd;
+	gint seals;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ FuCab *cab = NULL;
+
+	/* this is what fwupdmgr sends */
+	filename = fu_test_get_filename ("colorhug/colorhug-als-3.0.2.cab");
+	g_assert (filename != NULL);
+	fd = fu_memfd_new_for_file (filename, &error);
+	g_assert_no_error (error);
+	g_assert_cmpint (fd, >=, 0);
+
+	/* the memfd can only be mapped if the client cannot change it */
+	seals = fcntl (fd, F_GET_SEALS);
+	if (seals >= 0) {
+		g_assert_cmpint (seals & F_SEAL_SHRINK, !=, 0);
+		g_assert_cmpint (seals & F_SEAL_WRITE, !=, 0);
+	}
+
+	/* load it the way the daemon does */
+	cab = fu_cab_new ();
+	fu_cab_set_in_memory (cab, TRUE);
+	ret = fu_cab_load_fd (cab, fd, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpstr (fu_cab_get_guid (cab), ==, "84f40464-9272-4ef7-9399-cd95f12da696");
+	g_assert_cmpstr (fu_cab_get_version (cab), ==, "3.0.2");
+	g_assert (fu_cab_get_firmware_data (cab) != NULL);
+}
+
+/**
+ * fu_cab_checksum_verify:
+ *
+ * Loads @fn and checks the payload against the metadata content checksum.
+ **/
+static gboolean
+fu_cab_checksum_verify (const gchar *fn, gboolean in_memory, GError **error)
+{
+	gboolean ret;
+	_cleanup_free_ gchar *filename = NULL;
+	_cleanup_object_unref_ FuCab *cab = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	cab = fu_cab_new ();
+	fu_cab_set_in_memory (cab, in_memory);
+	filename = fu_test_get_filename (fn);
+	g_assert (filename != NULL);
+	file = g_file_new_for_path (filename);
+	if (!fu_cab_load_file (cab, file, NULL, error))
+		return FALSE;
+	if (!fu_cab_extract (cab, FU_CAB_EXTRACT_FLAG_FIRMWARE, error))
+		return FALSE;
+	ret = fu_cab_verify (cab, error);
+	fu_cab_delete_temp_files (cab, NULL);
+	return ret;
+}
+
+static void
+fu_cab_checksum_func (void)
+{
+	gboolean ret;
+	guint i;
+
+	for (i = 0; i < 2; i++) {
+		gboolean in_memory = i > 0;
+		GError *error = NULL;
+
+		/* the payload matches, so only the keys may be missing */
+		ret = fu_cab_checksum_verify ("colorhug/colorhug-als-3.0.2-checksum.cab",
+					      in_memory, &error);
+		if (g_error_matches (error, FWUPD_ERROR, FWUPD_ERROR_NOT_FOUND)) {
+			g_clear_error (&error);
+		} else {
+			g_assert_no_error (error);
+			g_assert (ret);
+		}
+
+		/* the payload was changed after the metadata was written */
+		ret = fu_cab_checksum_verify ("colorhug/colorhug-als-3.0.2-tampered.cab",
+					      in_memory, &error);
+		g_assert_error (error, FWUPD_ERROR, FWUPD_ERROR_INVALID_FILE);
+		g_assert (!ret);
+		g_clear_error (&error);
+	}
+}
+
+static void
+_provider_status_changed_cb (FuProvider *provider, FwupdStatus status,
+			     FuDevice *device, gpointer user_data)
 {
 	guint *cnt = (guint *) user_data;
 	(*cnt)++;
 }
 
+static void
+_provider_progress_changed_cb (FuProvider *provider, guint64 done,
+			       guint64 total, FuDevice *device,
+			       gpointer user_data)
+{
+	guint64 *progress = (guint64 *) user_data;
+	g_assert_cmpint (done, >=, progress[0]);
+	progress[0] = done;
+	progress[1] = total;
+}
+
 static void
 _provider_device_added_cb (FuProvider *provider, FuDevice *device, gpointer user_data)
 {
@@ -243,7 +442,6 @@ fu_provider_func (void)
 	gboolean ret;
 	guint cnt = 0;
 	_cleanup_free_ gchar *pending_cap = NULL;
-	_cleanup_free_ gchar *pending_db = NULL;
 	_cleanup_object_unref_ FuDevice *device = NULL;
 	_cleanup_object_unref_ FuPending *pending = NULL;
 	_cleanup_object_unref_ FuProvider *provider = NULL;
@@ -331,8 +529,523 @@ fu_provider_func (void)
 	g_clear_error (&error);
 
 	/* delete files */
-	pending_db = g_build_filename (LOCALSTATEDIR, "lib", "fwupd", "pending.db", NULL);
-	g_unlink (pending_db);
+	fu_test_remove_pending_db ();
+	g_unlink (pending_cap);
+}
+
+typedef struct {
+	GMainLoop	*loop;
+	guint		 added;
+	guint		 removed;
+} FuTestHotplugHelper;
+
+static void
+_provider_hotplug_added_cb (FuProvider *provider, FuDevice *device, gpointer user_data)
+{
+	FuTestHotplugHelper *helper = (FuTestHotplugHelper *) user_data;
+
+	/* a batch is published in one dispatch, so quitting here still lets
+	 * every device in the same batch be added */
+	helper->added++;
+	g_main_loop_quit (helper->loop);
+}
+
+static void
+_provider_hotplug_removed_cb (FuProvider *provider, FuDevice *device, gpointer user_data)
+{
+	FuTestHotplugHelper *helper = (FuTestHotplugHelper *) user_data;
+	helper->removed++;
+}
+
+static gboolean
+_provider_hotplug_timeout_cb (gpointer user_data)
+{
+	g_assert_not_reached ();
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_provider_hotplug_quit_cb (gpointer user_data)
+{
+	FuTestHotplugHelper *helper = (FuTestHotplugHelper *) user_data;
+	g_main_loop_quit (helper->loop);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+fu_provider_hotplug_func (void)
+{
+	FuTestHotplugHelper helper = { NULL, 0, 0 };
+	GError *error = NULL;
+	gboolean ret;
+	guint timeout_id;
+	_cleanup_object_unref_ FuDevice *device1 = NULL;
+	_cleanup_object_unref_ FuDevice *device2 = NULL;
+	_cleanup_object_unref_ FuDevice *device3 = NULL;
+	_cleanup_object_unref_ FuDevice *device4 = NULL;
+	_cleanup_object_unref_ FuDevice *device5 = NULL;
+	_cleanup_object_unref_ FuProvider *provider = NULL;
+
+	provider = fu_provider_fake_new ();
+	helper.loop = g_main_loop_new (NULL, FALSE);
+	g_signal_connect (provider, "device-added",
+			  G_CALLBACK (_provider_hotplug_added_cb), &helper);
+	g_signal_connect (provider, "device-removed",
+			  G_CALLBACK (_provider_hotplug_removed_cb), &helper);
+	timeout_id = g_timeout_add_seconds (5, _provider_hotplug_timeout_cb, NULL);
+
+	device1 = fu_device_new ();
+	fu_device_set_id (device1, "FakeHotplug1");
+	device2 = fu_device_new ();
+	fu_device_set_id (device2, "FakeHotplug2");
+	device3 = fu_device_new ();
+	fu_device_set_id (device3, "FakeHotplug3");
+	device4 = fu_device_new ();
+	fu_device_set_id (device4, "FakeHotplug4");
+	device5 = fu_device_new ();
+	fu_device_set_id (device5, "FakeHotplugSlow");
+
+	/* events that arrive together are probed and added as one batch, and
+	 * a duplicate add within the window is only probed once */
+	fu_provider_hotplug_add (provider, "FakeHotplug1", G_OBJECT (device1));
+	fu_provider_hotplug_add (provider, "FakeHotplug2", G_OBJECT (device2));
+	fu_provider_hotplug_add (provider, "FakeHotplug1", G_OBJECT (device1));
+	fu_provider_hotplug_add (provider, "FakeHotplug3", G_OBJECT (device3));
+	g_assert (!fu_provider_hotplug_has_removal (provider, "FakeHotplug1"));
+	g_main_loop_run (helper.loop);
+	g_assert_cmpint (helper.added, ==, 3);
+	g_assert_cmpint (helper.removed, ==, 0);
+
+	/* a device that comes and goes before it is probed is never added,
+	 * and a quick replug removes the device and then adds it again */
+	fu_provider_hotplug_add (provider, "FakeHotplug4", G_OBJECT (device4));
+	fu_provider_hotplug_remove (provider, "FakeHotplug4", G_OBJECT (device4));
+	fu_provider_hotplug_remove (provider, "FakeHotplug2", G_OBJECT (device2));
+	g_assert (!fu_provider_hotplug_has_removal (provider, "FakeHotplug4"));
+	g_assert (fu_provider_hotplug_has_removal (provider, "FakeHotplug2"));
+	fu_provider_hotplug_add (provider, "FakeHotplug2", G_OBJECT (device2));
+	g_main_loop_run (helper.loop);
+	g_assert_cmpint (helper.added, ==, 4);
+	g_assert_cmpint (helper.removed, ==, 1);
+	g_assert (!fu_provider_hotplug_has_removal (provider, "FakeHotplug2"));
+
+	/* coldplug waits for a batch that is already being probed, so stop
+	 * after the flush but before the slow device has been probed */
+	fu_provider_hotplug_add (provider, "FakeHotplugSlow", G_OBJECT (device5));
+	g_timeout_add (200, _provider_hotplug_quit_cb, &helper);
+	g_main_loop_run (helper.loop);
+	g_assert_cmpint (helper.added, ==, 4);
+	ret = fu_provider_coldplug (provider, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (helper.added, ==, 6);
+
+	g_source_remove (timeout_id);
+	g_main_loop_unref (helper.loop);
+}
+
+static void
+fu_main_snapshot_func (void)
+{
+	FuDevice *device_tmp;
+	GError *error = NULL;
+	gboolean ret;
+	const gchar *filename = "/tmp/fwupd-self-test/snapshot.gvariant";
+	_cleanup_object_unref_ FuDevice *device1 = NULL;
+	_cleanup_object_unref_ FuDevice *device2 = NULL;
+	_cleanup_object_unref_ FuProvider *provider = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices_new = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *providers = NULL;
+
+	provider = fu_provider_fake_new ();
+	fu_provider_fake_set_snapshot_key (FU_PROVIDER_FAKE (provider), "abc");
+	providers = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	g_ptr_array_add (providers, g_object_ref (provider));
+
+	/* a device from a provider that is not loaded is not saved */
+	device1 = fu_device_new ();
+	fu_device_set_id (device1, "FakeDevice");
+	fu_device_set_metadata (device1, FU_DEVICE_KEY_PROVIDER, "Fake");
+	fu_device_set_metadata (device1, FU_DEVICE_KEY_VERSION, "1.2.3");
+	device2 = fu_device_new ();
+	fu_device_set_id (device2, "UnknownDevice");
+	fu_device_set_metadata (device2, FU_DEVICE_KEY_PROVIDER, "Unknown");
+	devices = g_ptr_array_new ();
+	g_ptr_array_add (devices, device1);
+	g_ptr_array_add (devices, device2);
+	ret = fu_main_snapshot_save (filename, providers, devices, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the hardware is the same */
+	devices_new = fu_main_snapshot_load (filename, providers, &error);
+	g_assert_no_error (error);
+	g_assert (devices_new != NULL);
+	g_assert_cmpint (devices_new->len, ==, 1);
+	device_tmp = g_ptr_array_index (devices_new, 0);
+	g_assert_cmpstr (fu_device_get_id (device_tmp), ==, "FakeDevice");
+	g_assert_cmpstr (fu_device_get_metadata (device_tmp, FU_DEVICE_KEY_VERSION), ==, "1.2.3");
+	g_ptr_array_unref (devices_new);
+
+	/* something was plugged in */
+	fu_provider_fake_set_snapshot_key (FU_PROVIDER_FAKE (provider), "def");
+	devices_new = fu_main_snapshot_load (filename, providers, &error);
+	g_assert_no_error (error);
+	g_assert (devices_new != NULL);
+	g_assert_cmpint (devices_new->len, ==, 0);
+
+	g_unlink (filename);
+}
+
+typedef struct {
+	GMainLoop	*loop;
+	guint		 pending;
+	guint		 failed;
+} FuTestVerifyAllHelper;
+
+static void
+_provider_verify_all_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuTestVerifyAllHelper *helper = (FuTestVerifyAllHelper *) user_data;
+	_cleanup_error_free_ GError *error = NULL;
+
+	if (!fu_provider_verify_finish (FU_PROVIDER (source), res, &error)) {
+		g_assert_error (error, FWUPD_ERROR, FWUPD_ERROR_READ);
+		helper->failed++;
+	}
+	if (--helper->pending == 0)
+		g_main_loop_quit (helper->loop);
+}
+
+static void
+fu_provider_verify_all_func (void)
+{
+	FuDevice *device;
+	FuTestVerifyAllHelper helper = { NULL, 0, 0 };
+	const gchar *ids[] = { "FakeDevice1", "FakeDevice2", "FakeBroken", NULL };
+	guint i;
+	_cleanup_object_unref_ FuProvider *provider = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+
+	/* providers that do not allow parallel operation verify each device
+	 * in turn in a worker, without blocking the main loop */
+	provider = fu_provider_fake_new ();
+	fu_provider_set_allow_parallel (provider, FALSE);
+	helper.loop = g_main_loop_new (NULL, FALSE);
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = 0; ids[i] != NULL; i++) {
+		device = fu_device_new ();
+		fu_device_set_id (device, ids[i]);
+		g_ptr_array_add (devices, device);
+		helper.pending++;
+		fu_provider_verify_async (provider, device,
+					  FU_PROVIDER_VERIFY_FLAG_NONE,
+					  NULL, _provider_verify_all_cb, &helper);
+	}
+	g_main_loop_run (helper.loop);
+	g_assert_cmpint (helper.failed, ==, 1);
+	g_assert_cmpint (fu_provider_fake_get_verify_max (FU_PROVIDER_FAKE (provider)), ==, 1);
+	device = g_ptr_array_index (devices, 0);
+	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH), !=, NULL);
+	device = g_ptr_array_index (devices, 2);
+	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH), ==, NULL);
+
+	/* the rest verify all the devices at the same time */
+	fu_provider_set_allow_parallel (provider, TRUE);
+	helper.failed = 0;
+	for (i = 0; i < devices->len; i++) {
+		device = g_ptr_array_index (devices, i);
+		helper.pending++;
+		fu_provider_verify_async (provider, device,
+					  FU_PROVIDER_VERIFY_FLAG_NONE,
+					  NULL, _provider_verify_all_cb, &helper);
+	}
+	g_main_loop_run (helper.loop);
+	g_assert_cmpint (helper.failed, ==, 1);
+	g_main_loop_unref (helper.loop);
+}
+
+/**
+ * fu_test_capsule_new:
+ **/
+static FuProviderCapsule *
+fu_test_capsule_new (FuDevice *device)
+{
+	FuProviderCapsule *capsule = g_new0 (FuProviderCapsule, 1);
+	capsule->device = device;
+	capsule->fd = -1;
+	return capsule;
+}
+
+typedef struct {
+	GMainLoop	*loop;
+	GHashTable	*done;		/* id:percentage */
+	guint		 pending;
+} FuTestProgressHelper;
+
+static void
+_provider_device_progress_cb (FuProvider *provider, guint64 done,
+			      guint64 total, FuDevice *device,
+			      gpointer user_data)
+{
+	FuTestProgressHelper *helper = (FuTestProgressHelper *) user_data;
+	g_assert (device != NULL);
+	g_hash_table_insert (helper->done,
+			     g_strdup (fu_device_get_id (device)),
+			     GUINT_TO_POINTER (done * 100 / total));
+}
+
+static void
+_provider_device_progress_update_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuTestProgressHelper *helper = (FuTestProgressHelper *) user_data;
+	GError *error = NULL;
+	gboolean ret;
+
+	ret = fu_provider_update_finish (FU_PROVIDER (source), res, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	if (--helper->pending == 0)
+		g_main_loop_quit (helper->loop);
+}
+
+static void
+fu_provider_progress_func (void)
+{
+	FuTestProgressHelper helper = { NULL, NULL, 0 };
+	const gchar *ids[] = { "FakeProgress1", "FakeProgress2", NULL };
+	guint i;
+	_cleanup_object_unref_ FuProvider *provider = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+
+	/* each device gets its own progress, rate limited by itself */
+	provider = fu_provider_fake_new ();
+	helper.loop = g_main_loop_new (NULL, FALSE);
+	helper.done = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	g_signal_connect (provider, "progress-changed",
+			  G_CALLBACK (_provider_device_progress_cb), &helper);
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = 0; ids[i] != NULL; i++) {
+		FuDevice *device = fu_device_new ();
+		fu_device_set_id (device, ids[i]);
+		g_ptr_array_add (devices, device);
+		helper.pending++;
+		fu_provider_update_async (provider, device, NULL, -1,
+					  FU_PROVIDER_UPDATE_FLAG_NONE, NULL,
+					  _provider_device_progress_update_cb,
+					  &helper);
+	}
+	g_main_loop_run (helper.loop);
+	g_assert_cmpint (g_hash_table_size (helper.done), ==, 2);
+	for (i = 0; ids[i] != NULL; i++) {
+		g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (helper.done, ids[i])), ==, 100);
+	}
+	g_hash_table_unref (helper.done);
+	g_main_loop_unref (helper.loop);
+}
+
+typedef struct {
+	GMainLoop	*loop;
+	GCancellable	*cancellable;
+	guint		 started;
+	guint		 finished;
+	gboolean	 done;
+} FuTestBatchHelper;
+
+static void
+_batch_job_cb (FuMainBatchJob *job, const gchar *state, guint n_done, gpointer user_data)
+{
+	FuTestBatchHelper *helper = (FuTestBatchHelper *) user_data;
+	if (g_strcmp0 (state, "installing") == 0) {
+		helper->started++;
+		return;
+	}
+	helper->finished++;
+
+	/* cancel the devices still waiting their turn */
+	if (helper->cancellable != NULL)
+		g_cancellable_cancel (helper->cancellable);
+}
+
+static void
+_batch_done_cb (gpointer user_data)
+{
+	FuTestBatchHelper *helper = (FuTestBatchHelper *) user_data;
+	helper->done = TRUE;
+	g_main_loop_quit (helper->loop);
+}
+
+/**
+ * fu_test_batch_get_result:
+ **/
+static gchar *
+fu_test_batch_get_result (GPtrArray *jobs, const gchar *id)
+{
+	gchar *error_msg = NULL;
+	_cleanup_variant_unref_ GVariant *results = NULL;
+
+	results = g_variant_ref_sink (fu_main_batch_get_results (jobs));
+	g_variant_lookup (results, id, "s", &error_msg);
+	return error_msg;
+}
+
+static void
+fu_main_batch_func (void)
+{
+	FuMainBatchJob *job;
+	FuTestBatchHelper helper = { NULL, NULL, 0, 0, FALSE };
+	const gchar *ids[] = { "FakeBatch1", "FakeBatchBroken", "FakeBatch2",
+			       "FakeBatchSkipped", NULL };
+	guint i;
+	_cleanup_object_unref_ FuProvider *provider = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *jobs = NULL;
+	_cleanup_variant_unref_ GVariant *results = NULL;
+
+	provider = fu_provider_fake_new ();
+	helper.loop = g_main_loop_new (NULL, FALSE);
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = 0; ids[i] != NULL; i++) {
+		FuDevice *device = fu_device_new ();
+		fu_device_set_id (device, ids[i]);
+		g_ptr_array_add (devices, device);
+	}
+
+	/* some devices fail, and one failed the checks so is not attempted */
+	jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_main_batch_job_free);
+	for (i = 0; i < devices->len; i++) {
+		job = fu_main_batch_job_new (g_ptr_array_index (devices, i), provider);
+		g_ptr_array_add (jobs, job);
+	}
+	job = g_ptr_array_index (jobs, 3);
+	job->error_msg = g_strdup ("firmware is older");
+	fu_main_batch_run (jobs, NULL, FU_PROVIDER_UPDATE_FLAG_NONE, NULL,
+			   _batch_job_cb, _batch_done_cb, &helper);
+	g_main_loop_run (helper.loop);
+	g_assert (helper.done);
+	g_assert_cmpint (helper.started, ==, 3);
+	g_assert_cmpint (helper.finished, ==, 3);
+	results = g_variant_ref_sink (fu_main_batch_get_results (jobs));
+	g_assert_cmpint (g_variant_n_children (results), ==, 4);
+	for (i = 0; ids[i] != NULL; i++) {
+		_cleanup_free_ gchar *error_msg = NULL;
+		error_msg = fu_test_batch_get_result (jobs, ids[i]);
+		g_assert (error_msg != NULL);
+		if (i == 1)
+			g_assert_cmpstr (error_msg, ==, "cannot write firmware");
+		else if (i == 3)
+			g_assert_cmpstr (error_msg, ==, "firmware is older");
+		else
+			g_assert_cmpstr (error_msg, ==, "");
+	}
+	g_ptr_array_unref (jobs);
+
+	/* devices that have to wait their turn are not started once the
+	 * client has gone away */
+	fu_provider_set_allow_parallel (provider, FALSE);
+	helper.cancellable = g_cancellable_new ();
+	helper.started = 0;
+	helper.finished = 0;
+	helper.done = FALSE;
+	jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_main_batch_job_free);
+	for (i = 0; i < 3; i++) {
+		job = fu_main_batch_job_new (g_ptr_array_index (devices, i), provider);
+		g_ptr_array_add (jobs, job);
+	}
+	fu_main_batch_run (jobs, NULL, FU_PROVIDER_UPDATE_FLAG_NONE,
+			   helper.cancellable, _batch_job_cb, _batch_done_cb,
+			   &helper);
+	g_main_loop_run (helper.loop);
+	g_assert (helper.done);
+	g_assert_cmpint (helper.finished, ==, 3);
+	for (i = 0; i < 3; i++) {
+		_cleanup_free_ gchar *error_msg = NULL;
+		error_msg = fu_test_batch_get_result (jobs, ids[i]);
+		g_assert (error_msg != NULL);
+		if (i == 0)
+			g_assert_cmpstr (error_msg, ==, "");
+		else
+			g_assert_cmpstr (error_msg, !=, "");
+	}
+
+	g_object_unref (helper.cancellable);
+	g_main_loop_unref (helper.loop);
+}
+
+static void
+fu_provider_stage_func (void)
+{
+	FuDevice *device_tmp;
+	FuProviderCapsule *capsule;
+	GError *error = NULL;
+	gboolean ret;
+	guint i;
+	_cleanup_free_ gchar *pending_cap = NULL;
+	_cleanup_object_unref_ FuDevice *device = NULL;
+	_cleanup_object_unref_ FuDevice *device2 = NULL;
+	_cleanup_object_unref_ FuPending *pending = NULL;
+	_cleanup_object_unref_ FuProvider *provider = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+	_cleanup_object_unref_ GInputStream *stream = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *capsules = NULL;
+
+	provider = fu_provider_fake_new ();
+	g_signal_connect (provider, "device-added",
+			  G_CALLBACK (_provider_device_added_cb),
+			  &device);
+	ret = fu_provider_coldplug (provider, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (device != NULL);
+	device2 = fu_device_new ();
+	fu_device_set_id (device2, "FakeDevice2");
+	fu_device_set_guid (device2, "00000000-0000-0000-0000-000000000001");
+
+	/* stage two devices, one of them twice */
+	file = g_file_new_for_path ("/etc/resolv.conf");
+	stream = G_INPUT_STREAM (g_file_read (file, NULL, &error));
+	g_assert_no_error (error);
+	g_assert (stream != NULL);
+	capsules = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_provider_capsule_free);
+	g_ptr_array_add (capsules, fu_test_capsule_new (device));
+	g_ptr_array_add (capsules, fu_test_capsule_new (device2));
+	g_ptr_array_add (capsules, fu_test_capsule_new (device));
+	ret = fu_provider_stage_offline (provider, capsules, stream,
+					 FU_PROVIDER_UPDATE_FLAG_OFFLINE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	for (i = 0; i < capsules->len; i++) {
+		capsule = g_ptr_array_index (capsules, i);
+		g_assert (capsule->error == NULL);
+		g_assert (capsule->merged == (i == 2));
+	}
+
+	/* both are scheduled, sharing one copy of the cabinet */
+	pending = fu_pending_new ();
+	device_tmp = fu_pending_get_device (pending, fu_device_get_id (device), &error);
+	g_assert_no_error (error);
+	g_assert (device_tmp != NULL);
+	g_assert_cmpstr (fu_device_get_metadata (device_tmp, FU_DEVICE_KEY_PENDING_STATE), ==, "scheduled");
+	pending_cap = g_strdup (fu_device_get_metadata (device_tmp, FU_DEVICE_KEY_FILENAME_CAB));
+	g_assert (pending_cap != NULL);
+	g_object_unref (device_tmp);
+	device_tmp = fu_pending_get_device (pending, "FakeDevice2", &error);
+	g_assert_no_error (error);
+	g_assert (device_tmp != NULL);
+	g_assert_cmpstr (fu_device_get_metadata (device_tmp, FU_DEVICE_KEY_PENDING_STATE), ==, "scheduled");
+	g_assert_cmpstr (fu_device_get_metadata (device_tmp, FU_DEVICE_KEY_FILENAME_CAB), ==, pending_cap);
+	g_object_unref (device_tmp);
+
+	/* staging again is refused */
+	ret = fu_provider_stage_offline (provider, capsules, stream,
+					 FU_PROVIDER_UPDATE_FLAG_OFFLINE, &error);
+	g_assert_error (error, FWUPD_ERROR, FWUPD_ERROR_ALREADY_PENDING);
+	g_assert (!ret);
+	g_clear_error (&error);
+
+	/* delete files */
+	fu_test_remove_pending_db ();
 	g_unlink (pending_cap);
 }
 
@@ -341,15 +1054,18 @@ fu_provider_rpi_func (void)
 {
 	gboolean ret;
 	guint cnt = 0;
+	guint64 progress[2] = { 0, 0 };
 	int fd;
 	_cleanup_error_free_ GError *error = NULL;
 	_cleanup_free_ gchar *path = NULL;
-	_cleanup_free_ gchar *pending_db = NULL;
 	_cleanup_free_ gchar *fwfile = NULL;
 	_cleanup_object_unref_ FuDevice *device = NULL;
 	_cleanup_object_unref_ FuProvider *provider = NULL;
 	_cleanup_object_unref_ GFile *file = NULL;
 	_cleanup_object_unref_ GInputStream *stream = NULL;
+	_cleanup_object_unref_ GInputStream *stream2 = NULL;
+	struct stat st1;
+	struct stat st2;
 
 	/* test location */
 	path = fu_test_get_filename ("rpiboot");
@@ -381,6 +1097,9 @@ fu_provider_rpi_func (void)
 	g_unlink ("/tmp/rpiboot/start.elf");
 
 	/* do update */
+	g_signal_connect (provider, "progress-changed",
+			  G_CALLBACK (_provider_progress_changed_cb),
+			  progress);
 	fu_provider_rpi_set_fw_dir (FU_PROVIDER_RPI (provider), "/tmp/rpiboot");
 	fwfile = fu_test_get_filename ("rpiupdate/firmware.bin");
 	g_assert (fwfile != NULL);
@@ -394,6 +1113,8 @@ fu_provider_rpi_func (void)
 	g_assert_no_error (error);
 	g_assert (ret);
 	g_assert_cmpint (cnt, ==, 3);
+	g_assert_cmpint (progress[1], >, 0);
+	g_assert_cmpint (progress[0], ==, progress[1]);
 
 	/* check the file was exploded to the right place */
 	g_assert (g_file_test ("/tmp/rpiboot/start.elf", G_FILE_TEST_EXISTS));
@@ -401,9 +1122,254 @@ fu_provider_rpi_func (void)
 	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION), ==,
 			 "20150805");
 
+	/* files that have not changed are not written again */
+	g_assert_cmpint (g_stat ("/tmp/rpiboot/start.elf", &st1), ==, 0);
+	progress[0] = 0;
+	stream2 = G_INPUT_STREAM (g_file_read (file, NULL, &error));
+	g_assert_no_error (error);
+	fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream2));
+	ret = fu_provider_update (provider, device, NULL, fd,
+				  FU_PROVIDER_UPDATE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (g_stat ("/tmp/rpiboot/start.elf", &st2), ==, 0);
+	g_assert_cmpint (st1.st_ino, ==, st2.st_ino);
+	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION), ==,
+			 "20150805");
+
 	/* clean up */
-	pending_db = g_build_filename (LOCALSTATEDIR, "lib", "fwupd", "pending.db", NULL);
-	g_unlink (pending_db);
+	fu_test_remove_pending_db ();
+}
+
+static void
+fu_device_func (void)
+{
+	_cleanup_object_unref_ FuDevice *device = NULL;
+	_cleanup_variant_unref_ GVariant *val1 = NULL;
+	_cleanup_variant_unref_ GVariant *val2 = NULL;
+	_cleanup_free_ gchar *str1 = NULL;
+	_cleanup_free_ gchar *str2 = NULL;
+
+	device = fu_device_new ();
+	fu_device_set_id (device, "FakeDevice");
+	g_assert_cmpstr (fu_device_get_metadata (device, "NeverSetAnywhere"), ==, NULL);
+	fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, "1.2.3");
+	fu_device_set_metadata (device, FU_DEVICE_KEY_DISPLAY_NAME, "Fake");
+	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION), ==, "1.2.3");
+
+	/* the cached metadata is rebuilt when a setter is called */
+	val1 = g_variant_ref_sink (fu_device_get_metadata_as_variant (device));
+	str1 = g_variant_print (val1, FALSE);
+	g_assert_cmpstr (str1, ==, "([{'DisplayName', <'Fake'>}, "
+				   "{'Version', <'1.2.3'>}, "
+				   "{'Flags', <uint64 0>}],)");
+	fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, "1.2.4");
+	fu_device_add_flag (device, FU_DEVICE_FLAG_INTERNAL);
+	val2 = g_variant_ref_sink (fu_device_get_metadata_as_variant (device));
+	str2 = g_variant_print (val2, FALSE);
+	g_assert_cmpstr (str2, ==, "([{'DisplayName', <'Fake'>}, "
+				   "{'Version', <'1.2.4'>}, "
+				   "{'Flags', <uint64 1>}],)");
+}
+
+/**
+ * fu_device_threads_thread_cb:
+ **/
+static gpointer
+fu_device_threads_thread_cb (gpointer user_data)
+{
+	FuDevice *device = FU_DEVICE (user_data);
+	guint i;
+
+	for (i = 0; i < 1000; i++) {
+		_cleanup_free_ gchar *tmp = g_strdup_printf ("%u", i);
+		fu_device_set_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH, tmp);
+	}
+	return NULL;
+}
+
+static void
+fu_device_threads_func (void)
+{
+	GThread *thread;
+	guint i;
+	_cleanup_object_unref_ FuDevice *device = NULL;
+	_cleanup_free_ gchar *hash = NULL;
+
+	device = fu_device_new ();
+	fu_device_set_id (device, "FakeDevice");
+
+	/* a worker sets metadata while the main thread builds the variant */
+	thread = g_thread_new ("fu-self-test", fu_device_threads_thread_cb, device);
+	for (i = 0; i < 1000; i++) {
+		_cleanup_variant_unref_ GVariant *val = NULL;
+		_cleanup_free_ gchar *tmp = NULL;
+		val = g_variant_ref_sink (fu_device_to_variant (device));
+		tmp = fu_device_dup_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH);
+	}
+	g_thread_join (thread);
+	hash = fu_device_dup_metadata (device, FU_DEVICE_KEY_FIRMWARE_HASH);
+	g_assert_cmpstr (hash, ==, "999");
+}
+
+/**
+ * fu_test_store_new:
+ **/
+static AsStore *
+fu_test_store_new (const gchar *guid, const gchar *checksum)
+{
+	AsStore *store;
+	gboolean ret;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_free_ gchar *xml = NULL;
+
+	xml = g_strdup_printf ("<components version=\"0.9\">"
+			       "<component type=\"firmware\">"
+			       "<id>com.hughski.ColorHug2.firmware</id>"
+			       "<name>ColorHug2</name>"
+			       "<provides>"
+			       "<firmware type=\"flashed\">%s</firmware>"
+			       "</provides>"
+			       "<releases>"
+			       "<release version=\"2.0.1\" timestamp=\"1424116753\">"
+			       "<location>http://localhost/firmware.cab</location>"
+			       "<checksum target=\"container\" type=\"sha1\">"
+			       "c66a8b4a6e4f5e8c8b6a7a9cc0d5c6a6b3f2e1d0</checksum>"
+			       "<checksum target=\"content\" type=\"sha1\">%s</checksum>"
+			       "</release>"
+			       "</releases>"
+			       "</component>"
+			       "</components>", guid, checksum);
+	store = as_store_new ();
+	ret = as_store_from_xml (store, xml, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	return store;
+}
+
+static void
+fu_main_store_func (void)
+{
+	AsApp *app;
+	AsApp *app_new;
+	const gchar *guid = "84f40464-9272-4ef7-9399-cd95f12da696";
+	const gchar *csum = "0123456789abcdef0123456789abcdef01234567";
+	_cleanup_object_unref_ AsStore *store = NULL;
+	_cleanup_object_unref_ AsStore *store_csum = NULL;
+	_cleanup_object_unref_ AsStore *store_guid = NULL;
+	_cleanup_object_unref_ AsStore *store_same = NULL;
+
+	store = fu_test_store_new (guid, csum);
+	app = as_store_get_app_by_id (store, "com.hughski.ColorHug2.firmware");
+	g_assert (app != NULL);
+
+	/* identical metadata is not merged again */
+	store_same = fu_test_store_new (guid, csum);
+	app_new = as_store_get_app_by_id (store_same, "com.hughski.ColorHug2.firmware");
+	g_assert (fu_main_app_is_same (app, app_new));
+	g_assert_cmpint (fu_main_store_merge (store, store_same), ==, 0);
+
+	/* only the content checksum changed */
+	store_csum = fu_test_store_new (guid, "fedcba9876543210fedcba9876543210fedcba98");
+	app_new = as_store_get_app_by_id (store_csum, "com.hughski.ColorHug2.firmware");
+	g_assert (!fu_main_app_is_same (app, app_new));
+
+	/* only the GUID changed */
+	store_guid = fu_test_store_new ("9d1ecf4f-1c2b-4d7d-8a57-1c3f5e6b1a33", csum);
+	app_new = as_store_get_app_by_id (store_guid, "com.hughski.ColorHug2.firmware");
+	g_assert (!fu_main_app_is_same (app, app_new));
+	g_assert_cmpint (fu_main_store_merge (store, store_guid), ==, 1);
+	app = as_store_get_app_by_id (store, "com.hughski.ColorHug2.firmware");
+	g_assert (fu_main_app_is_same (app, app_new));
+}
+
+/**
+ * fu_test_store_index_get_id:
+ **/
+static const gchar *
+fu_test_store_index_get_id (const gchar *version1, const gchar *version2)
+{
+	FuMainRelease *release;
+	gboolean ret;
+	const gchar *id;
+	_cleanup_error_free_ GError *error = NULL;
+	_cleanup_free_ gchar *xml = NULL;
+	_cleanup_hashtable_unref_ GHashTable *releases_by_guid = NULL;
+	_cleanup_object_unref_ AsStore *store = NULL;
+
+	xml = g_strdup_printf ("<components version=\"0.9\">"
+			       "<component type=\"firmware\">"
+			       "<id>one.firmware</id>"
+			       "<provides><firmware type=\"flashed\">guid</firmware></provides>"
+			       "<releases><release version=\"%s\"/></releases>"
+			       "</component>"
+			       "<component type=\"firmware\">"
+			       "<id>two.firmware</id>"
+			       "<provides><firmware type=\"flashed\">guid</firmware></provides>"
+			       "<releases><release version=\"%s\"/></releases>"
+			       "</component>"
+			       "</components>", version1, version2);
+	store = as_store_new ();
+	ret = as_store_from_xml (store, xml, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	releases_by_guid = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						  (GDestroyNotify) fu_main_release_free);
+	fu_main_release_index_rebuild (releases_by_guid, store);
+	release = g_hash_table_lookup (releases_by_guid, "guid");
+	g_assert (release != NULL);
+	id = as_app_get_id (release->app);
+	if (g_strcmp0 (id, "one.firmware") == 0)
+		return "one.firmware";
+	return "two.firmware";
+}
+
+static void
+fu_main_store_index_func (void)
+{
+	FuMainRelease *release;
+	_cleanup_object_unref_ FuDevice *device = NULL;
+	_cleanup_object_unref_ AsStore *store = NULL;
+	_cleanup_hashtable_unref_ GHashTable *releases_by_guid = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *changed = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *updates = NULL;
+
+	/* the newest release wins whatever the order in the store */
+	g_assert_cmpstr (fu_test_store_index_get_id ("1.2.3", "1.2.10"), ==, "two.firmware");
+	g_assert_cmpstr (fu_test_store_index_get_id ("1.2.10", "1.2.3"), ==, "one.firmware");
+	g_assert_cmpstr (fu_test_store_index_get_id ("1.2.3", "1.2.3"), ==, "one.firmware");
+
+	/* the device is changed only when the copied metadata differs */
+	store = fu_test_store_new ("84f40464-9272-4ef7-9399-cd95f12da696",
+				   "0123456789abcdef0123456789abcdef01234567");
+	releases_by_guid = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						  (GDestroyNotify) fu_main_release_free);
+	fu_main_release_index_rebuild (releases_by_guid, store);
+	device = fu_device_new ();
+	fu_device_set_id (device, "ColorHug2");
+	fu_device_set_guid (device, "84f40464-9272-4ef7-9399-cd95f12da696");
+	fu_device_set_metadata (device, FU_DEVICE_KEY_VERSION, "2.0.0");
+	devices = g_ptr_array_new ();
+	g_ptr_array_add (devices, device);
+	changed = g_ptr_array_new ();
+	updates = fu_main_get_updates (releases_by_guid, devices, changed);
+	g_assert_cmpint (updates->len, ==, 1);
+	g_assert_cmpint (changed->len, ==, 1);
+	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_NAME), ==, "ColorHug2");
+	g_ptr_array_unref (updates);
+	g_ptr_array_set_size (changed, 0);
+	updates = fu_main_get_updates (releases_by_guid, devices, changed);
+	g_assert_cmpint (changed->len, ==, 0);
+
+	/* only the name changed, but not the version or the checksum */
+	release = g_hash_table_lookup (releases_by_guid,
+				       "84f40464-9272-4ef7-9399-cd95f12da696");
+	as_app_set_name (release->app, NULL, "ColorHug2 Pro");
+	g_ptr_array_unref (updates);
+	updates = fu_main_get_updates (releases_by_guid, devices, changed);
+	g_assert_cmpint (changed->len, ==, 1);
+	g_assert_cmpstr (fu_device_get_metadata (device, FU_DEVICE_KEY_NAME), ==, "ColorHug2 Pro");
 }
 
 static void
@@ -412,6 +1378,8 @@ fu_pending_func (void)
 	GError *error = NULL;
 	gboolean ret;
 	FuDevice *device;
+	GPtrArray *devices;
+	GPtrArray *devices_tmp;
 	_cleanup_object_unref_ FuPending *pending = NULL;
 	_cleanup_free_ gchar *dirname = NULL;
 	_cleanup_free_ gchar *filename = NULL;
@@ -425,7 +1393,7 @@ fu_pending_func (void)
 	if (!g_file_test (dirname, G_FILE_TEST_IS_DIR))
 		return;
 	filename = g_build_filename (dirname, "pending.db", NULL);
-	g_unlink (filename);
+	fu_test_remove_pending_db ();
 
 	/* add a device */
 	device = fu_device_new ();
@@ -485,6 +1453,40 @@ fu_pending_func (void)
 	g_assert_error (error, FWUPD_ERROR, FWUPD_ERROR_NOT_FOUND);
 	g_assert (device == NULL);
 	g_clear_error (&error);
+
+	/* add several devices at once */
+	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	device = fu_device_new ();
+	fu_device_set_id (device, "self-test1");
+	g_ptr_array_add (devices, device);
+	device = fu_device_new ();
+	fu_device_set_id (device, "self-test2");
+	g_ptr_array_add (devices, device);
+	ret = fu_pending_add_devices (pending, devices, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* set the state of them all */
+	ret = fu_pending_set_states (pending, devices, FU_PENDING_STATE_FAILED, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	devices_tmp = fu_pending_get_devices_by_state (pending, FU_PENDING_STATE_FAILED, &error);
+	g_assert_no_error (error);
+	g_assert (devices_tmp != NULL);
+	g_assert_cmpint (devices_tmp->len, ==, 2);
+	g_ptr_array_unref (devices_tmp);
+	devices_tmp = fu_pending_get_devices_by_state (pending, FU_PENDING_STATE_SCHEDULED, &error);
+	g_assert_no_error (error);
+	g_assert (devices_tmp != NULL);
+	g_assert_cmpint (devices_tmp->len, ==, 0);
+	g_ptr_array_unref (devices_tmp);
+
+	/* adding a duplicate adds nothing */
+	ret = fu_pending_add_devices (pending, devices, &error);
+	g_assert_error (error, FWUPD_ERROR, FWUPD_ERROR_WRITE);
+	g_assert (!ret);
+	g_clear_error (&error);
+	g_ptr_array_unref (devices);
 }
 
 static void
@@ -537,11 +1539,25 @@ main (int argc, char **argv)
 	g_assert_cmpint (g_mkdir_with_parents ("/tmp/fwupd-self-test/var/lib/fwupd", 0755), ==, 0);
 
 	/* tests go here */
+	g_test_add_func ("/fwupd/scanner", fu_scanner_func);
 	g_test_add_func ("/fwupd/rom", fu_rom_func);
 	g_test_add_func ("/fwupd/rom{all}", fu_rom_all_func);
 	g_test_add_func ("/fwupd/cab", fu_cab_func);
+	g_test_add_func ("/fwupd/cab{memory}", fu_cab_memory_func);
+	g_test_add_func ("/fwupd/cab{memfd}", fu_cab_memfd_func);
+	g_test_add_func ("/fwupd/cab{checksum}", fu_cab_checksum_func);
+	g_test_add_func ("/fwupd/device", fu_device_func);
+	g_test_add_func ("/fwupd/device{threads}", fu_device_threads_func);
 	g_test_add_func ("/fwupd/pending", fu_pending_func);
+	g_test_add_func ("/fwupd/store", fu_main_store_func);
+	g_test_add_func ("/fwupd/store{index}", fu_main_store_index_func);
+	g_test_add_func ("/fwupd/snapshot", fu_main_snapshot_func);
+	g_test_add_func ("/fwupd/batch", fu_main_batch_func);
 	g_test_add_func ("/fwupd/provider", fu_provider_func);
+	g_test_add_func ("/fwupd/provider{hotplug}", fu_provider_hotplug_func);
+	g_test_add_func ("/fwupd/provider{stage}", fu_provider_stage_func);
+	g_test_add_func ("/fwupd/provider{progress}", fu_provider_progress_func);
+	g_test_add_func ("/fwupd/provider{verify-all}", fu_provider_verify_all_func);
 	g_test_add_func ("/fwupd/provider{rpi}", fu_provider_rpi_func);
 	g_test_add_func ("/fwupd/keyring", fu_keyring_func);
 	return g_test_run ();
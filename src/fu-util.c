@@ -36,10 +36,14 @@
 #include <unistd.h>
 
 #include "fu-cleanup.h"
+#include "fu-memfd.h"
 #include "fu-pending.h"
 #include "fu-provider.h"
 #include "fu-rom.h"
 
+#define FU_UTIL_DOWNLOAD_MAX_PARALLEL	4
+#define FU_UTIL_DOWNLOAD_CHUNK_SIZE	(32 * 1024)	/* bytes */
+
 typedef struct {
 	GMainLoop		*loop;
 	GOptionContext		*context;
@@ -50,8 +54,33 @@ typedef struct {
 	FuProviderFlags		 flags;
 	GDBusConnection		*conn;
 	GDBusProxy		*proxy;
+	GPtrArray		*devices;	/* for devices_generation */
+	guint64			 devices_generation;
+	SoupSession		*session;
+	GMainLoop		*loop_download;
+	GPtrArray		*downloads_queue;	/* of FuUtilDownload, not started */
+	guint			 downloads_active;
 } FuUtilPrivate;
 
+typedef struct {
+	FuUtilPrivate		*priv;
+	FuDevice		*device;
+	gchar			*uri;
+	gchar			*fn;
+	gchar			*checksum_expected;
+	GChecksum		*checksum;
+	GCancellable		*cancellable;
+	GInputStream		*stream_in;
+	GOutputStream		*stream_out;
+	SoupMessage		*msg;
+	GError			*error;
+	gchar			*etag;
+	gchar			*last_modified;
+	gboolean		 not_modified;
+	gboolean		 done;
+	gboolean		 installed;
+} FuUtilDownload;
+
 typedef gboolean (*FuUtilPrivateCb)	(FuUtilPrivate	*util,
 					 gchar		**values,
 					 GError		**error);
@@ -250,6 +279,22 @@ fu_util_get_devices_cb (GObject *source, GAsyncResult *res, gpointer user_data)
 	g_main_loop_quit (priv->loop);
 }
 
+/**
+ * fu_util_get_generation:
+ *
+ * Return value: the daemon generation, or %G_MAXUINT64 if unknown
+ **/
+static guint64
+fu_util_get_generation (FuUtilPrivate *priv)
+{
+	_cleanup_variant_unref_ GVariant *val = NULL;
+
+	val = g_dbus_proxy_get_cached_property (priv->proxy, "Generation");
+	if (val == NULL)
+		return G_MAXUINT64;
+	return g_variant_get_uint64 (val);
+}
+
 /**
  * fu_util_get_devices_internal:
  **/
@@ -260,8 +305,16 @@ fu_util_get_devices_internal (FuUtilPrivate *priv, GError **error)
 	GPtrArray *devices = NULL;
 	FuDevice *dev;
 	gchar *id;
+	guint64 generation;
 	_cleanup_variant_iter_free_ GVariantIter *iter = NULL;
 
+	/* nothing changed since the last call */
+	generation = fu_util_get_generation (priv);
+	if (priv->devices != NULL &&
+	    generation != G_MAXUINT64 &&
+	    generation == priv->devices_generation)
+		return g_ptr_array_ref (priv->devices);
+
 	g_dbus_proxy_call (priv->proxy,
 			   "GetDevices",
 			   NULL,
@@ -285,6 +338,12 @@ fu_util_get_devices_internal (FuUtilPrivate *priv, GError **error)
 		g_ptr_array_add (devices, dev);
 		g_variant_iter_free (iter_device);
 	}
+
+	/* save for next time */
+	if (priv->devices != NULL)
+		g_ptr_array_unref (priv->devices);
+	priv->devices = g_ptr_array_ref (devices);
+	priv->devices_generation = generation;
 	return devices;
 }
 
@@ -326,20 +385,32 @@ fu_util_get_updates_internal (FuUtilPrivate *priv, GError **error)
 	return devices;
 }
 
+/**
+ * fu_util_print_key:
+ **/
+static void
+fu_util_print_key (const gchar *key, const gchar *value)
+{
+	guint k;
+	g_print ("  %s:", key);
+	for (k = strlen (key); k < 15; k++)
+		g_print (" ");
+	g_print (" %s\n", value);
+}
+
 /**
  * fu_util_get_devices:
+ *
+ * Only the keys that are printed are requested from the daemon.
  **/
 static gboolean
 fu_util_get_devices (FuUtilPrivate *priv, gchar **values, GError **error)
 {
-	FuDevice *dev;
-	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
-	guint i;
-	guint j;
-	guint k;
-	guint f;
+	const gchar *id;
 	guint64 flags;
-	const gchar *value;
+	guint f;
+	guint j;
+	_cleanup_variant_iter_free_ GVariantIter *iter = NULL;
 	const gchar *keys[] = {
 		FU_DEVICE_KEY_DISPLAY_NAME,
 		FU_DEVICE_KEY_PROVIDER,
@@ -350,7 +421,6 @@ fu_util_get_devices (FuUtilPrivate *priv, gchar **values, GError **error)
 		FU_DEVICE_KEY_SUMMARY,
 		FU_DEVICE_KEY_DESCRIPTION,
 		FU_DEVICE_KEY_LICENSE,
-		FU_DEVICE_KEY_FLAGS,
 		FU_DEVICE_KEY_TRUSTED,
 		FU_DEVICE_KEY_SIZE,
 		FU_DEVICE_KEY_FIRMWARE_HASH,
@@ -361,41 +431,166 @@ fu_util_get_devices (FuUtilPrivate *priv, gchar **values, GError **error)
 		"AllowOffline",
 		NULL };
 
-	/* get devices from daemon */
-	devices = fu_util_get_devices_internal (priv, error);
-	if (devices == NULL)
+	/* get devices from daemon, optionally only the IDs specified */
+	g_dbus_proxy_call (priv->proxy,
+			   "GetDevicesCompact",
+			   g_variant_new ("(^as^as)", keys, values),
+			   G_DBUS_CALL_FLAGS_NONE,
+			   -1,
+			   NULL,
+			   fu_util_get_devices_cb, priv);
+	g_main_loop_run (priv->loop);
+	if (priv->val == NULL) {
+		g_dbus_error_strip_remote_error (priv->error);
+		if (g_error_matches (priv->error, FWUPD_ERROR, FWUPD_ERROR_NOTHING_TO_DO)) {
+			g_clear_error (&priv->error);
+			/* TRANSLATORS: nothing attached that can be upgraded */
+			g_print ("%s\n", _("No hardware detected with firmware update capability"));
+			return TRUE;
+		}
+		g_propagate_error (error, priv->error);
+		priv->error = NULL;
 		return FALSE;
+	}
 
 	/* print */
-	if (devices->len == 0) {
-		/* TRANSLATORS: nothing attached that can be upgraded */
-		g_print ("%s\n", _("No hardware detected with firmware update capability"));
-		return TRUE;
-	}
-	for (i = 0; i < devices->len; i++) {
-		dev = g_ptr_array_index (devices, i);
-		g_print ("Device: %s\n", fu_device_get_id (dev));
-		for (j = 0; keys[j] != NULL; j++) {
-			if (g_strcmp0 (keys[j], FU_DEVICE_KEY_FLAGS) == 0) {
-				flags = fu_device_get_flags (dev);
-				for (f = 0; flags_str[f] != NULL; f++) {
-					g_print ("  %s:", flags_str[f]);
-					for (k = strlen (flags_str[f]); k < 15; k++)
-						g_print (" ");
-					g_print (" %s\n", flags & (1 << f) ? "True" : "False");
-				}
+	g_variant_get (priv->val, "(a(stas))", &iter);
+	while (TRUE) {
+		_cleanup_free_ const gchar **device_values = NULL;
+		if (!g_variant_iter_next (iter, "(&st^a&s)", &id, &flags, &device_values))
+			break;
+		g_print ("Device: %s\n", id);
+		for (j = 0; keys[j] != NULL && device_values[j] != NULL; j++) {
+			if (device_values[j][0] == '\0')
 				continue;
-			}
-			value = fu_device_get_metadata (dev, keys[j]);
-			if (value != NULL) {
-				g_print ("  %s:", keys[j]);
-				for (k = strlen (keys[j]); k < 15; k++)
-					g_print (" ");
-				g_print (" %s\n", value);
-			}
+			fu_util_print_key (keys[j], device_values[j]);
+		}
+		for (f = 0; flags_str[f] != NULL; f++)
+			fu_util_print_key (flags_str[f], flags & (1 << f) ? "True" : "False");
+	}
+
+	return TRUE;
+}
+
+/**
+ * fu_util_sort_stats_cb:
+ **/
+static gint
+fu_util_sort_stats_cb (gconstpointer a, gconstpointer b)
+{
+	GVariant *stat_a = *((GVariant **) a);
+	GVariant *stat_b = *((GVariant **) b);
+	const gchar *name_a;
+	const gchar *name_b;
+	g_variant_get_child (stat_a, 0, "&s", &name_a);
+	g_variant_get_child (stat_b, 0, "&s", &name_b);
+	return g_strcmp0 (name_a, name_b);
+}
+
+/**
+ * fu_util_print_histogram:
+ *
+ * Prints the non-empty buckets, where bucket 0 is under 1ms and each
+ * following bucket ends at twice the previous one.
+ **/
+static void
+fu_util_print_histogram (GVariant *histogram)
+{
+	const guint64 *buckets;
+	gsize n_buckets = 0;
+	guint i;
+	_cleanup_string_free_ GString *str = g_string_new ("");
+
+	buckets = g_variant_get_fixed_array (histogram, &n_buckets, sizeof (guint64));
+	for (i = 0; i < n_buckets; i++) {
+		if (buckets[i] == 0)
+			continue;
+		if (str->len > 0)
+			g_string_append (str, ", ");
+		if (i == n_buckets - 1) {
+			g_string_append_printf (str, ">=%ums", 1u << (i - 1));
+		} else {
+			g_string_append_printf (str, "<%ums", 1u << i);
 		}
+		g_string_append_printf (str, "=%" G_GUINT64_FORMAT, buckets[i]);
+	}
+	fu_util_print_key ("Histogram", str->str);
+}
+
+/**
+ * fu_util_get_stats:
+ **/
+static gboolean
+fu_util_get_stats (FuUtilPrivate *priv, gchar **values, GError **error)
+{
+	GVariant *stats;
+	guint i;
+	_cleanup_ptrarray_unref_ GPtrArray *array = NULL;
+
+	g_dbus_proxy_call (priv->proxy,
+			   "GetStatistics",
+			   NULL,
+			   G_DBUS_CALL_FLAGS_NONE,
+			   -1,
+			   NULL,
+			   fu_util_get_devices_cb, priv);
+	g_main_loop_run (priv->loop);
+	if (priv->val == NULL) {
+		g_propagate_error (error, priv->error);
+		priv->error = NULL;
+		return FALSE;
+	}
+
+	/* sort by phase name */
+	stats = g_variant_get_child_value (priv->val, 0);
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+	for (i = 0; i < g_variant_n_children (stats); i++)
+		g_ptr_array_add (array, g_variant_get_child_value (stats, i));
+	g_variant_unref (stats);
+	g_ptr_array_sort (array, fu_util_sort_stats_cb);
+	if (array->len == 0) {
+		/* TRANSLATORS: the daemon has not done anything yet */
+		g_print ("%s\n", _("No statistics available"));
+		return TRUE;
 	}
 
+	/* print */
+	for (i = 0; i < array->len; i++) {
+		const gchar *name;
+		guint64 count = 0;
+		guint64 failed = 0;
+		guint64 total = 0;
+		guint64 min = 0;
+		guint64 max = 0;
+		_cleanup_free_ gchar *tmp = NULL;
+		_cleanup_variant_unref_ GVariant *dict = NULL;
+		_cleanup_variant_unref_ GVariant *histogram = NULL;
+
+		g_variant_get (g_ptr_array_index (array, i), "{&s@a{sv}}", &name, &dict);
+		g_variant_lookup (dict, "Count", "t", &count);
+		g_variant_lookup (dict, "Failed", "t", &failed);
+		g_variant_lookup (dict, "Total", "t", &total);
+		g_variant_lookup (dict, "Minimum", "t", &min);
+		g_variant_lookup (dict, "Maximum", "t", &max);
+		if (count == 0)
+			continue;
+		g_print ("%s\n", name);
+		tmp = g_strdup_printf ("%" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " failed)",
+				       count, failed);
+		fu_util_print_key ("Count", tmp);
+		g_free (tmp);
+		tmp = g_strdup_printf ("%.1fms", (gdouble) total / count / 1000.f);
+		fu_util_print_key ("Mean", tmp);
+		g_free (tmp);
+		tmp = g_strdup_printf ("%.1fms", (gdouble) min / 1000.f);
+		fu_util_print_key ("Minimum", tmp);
+		g_free (tmp);
+		tmp = g_strdup_printf ("%.1fms", (gdouble) max / 1000.f);
+		fu_util_print_key ("Maximum", tmp);
+		histogram = g_variant_lookup_value (dict, "Histogram", G_VARIANT_TYPE ("at"));
+		if (histogram != NULL)
+			fu_util_print_histogram (histogram);
+	}
 	return TRUE;
 }
 
@@ -444,17 +639,15 @@ fu_util_install_internal (FuUtilPrivate *priv, const gchar *id,
 		g_variant_builder_add (&builder, "{sv}",
 				       "allow-reinstall", g_variant_new_boolean (TRUE));
 	}
+	if (priv->flags & FU_PROVIDER_UPDATE_FLAG_NO_PENDING) {
+		g_variant_builder_add (&builder, "{sv}",
+				       "no-pending", g_variant_new_boolean (TRUE));
+	}
 
-	/* open file */
-	fd = open (filename, O_RDONLY);
-	if (fd < 0) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_INVALID_FILE,
-			     "failed to open %s",
-			     filename);
+	/* the daemon can map a sealed copy rather than reading it */
+	fd = fu_memfd_new_for_file (filename, error);
+	if (fd < 0)
 		return FALSE;
-	}
 
 	/* set out of band file descriptor */
 	fd_list = g_unix_fd_list_new ();
@@ -547,6 +740,134 @@ fu_util_install (FuUtilPrivate *priv, gchar **values, GError **error)
 	return fu_util_install_with_fallback (priv, id, values[0], error);
 }
 
+/**
+ * fu_util_install_progress_cb:
+ **/
+static void
+fu_util_install_progress_cb (GDBusProxy *proxy,
+			     const gchar *sender_name,
+			     const gchar *signal_name,
+			     GVariant *parameters,
+			     gpointer user_data)
+{
+	const gchar *id;
+	const gchar *state;
+	guint done;
+	guint total;
+
+	if (g_strcmp0 (signal_name, "InstallProgress") != 0)
+		return;
+	g_variant_get (parameters, "(&s&suu)", &id, &state, &done, &total);
+	g_print ("[%u/%u] %s: %s\n", done, total, id, state);
+}
+
+/**
+ * fu_util_install_batch:
+ **/
+static gboolean
+fu_util_install_batch (FuUtilPrivate *priv, gchar **values, GError **error)
+{
+	GVariant *body;
+	GVariantBuilder builder;
+	const gchar *id;
+	const gchar *msg;
+	gint fd;
+	guint n_failed = 0;
+	gulong signal_id;
+	_cleanup_object_unref_ GDBusMessage *request = NULL;
+	_cleanup_object_unref_ GUnixFDList *fd_list = NULL;
+	_cleanup_variant_iter_free_ GVariantIter *iter = NULL;
+
+	if (g_strv_length (values) != 1) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_INTERNAL,
+				     "Invalid arguments: expected 'filename'");
+		return FALSE;
+	}
+
+	/* set options */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
+	g_variant_builder_add (&builder, "{sv}",
+			       "reason", g_variant_new_string ("user-action"));
+	if (priv->flags & FU_PROVIDER_UPDATE_FLAG_OFFLINE) {
+		g_variant_builder_add (&builder, "{sv}",
+				       "offline", g_variant_new_boolean (TRUE));
+	}
+	if (priv->flags & FU_PROVIDER_UPDATE_FLAG_ALLOW_OLDER) {
+		g_variant_builder_add (&builder, "{sv}",
+				       "allow-older", g_variant_new_boolean (TRUE));
+	}
+	if (priv->flags & FU_PROVIDER_UPDATE_FLAG_ALLOW_REINSTALL) {
+		g_variant_builder_add (&builder, "{sv}",
+				       "allow-reinstall", g_variant_new_boolean (TRUE));
+	}
+
+	/* the daemon can map a sealed copy rather than reading it */
+	fd = fu_memfd_new_for_file (values[0], error);
+	if (fd < 0) {
+		g_variant_builder_clear (&builder);
+		return FALSE;
+	}
+
+	/* set out of band file descriptor */
+	fd_list = g_unix_fd_list_new ();
+	g_unix_fd_list_append (fd_list, fd, NULL);
+	request = g_dbus_message_new_method_call (FWUPD_DBUS_SERVICE,
+						  FWUPD_DBUS_PATH,
+						  FWUPD_DBUS_INTERFACE,
+						  "InstallBatch");
+	g_dbus_message_set_unix_fd_list (request, fd_list);
+
+	/* g_unix_fd_list_append did a dup() already */
+	close (fd);
+
+	/* send message, printing the progress of each device */
+	body = g_variant_new ("(ha{sv})", 0, &builder);
+	g_dbus_message_set_body (request, body);
+	signal_id = g_signal_connect (priv->proxy, "g-signal",
+				      G_CALLBACK (fu_util_install_progress_cb), priv);
+	g_dbus_connection_send_message_with_reply (priv->conn,
+						   request,
+						   G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+						   -1,
+						   NULL,
+						   NULL,
+						   fu_util_update_cb,
+						   priv);
+	g_main_loop_run (priv->loop);
+	g_signal_handler_disconnect (priv->proxy, signal_id);
+	if (priv->message == NULL) {
+		g_dbus_error_strip_remote_error (priv->error);
+		g_propagate_error (error, priv->error);
+		return FALSE;
+	}
+	if (g_dbus_message_to_gerror (priv->message, error)) {
+		g_dbus_error_strip_remote_error (*error);
+		return FALSE;
+	}
+
+	/* print the results */
+	g_variant_get (g_dbus_message_get_body (priv->message), "(a{ss})", &iter);
+	while (g_variant_iter_next (iter, "{&s&s}", &id, &msg)) {
+		if (msg[0] == '\0') {
+			/* TRANSLATORS: the device was updated */
+			g_print ("%s: %s\n", id, _("Done!"));
+			continue;
+		}
+		g_print ("%s: %s\n", id, msg);
+		n_failed++;
+	}
+	if (n_failed > 0) {
+		g_set_error (error,
+			     FWUPD_ERROR,
+			     FWUPD_ERROR_INTERNAL,
+			     "%u devices failed to update", n_failed);
+		return FALSE;
+	}
+	return TRUE;
+}
+
 /**
  * fu_util_print_metadata:
  **/
@@ -601,16 +922,10 @@ fu_util_get_details (FuUtilPrivate *priv, gchar **values, GError **error)
 		return FALSE;
 	}
 
-	/* open file */
-	fd = open (values[0], O_RDONLY);
-	if (fd < 0) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_INVALID_FILE,
-			     "failed to open %s",
-			     values[0]);
+	/* the daemon can map a sealed copy rather than reading it */
+	fd = fu_memfd_new_for_file (values[0], error);
+	if (fd < 0)
 		return FALSE;
-	}
 
 	/* set out of band file descriptor */
 	fd_list = g_unix_fd_list_new ();
@@ -690,8 +1005,10 @@ fu_util_install_prepared (FuUtilPrivate *priv, gchar **values, GError **error)
 	gssize len;
 	guint cnt = 0;
 	guint i;
-	const gchar *tmp;
+	GError *error_install = NULL;
 	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices_failed = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *devices_success = NULL;
 	_cleanup_object_unref_ FuPending *pending = NULL;
 
 	/* verify this is pointing to our cache */
@@ -731,20 +1048,21 @@ fu_util_install_prepared (FuUtilPrivate *priv, gchar **values, GError **error)
 
 	/* get prepared updates */
 	pending = fu_pending_new ();
-	devices = fu_pending_get_devices (pending, error);
+	devices = fu_pending_get_devices_by_state (pending,
+						   FU_PENDING_STATE_SCHEDULED,
+						   error);
 	if (devices == NULL)
 		return FALSE;
 
-	/* apply each update */
+	/* apply each update, saving the states in one transaction */
+	priv->flags |= FU_PROVIDER_UPDATE_FLAG_NO_PENDING;
+	devices_failed = g_ptr_array_new ();
+	devices_success = g_ptr_array_new ();
 	for (i = 0; i < devices->len; i++) {
 		FuDevice *device;
+		_cleanup_error_free_ GError *error_local = NULL;
 		device = g_ptr_array_index (devices, i);
 
-		/* check not already done */
-		tmp = fu_device_get_metadata (device, FU_DEVICE_KEY_PENDING_STATE);
-		if (g_strcmp0 (tmp, "scheduled") != 0)
-			continue;
-
 		/* tell the user what's going to happen */
 		vercmp = as_utils_vercmp (fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION),
 					  fu_device_get_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION));
@@ -772,12 +1090,41 @@ fu_util_install_prepared (FuUtilPrivate *priv, gchar **values, GError **error)
 				 fu_device_get_metadata (device, FU_DEVICE_KEY_VERSION),
 				 fu_device_get_metadata (device, FU_DEVICE_KEY_UPDATE_VERSION));
 		}
+		cnt++;
 		if (!fu_util_install_internal (priv,
 					       fu_device_get_id (device),
 					       fu_device_get_metadata (device, FU_DEVICE_KEY_FILENAME_CAB),
-					       error))
-			return FALSE;
-		cnt++;
+					       &error_local)) {
+			g_print ("%s\n", error_local->message);
+			g_ptr_array_add (devices_failed, device);
+			if (error_install == NULL) {
+				error_install = error_local;
+				error_local = NULL;
+			}
+			continue;
+		}
+		g_ptr_array_add (devices_success, device);
+	}
+	priv->flags &= ~FU_PROVIDER_UPDATE_FLAG_NO_PENDING;
+
+	/* record the successful updates so the results can be reported */
+	if (devices_success->len > 0) {
+		_cleanup_error_free_ GError *error_local = NULL;
+		if (!fu_pending_set_states (pending, devices_success,
+					    FU_PENDING_STATE_SUCCESS,
+					    &error_local))
+			g_warning ("failed to save state: %s", error_local->message);
+	}
+
+	/* do not try to install the failed updates again on next boot */
+	if (devices_failed->len > 0) {
+		_cleanup_error_free_ GError *error_local = NULL;
+		if (!fu_pending_set_states (pending, devices_failed,
+					    FU_PENDING_STATE_FAILED,
+					    &error_local))
+			g_warning ("failed to save state: %s", error_local->message);
+		g_propagate_error (error, error_install);
+		return FALSE;
 	}
 
 	/* nothing to do */
@@ -864,63 +1211,227 @@ fu_util_dump_rom (FuUtilPrivate *priv, gchar **values, GError **error)
 	return TRUE;
 }
 
+typedef struct {
+	gchar		*filename;
+	gchar		*checksum;
+	gchar		*guid;
+	gchar		*version;
+	goffset		 size;
+	GError		*error;
+} FuUtilRomHelper;
+
 /**
- * fu_util_verify_update_internal:
+ * fu_util_rom_helper_free:
  **/
-static gboolean
-fu_util_verify_update_internal (FuUtilPrivate *priv,
-				const gchar *filename,
-				gchar **values,
-				GError **error)
+static void
+fu_util_rom_helper_free (FuUtilRomHelper *helper)
 {
-	guint i;
-	_cleanup_object_unref_ AsStore *store = NULL;
-	_cleanup_object_unref_ GFile *xml_file = NULL;
-
-	store = as_store_new ();
+	g_free (helper->filename);
+	g_free (helper->checksum);
+	g_free (helper->guid);
+	g_free (helper->version);
+	if (helper->error != NULL)
+		g_error_free (helper->error);
+	g_free (helper);
+}
 
-	/* open existing file */
-	xml_file = g_file_new_for_path (filename);
-	if (g_file_query_exists (xml_file, NULL)) {
-		if (!as_store_from_file (store, xml_file, NULL, NULL, error))
-			return FALSE;
+/**
+ * fu_util_rom_load_thread_cb:
+ **/
+static void
+fu_util_rom_load_thread_cb (gpointer data, gpointer user_data)
+{
+	FuUtilRomHelper *helper = (FuUtilRomHelper *) data;
+	GAsyncQueue *results = (GAsyncQueue *) user_data;
+	struct stat stat_buf;
+	_cleanup_object_unref_ FuRom *rom = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	file = g_file_new_for_path (helper->filename);
+	rom = fu_rom_new ();
+	if (fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_BLANK_PPID,
+			      NULL, &helper->error)) {
+		helper->checksum = g_strdup (fu_rom_get_checksum (rom));
+		helper->guid = g_strdup (fu_rom_get_guid (rom));
+		helper->version = g_strdup (fu_rom_get_version (rom));
 	}
+	if (g_stat (helper->filename, &stat_buf) == 0)
+		helper->size = stat_buf.st_size;
+	g_async_queue_push (results, helper);
+}
 
-	/* add new values */
-	as_store_set_api_version (store, 0.9);
-	for (i = 0; values[i] != NULL; i++) {
-		_cleanup_free_ gchar *guid = NULL;
-		_cleanup_object_unref_ AsApp *app = NULL;
-		_cleanup_object_unref_ AsChecksum *csum = NULL;
+/**
+ * fu_util_verify_update_add_filenames:
+ *
+ * Directories are expanded so a whole corpus of dumps can be processed.
+ **/
+static gboolean
+fu_util_verify_update_add_filenames (GPtrArray *filenames,
+				     const gchar *path,
+				     GError **error)
+{
+	const gchar *tmp;
+	_cleanup_dir_close_ GDir *dir = NULL;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		g_ptr_array_add (filenames, g_strdup (path));
+		return TRUE;
+	}
+	dir = g_dir_open (path, 0, error);
+	if (dir == NULL)
+		return FALSE;
+	while ((tmp = g_dir_read_name (dir)) != NULL) {
+		_cleanup_free_ gchar *fn = NULL;
+		fn = g_build_filename (path, tmp, NULL);
+		if (!fu_util_verify_update_add_filenames (filenames, fn, error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_util_verify_update_internal:
+ *
+ * The ROMs are parsed in parallel and added to the store as each one
+ * completes; ROMs with a checksum already in the store are skipped.
+ **/
+static gboolean
+fu_util_verify_update_internal (FuUtilPrivate *priv,
+				const gchar *filename,
+				gchar **values,
+				GError **error)
+{
+	GAsyncQueue *results;
+	GPtrArray *apps;
+	GThreadPool *pool;
+	gdouble elapsed;
+	goffset total_size = 0;
+	guint cnt_added = 0;
+	guint cnt_dupes = 0;
+	guint i;
+	guint j;
+	guint k;
+	_cleanup_object_unref_ AsStore *store = NULL;
+	_cleanup_object_unref_ GFile *xml_file = NULL;
+	_cleanup_hashtable_unref_ GHashTable *checksums = NULL;
+	_cleanup_ptrarray_unref_ GPtrArray *filenames = NULL;
+	_cleanup_timer_destroy_ GTimer *timer = NULL;
+
+	store = as_store_new ();
+
+	/* open existing file */
+	xml_file = g_file_new_for_path (filename);
+	if (g_file_query_exists (xml_file, NULL)) {
+		if (!as_store_from_file (store, xml_file, NULL, NULL, error))
+			return FALSE;
+	}
+
+	/* get the checksums we already know about */
+	checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	apps = as_store_get_apps (store);
+	for (i = 0; i < apps->len; i++) {
+		AsApp *app = g_ptr_array_index (apps, i);
+		GPtrArray *releases = as_app_get_releases (app);
+		for (j = 0; j < releases->len; j++) {
+			AsRelease *rel = g_ptr_array_index (releases, j);
+			GPtrArray *csums = as_release_get_checksums (rel);
+			for (k = 0; k < csums->len; k++) {
+				AsChecksum *csum = g_ptr_array_index (csums, k);
+				g_hash_table_add (checksums,
+						  g_strdup (as_checksum_get_value (csum)));
+			}
+		}
+	}
+
+	/* get all the files to parse */
+	filenames = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; values[i] != NULL; i++) {
+		if (!fu_util_verify_update_add_filenames (filenames, values[i], error))
+			return FALSE;
+	}
+
+	/* parse on all the cores */
+	timer = g_timer_new ();
+	results = g_async_queue_new ();
+	pool = g_thread_pool_new (fu_util_rom_load_thread_cb, results,
+				  (gint) g_get_num_processors (), TRUE, error);
+	if (pool == NULL) {
+		g_async_queue_unref (results);
+		return FALSE;
+	}
+	for (i = 0; i < filenames->len; i++) {
+		FuUtilRomHelper *helper = g_new0 (FuUtilRomHelper, 1);
+		helper->filename = g_strdup (g_ptr_array_index (filenames, i));
+		if (!g_thread_pool_push (pool, helper, error)) {
+			fu_util_rom_helper_free (helper);
+			g_thread_pool_free (pool, TRUE, TRUE);
+			g_async_queue_unref (results);
+			return FALSE;
+		}
+	}
+
+	/* add new values as they complete */
+	as_store_set_api_version (store, 0.9);
+	for (i = 0; i < filenames->len; i++) {
+		AsApp *app_tmp;
+		FuUtilRomHelper *helper;
+		_cleanup_object_unref_ AsApp *app = NULL;
+		_cleanup_object_unref_ AsChecksum *csum = NULL;
 		_cleanup_object_unref_ AsRelease *rel = NULL;
-		_cleanup_object_unref_ FuRom *rom = NULL;
-		_cleanup_object_unref_ GFile *file = NULL;
-		_cleanup_error_free_ GError *error_local = NULL;
 
-		file = g_file_new_for_path (values[i]);
-		rom = fu_rom_new ();
-		g_print ("Processing %s...\n", values[i]);
-		if (!fu_rom_load_file (rom, file, FU_ROM_LOAD_FLAG_BLANK_PPID,
-				       NULL, &error_local)) {
-			g_print ("%s\n", error_local->message);
+		helper = g_async_queue_pop (results);
+		total_size += helper->size;
+		g_print ("Processing %s...\n", helper->filename);
+		if (helper->error != NULL) {
+			g_print ("%s\n", helper->error->message);
+			fu_util_rom_helper_free (helper);
+			continue;
+		}
+		if (g_hash_table_contains (checksums, helper->checksum)) {
+			g_debug ("%s already present", helper->checksum);
+			fu_util_rom_helper_free (helper);
+			cnt_dupes++;
 			continue;
 		}
+		g_hash_table_add (checksums, g_strdup (helper->checksum));
 
-		/* add app to store */
-		app = as_app_new ();
-		as_app_set_id (app, fu_rom_get_guid (rom));
-		as_app_set_id_kind (app, AS_ID_KIND_FIRMWARE);
-		as_app_set_source_kind (app, AS_APP_SOURCE_KIND_INF);
+		/* add release to store */
 		rel = as_release_new ();
-		as_release_set_version (rel, fu_rom_get_version (rom));
+		as_release_set_version (rel, helper->version);
 		csum = as_checksum_new ();
 		as_checksum_set_kind (csum, G_CHECKSUM_SHA1);
-		as_checksum_set_value (csum, fu_rom_get_checksum (rom));
+		as_checksum_set_value (csum, helper->checksum);
 		as_checksum_set_target (csum, AS_CHECKSUM_TARGET_CONTENT);
 		as_release_add_checksum (rel, csum);
-		as_app_add_release (app, rel);
-		as_store_add_app (store, app);
+		app_tmp = as_store_get_app_by_id (store, helper->guid);
+		if (app_tmp != NULL) {
+			as_app_add_release (app_tmp, rel);
+		} else {
+			app = as_app_new ();
+			as_app_set_id (app, helper->guid);
+			as_app_set_id_kind (app, AS_ID_KIND_FIRMWARE);
+			as_app_set_source_kind (app, AS_APP_SOURCE_KIND_INF);
+			as_app_add_release (app, rel);
+			as_store_add_app (store, app);
+		}
+		fu_util_rom_helper_free (helper);
+		cnt_added++;
 	}
+	g_thread_pool_free (pool, FALSE, TRUE);
+	g_async_queue_unref (results);
+
+	/* show throughput */
+	elapsed = g_timer_elapsed (timer, NULL);
+	if (elapsed > 0.f) {
+		/* TRANSLATORS: the number of ROMs that were parsed */
+		g_print (_("Parsed %u ROMs (%u new, %u duplicate) in %.1fs: "
+			   "%.1f ROMs/s, %.1f MB/s"),
+			 filenames->len, cnt_added, cnt_dupes, elapsed,
+			 filenames->len / elapsed,
+			 total_size / (elapsed * 1024 * 1024));
+		g_print ("\n");
+	}
+
 	if (!as_store_to_file (store, xml_file,
 			       AS_NODE_TO_XML_FLAG_ADD_HEADER |
 			       AS_NODE_TO_XML_FLAG_FORMAT_INDENT |
@@ -1068,112 +1579,529 @@ fu_util_refresh_internal (FuUtilPrivate *priv,
 }
 
 /**
- * fu_util_download_file:
+ * fu_util_get_session:
+ *
+ * All downloads share one session so that connections to the same host
+ * are kept alive and reused.
  **/
-static gboolean
-fu_util_download_file (FuUtilPrivate *priv,
-		       const gchar *uri,
-		       const gchar *fn,
-		       const gchar *checksum_expected,
-		       GError **error)
+static SoupSession *
+fu_util_get_session (FuUtilPrivate *priv, GError **error)
 {
-	guint status_code;
-	_cleanup_error_free_ GError *error_local = NULL;
-	_cleanup_free_ gchar *checksum_actual = NULL;
-	_cleanup_object_unref_ SoupMessage *msg = NULL;
-	_cleanup_object_unref_ SoupSession *session = NULL;
-
-	session = soup_session_new_with_options (SOUP_SESSION_USER_AGENT,
-						 "fwupdmgr",
-						 NULL);
-	if (session == NULL) {
+	if (priv->session != NULL)
+		return priv->session;
+	priv->session = soup_session_new_with_options (SOUP_SESSION_USER_AGENT,
+						       "fwupdmgr",
+						       SOUP_SESSION_MAX_CONNS_PER_HOST,
+						       FU_UTIL_DOWNLOAD_MAX_PARALLEL,
+						       NULL);
+	if (priv->session == NULL) {
 		g_set_error_literal (error,
 				     FWUPD_ERROR,
 				     FWUPD_ERROR_INTERNAL,
-				     "%s: failed to setup networking");
-		return FALSE;
+				     "failed to setup networking");
+		return NULL;
 	}
 
 	/* this disables the double-compression of the firmware.xml.gz file */
-	soup_session_remove_feature_by_type (session, SOUP_TYPE_CONTENT_DECODER);
+	soup_session_remove_feature_by_type (priv->session, SOUP_TYPE_CONTENT_DECODER);
+	return priv->session;
+}
 
-	/* download data */
-	g_debug ("downloading %s to %s:", uri, fn);
-	msg = soup_message_new (SOUP_METHOD_GET, uri);
-	status_code = soup_session_send_message (session, msg);
-	if (status_code != SOUP_STATUS_OK) {
-		g_set_error (error,
-			     FWUPD_ERROR,
-			     FWUPD_ERROR_INVALID_FILE,
-			     "Failed to download %s: %s",
-			     uri, soup_status_get_phrase (status_code));
-		return FALSE;
+/**
+ * fu_util_download_new:
+ **/
+static FuUtilDownload *
+fu_util_download_new (FuUtilPrivate *priv,
+		      FuDevice *device,
+		      const gchar *uri,
+		      const gchar *fn,
+		      const gchar *checksum_expected,
+		      GCancellable *cancellable)
+{
+	FuUtilDownload *dl;
+	dl = g_new0 (FuUtilDownload, 1);
+	dl->priv = priv;
+	if (device != NULL)
+		dl->device = g_object_ref (device);
+	dl->uri = g_strdup (uri);
+	dl->fn = g_strdup (fn);
+	dl->checksum_expected = g_strdup (checksum_expected);
+	dl->checksum = g_checksum_new (G_CHECKSUM_SHA1);
+	dl->cancellable = g_object_ref (cancellable);
+	return dl;
+}
+
+/**
+ * fu_util_download_free:
+ **/
+static void
+fu_util_download_free (FuUtilDownload *dl)
+{
+	if (dl->device != NULL)
+		g_object_unref (dl->device);
+	if (dl->stream_in != NULL)
+		g_object_unref (dl->stream_in);
+	if (dl->stream_out != NULL)
+		g_object_unref (dl->stream_out);
+	if (dl->msg != NULL)
+		g_object_unref (dl->msg);
+	if (dl->error != NULL)
+		g_error_free (dl->error);
+	g_checksum_free (dl->checksum);
+	g_object_unref (dl->cancellable);
+	g_free (dl->uri);
+	g_free (dl->fn);
+	g_free (dl->checksum_expected);
+	g_free (dl->etag);
+	g_free (dl->last_modified);
+	g_free (dl);
+}
+
+static void fu_util_download_start (FuUtilDownload *dl);
+
+/**
+ * fu_util_download_done:
+ **/
+static void
+fu_util_download_done (FuUtilDownload *dl, GError *error)
+{
+	FuUtilPrivate *priv = dl->priv;
+	_cleanup_free_ gchar *fn_part = NULL;
+
+	if (dl->stream_out != NULL)
+		g_output_stream_close (dl->stream_out, NULL, NULL);
+	if (dl->stream_in != NULL)
+		g_input_stream_close (dl->stream_in, NULL, NULL);
+
+	/* do not leave a partial file behind */
+	fn_part = g_strdup_printf ("%s.part", dl->fn);
+	if (error == NULL && !dl->not_modified && g_rename (fn_part, dl->fn) != 0) {
+		error = g_error_new (FWUPD_ERROR,
+				     FWUPD_ERROR_WRITE,
+				     "Failed to save %s",
+				     dl->fn);
 	}
+	if (error != NULL) {
+		g_debug ("failed to download %s: %s", dl->uri, error->message);
+		g_unlink (fn_part);
+		dl->error = error;
+	} else {
+		g_debug ("downloaded %s", dl->uri);
+	}
+	dl->done = TRUE;
+
+	/* start the next queued download */
+	priv->downloads_active--;
+	if (priv->downloads_queue->len > 0) {
+		FuUtilDownload *dl_next = g_ptr_array_index (priv->downloads_queue, 0);
+		g_ptr_array_remove_index (priv->downloads_queue, 0);
+		fu_util_download_start (dl_next);
+	}
+	g_main_loop_quit (priv->loop_download);
+}
 
-	/* verify checksum */
-	if (checksum_expected != NULL) {
-		checksum_actual = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
-							       (guchar *) msg->response_body->data,
-							       msg->response_body->length);
-		if (g_strcmp0 (checksum_expected, checksum_actual) != 0) {
-			g_set_error (error,
-				     FWUPD_ERROR,
-				     FWUPD_ERROR_INVALID_FILE,
-				     "Checksum invalid, expected %s got %s",
-				     checksum_expected, checksum_actual);
-			return FALSE;
+/**
+ * fu_util_download_read_cb:
+ **/
+static void
+fu_util_download_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuUtilDownload *dl = (FuUtilDownload *) user_data;
+	GError *error = NULL;
+	const gchar *checksum_actual;
+	gsize len;
+	const guint8 *data;
+	_cleanup_bytes_unref_ GBytes *bytes = NULL;
+
+	bytes = g_input_stream_read_bytes_finish (G_INPUT_STREAM (source), res, &error);
+	if (bytes == NULL) {
+		fu_util_download_done (dl, error);
+		return;
+	}
+
+	/* end of stream */
+	data = g_bytes_get_data (bytes, &len);
+	if (len == 0) {
+		checksum_actual = g_checksum_get_string (dl->checksum);
+		if (dl->checksum_expected != NULL &&
+		    g_strcmp0 (dl->checksum_expected, checksum_actual) != 0) {
+			error = g_error_new (FWUPD_ERROR,
+					     FWUPD_ERROR_INVALID_FILE,
+					     "Checksum invalid, expected %s got %s",
+					     dl->checksum_expected, checksum_actual);
 		}
+		fu_util_download_done (dl, error);
+		return;
+	}
+
+	/* hash and save this chunk, then get the next */
+	g_checksum_update (dl->checksum, data, len);
+	if (!g_output_stream_write_all (dl->stream_out, data, len, NULL,
+					dl->cancellable, &error)) {
+		fu_util_download_done (dl, error);
+		return;
+	}
+	g_input_stream_read_bytes_async (dl->stream_in,
+					 FU_UTIL_DOWNLOAD_CHUNK_SIZE,
+					 G_PRIORITY_DEFAULT,
+					 dl->cancellable,
+					 fu_util_download_read_cb,
+					 dl);
+}
+
+/**
+ * fu_util_download_send_cb:
+ **/
+static void
+fu_util_download_send_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuUtilDownload *dl = (FuUtilDownload *) user_data;
+	GError *error = NULL;
+	_cleanup_free_ gchar *fn_part = NULL;
+	_cleanup_object_unref_ GFile *file = NULL;
+
+	dl->stream_in = soup_session_send_finish (SOUP_SESSION (source), res, &error);
+	if (dl->stream_in == NULL) {
+		fu_util_download_done (dl, error);
+		return;
 	}
 
-	/* save file */
-	if (!g_file_set_contents (fn,
-				  msg->response_body->data,
-				  msg->response_body->length,
-				  &error_local)) {
+	/* the copy we already have is current */
+	if (dl->msg->status_code == SOUP_STATUS_NOT_MODIFIED) {
+		g_debug ("%s not modified", dl->uri);
+		dl->not_modified = TRUE;
+		fu_util_download_done (dl, NULL);
+		return;
+	}
+	if (dl->msg->status_code != SOUP_STATUS_OK) {
+		error = g_error_new (FWUPD_ERROR,
+				     FWUPD_ERROR_INVALID_FILE,
+				     "Failed to download %s: %s",
+				     dl->uri,
+				     soup_status_get_phrase (dl->msg->status_code));
+		fu_util_download_done (dl, error);
+		return;
+	}
+
+	/* used for the next conditional request */
+	g_free (dl->etag);
+	dl->etag = g_strdup (soup_message_headers_get_one (dl->msg->response_headers,
+							   "ETag"));
+	g_free (dl->last_modified);
+	dl->last_modified = g_strdup (soup_message_headers_get_one (dl->msg->response_headers,
+								    "Last-Modified"));
+
+	/* save to disk as the data arrives */
+	fn_part = g_strdup_printf ("%s.part", dl->fn);
+	file = g_file_new_for_path (fn_part);
+	dl->stream_out = G_OUTPUT_STREAM (g_file_replace (file, NULL, FALSE,
+							  G_FILE_CREATE_NONE,
+							  dl->cancellable,
+							  &error));
+	if (dl->stream_out == NULL) {
+		fu_util_download_done (dl, error);
+		return;
+	}
+	g_input_stream_read_bytes_async (dl->stream_in,
+					 FU_UTIL_DOWNLOAD_CHUNK_SIZE,
+					 G_PRIORITY_DEFAULT,
+					 dl->cancellable,
+					 fu_util_download_read_cb,
+					 dl);
+}
+
+/**
+ * fu_util_download_start:
+ **/
+static void
+fu_util_download_start (FuUtilDownload *dl)
+{
+	FuUtilPrivate *priv = dl->priv;
+
+	g_debug ("downloading %s to %s:", dl->uri, dl->fn);
+	priv->downloads_active++;
+	dl->msg = soup_message_new (SOUP_METHOD_GET, dl->uri);
+	if (dl->msg == NULL) {
+		fu_util_download_done (dl, g_error_new (FWUPD_ERROR,
+							FWUPD_ERROR_INVALID_FILE,
+							"Failed to parse URI %s",
+							dl->uri));
+		return;
+	}
+	if (dl->etag != NULL) {
+		soup_message_headers_append (dl->msg->request_headers,
+					     "If-None-Match", dl->etag);
+	}
+	if (dl->last_modified != NULL) {
+		soup_message_headers_append (dl->msg->request_headers,
+					     "If-Modified-Since", dl->last_modified);
+	}
+	soup_session_send_async (priv->session, dl->msg, dl->cancellable,
+				 fu_util_download_send_cb, dl);
+}
+
+/**
+ * fu_util_download_queue:
+ *
+ * Starts the download now if there is a free slot, or when one of the
+ * running downloads completes.
+ **/
+static gboolean
+fu_util_download_queue (FuUtilPrivate *priv, FuUtilDownload *dl, GError **error)
+{
+	if (fu_util_get_session (priv, error) == NULL)
+		return FALSE;
+	if (priv->downloads_active >= FU_UTIL_DOWNLOAD_MAX_PARALLEL) {
+		g_ptr_array_add (priv->downloads_queue, dl);
+		return TRUE;
+	}
+	fu_util_download_start (dl);
+	return TRUE;
+}
+
+/**
+ * fu_util_download_wait:
+ **/
+static gboolean
+fu_util_download_wait (FuUtilPrivate *priv, FuUtilDownload *dl, GError **error)
+{
+	while (!dl->done)
+		g_main_loop_run (priv->loop_download);
+	if (dl->error != NULL) {
+		g_propagate_error (error, dl->error);
+		dl->error = NULL;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_util_download_cancel_all:
+ *
+ * Cancels the downloads and waits for them to stop, so that nothing
+ * refers to them once they are freed.
+ **/
+static void
+fu_util_download_cancel_all (FuUtilPrivate *priv, GCancellable *cancellable)
+{
+	g_cancellable_cancel (cancellable);
+	g_ptr_array_set_size (priv->downloads_queue, 0);
+	while (priv->downloads_active > 0)
+		g_main_loop_run (priv->loop_download);
+}
+
+/**
+ * fu_util_get_cache_dir:
+ **/
+static gchar *
+fu_util_get_cache_dir (GError **error)
+{
+	gchar *cache_dir;
+
+	cache_dir = g_build_filename (g_get_user_cache_dir (), "fwupdmgr", NULL);
+	if (g_mkdir_with_parents (cache_dir, 0700) != 0) {
 		g_set_error (error,
 			     FWUPD_ERROR,
 			     FWUPD_ERROR_WRITE,
-			     "Failed to save file: %s",
-			     error_local->message);
+			     "Failed to create %s",
+			     cache_dir);
+		g_free (cache_dir);
+		return NULL;
+	}
+	return cache_dir;
+}
+
+/**
+ * fu_util_download_set_conditional:
+ *
+ * Only asks for the file if it has changed since it was last downloaded.
+ **/
+static void
+fu_util_download_set_conditional (FuUtilDownload *dl, GKeyFile *state)
+{
+	if (!g_file_test (dl->fn, G_FILE_TEST_EXISTS))
+		return;
+	dl->etag = g_key_file_get_string (state, dl->uri, "ETag", NULL);
+	dl->last_modified = g_key_file_get_string (state, dl->uri, "LastModified", NULL);
+}
+
+/**
+ * fu_util_download_save_conditional:
+ **/
+static void
+fu_util_download_save_conditional (FuUtilDownload *dl, GKeyFile *state)
+{
+	g_key_file_remove_group (state, dl->uri, NULL);
+	if (dl->etag != NULL)
+		g_key_file_set_string (state, dl->uri, "ETag", dl->etag);
+	if (dl->last_modified != NULL)
+		g_key_file_set_string (state, dl->uri, "LastModified", dl->last_modified);
+}
+
+/**
+ * fu_util_download_pair:
+ *
+ * Downloads a file and its detached signature at the same time.
+ **/
+static gboolean
+fu_util_download_pair (FuUtilPrivate *priv,
+		       FuUtilDownload *dl_data,
+		       FuUtilDownload *dl_sig,
+		       GCancellable *cancellable,
+		       GError **error)
+{
+	if (!fu_util_download_queue (priv, dl_sig, error))
+		return FALSE;
+	if (!fu_util_download_queue (priv, dl_data, error) ||
+	    !fu_util_download_wait (priv, dl_sig, error) ||
+	    !fu_util_download_wait (priv, dl_data, error)) {
+		fu_util_download_cancel_all (priv, cancellable);
 		return FALSE;
 	}
 	return TRUE;
 }
 
+/**
+ * fu_util_download_metadata_delta:
+ *
+ * Sends the changes since the metadata the daemon last loaded, which fails
+ * with %FWUPD_ERROR_NOT_SUPPORTED if the delta is against another revision.
+ * Any failure here can be recovered by sending the full file instead.
+ **/
+static gboolean
+fu_util_download_metadata_delta (FuUtilPrivate *priv,
+				 const gchar *cache_dir,
+				 const gchar *delta_uri,
+				 GError **error)
+{
+	FuUtilDownload *dl_data;
+	FuUtilDownload *dl_sig;
+	gboolean ret;
+	_cleanup_free_ gchar *basename = NULL;
+	_cleanup_free_ gchar *data_fn = NULL;
+	_cleanup_free_ gchar *sig_fn = NULL;
+	_cleanup_free_ gchar *sig_uri = NULL;
+	_cleanup_object_unref_ GCancellable *cancellable = g_cancellable_new ();
+
+	basename = g_path_get_basename (delta_uri);
+	data_fn = g_build_filename (cache_dir, basename, NULL);
+	sig_fn = g_strdup_printf ("%s.asc", data_fn);
+	sig_uri = g_strdup_printf ("%s.asc", delta_uri);
+	dl_sig = fu_util_download_new (priv, NULL, sig_uri, sig_fn, NULL, cancellable);
+	dl_data = fu_util_download_new (priv, NULL, delta_uri, data_fn, NULL, cancellable);
+	ret = fu_util_download_pair (priv, dl_data, dl_sig, cancellable, error);
+	fu_util_download_free (dl_sig);
+	fu_util_download_free (dl_data);
+	if (!ret)
+		return FALSE;
+
+	/* send all this to fwupd */
+	ret = fu_util_refresh_internal (priv, data_fn, sig_fn, error);
+	g_unlink (data_fn);
+	g_unlink (sig_fn);
+	return ret;
+}
+
+/**
+ * fu_util_download_metadata_full:
+ **/
+static gboolean
+fu_util_download_metadata_full (FuUtilPrivate *priv,
+				const gchar *cache_dir,
+				const gchar *data_uri,
+				GError **error)
+{
+	FuUtilDownload *dl_data;
+	FuUtilDownload *dl_sig;
+	gboolean ret;
+	gsize len;
+	_cleanup_free_ gchar *data = NULL;
+	_cleanup_free_ gchar *data_fn = NULL;
+	_cleanup_free_ gchar *sig_fn = NULL;
+	_cleanup_free_ gchar *sig_uri = NULL;
+	_cleanup_free_ gchar *state_fn = NULL;
+	_cleanup_keyfile_unref_ GKeyFile *state = NULL;
+	_cleanup_object_unref_ GCancellable *cancellable = g_cancellable_new ();
+
+	/* keep the last copy so we can ask if it has changed */
+	data_fn = g_build_filename (cache_dir, "firmware.xml.gz", NULL);
+	sig_fn = g_strdup_printf ("%s.asc", data_fn);
+	state_fn = g_build_filename (cache_dir, "metadata.conf", NULL);
+	state = g_key_file_new ();
+	g_key_file_load_from_file (state, state_fn, G_KEY_FILE_NONE, NULL);
+
+	/* download the payload and signature at the same time */
+	sig_uri = g_strdup_printf ("%s.asc", data_uri);
+	dl_sig = fu_util_download_new (priv, NULL, sig_uri, sig_fn, NULL, cancellable);
+	dl_data = fu_util_download_new (priv, NULL, data_uri, data_fn, NULL, cancellable);
+	fu_util_download_set_conditional (dl_sig, state);
+	fu_util_download_set_conditional (dl_data, state);
+	if (!fu_util_download_pair (priv, dl_data, dl_sig, cancellable, error)) {
+		fu_util_download_free (dl_sig);
+		fu_util_download_free (dl_data);
+		return FALSE;
+	}
+
+	/* the daemon already has this metadata */
+	if (dl_sig->not_modified && dl_data->not_modified) {
+		g_debug ("metadata has not changed");
+		fu_util_download_free (dl_sig);
+		fu_util_download_free (dl_data);
+		return TRUE;
+	}
+	fu_util_download_save_conditional (dl_sig, state);
+	fu_util_download_save_conditional (dl_data, state);
+	fu_util_download_free (dl_sig);
+	fu_util_download_free (dl_data);
+
+	/* send all this to fwupd */
+	if (!fu_util_refresh_internal (priv, data_fn, sig_fn, error))
+		return FALSE;
+
+	/* only remember the validators once the daemon has accepted it */
+	data = g_key_file_to_data (state, &len, error);
+	if (data == NULL)
+		return FALSE;
+	ret = g_file_set_contents (state_fn, data, len, error);
+	return ret;
+}
+
 /**
  * fu_util_download_metadata:
  **/
 static gboolean
 fu_util_download_metadata (FuUtilPrivate *priv, GError **error)
 {
+	_cleanup_error_free_ GError *error_local = NULL;
+	_cleanup_free_ gchar *cache_dir = NULL;
 	_cleanup_free_ gchar *config_fn = NULL;
 	_cleanup_free_ gchar *data_uri = NULL;
-	_cleanup_free_ gchar *sig_fn = NULL;
-	_cleanup_free_ gchar *sig_uri = NULL;
+	_cleanup_free_ gchar *delta_uri = NULL;
 	_cleanup_keyfile_unref_ GKeyFile *config = NULL;
-	const gchar *data_fn = "/tmp/firmware.xml.gz";
 
 	/* read config file */
 	config = g_key_file_new ();
 	config_fn = g_build_filename (SYSCONFDIR, "fwupd.conf", NULL);
 	if (!g_key_file_load_from_file (config, config_fn, G_KEY_FILE_NONE, error))
 		return FALSE;
-
-	/* download the signature */
 	data_uri = g_key_file_get_string (config, "fwupd", "DownloadURI", error);
 	if (data_uri == NULL)
 		return FALSE;
-	sig_uri = g_strdup_printf ("%s.asc", data_uri);
-	sig_fn = g_strdup_printf ("%s.asc", data_fn);
-	if (!fu_util_download_file (priv, sig_uri, sig_fn, NULL, error))
+	cache_dir = fu_util_get_cache_dir (error);
+	if (cache_dir == NULL)
 		return FALSE;
 
-	/* download the payload */
-	if (!fu_util_download_file (priv, data_uri, data_fn, NULL, error))
-		return FALSE;
+	/* try the small delta first */
+	delta_uri = g_key_file_get_string (config, "fwupd", "DeltaURI", NULL);
+	if (delta_uri == NULL)
+		return fu_util_download_metadata_full (priv, cache_dir, data_uri, error);
+	if (fu_util_download_metadata_delta (priv, cache_dir, delta_uri, &error_local))
+		return TRUE;
 
-	/* send all this to fwupd */
-	return fu_util_refresh_internal (priv, data_fn, sig_fn, error);
+	/* the delta could not be downloaded, or the daemon has different
+	 * metadata to the base of the delta */
+	g_debug ("falling back to full metadata: %s", error_local->message);
+	return fu_util_download_metadata_full (priv, cache_dir, data_uri, error);
 }
 
 /**
@@ -1253,6 +2181,33 @@ fu_util_verify_internal (FuUtilPrivate *priv, const gchar *id, GError **error)
 
 }
 
+/**
+ * fu_util_verify_all_serial:
+ *
+ * Used when the daemon is too old to support VerifyAll.
+ **/
+static gboolean
+fu_util_verify_all_serial (FuUtilPrivate *priv, GPtrArray *devices, GError **error)
+{
+	FuDevice *dev;
+	guint i;
+
+	for (i = 0; i < devices->len; i++) {
+		_cleanup_error_free_ GError *error_local = NULL;
+		dev = g_ptr_array_index (devices, i);
+		if (!fu_util_verify_internal (priv, fu_device_get_id (dev), &error_local)) {
+			g_print ("%s\tFAILED: %s\n",
+				 fu_device_get_guid (dev),
+				 error_local->message);
+			continue;
+		}
+		g_print ("%s\t%s\n",
+			 fu_device_get_guid (dev),
+			 _("OK"));
+	}
+	return TRUE;
+}
+
 /**
  * fu_util_verify_all:
  **/
@@ -1262,20 +2217,52 @@ fu_util_verify_all (FuUtilPrivate *priv, GError **error)
 	FuDevice *dev;
 	guint i;
 	_cleanup_ptrarray_unref_ GPtrArray *devices = NULL;
+	_cleanup_variant_unref_ GVariant *results = NULL;
 
 	/* get devices from daemon */
 	devices = fu_util_get_devices_internal (priv, error);
 	if (devices == NULL)
 		return FALSE;
 
-	/* get results */
+	/* verify all the devices at the same time */
+	g_dbus_proxy_call (priv->proxy,
+			   "VerifyAll",
+			   NULL,
+			   G_DBUS_CALL_FLAGS_NONE,
+			   -1,
+			   NULL,
+			   fu_util_get_devices_cb, priv);
+	g_main_loop_run (priv->loop);
+	if (priv->val == NULL) {
+		if (g_error_matches (priv->error, G_DBUS_ERROR,
+				     G_DBUS_ERROR_UNKNOWN_METHOD)) {
+			g_clear_error (&priv->error);
+			return fu_util_verify_all_serial (priv, devices, error);
+		}
+		g_dbus_error_strip_remote_error (priv->error);
+		g_propagate_error (error, priv->error);
+		priv->error = NULL;
+		return FALSE;
+	}
+
+	/* print in the same order as get-devices */
+	results = g_variant_get_child_value (priv->val, 0);
 	for (i = 0; i < devices->len; i++) {
-		_cleanup_error_free_ GError *error_local = NULL;
+		gboolean success = FALSE;
+		const gchar *message = NULL;
+		_cleanup_variant_unref_ GVariant *dict = NULL;
+
 		dev = g_ptr_array_index (devices, i);
-		if (!fu_util_verify_internal (priv, fu_device_get_id (dev), &error_local)) {
+		dict = g_variant_lookup_value (results, fu_device_get_id (dev),
+					       G_VARIANT_TYPE ("a{sv}"));
+		if (dict == NULL)
+			continue;
+		g_variant_lookup (dict, "Success", "b", &success);
+		if (!success) {
+			g_variant_lookup (dict, "Error", "&s", &message);
 			g_print ("%s\tFAILED: %s\n",
 				 fu_device_get_guid (dev),
-				 error_local->message);
+				 message != NULL ? message : "unknown error");
 			continue;
 		}
 		g_print ("%s\t%s\n",
@@ -1380,20 +2367,88 @@ fu_util_get_updates (FuUtilPrivate *priv, gchar **values, GError **error)
 	return TRUE;
 }
 
+/**
+ * fu_util_check_cached:
+ *
+ * The cache is keyed by the checksum, so a file with that name is only
+ * used if its contents still match.
+ **/
+static gboolean
+fu_util_check_cached (const gchar *fn, const gchar *checksum)
+{
+	_cleanup_free_ gchar *checksum_actual = NULL;
+	_cleanup_mapped_file_unref_ GMappedFile *mapped = NULL;
+
+	if (!g_file_test (fn, G_FILE_TEST_EXISTS))
+		return FALSE;
+	mapped = g_mapped_file_new (fn, FALSE, NULL);
+	if (mapped == NULL)
+		return FALSE;
+	checksum_actual = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+						       (const guchar *) g_mapped_file_get_contents (mapped),
+						       g_mapped_file_get_length (mapped));
+	if (g_strcmp0 (checksum, checksum_actual) != 0) {
+		g_debug ("cached %s is invalid", fn);
+		g_unlink (fn);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_util_update_get_next:
+ *
+ * Returns the next download that has finished but not been installed, or
+ * %NULL if all have been installed.
+ **/
+static FuUtilDownload *
+fu_util_update_get_next (FuUtilPrivate *priv, GPtrArray *downloads)
+{
+	FuUtilDownload *dl;
+	gboolean pending;
+	guint i;
+
+	do {
+		pending = FALSE;
+		for (i = 0; i < downloads->len; i++) {
+			dl = g_ptr_array_index (downloads, i);
+			if (dl->installed)
+				continue;
+			if (dl->done)
+				return dl;
+			pending = TRUE;
+		}
+		if (pending)
+			g_main_loop_run (priv->loop_download);
+	} while (pending);
+	return NULL;
+}
+
 /**
  * fu_util_update:
+ *
+ * Downloads all the cabinets at the same time and installs each one as
+ * soon as it has been downloaded and verified.
  **/
 static gboolean
 fu_util_update (FuUtilPrivate *priv, gchar **values, GError **error)
 {
 	FuDevice *dev;
+	FuUtilDownload *dl;
 	GPtrArray *devices = NULL;
 	guint i;
+	_cleanup_free_ gchar *cache_dir = NULL;
+	_cleanup_object_unref_ GCancellable *cancellable = g_cancellable_new ();
+	_cleanup_ptrarray_unref_ GPtrArray *downloads = NULL;
 
 	/* apply any updates */
 	devices = fu_util_get_updates_internal (priv, error);
 	if (devices == NULL)
 		return FALSE;
+	cache_dir = fu_util_get_cache_dir (error);
+	if (cache_dir == NULL)
+		return FALSE;
+	downloads = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_util_download_free);
 	for (i = 0; i < devices->len; i++) {
 		const gchar *checksum;
 		const gchar *uri;
@@ -1409,18 +2464,44 @@ fu_util_update (FuUtilPrivate *priv, gchar **values, GError **error)
 		uri = fu_device_get_metadata (dev, FU_DEVICE_KEY_UPDATE_URI);
 		if (uri == NULL)
 			continue;
+		basename = g_strdup_printf ("%s.cab", checksum);
+		fn = g_build_filename (cache_dir, basename, NULL);
+		dl = fu_util_download_new (priv, dev, uri, fn, checksum, cancellable);
+		g_ptr_array_add (downloads, dl);
+
+		/* already downloaded */
+		if (fu_util_check_cached (fn, checksum)) {
+			g_debug ("using cached %s", fn);
+			dl->done = TRUE;
+			continue;
+		}
 		g_print ("Downloading %s for %s...\n",
 			 fu_device_get_metadata (dev, FU_DEVICE_KEY_UPDATE_VERSION),
 			 fu_device_get_display_name (dev));
-		basename = g_path_get_basename (uri);
-		fn = g_build_filename (g_get_tmp_dir (), basename, NULL);
-		if (!fu_util_download_file (priv, uri, fn, checksum, error))
+		if (!fu_util_download_queue (priv, dl, error)) {
+			fu_util_download_cancel_all (priv, cancellable);
+			return FALSE;
+		}
+	}
+
+	/* install in the order the downloads complete */
+	while ((dl = fu_util_update_get_next (priv, downloads)) != NULL) {
+		dl->installed = TRUE;
+		if (dl->error != NULL) {
+			g_propagate_error (error, dl->error);
+			dl->error = NULL;
+			fu_util_download_cancel_all (priv, cancellable);
 			return FALSE;
+		}
 		g_print ("Updating %s on %s...\n",
-			 fu_device_get_metadata (dev, FU_DEVICE_KEY_UPDATE_VERSION),
-			 fu_device_get_display_name (dev));
-		if (!fu_util_install_with_fallback (priv, fu_device_get_id (dev), fn, error))
+			 fu_device_get_metadata (dl->device, FU_DEVICE_KEY_UPDATE_VERSION),
+			 fu_device_get_display_name (dl->device));
+		if (!fu_util_install_with_fallback (priv,
+						    fu_device_get_id (dl->device),
+						    dl->fn, error)) {
+			fu_util_download_cancel_all (priv, cancellable);
 			return FALSE;
+		}
 	}
 
 	return TRUE;
@@ -1475,6 +2556,8 @@ main (int argc, char *argv[])
 	/* create helper object */
 	priv = g_new0 (FuUtilPrivate, 1);
 	priv->loop = g_main_loop_new (NULL, FALSE);
+	priv->loop_download = g_main_loop_new (NULL, FALSE);
+	priv->downloads_queue = g_ptr_array_new ();
 
 	/* add commands */
 	priv->cmd_array = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_util_item_free);
@@ -1496,6 +2579,12 @@ main (int argc, char *argv[])
 		     /* TRANSLATORS: command description */
 		     _("Install a firmware file on this hardware"),
 		     fu_util_install);
+	fu_util_add (priv->cmd_array,
+		     "install-batch",
+		     NULL,
+		     /* TRANSLATORS: command description */
+		     _("Install a firmware file on all matching hardware"),
+		     fu_util_install_batch);
 	fu_util_add (priv->cmd_array,
 		     "get-details",
 		     NULL,
@@ -1508,6 +2597,12 @@ main (int argc, char *argv[])
 		     /* TRANSLATORS: command description */
 		     _("Gets the list of updates for connected hardware"),
 		     fu_util_get_updates);
+	fu_util_add (priv->cmd_array,
+		     "get-stats",
+		     NULL,
+		     /* TRANSLATORS: command description */
+		     _("Gets the time spent in each phase of the daemon"),
+		     fu_util_get_stats);
 	fu_util_add (priv->cmd_array,
 		     "update",
 		     NULL,
@@ -1631,6 +2726,8 @@ out:
 	if (priv != NULL) {
 		if (priv->cmd_array != NULL)
 			g_ptr_array_unref (priv->cmd_array);
+		if (priv->devices != NULL)
+			g_ptr_array_unref (priv->devices);
 		if (priv->val != NULL)
 			g_variant_unref (priv->val);
 		if (priv->message != NULL)
@@ -1639,6 +2736,10 @@ out:
 			g_object_unref (priv->conn);
 		if (priv->proxy != NULL)
 			g_object_unref (priv->proxy);
+		if (priv->session != NULL)
+			g_object_unref (priv->session);
+		g_ptr_array_unref (priv->downloads_queue);
+		g_main_loop_unref (priv->loop_download);
 		g_main_loop_unref (priv->loop);
 		g_option_context_free (priv->context);
 		g_free (priv);